@@ -1,4 +1,5 @@
 #include <stdexcept>
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
 #include <sys/mman.h>
@@ -45,33 +46,54 @@ bool elf_loader::check_magic(const Elf32_Ehdr *hdr) const
         hdr->e_ident[EI_MAG3] == ELFMAG3;
 }
 
-elf_loader::~elf_loader()
+bool elf_loader::find_function(const std::string& name, Elf32_Addr& address) const
 {
+    auto it = symbols_.find(name);
+    if (it != symbols_.end()) {
+        address = it->second;
+        return true;
+    }
+    for (const auto& function : functions_) {
+        if (function.name == name) {
+            address = function.address;
+            return true;
+        }
+    }
+    return false;
+}
 
+elf_loader::~elf_loader()
+{
+    if (data_ != nullptr)
+        munmap(const_cast<uint8_t*>(data_), size_);
+    if (fd_ != -1)
+        close(fd_);
 }
 
 void elf_loader::load()
 {
-    // load target ELF into memory
+    // map target ELF, pages are read on first touch and shared with the page cache
+    fd_ = open(filename_.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd_ == -1) {
+        throw std::runtime_error("open() failed");
+    }
+
     struct stat st;
-    if (stat(filename_.c_str(), &st) == -1) {
+    if (fstat(fd_, &st) == -1) {
         throw std::runtime_error("stat() failed");
     }
-
-    buffer_.resize(st.st_size);
-
-    int fd = open(filename_.c_str(), O_RDONLY);
-    if (fd == -1) {
-        throw std::runtime_error("open() failed");
+    if ((size_t)st.st_size < sizeof(Elf32_Ehdr)) {
+        throw std::runtime_error("invalid ELF file");
     }
 
-    ssize_t bytes_read = read(fd, buffer_.data(), st.st_size);
-    close(fd);
-    if (bytes_read == -1 || bytes_read != st.st_size) {
-        throw std::runtime_error("read() failed");
+    size_ = (size_t)st.st_size;
+    void* data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+    if (data == MAP_FAILED) {
+        throw std::runtime_error("mmap() failed");
     }
+    data_ = reinterpret_cast<const uint8_t*>(data);
 
-    const uint8_t*const buf = buffer_.data();
+    const uint8_t*const buf = data_;
 
     fprintf(stderr, "[i] checking ELF file...\n");
     // check elf magic
@@ -101,6 +123,9 @@ void elf_loader::load()
         // we care only about PT_LOAD, since these segments are actually mapped
         // for now, we ignore the protection flag
         if (phdr->p_type == PT_LOAD) {
+            if ((uint64_t)phdr->p_offset + phdr->p_filesz > size_ || phdr->p_filesz > phdr->p_memsz) {
+                throw std::runtime_error("invalid ELF, segment out of the file");
+            }
             fprintf(stderr, "[i] segment %d - vaddr: 0x%08x, vsize: %d\n", i, phdr->p_vaddr, phdr->p_memsz);
             segments_.emplace_back(phdr);
         }
@@ -139,8 +164,16 @@ void elf_loader::load()
             auto sym_name = offset_ptr<const char>(strtable, psym->st_name);
             symbols_.emplace(sym_name, psym->st_value);
         }
+        // static functions too, for the address => function index
+        if (ELF32_ST_TYPE(psym->st_info) == STT_FUNC && psym->st_shndx != SHN_UNDEF) {
+            auto sym_name = offset_ptr<const char>(strtable, psym->st_name);
+            functions_.push_back(elf_function{psym->st_value, psym->st_size, sym_name});
+        }
         psym = offset_ptr<Elf32_Sym>(psym, symbol_table_->sh_entsize);
     }
+    std::sort(functions_.begin(), functions_.end(), [](const elf_function& a, const elf_function& b) {
+        return a.address < b.address;
+    });
 
     fprintf(stderr, "[i] entry point at 0x%08x\n", entry_point());
 }
@@ -26,34 +26,59 @@ private:
     const Elf32_Phdr* segment_ = nullptr;
 };
 
+// a function from the symbol table, local ones included
+struct elf_function
+{
+    Elf32_Addr address;
+    Elf32_Word size;
+    std::string name;
+};
+
 class elf_loader
 {
 public:
     explicit elf_loader(std::string filename) : filename_{std::move(filename)} {}
     ~elf_loader();
+
+    elf_loader(const elf_loader&) = delete;
+    elf_loader& operator=(const elf_loader&) = delete;
+
+    // maps the file read-only, segments are mapped from fd() into guest memory
     void load();
 
+    // open for as long as the loader lives
+    int fd() const { return fd_; }
+
     const auto& segments() const { return segments_; }
 
     template<typename T>
     const T* pointer_to(const elf_segment& segm) const
     {
-        return reinterpret_cast<const T*>(buffer_.data() + segm.offset());
+        return reinterpret_cast<const T*>(data_ + segm.offset());
     }
 
     Elf32_Addr entry_point() const { return header_->e_entry; }
 
+    // address of a function, global ones first, false if there is no such symbol
+    bool find_function(const std::string& name, Elf32_Addr& address) const;
+
+    // all the STT_FUNC symbols, sorted by address
+    const std::vector<elf_function>& functions() const { return functions_; }
+
 private:
     bool check_magic(const Elf32_Ehdr* hdr) const;
 
 private:
     std::string filename_;
-    std::vector<uint8_t> buffer_;
+    int fd_ = -1;
+    const uint8_t* data_ = nullptr;
+    size_t size_ = 0;
     std::vector<elf_segment> segments_;
     std::vector<const Elf32_Shdr*> sections_;
     const Elf32_Shdr* symbol_table_ = nullptr;
 
     // this definitely takes too much memory, needs to be fixed in the future
     std::unordered_map<std::string, Elf32_Addr> symbols_;
+    std::vector<elf_function> functions_;
     const Elf32_Ehdr *header_ = nullptr;
 };
@@ -1,4 +1,6 @@
 #include <string>
+#include <memory>
+#include <algorithm>
 #include <thread>
 #include <chrono>
 #include <ratio>
@@ -6,11 +8,229 @@
 #include "elfloader.h"
 #include "rv_memory.h"
 #include "rv_cpu.h"
+#include "rv_sdl.h"
+#include "rv_av_headless.h"
+#include "rv_fleet.h"
+#include "rv_profiler.h"
+#include "rv_snapshot.h"
+#include "rv_forkserver.h"
+#include "rv_replay.h"
 #include "rv_global.h"
 
+// emulated clock rate used by --headless when none is given
+constexpr unsigned kDefaultHeadlessMips = 100;
+
+// instructions per rv_cpu::run call
+constexpr size_t kTimeSlice = 500000;
+
+// --profile defaults
+constexpr unsigned long kDefaultProfileInterval = 10000;
+constexpr const char* kDefaultProfileOutput = "risc_666.folded";
+
+static struct option long_options[] = {
+    {"headless", optional_argument, nullptr, 'H'},
+    {"profile", optional_argument, nullptr, 'P'},
+    {"profile-interval", required_argument, nullptr, 'I'},
+    {"save-snapshot", required_argument, nullptr, 'S'},
+    {"restore-snapshot", required_argument, nullptr, 'R'},
+    {"fork-server", required_argument, nullptr, 'F'},
+    {"record", required_argument, nullptr, 'C'},
+    {"replay", required_argument, nullptr, 'Y'},
+    {"fleet", required_argument, nullptr, 'L'},
+    {"huge-pages", no_argument, nullptr, 'G'},
+    {"audio-dump", required_argument, nullptr, 'W'},
+    {"hle", no_argument, nullptr, 'E'},
+    {"hle-skip", required_argument, nullptr, 'X'},
+    {"hle-verify", no_argument, nullptr, 'V'},
+#ifdef RISC_666_TRACE
+    {"trace", required_argument, nullptr, 'T'},
+#endif
+    {nullptr, 0, nullptr, 0}
+};
+
+// where --fork-server starts serving
+enum class fork_marker
+{
+    none,
+    syscall,        // the target calls av_snapshot
+    instructions,   // after n instructions
+    symbol          // right before entering a function
+};
+
+// map a PT_LOAD segment copy-on-write from the executable and zero its bss
+// pages below mapped_end are shared with the previous segment, those are copied in instead
+static void load_segment(const elf_loader& loader, const elf_segment& seg, rv_memory& memory, rv_uint& mapped_end)
+{
+    static const uint8_t zero_page[0x1000] = {};
+
+    const rv_uint vaddr = seg.virtual_address();
+    const rv_uint file_end = vaddr + seg.file_size();
+    const rv_uint page_begin = vaddr & ~0xFFFu;
+    const rv_uint file_page_end = (file_end + 0xFFF) & ~0xFFFu;
+    const rv_uint page_end = (vaddr + seg.memory_size() + 0xFFF) & ~0xFFFu;
+
+    // file offset and address must agree modulo the page size
+    if (page_begin < mapped_end || ((vaddr ^ seg.offset()) & 0xFFF) != 0) {
+        memory.set_region(vaddr, loader.pointer_to<uint8_t>(seg), seg.file_size());
+        mapped_end = std::max(mapped_end, page_end);
+        return;
+    }
+
+    if (file_page_end != page_begin &&
+        !memory.map_region(page_begin, file_page_end - page_begin, seg.protection(), loader.fd(),
+            (off_t)(seg.offset() & ~0xFFFu), false))
+        throw std::runtime_error("unable to map the executable");
+
+    // the rest of the last file page is whatever follows the segment in the file
+    if (file_end < file_page_end)
+        memory.set_region(file_end, zero_page, file_page_end - file_end);
+    if (file_page_end < page_end && !memory.map_region(file_page_end, page_end - file_page_end, seg.protection(), -1, 0, false))
+        throw std::runtime_error("unable to map the executable");
+    mapped_end = page_end;
+}
+
+// lay out the executable, the stack and the heap in guest memory
+static void load_executable(const elf_loader& loader, rv_memory& memory, int argc, char *argv[], int optind)
+{
+    // first 64k are mapped RWX
+    memory.protect_region(0, 0x10000, RV_MEMORY_RWX);
+
+    rv_uint last_vaddr = 0;
+    rv_uint last_vsize = 0;
+    rv_uint mapped_end = 0x10000;
+
+    // this is wrong, there's no guarantee that the last segment comes last in memory
+    // but for now it's ok...for newlib layout at least
+    for (const auto& seg : loader.segments()) {
+        last_vaddr = seg.virtual_address();
+        last_vsize = seg.memory_size();
+        load_segment(loader, seg, memory, mapped_end);
+        memory.protect_region(last_vaddr, last_vsize, seg.protection());
+    }
+
+    // TODO: align to segment->alignment
+    if (last_vsize % 0x1000 != 0)
+        last_vsize = last_vsize + (0x1000 - (last_vsize%0x1000));
+
+    rv_uint end_of_data = last_vaddr + last_vsize;
+
+    // setup one guard page before the stack
+    end_of_data += 0x1000;
+
+    // setup memory protection for stack (rw)
+    memory.protect_region(end_of_data, memory.stack_size(), RV_MEMORY_RW);
+
+    // the stack starts right after the first guard page
+    memory.set_stack(end_of_data + memory.stack_size());
+    end_of_data += memory.stack_size();
+
+    memory.prepare_environment(argc, argv, optind);
+
+    // setup a second guard page after the stack
+    end_of_data += 0x1000;
+
+    // finally set the program break and map all the remaining ram
+    memory.set_brk(end_of_data);
+    memory.protect_region(end_of_data, memory.ram_end() - end_of_data, RV_MEMORY_RW);
+}
+
 void usage(const char *path)
 {
-    fprintf(stderr, "Usage: %s [-m memory_size] <target_executable> [arg 1] ... [argn n]\n", path);
+    fprintf(stderr, "Usage: %s [-m memory_size] [-j] [--headless[=mips]] [--profile[=file]] [--profile-interval=n] "
+        "[--save-snapshot=file] [--restore-snapshot=file] [--fork-server=marker] "
+        "[--record=file] [--replay=file] [--fleet=n] [--huge-pages] [--audio-dump=file] "
+        "[--hle] [--hle-skip=list] [--hle-verify] <target_executable> [arg 1] ... [argn n]\n", path);
+    fprintf(stderr, "  --headless           no window, the guest clock runs at the given emulated MIPS (default %u)\n",
+        kDefaultHeadlessMips);
+    fprintf(stderr, "  --profile            sample the guest pc, print a flat profile and write collapsed stacks to file (default %s)\n",
+        kDefaultProfileOutput);
+    fprintf(stderr, "  --profile-interval   instructions between samples (default %lu)\n", kDefaultProfileInterval);
+    fprintf(stderr, "  --save-snapshot      save the machine state to file when the target calls av_snapshot\n");
+    fprintf(stderr, "  --restore-snapshot   resume from a saved state, the executable is then optional (symbols only)\n");
+    fprintf(stderr, "  --fork-server        with --headless, run up to the marker (syscall, insn:<n> or symbol:<function>)\n"
+                    "                       then fork a child resuming from there for each request, see rv_forkserver.h\n");
+    fprintf(stderr, "  --record             log clock, input and non-file reads to file\n");
+    fprintf(stderr, "  --replay             feed a recorded log back to the target, implies --headless\n");
+    fprintf(stderr, "  --fleet              run n independent headless copies of the target on all host cores\n");
+    fprintf(stderr, "  --huge-pages         back guest memory with transparent huge pages where the host allows\n");
+    fprintf(stderr, "  --audio-dump         with --headless, write the sound the target plays to file as wav\n");
+    fprintf(stderr, "  --hle                run memcpy, memset, memmove, strlen, strcmp and strncasecmp on the host\n");
+    fprintf(stderr, "  --hle-skip           comma separated functions left to the guest code, implies --hle\n");
+    fprintf(stderr, "  --hle-verify         run the guest code anyway and compare its results with the host ones,\n"
+                    "                       implies --hle, interpreter only\n");
+#ifdef RISC_666_TRACE
+    fprintf(stderr, "  --trace              write every executed instruction to file, interpreter only, see rv_trace.h\n");
+#endif
+}
+
+static void print_report(const rv_memory& memory, const rv_cpu& cpu, const rv_av_backend& av, double wall_seconds)
+{
+    const uint64_t insns = cpu.cycle_count();
+    const uint64_t frames = av.frame_count();
+    fprintf(stderr, "[i] instructions: %llu\n", (unsigned long long)insns);
+    fprintf(stderr, "[i] wall time: %.3f s\n", wall_seconds);
+    fprintf(stderr, "[i] MIPS: %.2f\n", wall_seconds > 0 ? double(insns)/wall_seconds/1e6 : 0.0);
+    fprintf(stderr, "[i] frames: %llu, FPS: %.2f\n", (unsigned long long)frames,
+        wall_seconds > 0 ? double(frames)/wall_seconds : 0.0);
+    fprintf(stderr, "[i] peak guest memory: %.2f MiB of %.2f MiB\n", double(memory.peak_committed_bytes())/1048576.0,
+        double(memory.ram_end())/1048576.0);
+}
+
+// n guests, each with its own memory, descriptors and headless AV, on a pool of host threads
+static int run_fleet(const elf_loader& loader, size_t fleet_size, rv_uint memory_size, unsigned long headless_mips,
+    bool use_jit, bool huge_pages, bool hle, const std::vector<std::string>& hle_skip, int argc, char *argv[], int optind)
+{
+    rv_fleet fleet(std::max(1u, std::thread::hardware_concurrency()));
+    for (size_t i = 0; i < fleet_size; ++i) {
+        auto guest = std::make_unique<rv_guest>(memory_size, (uint64_t)headless_mips * 1000);
+        if (huge_pages)
+            guest->memory.advise_huge_pages();
+        load_executable(loader, guest->memory, argc, argv, optind);
+        guest->cpu.reset(loader.entry_point());
+        if (use_jit && !guest->cpu.enable_jit() && i == 0)
+            fprintf(stderr, "[i] JIT not supported on this host, using the interpreter\n");
+        if (hle) {
+            guest->hle = std::make_unique<rv_hle>(guest->memory, loader, hle_skip, false);
+            guest->cpu.attach_hle(guest->hle.get());
+            if (i == 0)
+                fprintf(stderr, "[i] hle: %zu functions\n", guest->hle->function_count());
+        }
+        fleet.add(std::move(guest));
+    }
+    fprintf(stderr, "[i] fleet of %zu guests on %u host threads, guest clock at %lu MIPS\n", fleet_size,
+        std::max(1u, std::thread::hardware_concurrency()), headless_mips);
+
+    const auto start_time = std::chrono::steady_clock::now();
+    fleet.run(kTimeSlice);
+    const std::chrono::duration<double> wall_time = std::chrono::steady_clock::now() - start_time;
+
+    int ret_val = EXIT_SUCCESS;
+    uint64_t insns = 0;
+    uint64_t frames = 0;
+    size_t peak_memory = 0;
+    for (size_t i = 0; i < fleet.guests().size(); ++i) {
+        const auto& guest = *fleet.guests()[i];
+        insns += guest.cpu.cycle_count();
+        frames += guest.av.frame_count();
+        peak_memory += guest.memory.peak_committed_bytes();
+        if (guest.cpu.emulation_exit()) {
+            fprintf(stderr, "[i] guest %zu exited with: %d\n", i, guest.cpu.emulation_exit_status());
+        }
+        else {
+            fprintf(stderr, "[i] guest %zu did not finish\n", i);
+            ret_val = EXIT_FAILURE;
+        }
+    }
+
+    const double wall_seconds = wall_time.count();
+    fprintf(stderr, "[i] instructions: %llu\n", (unsigned long long)insns);
+    fprintf(stderr, "[i] wall time: %.3f s\n", wall_seconds);
+    fprintf(stderr, "[i] aggregate MIPS: %.2f\n", wall_seconds > 0 ? double(insns)/wall_seconds/1e6 : 0.0);
+    fprintf(stderr, "[i] frames: %llu, FPS: %.2f\n", (unsigned long long)frames,
+        wall_seconds > 0 ? double(frames)/wall_seconds : 0.0);
+    fprintf(stderr, "[i] peak guest memory: %.2f MiB in total\n", double(peak_memory)/1048576.0);
+    rv_cpu::syscalls().print_stats(stderr);
+    return ret_val;
 }
 
 int main(int argc, char *argv[])
@@ -18,9 +238,29 @@ int main(int argc, char *argv[])
     int opt = -1;
     unsigned long int convres = (unsigned long int)-1;
     rv_uint memory_size = 128_MiB;
+    bool use_jit = false;
+    bool headless = false;
+    unsigned long headless_mips = kDefaultHeadlessMips;
+    bool profile = false;
+    std::string profile_output = kDefaultProfileOutput;
+    unsigned long profile_interval = kDefaultProfileInterval;
+    std::string save_path;
+    std::string restore_path;
+    fork_marker fork_at = fork_marker::none;
+    uint64_t fork_at_insns = 0;
+    std::string fork_at_symbol;
+    std::string record_path;
+    std::string replay_path;
+    unsigned long fleet_size = 0;
+    bool huge_pages = false;
+    std::string audio_dump_path;
+    bool hle = false;
+    bool hle_verify = false;
+    std::vector<std::string> hle_skip;
+    std::string trace_path;
     int ret_val = EXIT_SUCCESS;
 
-    while((opt = getopt(argc, argv, "m:")) != -1) {
+    while((opt = getopt_long(argc, argv, "+m:j", long_options, nullptr)) != -1) {
         switch (opt) {
         case 'm':
             convres = strtoul(optarg, nullptr, 10);
@@ -30,6 +270,97 @@ int main(int argc, char *argv[])
             }
             memory_size = (rv_uint)convres;
             break;
+        case 'j':
+            use_jit = true;
+            break;
+        case 'H':
+            headless = true;
+            if (optarg != nullptr) {
+                headless_mips = strtoul(optarg, nullptr, 10);
+                if (headless_mips == 0 || headless_mips > 100000) {
+                    fprintf(stderr, "[e] error: invalid headless clock rate: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+            }
+            break;
+        case 'P':
+            profile = true;
+            if (optarg != nullptr)
+                profile_output = optarg;
+            break;
+        case 'I':
+            profile_interval = strtoul(optarg, nullptr, 10);
+            if (profile_interval == 0) {
+                fprintf(stderr, "[e] error: invalid profile interval: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'S':
+            save_path = optarg;
+            break;
+        case 'R':
+            restore_path = optarg;
+            break;
+        case 'C':
+            record_path = optarg;
+            break;
+        case 'Y':
+            replay_path = optarg;
+            headless = true;
+            break;
+        case 'T':
+            trace_path = optarg;
+            break;
+        case 'G':
+            huge_pages = true;
+            break;
+        case 'W':
+            audio_dump_path = optarg;
+            break;
+        case 'E':
+            hle = true;
+            break;
+        case 'X': {
+            hle = true;
+            std::string list = optarg;
+            for (size_t begin = 0; begin <= list.size();) {
+                const size_t end = std::min(list.find(',', begin), list.size());
+                if (end != begin)
+                    hle_skip.push_back(list.substr(begin, end - begin));
+                begin = end + 1;
+            }
+        }
+            break;
+        case 'V':
+            hle = true;
+            hle_verify = true;
+            break;
+        case 'L':
+            fleet_size = strtoul(optarg, nullptr, 10);
+            if (fleet_size == 0 || fleet_size > 1024) {
+                fprintf(stderr, "[e] error: invalid fleet size: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'F': {
+            const std::string marker = optarg;
+            if (marker == "syscall") {
+                fork_at = fork_marker::syscall;
+            }
+            else if (marker.compare(0, 5, "insn:") == 0) {
+                fork_at = fork_marker::instructions;
+                fork_at_insns = strtoull(marker.c_str() + 5, nullptr, 10);
+            }
+            else if (marker.compare(0, 7, "symbol:") == 0 && marker.size() > 7) {
+                fork_at = fork_marker::symbol;
+                fork_at_symbol = marker.substr(7);
+            }
+            else {
+                fprintf(stderr, "[e] error: invalid fork-server marker: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+        }
+            break;
 
         default:
             usage(argv[0]);
@@ -37,58 +368,121 @@ int main(int argc, char *argv[])
         }
     }
 
-    if (optind >= argc) {
-        fprintf(stderr, "missing executable to emulate!\n");
+    if (!record_path.empty() && !replay_path.empty()) {
+        fprintf(stderr, "[e] error: --record and --replay are exclusive\n");
         exit(EXIT_FAILURE);
     }
 
-    elf_loader loader{std::string(argv[optind])};
-    try {
-        loader.load();
-        rv_memory memory(memory_size);
+    if (fork_at != fork_marker::none && !headless) {
+        fprintf(stderr, "[e] error: --fork-server needs --headless, children can't share a window\n");
+        exit(EXIT_FAILURE);
+    }
 
-        // first 64k are mapped RWX
-        memory.protect_region(0, 0x10000, RV_MEMORY_RWX);
+    if (!audio_dump_path.empty() && !headless) {
+        fprintf(stderr, "[e] error: --audio-dump needs --headless, the window plays the sound itself\n");
+        exit(EXIT_FAILURE);
+    }
 
-        rv_uint last_vaddr = 0;
-        rv_uint last_vsize = 0;
+    // every child would write to the same file
+    if (!audio_dump_path.empty() && fork_at != fork_marker::none) {
+        fprintf(stderr, "[e] error: --audio-dump can't be combined with --fork-server\n");
+        exit(EXIT_FAILURE);
+    }
 
-        // this is wrong, there's no guarantee that the last segment comes last in memory
-        // but for now it's ok...for newlib layout at least
-        for (const auto& seg : loader.segments()) {
-            last_vaddr = seg.virtual_address();
-            last_vsize = seg.memory_size();
-            memory.set_region(last_vaddr, loader.pointer_to<uint8_t>(seg), seg.file_size());
-            memory.protect_region(last_vaddr, last_vsize, seg.protection());
-        }
+    if (fleet_size != 0 && (profile || !save_path.empty() || !restore_path.empty() || fork_at != fork_marker::none ||
+        !record_path.empty() || !replay_path.empty() || !trace_path.empty() || hle_verify || !audio_dump_path.empty())) {
+        fprintf(stderr, "[e] error: --fleet can't be combined with profiling, snapshots, fork-server, record/replay, "
+            "tracing, --hle-verify or --audio-dump\n");
+        exit(EXIT_FAILURE);
+    }
 
-        // TODO: align to segment->alignment
-        if (last_vsize % 0x1000 != 0)
-            last_vsize = last_vsize + (0x1000 - (last_vsize%0x1000));
+    if (!trace_path.empty() && use_jit) {
+        fprintf(stderr, "[e] error: --trace needs the interpreter, drop -j\n");
+        exit(EXIT_FAILURE);
+    }
 
-        rv_uint end_of_data = last_vaddr + last_vsize;
+    // the writer thread doesn't survive fork()
+    if (!trace_path.empty() && fork_at != fork_marker::none) {
+        fprintf(stderr, "[e] error: --trace can't be combined with --fork-server\n");
+        exit(EXIT_FAILURE);
+    }
 
-        // setup one guard page before the stack
-        end_of_data += 0x1000;
+    // the trace would miss every instruction of the emulated functions
+    if (hle && !trace_path.empty()) {
+        fprintf(stderr, "[e] error: --hle can't be combined with --trace\n");
+        exit(EXIT_FAILURE);
+    }
 
-        // setup memory protection for stack (rw)
-        memory.protect_region(end_of_data, memory.stack_size(), RV_MEMORY_RW);
+    // both stop run() at a block of their own choosing
+    if (hle_verify && (use_jit || fork_at != fork_marker::none)) {
+        fprintf(stderr, "[e] error: --hle-verify needs the interpreter and can't be combined with --fork-server\n");
+        exit(EXIT_FAILURE);
+    }
 
-        // the stack starts right after the first guard page
-        memory.set_stack(end_of_data + memory.stack_size());
-        end_of_data += memory.stack_size();
+    if (optind >= argc && restore_path.empty()) {
+        fprintf(stderr, "missing executable to emulate!\n");
+        exit(EXIT_FAILURE);
+    }
 
-        memory.prepare_environment(argc, argv, optind);
+    // kill -USR1 prints the syscall stats while running
+    rv_syscall_install_stats_signal();
 
-        // setup a second guard page after the stack
-        end_of_data += 0x1000;
+    try {
+        // when restoring, the executable is optional and only used for its symbols
+        std::unique_ptr<elf_loader> loader;
+        if (optind < argc) {
+            loader = std::make_unique<elf_loader>(std::string(argv[optind]));
+            loader->load();
+        }
+
+        if (fleet_size != 0)
+            return run_fleet(*loader, fleet_size, memory_size, headless_mips, use_jit, huge_pages, hle, hle_skip,
+                argc, argv, optind);
+
+        std::unique_ptr<rv_snapshot_reader> snapshot;
+        if (!restore_path.empty()) {
+            snapshot = std::make_unique<rv_snapshot_reader>(restore_path);
+            memory_size = snapshot->header().ram_size;
+        }
+
+        rv_memory memory(memory_size);
+        if (huge_pages)
+            memory.advise_huge_pages();
+        if (snapshot != nullptr) {
+            memory.restore_state(*snapshot);
+            memory.restore_ram(*snapshot);
+        }
+        else {
+            load_executable(*loader, memory, argc, argv, optind);
+        }
 
-        // finally set the program break and map all the remaining ram
-        memory.set_brk(end_of_data);
-        memory.protect_region(end_of_data, memory.ram_end() - end_of_data, RV_MEMORY_RW);
+        std::unique_ptr<rv_av_backend> av;
+        if (headless) {
+            auto headless_av = std::make_unique<rv_av_headless>(memory, (uint64_t)headless_mips * 1000);
+            if (!audio_dump_path.empty() && !headless_av->dump_audio(audio_dump_path))
+                throw std::runtime_error("cannot create " + audio_dump_path);
+            av = std::move(headless_av);
+            fprintf(stderr, "[i] headless, guest clock at %lu MIPS\n", headless_mips);
+        }
+        else {
+            av = std::make_unique<rv_sdl>(memory);
+        }
 
-        rv_cpu cpu(memory);
-        cpu.reset(loader.entry_point());
+        rv_cpu cpu(memory, *av);
+        if (snapshot != nullptr) {
+            cpu.restore_state(*snapshot);
+            snapshot.reset();
+            fprintf(stderr, "[i] resuming from snapshot %s\n", restore_path.c_str());
+        }
+        else {
+            cpu.reset(loader->entry_point());
+        }
+        if (use_jit) {
+            if (cpu.enable_jit())
+                fprintf(stderr, "[i] JIT enabled\n");
+            else
+                fprintf(stderr, "[i] JIT not supported on this host, using the interpreter\n");
+        }
 #ifdef PROFILEME
         // start profiling thread
         std::thread([&cpu]() {
@@ -105,12 +499,114 @@ int main(int argc, char *argv[])
         }).detach();
 #endif
 
+        std::unique_ptr<rv_profiler> profiler;
+        if (profile) {
+            static const std::vector<elf_function> no_functions;
+            profiler = std::make_unique<rv_profiler>(memory, loader != nullptr ? loader->functions() : no_functions,
+                profile_interval);
+            cpu.attach_profiler(profiler.get());
+            fprintf(stderr, "[i] profiling every %lu instructions\n", profile_interval);
+        }
+
+        // the log starts here, a restored snapshot must be replayed from the same snapshot
+        std::unique_ptr<rv_replay> replay;
+        if (!record_path.empty())
+            replay = std::make_unique<rv_replay>(record_path, rv_replay::mode::record);
+        else if (!replay_path.empty())
+            replay = std::make_unique<rv_replay>(replay_path, rv_replay::mode::replay);
+        if (replay != nullptr) {
+            cpu.attach_replay(replay.get());
+            fprintf(stderr, "[i] %s %s\n", replay->replaying() ? "replaying" : "recording to",
+                replay->replaying() ? replay_path.c_str() : record_path.c_str());
+        }
+
+        // entry points come from the symbols, nothing to do without the executable
+        std::unique_ptr<rv_hle> hle_functions;
+        if (hle) {
+            if (loader == nullptr)
+                throw std::runtime_error("--hle needs the executable for its symbols");
+            hle_functions = std::make_unique<rv_hle>(memory, *loader, hle_skip, hle_verify);
+            cpu.attach_hle(hle_functions.get());
+            fprintf(stderr, "[i] hle: %zu functions%s\n", hle_functions->function_count(),
+                hle_verify ? ", verifying" : "");
+        }
+
+#ifdef RISC_666_TRACE
+        std::unique_ptr<rv_trace> trace;
+        if (!trace_path.empty()) {
+            trace = std::make_unique<rv_trace>(trace_path);
+            cpu.attach_trace(trace.get());
+            fprintf(stderr, "[i] tracing to %s\n", trace_path.c_str());
+        }
+#endif
+
+        if (fork_at == fork_marker::symbol) {
+            Elf32_Addr address;
+            if (loader == nullptr || !loader->find_function(fork_at_symbol, address))
+                throw std::runtime_error("fork-server: unknown function " + fork_at_symbol);
+            cpu.set_breakpoint(address);
+        }
+
+        // fork-server children exit with the status of the target, for the client to collect
+        bool forked_child = false;
+        auto start_time = std::chrono::steady_clock::now();
         for (;;) {
-            cpu.run(500000);
+            size_t slice = kTimeSlice;
+            if (fork_at == fork_marker::instructions && fork_at_insns > cpu.cycle_count())
+                slice = (size_t)std::min<uint64_t>(slice, fork_at_insns - cpu.cycle_count());
+            cpu.run(slice);
+            rv_syscall_poll_stats(rv_cpu::syscalls());
+
+            bool fork_now = false;
+            if (cpu.snapshot_requested()) {
+                cpu.clear_snapshot_request();
+                if (!save_path.empty()) {
+                    rv_save_snapshot(save_path, memory, cpu);
+                    fprintf(stderr, "[i] snapshot saved to %s\n", save_path.c_str());
+                }
+                fork_now = fork_at == fork_marker::syscall;
+            }
+            if (cpu.breakpoint_hit()) {
+                cpu.clear_breakpoint();
+                fork_now = true;
+            }
+            if (fork_at == fork_marker::instructions && cpu.cycle_count() >= fork_at_insns)
+                fork_now = true;
             if (cpu.emulation_exit())
                 break;
+
+            if (fork_now && fork_at != fork_marker::none) {
+                fork_at = fork_marker::none;
+                if (!rv_run_fork_server(cpu))
+                    return EXIT_SUCCESS;
+                forked_child = true;
+                start_time = std::chrono::steady_clock::now();
+            }
         }
+        const std::chrono::duration<double> wall_time = std::chrono::steady_clock::now() - start_time;
         fprintf(stderr, "[i] target exited with: %d\n", cpu.emulation_exit_status());
+        if (headless)
+            print_report(memory, cpu, *av, wall_time.count());
+        rv_cpu::syscalls().print_stats(stderr);
+        if (hle_functions != nullptr)
+            hle_functions->print_stats(stderr);
+        if (profiler != nullptr) {
+            cpu.attach_profiler(nullptr);
+            profiler->print_flat_profile(stderr, 30);
+            if (profiler->write_collapsed_stacks(profile_output))
+                fprintf(stderr, "[i] collapsed stacks written to %s\n", profile_output.c_str());
+            else
+                fprintf(stderr, "[e] error: cannot write %s\n", profile_output.c_str());
+        }
+#ifdef RISC_666_TRACE
+        if (trace != nullptr) {
+            cpu.attach_trace(nullptr);
+            fprintf(stderr, "[i] %llu instructions traced\n", (unsigned long long)trace->record_count());
+            trace.reset();
+        }
+#endif
+        if (forked_child)
+            ret_val = cpu.emulation_exit_status();
     }
     catch(const std::runtime_error& ex) {
         fprintf(stderr, "[e] error: %s", ex.what());
@@ -682,9 +682,70 @@ enum SYS_av_syscalls
     SYS_av_get_ticks,
     SYS_av_get_mouse_state,
     SYS_av_warp_mouse,
-    SYS_av_shutdown
+    SYS_av_shutdown,
+    SYS_av_snapshot,
+
+    // sound effects, mixed by the emulator: 8bit unsigned mono samples at any rate,
+    // volume 0..127, separation 0 (left) .. 255 (right), pitch 128 plays at the sample rate
+    SYS_av_audio_init,
+    SYS_av_sound_register,
+    SYS_av_sound_start,
+    SYS_av_sound_stop,
+    SYS_av_sound_update,
+    SYS_av_sound_playing,
+
+    // music, played by the emulator on an emulated OPL2: the GENMIDI lump first, then MUS
+    // lumps, both copied by the host; volume 0..127, one song plays at a time
+    SYS_av_music_init,
+    SYS_av_music_register,
+    SYS_av_music_unregister,
+    SYS_av_music_play,
+    SYS_av_music_stop,
+    SYS_av_music_pause,
+    SYS_av_music_resume,
+    SYS_av_music_volume,
+    SYS_av_music_playing,
+
+    // batches of the renderer inner loops, drawn by the emulator in order: an array of
+    // av_column and its count plus the framebuffer pitch, or an array of av_span and its count
+    SYS_av_draw_columns,
+    SYS_av_draw_spans
 };
 
+enum av_draw_flags
+{
+    AV_DRAW_WRAP = 1,           // column texels wrap at 128
+    AV_DRAW_DOUBLE = 2          // every texel covers two pixels side by side, blocky mode
+};
+
+// count pixels down from dest: colormap[translation[source[frac >> 16]]], frac += step
+// without translation if it's 0, all addresses in guest memory
+struct av_column
+{
+    uint32_t dest;
+    uint32_t source;
+    uint32_t colormap;
+    uint32_t translation;
+    int32_t frac;
+    int32_t step;
+    uint16_t count;
+    uint16_t flags;
+} __attribute__((packed));
+
+// count texels right from dest, out of a 64x64 flat: u = xfrac >> 16, v = yfrac >> 16
+struct av_span
+{
+    uint32_t dest;
+    uint32_t source;
+    uint32_t colormap;
+    int32_t xfrac;
+    int32_t yfrac;
+    int32_t xstep;
+    int32_t ystep;
+    uint16_t count;
+    uint16_t flags;
+} __attribute__((packed));
+
 struct av_color
 {
     uint8_t r;
@@ -0,0 +1,92 @@
+#include <errno.h>
+#include <stdexcept>
+#include "rv_av_backend.h"
+#include "rv_snapshot.h"
+
+rv_uint rv_av_backend::syscall_set_palette(rv_uint arg0, rv_uint arg1)
+{
+    if (arg0 == 0 || arg1 == 0)
+        return (rv_uint)-EINVAL;
+
+    const size_t cnt = arg1 < palette_.size() ? arg1 : palette_.size();
+    if (!memory_.check_range(arg0, cnt*sizeof(av_color), RV_MEMORY_R))
+        return (rv_uint)-EFAULT;
+    const av_color *colors = reinterpret_cast<const av_color*>(memory_.ram_ptr(arg0));
+    for (size_t i = 0; i < cnt; ++i)
+        palette_[i] = 0xFF000000 | ((uint32_t)colors[i].r << 16) | ((uint32_t)colors[i].g << 8) | colors[i].b;
+    return 0;
+}
+
+rv_uint rv_av_backend::syscall_audio_init()
+{
+    if (!audio_open_) {
+        if (!open_audio())
+            return (rv_uint)-ENODEV;
+        audio_open_ = true;
+    }
+    return 0;
+}
+
+rv_uint rv_av_backend::syscall_music_init(rv_uint arg0, rv_uint arg1)
+{
+    if (!memory_.check_range(arg0, arg1, RV_MEMORY_R))
+        return (rv_uint)-EFAULT;
+    return music_.set_instruments(memory_.ram_ptr(arg0), arg1);
+}
+
+rv_uint rv_av_backend::syscall_music_register(rv_uint arg0, rv_uint arg1)
+{
+    if (!memory_.check_range(arg0, arg1, RV_MEMORY_R))
+        return (rv_uint)-EFAULT;
+    return music_.add_song(memory_.ram_ptr(arg0), arg1);
+}
+
+rv_uint rv_av_backend::syscall_set_framebuffer(rv_uint arg0)
+{
+    if (arg0 == 0)
+        return (rv_uint)-EINVAL;
+
+    framebuffer_ = arg0;
+    return 0;
+}
+
+void rv_av_backend::save_state(rv_snapshot_writer& snapshot, uint64_t insn_count) const
+{
+    snapshot.put(width_);
+    snapshot.put(height_);
+    snapshot.put(framebuffer_);
+    snapshot.put(palette_);
+    snapshot.put(delayed_ms_);
+    snapshot.put<uint8_t>(width_ > 0);
+
+    // the clock as the guest sees it right now
+    snapshot.put(syscall_get_ticks(insn_count));
+
+    snapshot.put<uint8_t>(audio_open_);
+    mixer_.save_state(snapshot);
+    music_.save_state(snapshot);
+}
+
+void rv_av_backend::restore_state(rv_snapshot_reader& snapshot)
+{
+    const int width = snapshot.get<int>();
+    const int height = snapshot.get<int>();
+    const rv_uint framebuffer = snapshot.get<rv_uint>();
+    const auto palette = snapshot.get<std::array<uint32_t, 256>>();
+    delayed_ms_ = snapshot.get<uint64_t>();
+    const bool initialized = snapshot.get<uint8_t>() != 0;
+    const rv_uint ticks = snapshot.get<rv_uint>();
+    const bool audio_open = snapshot.get<uint8_t>() != 0;
+    mixer_.restore_state(snapshot);
+    music_.restore_state(snapshot);
+
+    if (initialized && syscall_init((rv_uint)width, (rv_uint)height) != 0)
+        throw std::runtime_error("unable to restore the video output");
+    framebuffer_ = framebuffer;
+    palette_ = palette;
+    restore_ticks(ticks);
+
+    // the guest carries on without sound rather than not at all
+    if (audio_open && syscall_audio_init() != 0)
+        fprintf(stderr, "[e] error: unable to restore the audio output\n");
+}
@@ -0,0 +1,105 @@
+#pragma once
+#include <array>
+#include "rv_av.h"
+#include "rv_global.h"
+#include "rv_memory.h"
+#include "rv_mixer.h"
+#include "rv_raster.h"
+
+class rv_snapshot_writer;
+class rv_snapshot_reader;
+
+// host side of the av_* syscalls, each guest has its own
+// rv_sdl draws in a window, rv_av_headless only counts frames and runs on an emulated clock
+// sound effects are mixed by rv_mixer along with the music of rv_music, the backend decides where the samples go
+class rv_av_backend
+{
+public:
+    rv_av_backend() = delete;
+    explicit rv_av_backend(rv_memory& memory) : memory_{memory}, music_{rv_mixer::output_rate}, mixer_{memory}, raster_{memory}
+    {
+        mixer_.attach_music(&music_);
+    }
+    virtual ~rv_av_backend() = default;
+
+    rv_av_backend(const rv_av_backend&) = delete;
+    rv_av_backend& operator=(const rv_av_backend&) = delete;
+
+    // frames presented through av_update
+    uint64_t frame_count() const { return frame_count_; }
+
+    // geometry, framebuffer, palette, clock, registered sounds and music, restore reopens the outputs there were
+    // the layout is the same for every backend, a snapshot taken with one resumes with the other
+    void save_state(rv_snapshot_writer& snapshot, uint64_t insn_count) const;
+    void restore_state(rv_snapshot_reader& snapshot);
+
+    virtual rv_uint syscall_init(rv_uint arg0, rv_uint arg1) = 0;
+    virtual rv_uint syscall_set_framebuffer(rv_uint arg0);
+    virtual rv_uint syscall_delay(rv_uint arg0) = 0;
+    virtual rv_uint syscall_update() = 0;
+    virtual rv_uint syscall_set_palette(rv_uint arg0, rv_uint arg1);
+    virtual rv_uint syscall_poll_event(rv_uint arg0) = 0;
+    virtual rv_uint syscall_get_ticks(uint64_t insn_count) const = 0;
+    virtual rv_uint syscall_get_mouse_state(rv_uint arg0, rv_uint arg1) = 0;
+    virtual rv_uint syscall_warp_mouse(rv_uint arg0, rv_uint arg1) = 0;
+    virtual rv_uint syscall_shutdown() = 0;
+
+    rv_uint syscall_audio_init();
+    rv_uint syscall_sound_register(rv_uint arg0, rv_uint arg1, rv_uint arg2) { return mixer_.add_sound(arg0, arg1, arg2); }
+    rv_uint syscall_sound_start(rv_uint arg0, rv_uint arg1, rv_uint arg2, rv_uint arg3)
+    {
+        return mixer_.start(arg0, arg1, arg2, arg3);
+    }
+    rv_uint syscall_sound_stop(rv_uint arg0) { return mixer_.stop(arg0); }
+    rv_uint syscall_sound_update(rv_uint arg0, rv_uint arg1, rv_uint arg2) { return mixer_.update(arg0, arg1, arg2); }
+    rv_uint syscall_sound_playing(rv_uint arg0) const { return mixer_.playing(arg0); }
+
+    rv_uint syscall_music_init(rv_uint arg0, rv_uint arg1);
+    rv_uint syscall_music_register(rv_uint arg0, rv_uint arg1);
+    rv_uint syscall_music_unregister(rv_uint arg0) { return music_.remove_song(arg0); }
+    rv_uint syscall_music_play(rv_uint arg0, rv_uint arg1) { return music_.play(arg0, arg1); }
+    rv_uint syscall_music_stop() { return music_.stop(); }
+    rv_uint syscall_music_pause() { return music_.pause(); }
+    rv_uint syscall_music_resume() { return music_.resume(); }
+    rv_uint syscall_music_volume(rv_uint arg0) { return music_.set_volume(arg0); }
+    rv_uint syscall_music_playing(rv_uint arg0) const { return music_.playing(arg0); }
+
+    rv_uint syscall_draw_columns(rv_uint arg0, rv_uint arg1, rv_uint arg2) { return raster_.draw_columns(arg0, arg1, arg2); }
+    rv_uint syscall_draw_spans(rv_uint arg0, rv_uint arg1) { return raster_.draw_spans(arg0, arg1); }
+
+    // mix up to the guest clock, called before every audio syscall and frame
+    // nothing to do for backends whose audio device pulls the samples itself
+    virtual void advance_audio(uint64_t insn_count) { (void)insn_count; }
+
+    // the guest clock in microseconds, read by rdtime
+    virtual uint64_t time_us(uint64_t insn_count) const = 0;
+
+protected:
+    // the guest clock was at ticks when the snapshot was taken
+    virtual void restore_ticks(rv_uint ticks) = 0;
+
+    // start taking samples from mixer_, false if the host can't play them
+    virtual bool open_audio() = 0;
+
+protected:
+    rv_memory& memory_;
+    int width_ = -1;
+    int height_ = -1;
+
+    // guest framebuffer, 8bit indexed
+    rv_uint framebuffer_ = 0;
+
+    // the palette as ARGB8888 pixels, built by syscall_set_palette
+    std::array<uint32_t, 256> palette_{};
+
+    // time the guest spent in av_delay without the host waiting
+    uint64_t delayed_ms_ = 0;
+    uint64_t frame_count_ = 0;
+
+    // before mixer_, which renders it
+    rv_music music_;
+    rv_mixer mixer_;
+    bool audio_open_ = false;
+
+    rv_raster raster_;
+};
@@ -0,0 +1,123 @@
+#include <algorithm>
+#include <errno.h>
+#include "rv_av_headless.h"
+
+// the canonical 44 byte header, the sizes are patched in once the file is closed
+static void write_wav_header(FILE* f, uint64_t frames)
+{
+    const uint32_t data_size = (uint32_t)std::min<uint64_t>(frames*4, 0xFFFFFFFFu - 36);
+    auto put16 = [f](uint32_t v) { fputc((int)(v & 0xFF), f); fputc((int)(v >> 8), f); };
+    auto put32 = [&put16](uint32_t v) { put16(v & 0xFFFF); put16(v >> 16); };
+
+    fwrite("RIFF", 1, 4, f);
+    put32(36 + data_size);
+    fwrite("WAVEfmt ", 1, 8, f);
+    put32(16);
+    put16(1);                               // PCM
+    put16(2);
+    put32(rv_mixer::output_rate);
+    put32(rv_mixer::output_rate*4);         // bytes per second
+    put16(4);                               // bytes per frame
+    put16(16);
+    fwrite("data", 1, 4, f);
+    put32(data_size);
+}
+
+rv_av_headless::~rv_av_headless()
+{
+    if (wav_ != nullptr) {
+        fseek(wav_, 0, SEEK_SET);
+        write_wav_header(wav_, wav_frames_);
+        fclose(wav_);
+    }
+}
+
+bool rv_av_headless::dump_audio(const std::string& path)
+{
+    wav_ = fopen(path.c_str(), "wb");
+    if (wav_ == nullptr)
+        return false;
+    write_wav_header(wav_, 0);
+    return true;
+}
+
+void rv_av_headless::advance_audio(uint64_t insn_count)
+{
+    if (!audio_open_)
+        return;
+
+    const uint64_t due = time_us(insn_count) * rv_mixer::output_rate / 1000000;
+    if (!audio_clock_set_) {
+        audio_frames_ = due;
+        audio_clock_set_ = true;
+        return;
+    }
+
+    int16_t samples[1024*2];
+    while (audio_frames_ < due) {
+        const size_t n = (size_t)std::min<uint64_t>(due - audio_frames_, 1024);
+        mixer_.mix(wav_ != nullptr ? samples : nullptr, n);
+        if (wav_ != nullptr) {
+            fwrite(samples, 4, n, wav_);
+            wav_frames_ += n;
+        }
+        audio_frames_ += n;
+    }
+}
+
+rv_uint rv_av_headless::syscall_init(rv_uint arg0, rv_uint arg1)
+{
+    width_ = (int)arg0;
+    height_ = (int)arg1;
+    return 0;
+}
+
+rv_uint rv_av_headless::syscall_delay(rv_uint arg0)
+{
+    // the time spent waiting is simply skipped
+    delayed_ms_ += arg0;
+    return 0;
+}
+
+rv_uint rv_av_headless::syscall_update()
+{
+    ++frame_count_;
+    return 0;
+}
+
+rv_uint rv_av_headless::syscall_poll_event(rv_uint arg0)
+{
+    return arg0 != 0 ? 0 : (rv_uint)-EINVAL;
+}
+
+rv_uint rv_av_headless::syscall_get_ticks(uint64_t insn_count) const
+{
+    return (rv_uint)(insn_count / insns_per_ms_ + delayed_ms_);
+}
+
+uint64_t rv_av_headless::time_us(uint64_t insn_count) const
+{
+    return insn_count * 1000 / insns_per_ms_ + delayed_ms_ * 1000;
+}
+
+rv_uint rv_av_headless::syscall_get_mouse_state(rv_uint arg0, rv_uint arg1)
+{
+    if ((arg0 != 0 && !memory_.check_range(arg0, sizeof(int32_t), RV_MEMORY_W)) ||
+        (arg1 != 0 && !memory_.check_range(arg1, sizeof(int32_t), RV_MEMORY_W)))
+        return (rv_uint)-EFAULT;
+    if (arg0 != 0)
+        *(int *)memory_.ram_ptr(arg0) = 0;
+    if (arg1 != 0)
+        *(int *)memory_.ram_ptr(arg1) = 0;
+    return 0;
+}
+
+rv_uint rv_av_headless::syscall_warp_mouse(rv_uint, rv_uint)
+{
+    return 0;
+}
+
+rv_uint rv_av_headless::syscall_shutdown()
+{
+    return 0;
+}
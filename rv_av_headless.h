@@ -0,0 +1,46 @@
+#pragma once
+#include <cstdio>
+#include <string>
+#include "rv_av_backend.h"
+
+// no window and no host clock: frames are only counted, av_delay doesn't sleep
+// and the guest clock advances by one ms every insns_per_ms executed instructions
+// audio is mixed on the same clock, to a wav file or to nowhere
+// nothing here is process-global, any number of them can run side by side
+class rv_av_headless : public rv_av_backend
+{
+public:
+    rv_av_headless(rv_memory& memory, uint64_t insns_per_ms)
+        : rv_av_backend{memory}, insns_per_ms_{insns_per_ms != 0 ? insns_per_ms : 1} {}
+    ~rv_av_headless() override;
+
+    // write what the guest plays to path as 16bit stereo wav, false if it can't be created
+    bool dump_audio(const std::string& path);
+
+    rv_uint syscall_init(rv_uint arg0, rv_uint arg1) override;
+    rv_uint syscall_delay(rv_uint arg0) override;
+    rv_uint syscall_update() override;
+    rv_uint syscall_poll_event(rv_uint arg0) override;
+    rv_uint syscall_get_ticks(uint64_t insn_count) const override;
+    rv_uint syscall_get_mouse_state(rv_uint arg0, rv_uint arg1) override;
+    rv_uint syscall_warp_mouse(rv_uint arg0, rv_uint arg1) override;
+    rv_uint syscall_shutdown() override;
+
+    uint64_t time_us(uint64_t insn_count) const override;
+    void advance_audio(uint64_t insn_count) override;
+
+protected:
+    // derived from the instruction count and delayed_ms_, both restored already
+    void restore_ticks(rv_uint) override { audio_clock_set_ = false; }
+    bool open_audio() override { return true; }
+
+private:
+    uint64_t insns_per_ms_;
+
+    FILE* wav_ = nullptr;
+    uint64_t wav_frames_ = 0;
+
+    // output frames mixed so far, counted from the guest clock at the first advance_audio
+    uint64_t audio_frames_ = 0;
+    bool audio_clock_set_ = false;
+};
@@ -1,4 +1,7 @@
 #include <memory.h>
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
 #include <limits>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -11,6 +14,9 @@
 #include "rv_exceptions.h"
 #include "rv_memory.h"
 #include "rv_bits.h"
+#include "rv_fpu.h"
+#include "rv_snapshot.h"
+#include "rv_replay.h"
 #include "newlib_syscalls.h"
 #include "newlib_trans.h"
 
@@ -18,6 +24,13 @@ constexpr uint32_t kRiscvOpcodeMask = 0x7F;
 
 constexpr uint32_t RV_PRIV_U = 0;
 
+// all the writes to x0 end up here
+constexpr uint8_t RV_REG_SINK = 32;
+
+// sign bits, for fsgnj*
+constexpr uint32_t kSignS = 0x80000000;
+constexpr uint64_t kSignD = 0x8000000000000000ULL;
+
 enum class rv_opcode: uint32_t
 {
     lui = 0b01101,
@@ -31,11 +44,22 @@ enum class rv_opcode: uint32_t
     op = 0b01100,
     misc_mem = 0b00011,
     system  = 0b11100,
-    amo = 0b01011
+    amo = 0b01011,
+    load_fp = 0b00001,
+    store_fp = 0b01001,
+    madd = 0b10000,
+    msub = 0b10001,
+    nmsub = 0b10010,
+    nmadd = 0b10011,
+    op_fp = 0b10100
 };
 
 enum class rv_csr: uint32_t
 {
+    fflags = 0x001,
+    frm = 0x002,
+    fcsr = 0x003,
+
     cycle = 0xC00,
     time = 0xC01,
     instret = 0xC02,
@@ -94,10 +118,278 @@ enum riscv_register
     t3, t4, t5, t6
 };
 
-rv_cpu::rv_cpu(rv_memory& memory)
-    : memory_{memory}, sdl_{memory}
+rv_cpu::rv_cpu(rv_memory& memory, rv_av_backend& av)
+    : memory_{memory}, icache_{memory.ram_end()}, av_{av}, vmas_{memory}
 {
+    memory_.attach_icache(&icache_);
+}
+
+rv_cpu::~rv_cpu()
+{
+    memory_.attach_icache(nullptr);
+}
+
+bool rv_cpu::enable_jit()
+{
+    if (!rv_jit::supported())
+        return false;
+
+    jit_ = std::make_unique<rv_jit>();
+    jit_ctx_.regs = regs_.data();
+    jit_ctx_.ram = memory_.ram_ptr(0);
+    jit_ctx_.mpu = memory_.mpu_ptr();
+    jit_ctx_.budget = 0;
+    jit_ctx_.link_slot = nullptr;
+    jit_ctx_.pc = 0;
+    jit_ctx_.ram_end = memory_.ram_end();
+
+    // blocks translated so far have no host code, start from scratch
+    flush_translations();
+    return true;
+}
 
+void rv_cpu::attach_profiler(rv_profiler* profiler)
+{
+    profiler_ = profiler;
+    profile_countdown_ = profiler != nullptr ? profiler->interval() : 0;
+}
+
+void rv_cpu::attach_hle(rv_hle* hle)
+{
+    if (hle != nullptr && hle->verifying() && jit_ != nullptr)
+        throw std::runtime_error("hle verification needs the interpreter");
+
+    hle_ = hle;
+
+    // function entries translated so far have no hle op, or a stale one
+    flush_translations();
+}
+
+#ifdef RISC_666_TRACE
+void rv_cpu::attach_trace(rv_trace* trace)
+{
+    if (trace != nullptr && jit_ != nullptr)
+        throw std::runtime_error("tracing needs the interpreter");
+
+    trace_ = trace;
+    trace_blocks_ = 0;
+
+    // blocks translated so far can hold fused pairs
+    flush_translations();
+}
+
+// register written by insn: x1..x31, 32 + f0..f31, or rv_trace_record::no_dest
+static uint8_t trace_dest(const rv_insn& insn)
+{
+    switch (insn.op) {
+    case rv_op::op_illegal: case rv_op::op_fallthrough: case rv_op::op_nop:
+    case rv_op::op_ecall: case rv_op::op_ebreak: case rv_op::op_fence_i:
+    case rv_op::op_beq: case rv_op::op_bne: case rv_op::op_blt:
+    case rv_op::op_bge: case rv_op::op_bltu: case rv_op::op_bgeu:
+    case rv_op::op_sb: case rv_op::op_sh: case rv_op::op_sw:
+    case rv_op::op_fsw: case rv_op::op_fsd:
+        return rv_trace_record::no_dest;
+
+    case rv_op::op_flw: case rv_op::op_fld:
+    case rv_op::op_fmadd_s: case rv_op::op_fmsub_s: case rv_op::op_fnmsub_s: case rv_op::op_fnmadd_s:
+    case rv_op::op_fadd_s: case rv_op::op_fsub_s: case rv_op::op_fmul_s: case rv_op::op_fdiv_s:
+    case rv_op::op_fsqrt_s: case rv_op::op_fsgnj_s: case rv_op::op_fsgnjn_s: case rv_op::op_fsgnjx_s:
+    case rv_op::op_fmin_s: case rv_op::op_fmax_s: case rv_op::op_fcvt_s_w: case rv_op::op_fcvt_s_wu:
+    case rv_op::op_fmv_w_x:
+    case rv_op::op_fmadd_d: case rv_op::op_fmsub_d: case rv_op::op_fnmsub_d: case rv_op::op_fnmadd_d:
+    case rv_op::op_fadd_d: case rv_op::op_fsub_d: case rv_op::op_fmul_d: case rv_op::op_fdiv_d:
+    case rv_op::op_fsqrt_d: case rv_op::op_fsgnj_d: case rv_op::op_fsgnjn_d: case rv_op::op_fsgnjx_d:
+    case rv_op::op_fmin_d: case rv_op::op_fmax_d: case rv_op::op_fcvt_s_d: case rv_op::op_fcvt_d_s:
+    case rv_op::op_fcvt_d_w: case rv_op::op_fcvt_d_wu:
+        return (uint8_t)(32 + insn.rd);
+
+    default:
+        return insn.rd != RV_REG_SINK ? insn.rd : rv_trace_record::no_dest;
+    }
+}
+
+// see rv_insn::trace_access
+static uint8_t trace_access(const rv_insn& insn)
+{
+    switch (insn.op) {
+    case rv_op::op_lb: case rv_op::op_lh: case rv_op::op_lw: case rv_op::op_lbu: case rv_op::op_lhu:
+    case rv_op::op_sb: case rv_op::op_sh: case rv_op::op_sw:
+    case rv_op::op_flw: case rv_op::op_fsw: case rv_op::op_fld: case rv_op::op_fsd:
+        return 1;
+    case rv_op::op_lr: case rv_op::op_sc: case rv_op::op_amoswap: case rv_op::op_amoadd:
+    case rv_op::op_amoxor: case rv_op::op_amoand: case rv_op::op_amoor: case rv_op::op_amomin:
+    case rv_op::op_amomax: case rv_op::op_amominu: case rv_op::op_amomaxu:
+        return 2;
+    default:
+        return 0;
+    }
+}
+
+// see rv_trace_format::value_recorded, anything not listed is recorded
+static uint8_t trace_value(const rv_insn& insn)
+{
+    if (insn.trace_dest >= 32)
+        return rv_trace_format::value_recorded;
+
+    constexpr uint8_t imm = rv_trace_format::value_imm_operand;
+    switch (insn.op) {
+    case rv_op::op_jal: case rv_op::op_jalr: return rv_trace_format::value_link;
+    case rv_op::op_lui: return rv_trace_format::value_imm;
+    case rv_op::op_addi: return rv_trace_format::value_add | imm;
+    case rv_op::op_slti: return rv_trace_format::value_slt | imm;
+    case rv_op::op_sltiu: return rv_trace_format::value_sltu | imm;
+    case rv_op::op_xori: return rv_trace_format::value_xor | imm;
+    case rv_op::op_ori: return rv_trace_format::value_or | imm;
+    case rv_op::op_andi: return rv_trace_format::value_and | imm;
+    case rv_op::op_slli: return rv_trace_format::value_sll | imm;
+    case rv_op::op_srli: return rv_trace_format::value_srl | imm;
+    case rv_op::op_srai: return rv_trace_format::value_sra | imm;
+    case rv_op::op_add: return rv_trace_format::value_add;
+    case rv_op::op_sub: return rv_trace_format::value_sub;
+    case rv_op::op_sll: return rv_trace_format::value_sll;
+    case rv_op::op_slt: return rv_trace_format::value_slt;
+    case rv_op::op_sltu: return rv_trace_format::value_sltu;
+    case rv_op::op_xor: return rv_trace_format::value_xor;
+    case rv_op::op_srl: return rv_trace_format::value_srl;
+    case rv_op::op_sra: return rv_trace_format::value_sra;
+    case rv_op::op_or: return rv_trace_format::value_or;
+    case rv_op::op_and: return rv_trace_format::value_and;
+    case rv_op::op_mul: return rv_trace_format::value_mul;
+    case rv_op::op_mulh: return rv_trace_format::value_mulh;
+    case rv_op::op_mulhsu: return rv_trace_format::value_mulhsu;
+    case rv_op::op_mulhu: return rv_trace_format::value_mulhu;
+    case rv_op::op_div: return rv_trace_format::value_div;
+    case rv_op::op_divu: return rv_trace_format::value_divu;
+    case rv_op::op_rem: return rv_trace_format::value_rem;
+    case rv_op::op_remu: return rv_trace_format::value_remu;
+    default: return rv_trace_format::value_recorded;
+    }
+}
+
+// the integer loads record what they read themselves
+static rv_op trace_load(rv_op op)
+{
+    switch (op) {
+    case rv_op::op_lb: return rv_op::op_trace_lb;
+    case rv_op::op_lh: return rv_op::op_trace_lh;
+    case rv_op::op_lw: return rv_op::op_trace_lw;
+    case rv_op::op_lbu: return rv_op::op_trace_lbu;
+    case rv_op::op_lhu: return rv_op::op_trace_lhu;
+    default: return op;
+    }
+}
+
+// interleaves the guest instructions of a block translated while tracing with the
+// pseudo ops writing its runs, the rest of the interpreter never looks at the trace
+// the reader works out addresses and integer results from the registers: only the
+// values it can't are recorded, by the traced loads themselves or by op_trace_x and
+// op_trace_f right after the instruction, op_trace_end publishes the run ahead of
+// the instruction leaving the block (which never has a value to record)
+static void add_trace_ops(std::vector<rv_insn>& insns, bool block_end)
+{
+    std::vector<rv_insn> traced;
+    traced.reserve(insns.size() * 2 + 3);
+
+    rv_insn marker{};
+    marker.pc = insns.front().pc;
+    marker.op = rv_op::op_trace_start;
+    traced.push_back(marker);
+
+    const size_t body = block_end ? insns.size() - 1 : insns.size();
+    for (size_t i = 0; i < body; ++i) {
+        rv_insn insn = insns[i];
+        bool recorded = insn.trace_dest != rv_trace_record::no_dest &&
+            insn.trace_value == rv_trace_format::value_recorded;
+        const rv_op load = trace_load(insn.op);
+        if (recorded && load != insn.op) {
+            insn.op = load;
+            recorded = false;
+        }
+        traced.push_back(insn);
+        if (recorded) {
+            marker.pc = insn.pc;
+            marker.op = insn.trace_dest < 32 ? rv_op::op_trace_x : rv_op::op_trace_f;
+            marker.rd = insn.trace_dest & 31;
+            traced.push_back(marker);
+        }
+    }
+    marker.pc = insns.back().pc;
+    marker.op = rv_op::op_trace_end;
+    marker.rd = 0;
+    traced.push_back(marker);
+    if (block_end)
+        traced.push_back(insns.back());
+    insns.swap(traced);
+}
+
+void rv_cpu::trace_define(rv_block& block)
+{
+    uint32_t* out = trace_->reserve();
+    *out++ = rv_trace_format::trace_define;
+    *out++ = block.insn_count;
+    *out++ = block.pc;
+    for (const auto& insn : block.insns) {
+        // pseudo ops, nothing the guest executes
+        if (insn.count == 0)
+            continue;
+        *out++ = insn.raw;
+        *out++ = insn.trace_dest | insn.trace_access << 8 | insn.trace_value << 16 | (uint32_t)insn.rs1 << 24;
+        *out++ = insn.rs2;
+        // atomics don't use it, their address is rs1
+        *out++ = insn.trace_access == 2 ? 0 : (uint32_t)insn.imm;
+    }
+    trace_->commit(out, 0);
+    block.trace_id = ++trace_blocks_;
+}
+
+void rv_cpu::trace_state()
+{
+    uint32_t* out = trace_->reserve();
+    *out++ = rv_trace_format::trace_state;
+    for (int i = 1; i < 32; ++i)
+        *out++ = regs_[i];
+    trace_->commit(out, 0);
+}
+
+void rv_cpu::trace_close()
+{
+    if (trace_count_ == nullptr)
+        return;
+
+    // the interpreter left the block halfway, at the instruction pc_ points to: it never
+    // got to record its value, the register it would have written still holds what the
+    // trace shows for it
+    // (looked up here, keeping ip around for it would slow down every handler)
+    const rv_insn* exit = nullptr;
+    for (const auto& insn : trace_block_->insns) {
+        if (insn.count == 0)
+            continue;
+        exit = &insn;
+        if (insn.pc == pc_)
+            break;
+    }
+    uint32_t* out = trace_out_;
+    if (exit->trace_dest != rv_trace_record::no_dest && exit->trace_value == rv_trace_format::value_recorded) {
+        if (exit->trace_dest >= 32) {
+            const uint64_t value = fregs_[exit->trace_dest & 31];
+            *out++ = (uint32_t)value;
+            *out++ = (uint32_t)(value >> 32);
+        }
+        else {
+            *out++ = regs_[exit->trace_dest];
+        }
+    }
+    *trace_count_ = exit->trace_index;
+    trace_->commit(out, *trace_count_);
+    trace_count_ = nullptr;
+}
+#endif
+
+void rv_cpu::flush_translations()
+{
+    icache_.flush();
+    if (jit_ != nullptr)
+        jit_->reset();
 }
 
 void rv_cpu::reset(rv_uint pc)
@@ -106,6 +398,11 @@ void rv_cpu::reset(rv_uint pc)
 
     // initialize all registers to 0
     regs_.fill(0);
+    fregs_.fill(0);
+    fflags_ = 0;
+    frm_ = RV_RM_RNE;
+    rv_host_fflags_clear();
+    icache_.invalidate(0, memory_.ram_end());
 
     cycle_ = 0;
     instret_ = 0;
@@ -121,562 +418,1648 @@ void rv_cpu::reset(rv_uint pc)
     emulation_exit_ = false;
 }
 
-void rv_cpu::run(size_t nCycles)
+void rv_cpu::reopen_files()
 {
-    auto c = nCycles;
+    files_.reopen_files();
+}
 
-    c += 1;
-    while(likely(!exception_raised_)) {
-        if (unlikely(!--c))
-            break;
+void rv_cpu::save_state(rv_snapshot_writer& snapshot)
+{
+    // exceptions accrued by the host fpu are part of fflags
+    fflags_ |= rv_host_fflags_take();
+
+    snapshot.put(pc_);
+    snapshot.put(regs_);
+    snapshot.put(amo_res_);
+    snapshot.put(fregs_);
+    snapshot.put(fflags_);
+    snapshot.put(frm_);
+    snapshot.put(cycle_);
+    snapshot.put(instret_);
+
+    files_.save_state(snapshot);
+    vmas_.save_state(snapshot);
+    av_.save_state(snapshot, cycle_);
+}
 
-        uint32_t insn;
-        if (unlikely(!memory_.fetch(pc_, insn))) {
-            raise_memory_exception();
-            break;
-        }
+void rv_cpu::restore_state(rv_snapshot_reader& snapshot)
+{
+    pc_ = snapshot.get<rv_uint>();
+    regs_ = snapshot.get<decltype(regs_)>();
+    amo_res_ = snapshot.get<rv_uint>();
+    fregs_ = snapshot.get<decltype(fregs_)>();
+    fflags_ = snapshot.get<uint32_t>();
+    frm_ = snapshot.get<uint32_t>();
+    cycle_ = snapshot.get<uint64_t>();
+    instret_ = snapshot.get<uint64_t>();
+    rv_host_fflags_clear();
+    icache_.invalidate(0, memory_.ram_end());
+
+    files_.restore_state(snapshot);
+    vmas_.restore_state(snapshot);
+    av_.restore_state(snapshot);
 
-        // add support for compressed instructions!
-        const auto opcode = (rv_opcode) ((insn & kRiscvOpcodeMask) >> 2);
-        switch (opcode) {
-        case rv_opcode::load:
-            execute_load(insn);
-            break;
-        case rv_opcode::misc_mem:
-            execute_misc_mem(insn);
-            break;
-        case rv_opcode::imm:
-            execute_imm(insn);
-            break;
-        case rv_opcode::auipc:
-            execute_auipc(insn);
-            break;
-        case rv_opcode::store:
-            execute_store(insn);
-            break;
-        case rv_opcode::amo:
-            execute_amo(insn);
-            break;
-        case rv_opcode::op:
-            execute_op(insn);
-            break;
-        case rv_opcode::lui:
-            execute_lui(insn);
-            break;
-        case rv_opcode::branch:
-            execute_branch(insn);
-            break;
-        case rv_opcode::jalr:
-            execute_jalr(insn);
-            break;
-        case rv_opcode::jal:
-            execute_jal(insn);
-            break;
-        case rv_opcode::system:
-            execute_system(insn);
-            break;
-        default:
-            raise_illegal_instruction();
-            break;
-        }
-    }
-    if (unlikely(exception_raised_)) {
-        handle_user_exception();
-    }
-    cycle_ += nCycles - c;
+    exception_raised_ = false;
+    emulation_exit_status_ = 0;
+    emulation_exit_ = false;
 }
 
-void rv_cpu::execute_lui(uint32_t insn)
+// 32bit encoders, used to expand compressed instructions
+static uint32_t encode_r(uint32_t opcode, uint32_t rd, uint32_t funct3, uint32_t rs1, uint32_t rs2, uint32_t funct7)
 {
-    const auto rd = decode_rd(insn);
-    regs_[rd] = insn & 0xFFFFF000;
-    next_insn();
+    return (funct7 << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | opcode;
 }
 
-void rv_cpu::execute_auipc(uint32_t insn)
+static uint32_t encode_i(uint32_t opcode, uint32_t rd, uint32_t funct3, uint32_t rs1, uint32_t imm)
 {
-    const auto rd = decode_rd(insn);
-    regs_[rd] = pc_ + (int32_t)(insn & 0xFFFFF000);
-    next_insn();
+    return ((imm & 0xFFF) << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | opcode;
 }
 
-void rv_cpu::execute_jal(uint32_t insn)
+static uint32_t encode_s(uint32_t opcode, uint32_t funct3, uint32_t rs1, uint32_t rs2, uint32_t imm)
 {
-    const auto rd = decode_rd(insn);
-    rv_int imm = (bits(insn, 21, 30) << 1) |
-                 (bit(insn, 20) << 11) |
-                 (bits(insn, 12, 19) << 12) |
-                 (bit(insn, 31) << 20);
-    imm = (imm << 11) >> 11;
-    if (rd != 0) {
-        regs_[rd] = pc_ + 4;
+    return (((imm >> 5) & 0x7F) << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) | ((imm & 0x1F) << 7) | opcode;
+}
+
+static uint32_t encode_b(uint32_t funct3, uint32_t rs1, uint32_t rs2, uint32_t imm)
+{
+    return (((imm >> 12) & 1) << 31) | (((imm >> 5) & 0x3F) << 25) | (rs2 << 20) | (rs1 << 15) |
+           (funct3 << 12) | (((imm >> 1) & 0xF) << 8) | (((imm >> 11) & 1) << 7) | 0x63;
+}
+
+static uint32_t encode_j(uint32_t rd, uint32_t imm)
+{
+    return (((imm >> 20) & 1) << 31) | (((imm >> 1) & 0x3FF) << 21) | (((imm >> 11) & 1) << 20) |
+           (((imm >> 12) & 0xFF) << 12) | (rd << 7) | 0x6F;
+}
+
+// sign extend the low "width" bits of val
+static uint32_t sign_extend(uint32_t val, uint32_t width)
+{
+    return (uint32_t)((int32_t)(val << (32 - width)) >> (32 - width));
+}
+
+uint32_t rv_cpu::expand_compressed(uint32_t insn) const
+{
+    constexpr uint32_t op_load = 0x03, op_load_fp = 0x07, op_imm = 0x13, op_store = 0x23;
+    constexpr uint32_t op_store_fp = 0x27, op_op = 0x33, op_lui = 0x37, op_jalr = 0x67;
+
+    const auto funct3 = bits(insn, 13, 15);
+    // full register numbers in [11:7] and [6:2], popular registers x8-x15 in [9:7] and [4:2]
+    const auto rd = bits(insn, 7, 11);
+    const auto rs2 = bits(insn, 2, 6);
+    const auto rdp = bits(insn, 7, 9) + 8;
+    const auto rs2p = bits(insn, 2, 4) + 8;
+    // imm[5] in [12], imm[4:0] in [6:2]
+    const auto imm6 = sign_extend((bit(insn, 12) << 5) | rs2, 6);
+
+    switch (insn & 3) {
+    case 0b00:
+    {
+        // offsets for c.lw/c.sw/c.flw/c.fsw and c.fld/c.fsd
+        const auto offw = (bits(insn, 10, 12) << 3) | (bit(insn, 6) << 2) | (bit(insn, 5) << 6);
+        const auto offd = (bits(insn, 10, 12) << 3) | (bits(insn, 5, 6) << 6);
+        switch (funct3) {
+        case 0b000:  // c.addi4spn
+        {
+            const auto imm = (bits(insn, 11, 12) << 4) | (bits(insn, 7, 10) << 6) | (bit(insn, 6) << 2) | (bit(insn, 5) << 3);
+            if (imm == 0)
+                return 0;
+            return encode_i(op_imm, rs2p, 0b000, sp, imm);
+        }
+        case 0b001: return encode_i(op_load_fp, rs2p, 0b011, rdp, offd);     // c.fld
+        case 0b010: return encode_i(op_load, rs2p, 0b010, rdp, offw);        // c.lw
+        case 0b011: return encode_i(op_load_fp, rs2p, 0b010, rdp, offw);     // c.flw
+        case 0b101: return encode_s(op_store_fp, 0b011, rdp, rs2p, offd);    // c.fsd
+        case 0b110: return encode_s(op_store, 0b010, rdp, rs2p, offw);       // c.sw
+        case 0b111: return encode_s(op_store_fp, 0b010, rdp, rs2p, offw);    // c.fsw
+        }
+        return 0;
+    }
+
+    case 0b01:
+        switch (funct3) {
+        case 0b000: return encode_i(op_imm, rd, 0b000, rd, imm6);           // c.addi, c.nop
+        case 0b001:  // c.jal
+        case 0b101:  // c.j
+        {
+            const auto imm = (bits(insn, 3, 5) << 1) | (bit(insn, 11) << 4) | (bit(insn, 2) << 5) |
+                             (bit(insn, 7) << 6) | (bit(insn, 6) << 7) | (bits(insn, 9, 10) << 8) |
+                             (bit(insn, 8) << 10) | (bit(insn, 12) << 11);
+            return encode_j(funct3 == 0b001 ? ra : zero, sign_extend(imm, 12));
+        }
+        case 0b010: return encode_i(op_imm, rd, 0b000, zero, imm6);         // c.li
+        case 0b011:
+            if (rd == sp) {  // c.addi16sp
+                const auto imm = (bit(insn, 6) << 4) | (bit(insn, 2) << 5) | (bit(insn, 5) << 6) |
+                                 (bits(insn, 3, 4) << 7) | (bit(insn, 12) << 9);
+                if (imm == 0)
+                    return 0;
+                return encode_i(op_imm, sp, 0b000, sp, sign_extend(imm, 10));
+            }
+            // c.lui
+            if (imm6 == 0)
+                return 0;
+            return (imm6 << 12) | (rd << 7) | op_lui;
+        case 0b100:
+            switch (bits(insn, 10, 11)) {
+            case 0b00:  // c.srli
+            case 0b01:  // c.srai
+                // shamt[5] must be zero on RV32
+                if (bit(insn, 12) != 0)
+                    return 0;
+                return encode_i(op_imm, rdp, 0b101, rdp, rs2 | (bit(insn, 10) << 10));
+            case 0b10: return encode_i(op_imm, rdp, 0b111, rdp, imm6);      // c.andi
+            default:
+                if (bit(insn, 12) != 0)
+                    return 0;
+                switch (bits(insn, 5, 6)) {
+                case 0b00: return encode_r(op_op, rdp, 0b000, rdp, rs2p, 0x20);  // c.sub
+                case 0b01: return encode_r(op_op, rdp, 0b100, rdp, rs2p, 0);     // c.xor
+                case 0b10: return encode_r(op_op, rdp, 0b110, rdp, rs2p, 0);     // c.or
+                default:   return encode_r(op_op, rdp, 0b111, rdp, rs2p, 0);     // c.and
+                }
+            }
+        case 0b110:  // c.beqz
+        case 0b111:  // c.bnez
+        {
+            const auto imm = (bits(insn, 3, 4) << 1) | (bits(insn, 10, 11) << 3) | (bit(insn, 2) << 5) |
+                             (bits(insn, 5, 6) << 6) | (bit(insn, 12) << 8);
+            return encode_b(funct3 == 0b110 ? 0b000 : 0b001, rdp, zero, sign_extend(imm, 9));
+        }
+        }
+        return 0;
+
+    case 0b10:
+    {
+        // stack pointer relative offsets
+        const auto lwsp = (bit(insn, 12) << 5) | (bits(insn, 4, 6) << 2) | (bits(insn, 2, 3) << 6);
+        const auto ldsp = (bit(insn, 12) << 5) | (bits(insn, 5, 6) << 3) | (bits(insn, 2, 4) << 6);
+        const auto swsp = (bits(insn, 9, 12) << 2) | (bits(insn, 7, 8) << 6);
+        const auto sdsp = (bits(insn, 10, 12) << 3) | (bits(insn, 7, 9) << 6);
+        switch (funct3) {
+        case 0b000:  // c.slli
+            if (bit(insn, 12) != 0)
+                return 0;
+            return encode_i(op_imm, rd, 0b001, rd, rs2);
+        case 0b001: return encode_i(op_load_fp, rd, 0b011, sp, ldsp);       // c.fldsp
+        case 0b010:  // c.lwsp
+            if (rd == 0)
+                return 0;
+            return encode_i(op_load, rd, 0b010, sp, lwsp);
+        case 0b011: return encode_i(op_load_fp, rd, 0b010, sp, lwsp);       // c.flwsp
+        case 0b100:
+            if (bit(insn, 12) == 0) {
+                if (rs2 != 0)
+                    return encode_r(op_op, rd, 0b000, zero, rs2, 0);        // c.mv
+                if (rd == 0)
+                    return 0;
+                return encode_i(op_jalr, zero, 0b000, rd, 0);               // c.jr
+            }
+            if (rs2 != 0)
+                return encode_r(op_op, rd, 0b000, rd, rs2, 0);              // c.add
+            if (rd == 0)
+                return 0x00100073;                                          // c.ebreak
+            return encode_i(op_jalr, ra, 0b000, rd, 0);                     // c.jalr
+        case 0b101: return encode_s(op_store_fp, 0b011, sp, rs2, sdsp);     // c.fsdsp
+        case 0b110: return encode_s(op_store, 0b010, sp, rs2, swsp);        // c.swsp
+        case 0b111: return encode_s(op_store_fp, 0b010, sp, rs2, swsp);     // c.fswsp
+        }
+        return 0;
+    }
     }
-    jump_insn(pc_ + imm);
+    return 0;
 }
 
-void rv_cpu::execute_jalr(uint32_t insn)
+void rv_cpu::decode_op_fp(uint32_t insn, rv_insn& out) const
 {
-    const rv_int imm = (rv_int)insn >> 20;
-    const auto rd = decode_rd(insn);
-    const auto rs1 = decode_rs1(insn);
+    const auto funct3 = decode_funct3(insn);
+    const auto rs2 = decode_rs2(insn);
+    const auto funct7 = insn >> 25;
+    const bool single = (funct7 & 1) == 0;
+    const bool rm_valid = funct3 != 5 && funct3 != 6;
 
-    if (rd != 0) {
-        regs_[rd] = pc_ + 4;
+    // rounding mode, for the ops that have one
+    out.imm = (rv_int)funct3;
+
+    switch (funct7 & ~1U) {
+    case 0x00:
+        if (rm_valid)
+            out.op = single ? rv_op::op_fadd_s : rv_op::op_fadd_d;
+        break;
+    case 0x04:
+        if (rm_valid)
+            out.op = single ? rv_op::op_fsub_s : rv_op::op_fsub_d;
+        break;
+    case 0x08:
+        if (rm_valid)
+            out.op = single ? rv_op::op_fmul_s : rv_op::op_fmul_d;
+        break;
+    case 0x0C:
+        if (rm_valid)
+            out.op = single ? rv_op::op_fdiv_s : rv_op::op_fdiv_d;
+        break;
+    case 0x2C:
+        if (rm_valid && rs2 == 0)
+            out.op = single ? rv_op::op_fsqrt_s : rv_op::op_fsqrt_d;
+        break;
+    case 0x10:
+        if (funct3 <= 2)
+            out.op = (rv_op)((uint32_t)(single ? rv_op::op_fsgnj_s : rv_op::op_fsgnj_d) + funct3);
+        break;
+    case 0x14:
+        if (funct3 == 0)
+            out.op = single ? rv_op::op_fmin_s : rv_op::op_fmin_d;
+        else if (funct3 == 1)
+            out.op = single ? rv_op::op_fmax_s : rv_op::op_fmax_d;
+        break;
+    case 0x20:
+        // fcvt.s.d | fcvt.d.s
+        if (rm_valid && single && rs2 == 1)
+            out.op = rv_op::op_fcvt_s_d;
+        else if (rm_valid && !single && rs2 == 0)
+            out.op = rv_op::op_fcvt_d_s;
+        break;
+    case 0x50:
+        if (funct3 == 0)
+            out.op = single ? rv_op::op_fle_s : rv_op::op_fle_d;
+        else if (funct3 == 1)
+            out.op = single ? rv_op::op_flt_s : rv_op::op_flt_d;
+        else if (funct3 == 2)
+            out.op = single ? rv_op::op_feq_s : rv_op::op_feq_d;
+        break;
+    case 0x60:
+        if (rm_valid && rs2 == 0)
+            out.op = single ? rv_op::op_fcvt_w_s : rv_op::op_fcvt_w_d;
+        else if (rm_valid && rs2 == 1)
+            out.op = single ? rv_op::op_fcvt_wu_s : rv_op::op_fcvt_wu_d;
+        break;
+    case 0x68:
+        if (rm_valid && rs2 == 0)
+            out.op = single ? rv_op::op_fcvt_s_w : rv_op::op_fcvt_d_w;
+        else if (rm_valid && rs2 == 1)
+            out.op = single ? rv_op::op_fcvt_s_wu : rv_op::op_fcvt_d_wu;
+        break;
+    case 0x70:
+        // fmv.x.w | fclass.s | fclass.d
+        if (rs2 == 0 && funct3 == 0 && single)
+            out.op = rv_op::op_fmv_x_w;
+        else if (rs2 == 0 && funct3 == 1)
+            out.op = single ? rv_op::op_fclass_s : rv_op::op_fclass_d;
+        break;
+    case 0x78:
+        if (rs2 == 0 && funct3 == 0 && single)
+            out.op = rv_op::op_fmv_w_x;
+        break;
+    }
+
+    // compares, fclass, fmv.x.w and conversions to integer write an x register
+    switch (funct7 & ~1U) {
+    case 0x50:
+    case 0x60:
+    case 0x70:
+        break;
+    default:
+        out.rd = (uint8_t)decode_rd(insn);
+        break;
     }
-    jump_insn((regs_[rs1] + imm) & 0xFFFFFFFE);
 }
 
-void rv_cpu::execute_branch(uint32_t insn)
+bool rv_cpu::decode(uint32_t insn, rv_uint pc, rv_insn& out) const
 {
+    const auto rd = decode_rd(insn);
     const auto rs1 = decode_rs1(insn);
     const auto rs2 = decode_rs2(insn);
     const auto funct3 = decode_funct3(insn);
 
-    const rv_uint val1 = regs_[rs1];
-    const rv_uint val2 = regs_[rs2];
-    int cond = 0;
-    switch (funct3 >> 1) {
-    case 0b00:  // beq | bne
-        cond = val1 == val2;
-        break;
-    case 0b10:  // blt | bge
-        cond = (rv_int)val1 < (rv_int)val2;
+    // writes to x0 are redirected to the sink register, so handlers never need to check rd
+    out.rd = (uint8_t)(rd != 0 ? rd : RV_REG_SINK);
+    out.rs1 = (uint8_t)rs1;
+    out.rs2 = (uint8_t)rs2;
+    out.label = nullptr;
+    out.pc = pc;
+    out.imm = (rv_int)insn >> 20;
+    out.op = rv_op::op_illegal;
+    out.len = 4;
+    out.count = 1;
+
+    // only 32bit encodings get here, anything else is an illegal compressed instruction
+    if ((insn & 3) != 3)
+        return true;
+
+    const auto opcode = (rv_opcode) ((insn & kRiscvOpcodeMask) >> 2);
+    switch (opcode) {
+    case rv_opcode::lui:
+        out.imm = (rv_int)(insn & 0xFFFFF000);
+        out.op = rv_op::op_lui;
         break;
-    case 0b11:  // bltu | bgeu
-        cond = val1 < val2;
+
+    case rv_opcode::auipc:
+        // the result is known at translation time, so this is just a lui
+        out.imm = (rv_int)(pc + (insn & 0xFFFFF000));
+        out.op = rv_op::op_lui;
         break;
+
+    case rv_opcode::jal:
+    {
+        rv_int imm = (bits(insn, 21, 30) << 1) |
+                     (bit(insn, 20) << 11) |
+                     (bits(insn, 12, 19) << 12) |
+                     (bit(insn, 31) << 20);
+        out.imm = (rv_int)(pc + ((imm << 11) >> 11));
+        out.op = rv_op::op_jal;
     }
-    cond ^= (funct3 & 1);
-    if (cond != 0) {
+        break;
+
+    case rv_opcode::jalr:
+        out.op = rv_op::op_jalr;
+        break;
+
+    case rv_opcode::branch:
+    {
         rv_int imm = (bits(insn, 8, 11) << 1) |
                      (bits(insn, 25, 30) << 5) |
                      (bit(insn, 7) << 11) |
                      (bit(insn, 31) << 12);
-        imm = (imm << 19) >> 19;
-        jump_insn((pc_ + imm) & 0xFFFFFFFE);
-    }
-    else {
-        next_insn();
+        out.imm = (rv_int)(pc + ((imm << 19) >> 19));
+        switch (funct3) {
+        case 0b000: out.op = rv_op::op_beq; break;
+        case 0b001: out.op = rv_op::op_bne; break;
+        case 0b100: out.op = rv_op::op_blt; break;
+        case 0b101: out.op = rv_op::op_bge; break;
+        case 0b110: out.op = rv_op::op_bltu; break;
+        case 0b111: out.op = rv_op::op_bgeu; break;
+        }
     }
-}
+        break;
 
-void rv_cpu::execute_load(uint32_t insn)
-{
-    const auto rd = decode_rd(insn);
-    const auto rs1 = decode_rs1(insn);
-    const auto funct3 = decode_funct3(insn);
+    case rv_opcode::load:
+        switch (funct3) {
+        case 0b000: out.op = rv_op::op_lb; break;    // lb
+        case 0b001: out.op = rv_op::op_lh; break;   // lh
+        case 0b010: out.op = rv_op::op_lw; break;   // lw
+        case 0b100: out.op = rv_op::op_lbu; break;   // lbu
+        case 0b101: out.op = rv_op::op_lhu; break;  // lhu
+        }
+        break;
 
-    const rv_int imm = (rv_int)insn >> 20;
-    const rv_uint addr = regs_[rs1] + imm;
-    rv_uint val;
-    switch (funct3) {
-    case 0b000:  // lb
-        int8_t i8;
-        if (!memory_.read(addr, i8)) {
-            raise_memory_exception();
-            return;
+    case rv_opcode::store:
+        out.imm = (rv_int)((insn & 0xFE000000) | (rd << 20)) >> 20;
+        switch (funct3) {
+        case 0b000: out.op = rv_op::op_sb; break;   // sb
+        case 0b001: out.op = rv_op::op_sh; break;  // sh
+        case 0b010: out.op = rv_op::op_sw; break;  // sw
         }
-        val = i8;
         break;
-    case 0b001:  // lh
-        int16_t i16;
-        if (!memory_.read(addr, i16)) {
-            raise_memory_exception();
-            return;
+
+    case rv_opcode::imm:
+        switch (funct3) {
+        case 0b000: out.op = rv_op::op_addi; break;
+        case 0b001:  // slli
+            out.imm &= 0x1F;
+            out.op = rv_op::op_slli;
+            break;
+        case 0b010: out.op = rv_op::op_slti; break;
+        case 0b011: out.op = rv_op::op_sltiu; break;
+        case 0b100: out.op = rv_op::op_xori; break;
+        case 0b101:  // srai | srli
+            if ((out.imm & 0xFFFFFBE0) != 0)
+                break;
+            out.op = (out.imm & 0x400) != 0 ? rv_op::op_srai : rv_op::op_srli;
+            out.imm &= 0x1F;
+            break;
+        case 0b110: out.op = rv_op::op_ori; break;
+        case 0b111: out.op = rv_op::op_andi; break;
         }
-        val = i16;
         break;
-    case 0b010:  // lw
-        int32_t i32;
-        if (!memory_.read(addr, i32)) {
-            raise_memory_exception();
-            return;
+
+    case rv_opcode::op:
+    {
+        const rv_uint funct7 = insn >> 25;
+        if (funct7 == 1) {
+            switch (funct3) {
+            case 0b000: out.op = rv_op::op_mul; break;
+            case 0b001: out.op = rv_op::op_mulh; break;
+            case 0b010: out.op = rv_op::op_mulhsu; break;
+            case 0b011: out.op = rv_op::op_mulhu; break;
+            case 0b100: out.op = rv_op::op_div; break;
+            case 0b101: out.op = rv_op::op_divu; break;
+            case 0b110: out.op = rv_op::op_rem; break;
+            case 0b111: out.op = rv_op::op_remu; break;
+            }
+        }
+        else if (funct7 == 0) {
+            switch (funct3) {
+            case 0b000: out.op = rv_op::op_add; break;
+            case 0b001: out.op = rv_op::op_sll; break;
+            case 0b010: out.op = rv_op::op_slt; break;
+            case 0b011: out.op = rv_op::op_sltu; break;
+            case 0b100: out.op = rv_op::op_xor; break;
+            case 0b101: out.op = rv_op::op_srl; break;
+            case 0b110: out.op = rv_op::op_or; break;
+            case 0b111: out.op = rv_op::op_and; break;
+            }
         }
-        val = i32;
+        else if (funct7 == 0x20) {
+            switch (funct3) {
+            case 0b000: out.op = rv_op::op_sub; break;
+            case 0b101: out.op = rv_op::op_sra; break;
+            }
+        }
+    }
         break;
-    case 0b100:  // lbu
-        uint8_t u8;
-        if (!memory_.read(addr, u8)) {
-            raise_memory_exception();
-            return;
+
+    case rv_opcode::amo:
+        if (funct3 != 0b010)
+            break;
+        switch (insn >> 27) {
+        case 0b00010:  // lr.w
+            if (rs2 == 0)
+                out.op = rv_op::op_lr;
+            break;
+        case 0b00011: out.op = rv_op::op_sc; break;
+        case 0b00001: out.op = rv_op::op_amoswap; break;
+        case 0b00000: out.op = rv_op::op_amoadd; break;
+        case 0b00100: out.op = rv_op::op_amoxor; break;
+        case 0b01100: out.op = rv_op::op_amoand; break;
+        case 0b01000: out.op = rv_op::op_amoor; break;
+        case 0b10000: out.op = rv_op::op_amomin; break;
+        case 0b10100: out.op = rv_op::op_amomax; break;
+        case 0b11000: out.op = rv_op::op_amominu; break;
+        case 0b11100: out.op = rv_op::op_amomaxu; break;
         }
-        val = u8;
         break;
-    case 0b101:  //lhu
-        uint16_t u16;
-        if (!memory_.read(addr, u16)) {
-            raise_memory_exception();
-            return;
+
+    case rv_opcode::load_fp:
+        // f registers have no sink, f0 is a regular register
+        out.rd = (uint8_t)rd;
+        if (funct3 == 0b010)
+            out.op = rv_op::op_flw;
+        else if (funct3 == 0b011)
+            out.op = rv_op::op_fld;
+        break;
+
+    case rv_opcode::store_fp:
+        out.imm = (rv_int)((insn & 0xFE000000) | (rd << 20)) >> 20;
+        if (funct3 == 0b010)
+            out.op = rv_op::op_fsw;
+        else if (funct3 == 0b011)
+            out.op = rv_op::op_fsd;
+        break;
+
+    case rv_opcode::madd:
+    case rv_opcode::msub:
+    case rv_opcode::nmsub:
+    case rv_opcode::nmadd:
+    {
+        const auto fmt = bits(insn, 25, 26);
+        if (fmt > 1 || funct3 == 5 || funct3 == 6)
+            break;
+        const auto first = fmt == 0 ? rv_op::op_fmadd_s : rv_op::op_fmadd_d;
+        out.rd = (uint8_t)rd;
+        out.imm = (rv_int)(funct3 | ((insn >> 27) << 3));
+        out.op = (rv_op)((uint32_t)first + ((uint32_t)opcode - (uint32_t)rv_opcode::madd));
+    }
+        break;
+
+    case rv_opcode::op_fp:
+        decode_op_fp(insn, out);
+        break;
+
+    case rv_opcode::misc_mem:
+        // fence is a nop, fence.i drops every translated block
+        out.op = funct3 == 0b001 ? rv_op::op_fence_i : rv_op::op_nop;
+        break;
+
+    case rv_opcode::system:
+        // csr number for csr instructions, funct12 for the others
+        out.imm = (rv_int)(insn >> 20);
+        switch (funct3) {
+        case 0:  // ecall | ebreak | mret
+            if ((insn & 0x000FFF80) != 0)
+                break;
+            if (out.imm == 0)
+                out.op = rv_op::op_ecall;
+            else if (out.imm == 1)
+                out.op = rv_op::op_ebreak;
+            break;
+        case 1: out.op = rv_op::op_csrrw; break;
+        case 2: out.op = rv_op::op_csrrs; break;
+        case 3: out.op = rv_op::op_csrrc; break;
+        case 5: out.op = rv_op::op_csrrwi; break;
+        case 6: out.op = rv_op::op_csrrsi; break;
+        case 7: out.op = rv_op::op_csrrci; break;
         }
-        val = u16;
         break;
+    }
+
+    switch (out.op) {
+    case rv_op::op_illegal:
+    case rv_op::op_ecall:
+    case rv_op::op_ebreak:
+    case rv_op::op_fence_i:
+    case rv_op::op_jal:
+    case rv_op::op_jalr:
+    case rv_op::op_beq:
+    case rv_op::op_bne:
+    case rv_op::op_blt:
+    case rv_op::op_bge:
+    case rv_op::op_bltu:
+    case rv_op::op_bgeu:
+        return true;
     default:
-        raise_illegal_instruction();
+        return false;
+    }
+}
+
+bool rv_cpu::fuse_pair(const rv_insn& first, const rv_insn& second, rv_insn& out) const
+{
+    // rd is never x0 here: writes to x0 are redirected to the sink register
+    out = first;
+    out.len = first.len + second.len;
+    out.count = first.count + second.count;
+
+    switch (first.op) {
+    case rv_op::op_lui:
+        // lui/auipc + addi: load a 32bit constant or a pc-relative address
+        if (second.op == rv_op::op_addi && second.rs1 == first.rd && second.rd == first.rd) {
+            out.imm = first.imm + second.imm;
+            return true;
+        }
+        // lui/auipc + jalr through the same register: a far call with a known target
+        if (second.op == rv_op::op_jalr && second.rs1 == first.rd && second.rd == first.rd) {
+            out.op = rv_op::op_jal;
+            out.imm = (first.imm + second.imm) & ~1;
+            return true;
+        }
+        return false;
+
+    case rv_op::op_slli:
+        // slli + add: array indexing, the shifted index is still written back
+        if (second.op == rv_op::op_add && first.rd != RV_REG_SINK &&
+            (second.rs1 == first.rd || second.rs2 == first.rd)) {
+            out.op = rv_op::op_slli_add;
+            out.rd = second.rd;
+            out.rs1 = first.rs1;
+            out.rs2 = second.rs1 == first.rd ? second.rs2 : second.rs1;
+            out.imm = first.imm | (first.rd << 8);
+            return true;
+        }
+        return false;
+
+    case rv_op::op_lw:
+        // lw + addi on the loaded value, both offsets fit in 12 bits
+        if (second.op == rv_op::op_addi && first.rd != RV_REG_SINK &&
+            second.rs1 == first.rd && second.rd == first.rd) {
+            out.op = rv_op::op_lw_addi;
+            out.imm = (rv_int)((first.imm & 0xFFF) | ((rv_uint)second.imm << 12));
+            return true;
+        }
+        return false;
+
+    default:
+        return false;
+    }
+}
+
+void rv_cpu::fuse(std::vector<rv_insn>& insns) const
+{
+    size_t out = 0;
+    for (size_t i = 0; i < insns.size(); ++i) {
+        rv_insn fused;
+        if (i + 1 < insns.size() && fuse_pair(insns[i], insns[i + 1], fused)) {
+            insns[out] = fused;
+            i += 1;
+        }
+        else {
+            insns[out] = insns[i];
+        }
+        out += 1;
+    }
+    insns.resize(out);
+}
+
+rv_block* rv_cpu::find_block(rv_uint pc)
+{
+    // blocks always start on a valid instruction boundary
+    if (unlikely((pc & 1) != 0)) {
+        raise_exception(rv_exception::instruction_address_misaligned);
+        return nullptr;
+    }
+
+    rv_block* block = icache_.lookup(pc);
+    if (likely(block != nullptr))
+        return block;
+
+    auto translated = translate(pc);
+    if (translated == nullptr) {
+        raise_memory_exception();
+        return nullptr;
+    }
+    block = icache_.insert(std::move(translated));
+    if (block == nullptr)
+        raise_exception(rv_exception::instruction_access_fault);
+    return block;
+}
+
+std::unique_ptr<rv_block> rv_cpu::translate(rv_uint pc)
+{
+    auto block = std::make_unique<rv_block>();
+    block->pc = pc;
+    block->links.fill(nullptr);
+
+    bool block_end = false;
+    while (!block_end) {
+        uint32_t insn;
+        if (!memory_.fetch_insn(pc, insn)) {
+            // only the first instruction can fault, the rest of the page has the same protection
+            // (a 32bit instruction crossing into the next page ends up first in its own block)
+            if (block->insns.empty())
+                return nullptr;
+            break;
+        }
+
+        rv_insn decoded;
+        if ((insn & 3) != 3) {
+            block_end = decode(expand_compressed(insn), pc, decoded);
+            decoded.len = 2;
+        }
+        else {
+            block_end = decode(insn, pc, decoded);
+        }
+#ifdef RISC_666_TRACE
+        decoded.raw = decoded.len == 2 ? insn & 0xFFFF : insn;
+        decoded.trace_dest = trace_dest(decoded);
+        decoded.trace_access = trace_access(decoded);
+        decoded.trace_value = trace_value(decoded);
+        decoded.trace_index = (uint8_t)(block->insns.size() + 1);
+#endif
+        block->insns.push_back(decoded);
+        pc += decoded.len;
+
+        // never go past a page boundary, so that invalidation stays page-granular
+        // only the last instruction can straddle it
+        if ((pc >> rv_icache::page_shift) != (block->pc >> rv_icache::page_shift) ||
+            block->insns.size() >= rv_block::max_insns)
+            break;
+    }
+    block->insn_count = (uint32_t)block->insns.size();
+#ifdef RISC_666_TRACE
+    if (trace_ != nullptr)
+        add_trace_ops(block->insns, block_end);
+    else
+#endif
+    fuse(block->insns);
+
+    // a function the host runs itself: the op goes first, the guest code stays as the fallback
+    if (hle_ != nullptr) {
+        const int function = hle_->lookup(block->pc);
+        if (function >= 0) {
+            rv_insn hle{};
+            hle.pc = block->pc;
+            hle.imm = function;
+            hle.op = rv_op::op_hle;
+            block->insns.insert(block->insns.begin(), hle);
+        }
+    }
+
+    // straight-line code cut short by page boundary or length limit: continue at pc
+    if (!block_end) {
+        rv_insn fallthrough{};
+        fallthrough.pc = pc;
+        fallthrough.op = rv_op::op_fallthrough;
+        block->insns.push_back(fallthrough);
+    }
+
+    for (auto& insn : block->insns)
+        insn.label = dispatch_table_[(size_t)insn.op];
+#ifdef RISC_666_TRACE
+    if (trace_ != nullptr)
+        trace_define(*block);
+#endif
+    memory_.code_translated(block->pc);
+    memory_.code_translated(pc - 1);
+    return block;
+}
+
+// direct-threaded dispatch: every handler jumps straight to the next one
+// pc_ is only kept up to date at block boundaries and on exceptions
+#define RV_OP_LABEL(name) &&op_##name,
+#define RV_NEXT() goto *(++ip)->label
+#define RV_EXIT_BLOCK(target, slot) do { pc_ = (target); exit_slot = (slot); goto next_block; } while (0)
+
+// rounding mode of the current fp instruction, reserved modes are illegal
+#define RV_FP_RM() \
+    uint32_t rm = (uint32_t)ip->imm & 7; \
+    if (rm == RV_RM_DYN) \
+        rm = frm_; \
+    if (unlikely(rm > RV_RM_RMM)) \
+        goto op_illegal
+
+#define RV_FS(r) rv_unbox_s(fregs_[(r)])
+#define RV_FD(r) rv_as_d(fregs_[(r)])
+
+// the host is always in round to nearest even, other modes take the slow path
+// (RMM on doubles is illegal on hosts where long double can't do it)
+#define RV_FP_ARITH(name, T, FREG, BOX, fop, expr) \
+op_##name: \
+{ \
+    RV_FP_RM(); \
+    if (sizeof(T) == sizeof(double) && !RV_FPU_RMM_D && rm == RV_RM_RMM) \
+        goto op_illegal; \
+    const T a = FREG(ip->rs1); \
+    const T b = FREG(ip->rs2); \
+    const T c = FREG(ip->imm >> 3); \
+    fregs_[ip->rd] = BOX(likely(rm == RV_RM_RNE) ? (expr) : rv_fop_rounded(rv_fop::fop, a, b, c, rm)); \
+    RV_NEXT(); \
+}
+
+// with the host MMU a faulting access never returns, remember which instruction made it
+#ifdef RISC_666_HOST_MMU
+#define RV_GUEST_ACCESS() fault_insn_ = ip
+#else
+#define RV_GUEST_ACCESS() do {} while (0)
+#endif
+
+#ifdef RISC_666_TRACE
+// op_lb.. recording the value read
+#define RV_TRACE_LOAD(name, T) \
+op_trace_##name: \
+{ \
+    T val; \
+    RV_GUEST_ACCESS(); \
+    if (unlikely(!memory_.read(regs[ip->rs1] + ip->imm, val))) \
+        goto memory_fault; \
+    regs[ip->rd] = (rv_uint)val; \
+    *trace_out_++ = (rv_uint)val; \
+    RV_NEXT(); \
+}
+#endif
+
+// guest instructions in block ahead of insn
+static uint32_t retired_before(const rv_block& block, const rv_insn* insn)
+{
+    uint32_t count = 0;
+    for (const rv_insn* p = block.insns.data(); p != insn; ++p)
+        count += p->count;
+    return count;
+}
+
+void rv_cpu::run(size_t nCycles)
+{
+    // stop in time for the next profiler sample
+    // volatile: still needed once a guest fault longjmps back in here
+    volatile const size_t slice = unlikely(profiler_ != nullptr) && nCycles > profile_countdown_ ?
+        (size_t)profile_countdown_ : nCycles;
+
+    // the host fpu flags belong to the thread, not to this guest: whatever is accrued
+    // there is folded into fflags_ before leaving, run() may resume on another thread
+    rv_host_fflags_clear();
+
+#ifdef RISC_666_TRACE
+    // syscalls change registers behind the trace's back, it starts over from them
+    if (trace_ != nullptr)
+        trace_state();
+#endif
+
+#ifdef RISC_666_HOST_MMU
+    // guest faults land here, out of interpret() and whatever it kept in locals
+    sigjmp_buf fault_recovery;
+    if (sigsetjmp(fault_recovery, 0) != 0) {
+        // compiled code keeps its pc in the jit context
+        pc_ = fault_insn_ != nullptr ? fault_insn_->pc : jit_ctx_.pc;
+        raise_memory_exception();
+        // the whole slice is charged, the emulation stops there anyway
+        finish_run(slice);
         return;
     }
-    if (likely(rd != 0))
-        regs_[rd] = val;
-    next_insn();
+    memory_.arm_fault_handler(&fault_recovery);
+#endif
+
+    finish_run(interpret(slice));
+}
+
+void rv_cpu::finish_run(uint64_t executed)
+{
+#ifdef RISC_666_HOST_MMU
+    memory_.disarm_fault_handler();
+#endif
+    fflags_ |= rv_host_fflags_take();
+#ifdef RISC_666_TRACE
+    trace_close();
+#endif
+    // the count is updated first so that syscalls see it
+    cycle_ += executed;
+    instret_ += executed;
+    if (unlikely(profiler_ != nullptr)) {
+        if (executed >= profile_countdown_) {
+            profiler_->sample(pc_, regs_[ra], regs_[sp]);
+            profile_countdown_ = profiler_->interval();
+        }
+        else {
+            profile_countdown_ -= executed;
+        }
+    }
+    if (unlikely(exception_raised_)) {
+        handle_user_exception();
+    }
+}
+
+uint64_t rv_cpu::interpret(size_t nCycles)
+{
+    static const void* const dispatch_table[] = { RV_OP_LIST(RV_OP_LABEL) };
+    dispatch_table_ = dispatch_table;
+
+    auto& regs = regs_;
+    int64_t c = (int64_t)nCycles;
+    size_t exit_slot = 0;
+    const rv_insn* ip = nullptr;
+    rv_block* block;
+
+    bool interpret_once = false;
+
+    if (unlikely(icache_.flush_pending()))
+        flush_translations();
+
+    block = find_block(pc_);
+    if (unlikely(block == nullptr))
+        goto leave;
+
+enter_block:
+    // never compiled, so compiled code can't chain past it
+    if (unlikely(block->pc == break_pc_)) {
+        // back from a call hle is verifying, not a breakpoint
+        if (hle_ != nullptr && hle_->pending_return() == block->pc) {
+            hle_->check(regs[a0]);
+            break_pc_ = kNoBreakpoint;
+        }
+        else {
+            breakpoint_hit_ = true;
+            goto leave;
+        }
+    }
+
+    if (jit_ != nullptr) {
+        // after an "interpret" exit the block at pc_ runs here once, whatever its state
+        if (likely(!interpret_once)) {
+            if (unlikely(block->native == nullptr) && ++block->exec_count == rv_jit::hot_threshold) {
+                if (!jit_->compile(*block, memory_.ram_end())) {
+                    // code buffer full, start over at the next block boundary
+                    icache_.invalidate(0, memory_.ram_end());
+                }
+            }
+            if (block->native != nullptr)
+                goto run_native;
+        }
+        interpret_once = false;
+    }
+
+    // the cycle budget is charged once per block
+    c -= block->insn_count;
+    ip = block->insns.data();
+    goto *ip->label;
+
+next_block:
+    if (unlikely(c <= 0))
+        goto leave;
+    if (unlikely(icache_.flush_pending())) {
+        flush_translations();
+        block = find_block(pc_);
+        if (unlikely(block == nullptr))
+            goto leave;
+        goto enter_block;
+    }
+    {
+        rv_block* next = block->links[exit_slot];
+        if (unlikely(next == nullptr || next->pc != pc_)) {
+            next = find_block(pc_);
+            if (unlikely(next == nullptr))
+                goto leave;
+            block->links[exit_slot] = next;
+        }
+        block = next;
+    }
+    goto enter_block;
+
+run_native:
+    // compiled blocks chain among themselves until the budget runs out,
+    // an unlinked exit or something only the interpreter can do
+    jit_ctx_.budget = c;
+    fault_insn_ = nullptr;
+    interpret_once = jit_->execute(*block, jit_ctx_) == rv_jit::exit_status::interpret;
+    c = jit_ctx_.budget;
+    pc_ = jit_ctx_.pc;
+    if (unlikely(c <= 0))
+        goto leave;
+    if (unlikely(icache_.flush_pending()))
+        flush_translations();
+    {
+        rv_block* next = find_block(pc_);
+        if (unlikely(next == nullptr))
+            goto leave;
+        if (!interpret_once && jit_ctx_.link_slot != nullptr && next->native != nullptr)
+            jit_->link(jit_ctx_.link_slot, *next);
+        block = next;
+    }
+    goto enter_block;
+
+memory_fault:
+    pc_ = ip->pc;
+    raise_memory_exception();
+    goto leave;
+
+op_illegal:
+    pc_ = ip->pc;
+    raise_illegal_instruction();
+    goto leave;
+
+op_fallthrough:
+    RV_EXIT_BLOCK(ip->pc, 1);
+
+#ifdef RISC_666_TRACE
+// see add_trace_ops
+op_trace_start:
+    trace_out_ = trace_->reserve();
+    trace_out_[0] = block->trace_id;
+    trace_out_[1] = block->insn_count;
+    trace_count_ = trace_out_ + 1;
+    trace_out_ += 2;
+    trace_block_ = block;
+    RV_NEXT();
+
+op_trace_x:
+    *trace_out_++ = regs[ip->rd];
+    RV_NEXT();
+
+op_trace_f:
+    trace_out_[0] = (uint32_t)fregs_[ip->rd];
+    trace_out_[1] = (uint32_t)(fregs_[ip->rd] >> 32);
+    trace_out_ += 2;
+    RV_NEXT();
+
+RV_TRACE_LOAD(lb, int8_t)
+RV_TRACE_LOAD(lh, int16_t)
+RV_TRACE_LOAD(lw, rv_uint)
+RV_TRACE_LOAD(lbu, uint8_t)
+RV_TRACE_LOAD(lhu, uint16_t)
+
+op_trace_end:
+    trace_->commit(trace_out_, block->insn_count);
+    trace_count_ = nullptr;
+    RV_NEXT();
+#endif
+
+op_nop:
+    RV_NEXT();
+
+op_hle:
+{
+    // a0..a2 are contiguous, returns like the ret at the end of the function would
+    rv_uint result;
+    if (likely(hle_->call((int)ip->imm, regs[ra], &regs[a0], result))) {
+        regs[a0] = result;
+        RV_EXIT_BLOCK(regs[ra] & ~1u, 0);
+    }
+    // into the guest code, when verifying it has to stop once it returns
+    if (unlikely(hle_->pending_return() != 0))
+        break_pc_ = hle_->pending_return();
+    RV_NEXT();
+}
+
+op_ecall:
+    pc_ = ip->pc;
+    exception_len_ = ip->len;
+    raise_exception(static_cast<rv_exception>(
+                        static_cast<uint32_t>(rv_exception::ecall_from_umode) +
+                        static_cast<uint32_t>(RV_PRIV_U))
+    );
+    goto leave;
+
+op_ebreak:
+    pc_ = ip->pc;
+    exception_len_ = ip->len;
+    raise_breakpoint_exception();
+    goto leave;
+
+op_fence_i:
+    // drop all the translated code once we're out of this block
+    icache_.invalidate(0, memory_.ram_end());
+    RV_EXIT_BLOCK(ip->pc + ip->len, 1);
+
+op_csrrw:
+op_csrrs:
+op_csrrc:
+op_csrrwi:
+op_csrrsi:
+op_csrrci:
+{
+    pc_ = ip->pc;
+    // the counters are only brought up to date when run() returns, the whole block is charged already
+    csr_retired_ = cycle_ + (uint64_t)((int64_t)nCycles - c) - block->insn_count + retired_before(*block, ip);
+    const auto csrop = (uint32_t)ip->op - (uint32_t)rv_op::op_csrrw;
+    const rv_uint new_value = csrop < 3 ? regs[ip->rs1] : (rv_uint)ip->rs1;
+    if (!csr_rw((uint32_t)ip->imm, ip->rd, new_value, (csrop % 3) + 1))
+        goto leave;
+    RV_NEXT();
+}
+
+op_lui:
+    regs[ip->rd] = ip->imm;
+    RV_NEXT();
+
+op_jal:
+    regs[ip->rd] = ip->pc + ip->len;
+    RV_EXIT_BLOCK(ip->imm, 0);
+
+op_jalr:
+{
+    // rd can be the same as rs1
+    const rv_uint newpc = (regs[ip->rs1] + ip->imm) & 0xFFFFFFFE;
+    regs[ip->rd] = ip->pc + ip->len;
+    RV_EXIT_BLOCK(newpc, 0);
+}
+
+op_beq:
+    if (regs[ip->rs1] == regs[ip->rs2])
+        RV_EXIT_BLOCK(ip->imm, 0);
+    RV_EXIT_BLOCK(ip->pc + ip->len, 1);
+
+op_bne:
+    if (regs[ip->rs1] != regs[ip->rs2])
+        RV_EXIT_BLOCK(ip->imm, 0);
+    RV_EXIT_BLOCK(ip->pc + ip->len, 1);
+
+op_blt:
+    if ((rv_int)regs[ip->rs1] < (rv_int)regs[ip->rs2])
+        RV_EXIT_BLOCK(ip->imm, 0);
+    RV_EXIT_BLOCK(ip->pc + ip->len, 1);
+
+op_bge:
+    if ((rv_int)regs[ip->rs1] >= (rv_int)regs[ip->rs2])
+        RV_EXIT_BLOCK(ip->imm, 0);
+    RV_EXIT_BLOCK(ip->pc + ip->len, 1);
+
+op_bltu:
+    if (regs[ip->rs1] < regs[ip->rs2])
+        RV_EXIT_BLOCK(ip->imm, 0);
+    RV_EXIT_BLOCK(ip->pc + ip->len, 1);
+
+op_bgeu:
+    if (regs[ip->rs1] >= regs[ip->rs2])
+        RV_EXIT_BLOCK(ip->imm, 0);
+    RV_EXIT_BLOCK(ip->pc + ip->len, 1);
+
+op_lb:
+{
+    int8_t val;
+    RV_GUEST_ACCESS();
+    if (unlikely(!memory_.read(regs[ip->rs1] + ip->imm, val)))
+        goto memory_fault;
+    regs[ip->rd] = (rv_uint)val;
+    RV_NEXT();
+}
+
+op_lh:
+{
+    int16_t val;
+    RV_GUEST_ACCESS();
+    if (unlikely(!memory_.read(regs[ip->rs1] + ip->imm, val)))
+        goto memory_fault;
+    regs[ip->rd] = (rv_uint)val;
+    RV_NEXT();
+}
+
+op_lw:
+{
+    rv_uint val;
+    RV_GUEST_ACCESS();
+    if (unlikely(!memory_.read(regs[ip->rs1] + ip->imm, val)))
+        goto memory_fault;
+    regs[ip->rd] = val;
+    RV_NEXT();
+}
+
+op_lbu:
+{
+    uint8_t val;
+    RV_GUEST_ACCESS();
+    if (unlikely(!memory_.read(regs[ip->rs1] + ip->imm, val)))
+        goto memory_fault;
+    regs[ip->rd] = val;
+    RV_NEXT();
+}
+
+op_lhu:
+{
+    uint16_t val;
+    RV_GUEST_ACCESS();
+    if (unlikely(!memory_.read(regs[ip->rs1] + ip->imm, val)))
+        goto memory_fault;
+    regs[ip->rd] = val;
+    RV_NEXT();
+}
+
+op_sb:
+    RV_GUEST_ACCESS();
+    if (unlikely(!memory_.write(regs[ip->rs1] + ip->imm, (uint8_t)regs[ip->rs2])))
+        goto memory_fault;
+    RV_NEXT();
+
+op_sh:
+    RV_GUEST_ACCESS();
+    if (unlikely(!memory_.write(regs[ip->rs1] + ip->imm, (uint16_t)regs[ip->rs2])))
+        goto memory_fault;
+    RV_NEXT();
+
+op_sw:
+    RV_GUEST_ACCESS();
+    if (unlikely(!memory_.write(regs[ip->rs1] + ip->imm, regs[ip->rs2])))
+        goto memory_fault;
+    RV_NEXT();
+
+op_addi:
+    regs[ip->rd] = regs[ip->rs1] + ip->imm;
+    RV_NEXT();
+
+op_slli_add:
+{
+    // the shifted value goes to its own register first, the add may read it back
+    const rv_uint shifted = regs[ip->rs1] << (ip->imm & 0x1F);
+    regs[ip->imm >> 8] = shifted;
+    regs[ip->rd] = regs[ip->rs2] + shifted;
+    RV_NEXT();
+}
+
+op_lw_addi:
+{
+    rv_uint val;
+    RV_GUEST_ACCESS();
+    if (unlikely(!memory_.read(regs[ip->rs1] + ((rv_int)((rv_uint)ip->imm << 20) >> 20), val)))
+        goto memory_fault;
+    regs[ip->rd] = val + (ip->imm >> 12);
+    RV_NEXT();
+}
+
+op_slti:
+    regs[ip->rd] = (rv_int)regs[ip->rs1] < ip->imm ? 1 : 0;
+    RV_NEXT();
+
+op_sltiu:
+    regs[ip->rd] = regs[ip->rs1] < (rv_uint)ip->imm ? 1 : 0;
+    RV_NEXT();
+
+op_xori:
+    regs[ip->rd] = regs[ip->rs1] ^ ip->imm;
+    RV_NEXT();
+
+op_ori:
+    regs[ip->rd] = regs[ip->rs1] | ip->imm;
+    RV_NEXT();
+
+op_andi:
+    regs[ip->rd] = regs[ip->rs1] & ip->imm;
+    RV_NEXT();
+
+op_slli:
+    regs[ip->rd] = regs[ip->rs1] << ip->imm;
+    RV_NEXT();
+
+op_srli:
+    regs[ip->rd] = regs[ip->rs1] >> ip->imm;
+    RV_NEXT();
+
+op_srai:
+    regs[ip->rd] = (rv_uint)((rv_int)regs[ip->rs1] >> ip->imm);
+    RV_NEXT();
+
+op_add:
+    regs[ip->rd] = regs[ip->rs1] + regs[ip->rs2];
+    RV_NEXT();
+
+op_sub:
+    regs[ip->rd] = regs[ip->rs1] - regs[ip->rs2];
+    RV_NEXT();
+
+op_sll:
+    regs[ip->rd] = regs[ip->rs1] << (regs[ip->rs2] & 0x1F);
+    RV_NEXT();
+
+op_slt:
+    regs[ip->rd] = (rv_int)regs[ip->rs1] < (rv_int)regs[ip->rs2] ? 1 : 0;
+    RV_NEXT();
+
+op_sltu:
+    regs[ip->rd] = regs[ip->rs1] < regs[ip->rs2] ? 1 : 0;
+    RV_NEXT();
+
+op_xor:
+    regs[ip->rd] = regs[ip->rs1] ^ regs[ip->rs2];
+    RV_NEXT();
+
+op_srl:
+    regs[ip->rd] = regs[ip->rs1] >> (regs[ip->rs2] & 0x1F);
+    RV_NEXT();
+
+op_sra:
+    regs[ip->rd] = (rv_uint)((rv_int)regs[ip->rs1] >> (regs[ip->rs2] & 0x1F));
+    RV_NEXT();
+
+op_or:
+    regs[ip->rd] = regs[ip->rs1] | regs[ip->rs2];
+    RV_NEXT();
+
+op_and:
+    regs[ip->rd] = regs[ip->rs1] & regs[ip->rs2];
+    RV_NEXT();
+
+op_mul:
+    regs[ip->rd] = (rv_uint)((rv_long)(rv_int)regs[ip->rs1] * (rv_long)(rv_int)regs[ip->rs2]);
+    RV_NEXT();
+
+op_mulh:
+    regs[ip->rd] = (rv_uint)(((rv_long)(rv_int)regs[ip->rs1] * (rv_long)(rv_int)regs[ip->rs2]) >> 32);
+    RV_NEXT();
+
+op_mulhsu:
+    regs[ip->rd] = (rv_uint)(((rv_long)(rv_int)regs[ip->rs1] * (rv_long)regs[ip->rs2]) >> 32);
+    RV_NEXT();
+
+op_mulhu:
+    regs[ip->rd] = (rv_uint)(((rv_ulong)regs[ip->rs1] * (rv_ulong)regs[ip->rs2]) >> 32);
+    RV_NEXT();
+
+op_div:
+{
+    const rv_uint val1 = regs[ip->rs1];
+    const rv_uint val2 = regs[ip->rs2];
+    if (val2 == 0)
+        regs[ip->rd] = (rv_uint)-1;
+    else if (val1 == 0x80000000 && val2 == (rv_uint)-1)
+        regs[ip->rd] = val1;
+    else
+        regs[ip->rd] = (rv_uint)((rv_int)val1 / (rv_int)val2);
+    RV_NEXT();
 }
 
-void rv_cpu::execute_store(uint32_t insn)
+op_divu:
 {
-    const auto rd = decode_rd(insn);
-    const auto rs1 = decode_rs1(insn);
-    const auto rs2 = decode_rs2(insn);
-    const auto funct3 = decode_funct3(insn);
+    const rv_uint val1 = regs[ip->rs1];
+    const rv_uint val2 = regs[ip->rs2];
+    regs[ip->rd] = val2 == 0 ? (rv_uint)-1 : val1 / val2;
+    RV_NEXT();
+}
 
-    const rv_int imm = (rv_int)((insn & 0xFE000000) | (rd << 20)) >> 20;
-    const rv_uint addr = regs_[rs1] + imm;
-    const rv_uint val = regs_[rs2];
-    switch (funct3) {
-    case 0b000:  // sb
-        if (!memory_.write(addr, (uint8_t)(val & 0xFF))) {
-            raise_memory_exception();
-        }
-        break;
-    case 0b001:  // sh
-        if (!memory_.write(addr, (uint16_t)(val & 0xFFFF))) {
-            raise_memory_exception();
-            return;
-        }
-        break;
-    case 0b010:  // sw
-        if (!memory_.write(addr, val)) {
-            raise_memory_exception();
-            return;
-        }
-        break;
-    default:
-        raise_illegal_instruction();
-        return;
-    }
-    next_insn();
+op_rem:
+{
+    const rv_uint val1 = regs[ip->rs1];
+    const rv_uint val2 = regs[ip->rs2];
+    if (val2 == 0)
+        regs[ip->rd] = val1;
+    else if (val1 == 0x80000000 && val2 == (rv_uint)-1)
+        regs[ip->rd] = 0;
+    else
+        regs[ip->rd] = (rv_uint)((rv_int)val1 % (rv_int)val2);
+    RV_NEXT();
 }
 
-void rv_cpu::execute_imm(uint32_t insn)
+op_remu:
 {
-    const auto rd = decode_rd(insn);
-    const auto rs1 = decode_rs1(insn);
-    const auto funct3 = decode_funct3(insn);
+    const rv_uint val1 = regs[ip->rs1];
+    const rv_uint val2 = regs[ip->rs2];
+    regs[ip->rd] = val2 == 0 ? val1 : val1 % val2;
+    RV_NEXT();
+}
 
-    const rv_int imm = (rv_int)insn >> 20;
-    rv_uint res = 0;
-    const rv_uint val = regs_[rs1];
-    switch (funct3) {
-    case 0b000:  // addi
-        res = val + imm;
-        break;
-    case 0b001:  // slli
-/*            if ((imm & 0x5F) != 0) {
-                raise_illegal_instruction();
-                return;
-            }*/
-        res  = val << (imm & 0x1F);
-        break;
-    case 0b010:  // slti
-        res = (rv_int)val < imm ? 1 : 0;
-        break;
-    case 0b011:  // sltiu
-        res = val < imm ? 1 : 0;
-        break;
-    case 0b100:
-        res = val ^ imm;
-        break;
-    case 0b101:  // srai | srli
-    {
-        if ((imm & 0xFFFFFBE0) != 0) {
-            raise_illegal_instruction();
-            return;
-        }
-        if ((imm & 0x400) != 0)
-            res = (rv_int)val >> (imm & 0x1F);
-        else
-            res = val >> (imm & 0x1F);
-        break;
-    }
-    case 0b110:  // ori
-        res = val | imm;
-        break;
-    case 0b111:  // andi
-        res = val & imm;
-        break;
+op_lr:
+{
+    RV_GUEST_ACCESS();
+    const auto addr = regs[ip->rs1];
+    rv_uint val;
+    if (!memory_.read(addr, val))
+        goto memory_fault;
+    regs[ip->rd] = val;
+    amo_res_ = addr;
+    RV_NEXT();
+}
+
+op_sc:
+{
+    RV_GUEST_ACCESS();
+    const auto addr = regs[ip->rs1];
+    rv_uint val = 1;
+    if (amo_res_ == addr) {
+        if (!memory_.write(addr, regs[ip->rs2]))
+            goto memory_fault;
+        val = 0;
     }
-    if (likely(rd != 0))
-        regs_[rd] = res;
-    next_insn();
+    regs[ip->rd] = val;
+    RV_NEXT();
 }
 
-void rv_cpu::execute_op(uint32_t insn)
+op_amoswap:
+    RV_GUEST_ACCESS();
+    if (!execute_amo(*ip, [](rv_uint, rv_uint val2) { return val2; }))
+        goto memory_fault;
+    RV_NEXT();
+
+op_amoadd:
+    RV_GUEST_ACCESS();
+    if (!execute_amo(*ip, [](rv_uint val, rv_uint val2) { return val + val2; }))
+        goto memory_fault;
+    RV_NEXT();
+
+op_amoxor:
+    RV_GUEST_ACCESS();
+    if (!execute_amo(*ip, [](rv_uint val, rv_uint val2) { return val ^ val2; }))
+        goto memory_fault;
+    RV_NEXT();
+
+op_amoand:
+    RV_GUEST_ACCESS();
+    if (!execute_amo(*ip, [](rv_uint val, rv_uint val2) { return val & val2; }))
+        goto memory_fault;
+    RV_NEXT();
+
+op_amoor:
+    RV_GUEST_ACCESS();
+    if (!execute_amo(*ip, [](rv_uint val, rv_uint val2) { return val | val2; }))
+        goto memory_fault;
+    RV_NEXT();
+
+op_amomin:
+    RV_GUEST_ACCESS();
+    if (!execute_amo(*ip, [](rv_uint val, rv_uint val2) { return (rv_int)val < (rv_int)val2 ? val : val2; }))
+        goto memory_fault;
+    RV_NEXT();
+
+op_amomax:
+    RV_GUEST_ACCESS();
+    if (!execute_amo(*ip, [](rv_uint val, rv_uint val2) { return (rv_int)val > (rv_int)val2 ? val : val2; }))
+        goto memory_fault;
+    RV_NEXT();
+
+op_amominu:
+    RV_GUEST_ACCESS();
+    if (!execute_amo(*ip, [](rv_uint val, rv_uint val2) { return val < val2 ? val : val2; }))
+        goto memory_fault;
+    RV_NEXT();
+
+op_amomaxu:
+    RV_GUEST_ACCESS();
+    if (!execute_amo(*ip, [](rv_uint val, rv_uint val2) { return val > val2 ? val : val2; }))
+        goto memory_fault;
+    RV_NEXT();
+
+op_flw:
 {
-    const auto rd = decode_rd(insn);
-    const auto rs1 = decode_rs1(insn);
-    const auto rs2 = decode_rs2(insn);
-    const auto funct3 = decode_funct3(insn);
+    uint32_t val;
+    RV_GUEST_ACCESS();
+    if (unlikely(!memory_.read(regs[ip->rs1] + ip->imm, val)))
+        goto memory_fault;
+    fregs_[ip->rd] = rv_box_bits_s(val);
+    RV_NEXT();
+}
 
-    const rv_uint imm = insn >> 25;
-    const rv_uint val1 = regs_[rs1];
-    const rv_uint val2 = regs_[rs2];
-    rv_uint res = 0;
-    if (imm == 1) {
-        const auto sval1 = (rv_int)val1;
-        const auto sval2 = (rv_int)val2;
-        switch (funct3) {
-        case 0b000:  // mul
-            res = (rv_uint)((rv_long)sval1 * (rv_long)sval2);
-            break;
-        case 0b001:  // mulh
-            res = (rv_uint)(((rv_long)sval1 * (rv_long)sval2) >> 32);
-            break;
-        case 0b010:  // mulhsu
-            res = (rv_uint)(((rv_long)sval1 * (rv_long)val2) >> 32);
-            break;
-        case 0b011:  // mulhu
-            res = (rv_uint)(((rv_long)val1 * (rv_long)val2) >> 32);
-            break;
-        case 0b100:  // div
-        {
-            if (val2 == 0)
-                res = (rv_uint)-1;
-            else if (val1 == 0x80000000 && val2 == (rv_int)-1)
-                res = val1;
-            else
-                res = sval1 / sval2;
-        }
-            break;
+op_fld:
+{
+    uint64_t val;
+    RV_GUEST_ACCESS();
+    if (unlikely(!memory_.read(regs[ip->rs1] + ip->imm, val)))
+        goto memory_fault;
+    fregs_[ip->rd] = val;
+    RV_NEXT();
+}
 
-        case 0b101:  // divu
-            if (val2 == 0)
-                res = (rv_uint)-1;
-            else
-                res = val1 / val2;
-            break;
-        case 0b110:  // rem
-        {
-            if (val2 == 0)
-                res = val1;
-            else if (val1 == 0x80000000 && val2 == (rv_int)-1)
-                res = 0;
-            else
-                res = (rv_uint)(sval1 % sval2);
-        }
-            break;
-        case 0b111:  // remu
-            if (val2 == 0)
-                res = val1;
-            else
-                res = val1 % val2;
-            break;
-        }
-    }
-    else {
-        switch (funct3) {
-        case 0b000:  // add | sub
-        {
-            if (unlikely((imm & 0x5F) != 0)) {
-                raise_illegal_instruction();
-                return;
-            }
-            if ((imm & 0x20) != 0)  // sub
-                res = val1 - val2;
-            else  // add
-                res = val1 + val2;
-        }
-            break;
-        case 0b001:  // sll
-            res = val1 << val2;
-            break;
-        case 0b010:  // slt
-            res = (rv_int)val1 < (rv_int)val2 ? 1 : 0;
-            break;
-        case 0b011:  // sltu
-            res = val1 < val2 ? 1 : 0;
-            break;
-        case 0b100:  // xor
-            res = val1 ^ val2;
-            break;
-        case 0b101:  // srl | sra
-        {
-            if ((imm & 0x5F) != 0) {
-                raise_illegal_instruction();
-                return;
-            }
-            if ((imm & 0x20) != 0)  // sra
-                res = (rv_uint)((rv_int)val1 >> val2);
-            else  // srl
-                res = val1 >> val2;
-        }
-            break;
-        case 0b110:  // or
-            res = val1 | val2;
-            break;
-        case 0b111:  // and
-            res = val1 & val2;
-            break;
-        }
-    }
-    if (likely(rd != 0)) {
-        regs_[rd] = res;
-    }
-    next_insn();
+op_fsw:
+    RV_GUEST_ACCESS();
+    if (unlikely(!memory_.write(regs[ip->rs1] + ip->imm, (uint32_t)fregs_[ip->rs2])))
+        goto memory_fault;
+    RV_NEXT();
+
+op_fsd:
+    RV_GUEST_ACCESS();
+    if (unlikely(!memory_.write(regs[ip->rs1] + ip->imm, fregs_[ip->rs2])))
+        goto memory_fault;
+    RV_NEXT();
+
+    RV_FP_ARITH(fadd_s, float, RV_FS, rv_box_s, add, a + b)
+    RV_FP_ARITH(fsub_s, float, RV_FS, rv_box_s, sub, a - b)
+    RV_FP_ARITH(fmul_s, float, RV_FS, rv_box_s, mul, a * b)
+    RV_FP_ARITH(fdiv_s, float, RV_FS, rv_box_s, div, a / b)
+    RV_FP_ARITH(fsqrt_s, float, RV_FS, rv_box_s, sqrt, std::sqrt(a))
+    RV_FP_ARITH(fmadd_s, float, RV_FS, rv_box_s, madd, std::fma(a, b, c))
+    RV_FP_ARITH(fmsub_s, float, RV_FS, rv_box_s, msub, std::fma(a, b, -c))
+    RV_FP_ARITH(fnmsub_s, float, RV_FS, rv_box_s, nmsub, std::fma(-a, b, c))
+    RV_FP_ARITH(fnmadd_s, float, RV_FS, rv_box_s, nmadd, std::fma(-a, b, -c))
+    RV_FP_ARITH(fadd_d, double, RV_FD, rv_from_d, add, a + b)
+    RV_FP_ARITH(fsub_d, double, RV_FD, rv_from_d, sub, a - b)
+    RV_FP_ARITH(fmul_d, double, RV_FD, rv_from_d, mul, a * b)
+    RV_FP_ARITH(fdiv_d, double, RV_FD, rv_from_d, div, a / b)
+    RV_FP_ARITH(fsqrt_d, double, RV_FD, rv_from_d, sqrt, std::sqrt(a))
+    RV_FP_ARITH(fmadd_d, double, RV_FD, rv_from_d, madd, std::fma(a, b, c))
+    RV_FP_ARITH(fmsub_d, double, RV_FD, rv_from_d, msub, std::fma(a, b, -c))
+    RV_FP_ARITH(fnmsub_d, double, RV_FD, rv_from_d, nmsub, std::fma(-a, b, c))
+    RV_FP_ARITH(fnmadd_d, double, RV_FD, rv_from_d, nmadd, std::fma(-a, b, -c))
+
+op_fsgnj_s:
+    fregs_[ip->rd] = rv_box_bits_s((rv_unbox_bits_s(fregs_[ip->rs1]) & ~kSignS) | (rv_unbox_bits_s(fregs_[ip->rs2]) & kSignS));
+    RV_NEXT();
+
+op_fsgnjn_s:
+    fregs_[ip->rd] = rv_box_bits_s((rv_unbox_bits_s(fregs_[ip->rs1]) & ~kSignS) | (~rv_unbox_bits_s(fregs_[ip->rs2]) & kSignS));
+    RV_NEXT();
+
+op_fsgnjx_s:
+    fregs_[ip->rd] = rv_box_bits_s(rv_unbox_bits_s(fregs_[ip->rs1]) ^ (rv_unbox_bits_s(fregs_[ip->rs2]) & kSignS));
+    RV_NEXT();
+
+op_fsgnj_d:
+    fregs_[ip->rd] = (fregs_[ip->rs1] & ~kSignD) | (fregs_[ip->rs2] & kSignD);
+    RV_NEXT();
+
+op_fsgnjn_d:
+    fregs_[ip->rd] = (fregs_[ip->rs1] & ~kSignD) | (~fregs_[ip->rs2] & kSignD);
+    RV_NEXT();
+
+op_fsgnjx_d:
+    fregs_[ip->rd] = fregs_[ip->rs1] ^ (fregs_[ip->rs2] & kSignD);
+    RV_NEXT();
+
+op_fmin_s:
+    fregs_[ip->rd] = rv_box_s(rv_fmin(RV_FS(ip->rs1), RV_FS(ip->rs2), fflags_));
+    RV_NEXT();
+
+op_fmax_s:
+    fregs_[ip->rd] = rv_box_s(rv_fmax(RV_FS(ip->rs1), RV_FS(ip->rs2), fflags_));
+    RV_NEXT();
+
+op_fmin_d:
+    fregs_[ip->rd] = rv_from_d(rv_fmin(RV_FD(ip->rs1), RV_FD(ip->rs2), fflags_));
+    RV_NEXT();
+
+op_fmax_d:
+    fregs_[ip->rd] = rv_from_d(rv_fmax(RV_FD(ip->rs1), RV_FD(ip->rs2), fflags_));
+    RV_NEXT();
+
+op_feq_s:
+    regs[ip->rd] = rv_feq(RV_FS(ip->rs1), RV_FS(ip->rs2), fflags_);
+    RV_NEXT();
+
+op_flt_s:
+    regs[ip->rd] = rv_flt(RV_FS(ip->rs1), RV_FS(ip->rs2), fflags_);
+    RV_NEXT();
+
+op_fle_s:
+    regs[ip->rd] = rv_fle(RV_FS(ip->rs1), RV_FS(ip->rs2), fflags_);
+    RV_NEXT();
+
+op_feq_d:
+    regs[ip->rd] = rv_feq(RV_FD(ip->rs1), RV_FD(ip->rs2), fflags_);
+    RV_NEXT();
+
+op_flt_d:
+    regs[ip->rd] = rv_flt(RV_FD(ip->rs1), RV_FD(ip->rs2), fflags_);
+    RV_NEXT();
+
+op_fle_d:
+    regs[ip->rd] = rv_fle(RV_FD(ip->rs1), RV_FD(ip->rs2), fflags_);
+    RV_NEXT();
+
+op_fclass_s:
+    regs[ip->rd] = rv_fclass(RV_FS(ip->rs1));
+    RV_NEXT();
+
+op_fclass_d:
+    regs[ip->rd] = rv_fclass(RV_FD(ip->rs1));
+    RV_NEXT();
+
+op_fmv_x_w:
+    regs[ip->rd] = (rv_uint)fregs_[ip->rs1];
+    RV_NEXT();
+
+op_fmv_w_x:
+    fregs_[ip->rd] = rv_box_bits_s(regs[ip->rs1]);
+    RV_NEXT();
+
+op_fcvt_w_s:
+{
+    RV_FP_RM();
+    regs[ip->rd] = rv_fcvt_w(RV_FS(ip->rs1), rm, fflags_);
+    RV_NEXT();
 }
 
-void rv_cpu::execute_amo(uint32_t insn)
+op_fcvt_wu_s:
 {
-    const auto rd = decode_rd(insn);
-    const auto rs1 = decode_rs1(insn);
-    const auto rs2 = decode_rs2(insn);
-    const auto funct5 = insn >> 27;
+    RV_FP_RM();
+    regs[ip->rd] = rv_fcvt_wu(RV_FS(ip->rs1), rm, fflags_);
+    RV_NEXT();
+}
 
-    const auto addr = regs_[rs1];
-    rv_uint val;
-    switch (funct5) {
-    case 0b00010:  // lr.w
-        if (rs2 != 0) {
-            raise_illegal_instruction();
-            return;
-        }
-        int32_t i32;
-        if (!memory_.read(addr, i32)) {
-            raise_memory_exception();
-            return;
-        }
-        val = i32;
-        amo_res_ = addr;
-        break;
+op_fcvt_w_d:
+{
+    RV_FP_RM();
+    regs[ip->rd] = rv_fcvt_w(RV_FD(ip->rs1), rm, fflags_);
+    RV_NEXT();
+}
 
-    case 0b00011:  // sc.w
-        if (amo_res_ == addr) {
-            if (!memory_.write(addr, regs_[rs1])) {
-                raise_memory_exception();
-                return;
-            }
-            val = 0;
-        }
-        else {
-            val = 1;
-        }
-        break;
-    case 0b00001:  // amoswap.w
-    case 0b00000:  // amoadd.w
-    case 0b00100:  // amoxor.w
-    case 0b01100:  // amoand.w
-    case 0b01000:  // amoor.w
-    case 0b10000:  // amomin.w
-    case 0b10100:  // amomax.w
-    case 0b11000:  // amominu.w
-    case 0b11100:  // amomaxu.w
-    {
-        if (memory_.read(addr, (int32_t&)val)) {
-            raise_memory_exception();
-            return;
-        }
-        auto val2 = regs_[rs2];
-        switch (funct5) {
-        case 0b00001:  // amoswap.w
-            break;
-        case 0b00000:  // amoadd.w
-            val2 = (int32_t)(val + val2);
-            break;
-        case 0b00100:  // amoxor.w
-            val2 = (int32_t)(val ^ val2);
-            break;
-        case 0b01100:  // amoand.w
-            val2 = (int32_t)(val & val2);
-            break;
-        case 0b01000:  // amoor.w
-            val2 = (int32_t)(val | val2);
-            break;
-        case 0b10000:  // amomin.w
-            if ((int32_t)val < (int32_t)val2)
-                val2 = (int32_t)val;
-            break;
-        case 0b10100:  // amomax.w
-            if ((int32_t)val > (int32_t)val2)
-                val2 = (int32_t)val;
-            break;
-        case 0b11000:  // amominu.w
-            if ((uint32_t)val < (uint32_t)val2)
-                val2 = (int32_t)val;
-            break;
-        case 0b11100:  // amomaxu.w
-            if ((uint32_t)val > (uint32_t)val2)
-                val2 = (int32_t)val;
-            break;
+op_fcvt_wu_d:
+{
+    RV_FP_RM();
+    regs[ip->rd] = rv_fcvt_wu(RV_FD(ip->rs1), rm, fflags_);
+    RV_NEXT();
+}
 
-        }
-        if (!memory_.write(addr, val2)) {
-            raise_memory_exception();
-            return;
-        }
-        if (rd != 0) {
-            regs_[rd] = val;
-        }
-    }
-        break;
-    default:
-        raise_illegal_instruction();
-        return;
-    }
-    next_insn();
+op_fcvt_s_w:
+{
+    RV_FP_RM();
+    const auto val = (int32_t)regs[ip->rs1];
+    fregs_[ip->rd] = rv_box_s(likely(rm == RV_RM_RNE) ? (float)val : rv_fcvt_s_w(val, rm));
+    RV_NEXT();
 }
 
-void rv_cpu::execute_misc_mem(uint32_t insn)
+op_fcvt_s_wu:
 {
-    // fence and fence.i are nops
-    next_insn();
+    RV_FP_RM();
+    const auto val = regs[ip->rs1];
+    fregs_[ip->rd] = rv_box_s(likely(rm == RV_RM_RNE) ? (float)val : rv_fcvt_s_wu(val, rm));
+    RV_NEXT();
 }
 
-void rv_cpu::execute_system(uint32_t insn)
+op_fcvt_s_d:
 {
-    const auto rd = decode_rd(insn);
-    const auto rs1 = decode_rs1(insn);
-    const auto funct3 = decode_funct3(insn);
-    const uint32_t imm = insn >> 20;
+    RV_FP_RM();
+    const double val = RV_FD(ip->rs1);
+    fregs_[ip->rd] = rv_box_s(likely(rm == RV_RM_RNE) ? (float)val : rv_fcvt_s_d(val, rm));
+    RV_NEXT();
+}
 
-    switch (funct3) {
-    case 0:  // ecall | ebreak | mret
-        switch (imm) {
-        case 0:  // ecall
-            if ((insn & 0x000FFF80) != 0)
-                raise_illegal_instruction();
-            raise_exception(static_cast<rv_exception>(
-                                static_cast<uint32_t>(rv_exception::ecall_from_umode) +
-                                static_cast<uint32_t>(RV_PRIV_U))
-            );
-            return;
-        case 1:  // ebreak
-            if ((insn & 0x000FFF80) != 0)
-                raise_illegal_instruction();
-            raise_exception(rv_exception::breakpoint);
-            return;
-        case 0x302:  // mret
-            raise_illegal_instruction();
-            return;
-        default:
-            raise_illegal_instruction();
-            return;
-        }
-        break;
+// the following are exact, rm is only checked for validity
+op_fcvt_d_s:
+{
+    RV_FP_RM();
+    (void)rm;
+    fregs_[ip->rd] = rv_from_d((double)RV_FS(ip->rs1));
+    RV_NEXT();
+}
 
-    case 1:  // csrrw
-    case 2:  // csrrs
-    case 3:  // csrrc
-        if (!csr_rw(imm, rd, regs_[rs1], funct3))
-            return;
-        break;
-    case 5:  // csrrwi
-    case 6:  // csrrsi
-    case 7:  // csrrci
-        if (!csr_rw(imm, rd, (rv_uint)(rs1 & 0b11111), funct3 - 4))
-            return;
-        break;
-    default:
-        raise_illegal_instruction();
-        return;
+op_fcvt_d_w:
+{
+    RV_FP_RM();
+    (void)rm;
+    fregs_[ip->rd] = rv_from_d((double)(int32_t)regs[ip->rs1]);
+    RV_NEXT();
+}
+
+op_fcvt_d_wu:
+{
+    RV_FP_RM();
+    (void)rm;
+    fregs_[ip->rd] = rv_from_d((double)regs[ip->rs1]);
+    RV_NEXT();
+}
+
+leave:
+    // faulting blocks are charged in full, the emulation stops there anyway
+    return (uint64_t)((int64_t)nCycles - c);
+}
+
+#undef RV_FP_ARITH
+#undef RV_FD
+#undef RV_FS
+#undef RV_FP_RM
+#undef RV_GUEST_ACCESS
+#undef RV_EXIT_BLOCK
+#undef RV_NEXT
+#undef RV_OP_LABEL
+
+template<typename F>
+bool rv_cpu::execute_amo(const rv_insn& insn, F op)
+{
+    const auto addr = regs_[insn.rs1];
+    rv_uint val;
+    if (!memory_.read(addr, val))
+        return false;
+    if (!memory_.write(addr, op(val, regs_[insn.rs2])))
+        return false;
+    regs_[insn.rd] = val;
+    return true;
+}
+
+rv_uint rv_cpu::read_time(uint32_t csr)
+{
+    // the host clock is nondeterministic, every read goes to the log
+    if (unlikely(replay_ != nullptr) && replay_->replaying()) {
+        const auto recorded = replay_->next_entry();
+        if (recorded.syscall_no != RV_REPLAY_CSR + csr)
+            throw std::runtime_error("replay diverged at entry " + std::to_string(replay_->entry_count()) +
+                ": csr " + std::to_string(csr) + " instead of " + std::to_string(recorded.syscall_no));
+        return recorded.retval;
     }
 
-    next_insn();
+    const uint64_t now = av_.time_us(csr_retired_);
+    const rv_uint value = (rv_csr)csr == rv_csr::time ? (rv_uint)now : (rv_uint)(now >> 32);
+    if (unlikely(replay_ != nullptr))
+        replay_->put_entry(RV_REPLAY_CSR + csr, value, false);
+    return value;
 }
 
 bool rv_cpu::csr_read(uint32_t csr, rv_uint &csr_value, bool write_back)
@@ -688,32 +2071,30 @@ bool rv_cpu::csr_read(uint32_t csr, rv_uint &csr_value, bool write_back)
     }
 
     switch ((rv_csr)csr) {
-/*    case rv_csr::cycle:
+    case rv_csr::cycle:
     case rv_csr::instret:
-        if (priv_ < RV_PRIV_M) {
-            if ((mcounteren_ & RV_MCOUNTEREN_CY) == 0) {
-                raise_illegal_instruction();
-                return false;
-            }
-        }
-        csr_value = (rv_uint)(cycle_ & 0xFFFFFFFF);
+        // one instruction per cycle
+        csr_value = (rv_uint)csr_retired_;
         break;
     case rv_csr::cycleh:
     case rv_csr::instreth:
-        if (priv_ < RV_PRIV_M) {
-            if ((mcounteren_ & RV_MCOUNTEREN_IR) == 0) {
-                raise_illegal_instruction();
-                return false;
-            }
-        }
-        csr_value = (rv_uint)(cycle_ >> 32);
+        csr_value = (rv_uint)(csr_retired_ >> 32);
+        break;
+    case rv_csr::time:
+    case rv_csr::timeh:
+        csr_value = read_time(csr);
+        break;
+    case rv_csr::fflags:
+        fflags_ |= rv_host_fflags_take();
+        csr_value = fflags_;
+        break;
+    case rv_csr::frm:
+        csr_value = frm_;
         break;
-    case rv_csr::mstatus:
-        csr_value = mstatus_;
+    case rv_csr::fcsr:
+        fflags_ |= rv_host_fflags_take();
+        csr_value = (frm_ << 5) | fflags_;
         break;
-    case rv_csr::misa:
-        csr_value = misa_;
-        break;*/
     case rv_csr::mvendorid:
     case rv_csr::mimpid:
     case rv_csr::mhartid:
@@ -730,6 +2111,18 @@ bool rv_cpu::csr_write(uint32_t csr, rv_uint csr_value)
 {
     uint32_t mask;
     switch ((rv_csr)csr) {
+    case rv_csr::fflags:
+        fflags_ = csr_value & 0x1F;
+        rv_host_fflags_clear();
+        break;
+    case rv_csr::frm:
+        frm_ = csr_value & 0x7;
+        break;
+    case rv_csr::fcsr:
+        frm_ = (csr_value >> 5) & 0x7;
+        fflags_ = csr_value & 0x1F;
+        rv_host_fflags_clear();
+        break;
     default:
         raise_illegal_instruction();
         return false;
@@ -754,7 +2147,7 @@ bool rv_cpu::csr_rw(uint32_t csr, uint32_t rd, rv_uint new_value, uint32_t csrop
             return false;
         }
         if (new_value != 0) {
-            if(!csr_write(csr, csrvalue & ~new_value)) {
+            if(!csr_write(csr, csrvalue | new_value)) {
                 return false;
             }
         }
@@ -764,7 +2157,7 @@ bool rv_cpu::csr_rw(uint32_t csr, uint32_t rd, rv_uint new_value, uint32_t csrop
             return false;
         }
         if (new_value != 0) {
-            if (!csr_write(csr, csrvalue | new_value)) {
+            if (!csr_write(csr, csrvalue & ~new_value)) {
                 return false;
             }
         }
@@ -797,6 +2190,7 @@ void rv_cpu::handle_user_exception()
         handle_illegal_instruction();
         break;
 
+    case rv_exception::instruction_address_misaligned:
     case rv_exception::instruction_access_fault:
     case rv_exception::store_access_fault:
     case rv_exception::load_access_fault:
@@ -811,8 +2205,9 @@ void rv_cpu::handle_user_exception()
         break;
     }
 
+    // the other exceptions stop the emulation
     exception_raised_ = false;
-    pc_ = pc_+4;
+    pc_ = pc_ + exception_len_;
 }
 
 void rv_cpu::dump_regs()
@@ -844,7 +2239,9 @@ void rv_cpu::handle_illegal_instruction()
 void rv_cpu::handle_memory_access_fault()
 {
     const char *exname = nullptr;
-    if (exception_code_ == rv_exception::instruction_access_fault)
+    if (exception_code_ == rv_exception::instruction_address_misaligned)
+        exname = "instruction_address_misaligned";
+    else if (exception_code_ == rv_exception::instruction_access_fault)
         exname = "instruction_access_fault";
     else if(exception_code_ == rv_exception::store_access_fault)
         exname = "store_access_fault";
@@ -864,8 +2261,16 @@ void rv_cpu::handle_memory_access_fault()
 // int fstat(int fd, struct stat *statbuf);
 rv_uint rv_cpu::syscall_fstat(rv_uint arg0, rv_uint arg1)
 {
+    const int fd = files_.host_fd((int)arg0);
+    if (fd == -1)
+        return (rv_uint)(-EBADF);
+    if (arg1 != 0 && !memory_.check_range(arg1, sizeof(newlib_stat), RV_MEMORY_W))
+        return (rv_uint)(-EFAULT);
+
+    if (arg1 != 0)
+        memory_.host_writing(arg1, sizeof(newlib_stat));
     struct stat st;
-    if (fstat((int)arg0, arg1 != 0 ? &st : nullptr) == -1) {
+    if (fstat(fd, arg1 != 0 ? &st : nullptr) == -1) {
         return (rv_uint)(-errno);
     }
 
@@ -878,8 +2283,13 @@ rv_uint rv_cpu::syscall_fstat(rv_uint arg0, rv_uint arg1)
 
 rv_uint rv_cpu::syscall_stat(rv_uint arg0, rv_uint arg1)
 {
+    if ((arg0 != 0 && !memory_.check_string(arg0)) ||
+        (arg1 != 0 && !memory_.check_range(arg1, sizeof(newlib_stat), RV_MEMORY_W)))
+        return (rv_uint)(-EFAULT);
     const char *pathname = arg0 != 0 ? reinterpret_cast<const char *>(memory_.ram_ptr(arg0)) : nullptr;
     newlib_stat *nst = reinterpret_cast<newlib_stat*>(memory_.ram_ptr(arg1));
+    if (arg1 != 0)
+        memory_.host_writing(arg1, sizeof(newlib_stat));
     struct stat st;
     if (stat(pathname, arg1 != 0 ? &st : nullptr) == -1)
         return (rv_uint)(-errno);
@@ -900,6 +2310,8 @@ rv_uint rv_cpu::syscall_brk(rv_uint arg0)
 
 rv_uint rv_cpu::syscall_open(rv_uint arg0, rv_uint arg1, rv_uint arg2)
 {
+    if (arg0 != 0 && !memory_.check_string(arg0))
+        return (rv_uint)(-EFAULT);
     const char *pathname = arg0 != 0 ? reinterpret_cast<const char *>(memory_.ram_ptr(arg0)) : nullptr;
     int flags = (int)arg1;
     int mode = (int)arg2;
@@ -907,15 +2319,19 @@ rv_uint rv_cpu::syscall_open(rv_uint arg0, rv_uint arg1, rv_uint arg2)
     int res = open(pathname, newlib_translate_open_flags(flags), mode);
     if (res == -1)
         return (rv_uint)(-errno);
-    return (rv_uint)res;
+    return (rv_uint)files_.install(res, pathname, newlib_translate_open_flags(flags), mode);
 }
 
 // ssize_t write(int fd, const void *buf, size_t count);
 rv_uint rv_cpu::syscall_write(rv_uint arg0, rv_uint arg1, rv_uint arg2)
 {
+    if (arg1 != 0 && !memory_.check_range(arg1, arg2, RV_MEMORY_R))
+        return (rv_uint)(-EFAULT);
     const void *buf = arg1 != 0 ? memory_.ram_ptr(arg1) : nullptr;
     size_t count = (size_t)arg2;
-    int fd = (int)arg0;
+    int fd = files_.host_fd((int)arg0);
+    if (fd == -1)
+        return (rv_uint)(-EBADF);
     int res = (int)write(fd, buf, count);
     if (res == -1)
         return (rv_uint)(-errno);
@@ -925,9 +2341,15 @@ rv_uint rv_cpu::syscall_write(rv_uint arg0, rv_uint arg1, rv_uint arg2)
 // ssize_t read(int fd, void *buf, size_t count);
 rv_uint rv_cpu::syscall_read(rv_uint arg0, rv_uint arg1, rv_uint arg2)
 {
+    if (arg1 != 0 && !memory_.check_range(arg1, arg2, RV_MEMORY_W))
+        return (rv_uint)(-EFAULT);
     void *buf = arg1 != 0 ? memory_.ram_ptr(arg1) : nullptr;
     size_t count = (size_t)arg2;
-    int fd = (int)arg0;
+    int fd = files_.host_fd((int)arg0);
+    if (fd == -1)
+        return (rv_uint)(-EBADF);
+    if (arg1 != 0)
+        memory_.host_writing(arg1, count);
     int res = (int)read(fd, buf, count);
     if (res == -1)
         return (rv_uint)(-errno);
@@ -937,12 +2359,7 @@ rv_uint rv_cpu::syscall_read(rv_uint arg0, rv_uint arg1, rv_uint arg2)
 // int close(int fd)
 rv_uint rv_cpu::syscall_close(rv_uint arg0)
 {
-    int fd = (int)arg0;
-
-    // we don't want to close our own stdin, stderrr and stdout :)
-    if (fd != 0 && fd != 1 && fd != 2)
-        return close(fd) != -1 ? 0 : (rv_uint)(-errno);
-    return 0;
+    return (rv_uint)files_.close((int)arg0);
 }
 
 // void _exit(int _status)
@@ -954,7 +2371,9 @@ rv_uint rv_cpu::syscall_exit(rv_uint arg0)
 
 rv_uint rv_cpu::syscall_lseek(rv_uint arg0, rv_uint arg1, rv_uint arg2)
 {
-    int fd = (int)arg0;
+    int fd = files_.host_fd((int)arg0);
+    if (fd == -1)
+        return (rv_uint)(-EBADF);
     off_t where = (off_t)arg1;
     int whence = (int)arg2;
     int res = (int)lseek(fd, where, whence);
@@ -965,21 +2384,38 @@ rv_uint rv_cpu::syscall_lseek(rv_uint arg0, rv_uint arg1, rv_uint arg2)
 
 rv_uint rv_cpu::syscall_openat(rv_uint arg0, rv_uint arg1, rv_uint arg2, rv_uint arg3)
 {
+    if (arg1 != 0 && !memory_.check_string(arg1))
+        return (rv_uint)(-EFAULT);
     int dirfd = (int)arg0;
     const char *pathname = arg1 != 0 ? reinterpret_cast<const char *>(memory_.ram_ptr(arg1)) : nullptr;
     int flags = (int)arg2;
     int mode = (int)arg3;
 
+    // only paths that don't depend on dirfd can be reopened
+    const bool reopenable = dirfd == AT_FDCWD || (pathname != nullptr && pathname[0] == '/');
+    if (dirfd != AT_FDCWD) {
+        dirfd = files_.host_fd(dirfd);
+        if (dirfd == -1)
+            return (rv_uint)(-EBADF);
+    }
+
     int res = openat(dirfd, pathname, flags, mode);
     if (res == -1)
         return (rv_uint)(-errno);
-    return (rv_uint)res;
+    return (rv_uint)files_.install(res, reopenable ? pathname : "", flags, mode);
 }
 
 rv_uint rv_cpu::syscall_gettimeofday(rv_uint arg0, rv_uint arg1)
 {
+    if ((arg0 != 0 && !memory_.check_range(arg0, sizeof(newlib_timeval), RV_MEMORY_W)) ||
+        (arg1 != 0 && !memory_.check_range(arg1, sizeof(struct timezone), RV_MEMORY_W)))
+        return (rv_uint)(-EFAULT);
     struct newlib_timeval *ntv = reinterpret_cast<struct newlib_timeval*>(memory_.ram_ptr(arg0));
     struct timezone *tz = reinterpret_cast<struct timezone*>(memory_.ram_ptr(arg1));
+    if (arg0 != 0)
+        memory_.host_writing(arg0, sizeof(newlib_timeval));
+    if (arg1 != 0)
+        memory_.host_writing(arg1, sizeof(struct timezone));
     struct timeval tv;
     int res = gettimeofday(arg0 != 0 ? &tv : nullptr, arg1 != 0 ? tz : nullptr);
     if (res != -1 && arg0 != 0)
@@ -987,105 +2423,320 @@ rv_uint rv_cpu::syscall_gettimeofday(rv_uint arg0, rv_uint arg1)
     return res != -1 ? 0 : (rv_uint)(-errno);
 }
 
-void rv_cpu::dispatch_syscall(rv_uint syscall_no,
-    rv_uint arg0,
-    rv_uint arg1,
-    rv_uint arg2,
-    rv_uint arg3,
-    rv_uint arg4,
-    rv_uint arg5
-)
+// void *mmap(void *addr, size_t length, int prot, int flags, int fd, off_t pgoffset);
+// the 32bit syscall takes the offset in 4KiB pages (mmap2)
+rv_uint rv_cpu::syscall_mmap(rv_uint arg0, rv_uint arg1, rv_uint arg2, rv_uint arg3, rv_uint arg4, rv_uint arg5)
 {
-#ifdef DEBUG_SYSCALLS
-    fprintf(stderr, "[d] syscall %d, 0x%08x, 0x%08x, 0x%08x, 0x%08x, 0x%08x, 0x%08x\n", syscall_no, arg0, arg1,
-        arg2, arg3, arg4, arg5);
-#endif
+    int host_fd = -1;
+    if ((arg3 & RV_MAP_ANONYMOUS) == 0) {
+        host_fd = files_.host_fd((int)arg4);
+        if (host_fd == -1)
+            return (rv_uint)(-EBADF);
+    }
+    return vmas_.map(arg0, arg1, arg2, arg3, host_fd, (off_t)arg5 << 12);
+}
 
-    rv_uint retval = 0;
+// syscalls whose results depend on the host, see rv_replay.h
+static bool is_nondeterministic(rv_uint syscall_no)
+{
     switch (syscall_no) {
-    case SYS_fstat:
-        retval = syscall_fstat(arg0, arg1);
-        break;
+    case SYS_read:
+    case SYS_gettimeofday:
+    case SYS_av_get_ticks:
+    case SYS_av_poll_event:
+    case SYS_av_get_mouse_state:
+    case SYS_av_sound_playing:
+    case SYS_av_music_playing:
+        return true;
+    default:
+        return false;
+    }
+}
 
-    case SYS_stat:
-        retval = syscall_stat(arg0, arg1);
+size_t rv_cpu::syscall_outputs(rv_uint syscall_no, rv_uint arg0, rv_uint arg1, rv_uint retval,
+    syscall_output outputs[2]) const
+{
+    size_t count = 0;
+    switch (syscall_no) {
+    case SYS_read:
+        if ((rv_int)retval > 0)
+            outputs[count++] = syscall_output{arg1, retval};
         break;
 
-    case SYS_brk:
-        retval = syscall_brk(arg0);
+    case SYS_gettimeofday:
+        if (retval == 0 && arg0 != 0)
+            outputs[count++] = syscall_output{arg0, (rv_uint)sizeof(newlib_timeval)};
+        if (retval == 0 && arg1 != 0)
+            outputs[count++] = syscall_output{arg1, (rv_uint)sizeof(struct timezone)};
         break;
 
-    case SYS_open:
-        retval = syscall_open(arg0, arg1, arg2);
+    case SYS_av_poll_event:
+        // the largest event, whatever the host did not fill is replayed as it was
+        if (retval == 1)
+            outputs[count++] = syscall_output{arg0, (rv_uint)std::max(sizeof(av_event_keyboard),
+                std::max(sizeof(av_event_mouse_button), sizeof(av_event_mouse_move)))};
         break;
 
-    case SYS_read:
-        retval = syscall_read(arg0, arg1, arg2);
+    case SYS_av_get_mouse_state:
+        if (arg0 != 0)
+            outputs[count++] = syscall_output{arg0, (rv_uint)sizeof(int32_t)};
+        if (arg1 != 0)
+            outputs[count++] = syscall_output{arg1, (rv_uint)sizeof(int32_t)};
         break;
+    }
+    return count;
+}
 
-    case SYS_write:
-        retval = syscall_write(arg0, arg1, arg2);
-        break;
+void rv_cpu::attach_replay(rv_replay* replay)
+{
+    replay_ = replay;
+}
 
-    case SYS_lseek:
-        retval = syscall_lseek(arg0, arg1, arg2);
-        break;
+// regular files read the same on replay, only their results are checked
+static bool is_regular_file(int host_fd)
+{
+    struct stat st;
+    return fstat(host_fd, &st) == 0 && S_ISREG(st.st_mode);
+}
 
-    case SYS_close:
-        retval = syscall_close(arg0);
-        break;
+void rv_cpu::record_syscall(rv_uint syscall_no, rv_uint arg0, rv_uint arg1, rv_uint arg2, rv_uint retval)
+{
+    (void)arg2;
+    if (replay_->replaying() || !is_nondeterministic(syscall_no))
+        return;
 
-    case SYS_exit:
-        retval = syscall_exit(arg0);
-        break;
+    const bool has_data = syscall_no != SYS_read || !is_regular_file(files_.host_fd((int)arg0));
+    replay_->put_entry(syscall_no, retval, has_data);
+    if (!has_data)
+        return;
 
-    case SYS_openat:
-        retval = syscall_openat(arg0, arg1, arg2, arg3);
-        break;
+    syscall_output outputs[2];
+    const size_t count = syscall_outputs(syscall_no, arg0, arg1, retval, outputs);
+    for (size_t i = 0; i < count; ++i)
+        replay_->put_data(memory_.ram_ptr(outputs[i].address), outputs[i].len);
+}
 
-    case SYS_gettimeofday:
-        retval = syscall_gettimeofday(arg0, arg1);
-        break;
+bool rv_cpu::replay_syscall(rv_uint syscall_no, rv_uint arg0, rv_uint arg1, rv_uint arg2, rv_uint& retval)
+{
+    if (!is_nondeterministic(syscall_no))
+        return false;
 
-    case SYS_av_init:
-        retval = sdl_.syscall_init(arg0, arg1);
-        break;
+    const auto recorded = replay_->next_entry();
+    if (recorded.syscall_no != syscall_no) {
+        throw std::runtime_error("replay diverged at entry " + std::to_string(replay_->entry_count()) +
+            ": syscall " + std::to_string(syscall_no) + " instead of " + std::to_string(recorded.syscall_no));
+    }
 
-    case SYS_av_set_framebuffer:
-        retval = sdl_.syscall_set_framebuffer(arg0);
-        break;
+    if (!recorded.has_data) {
+        retval = syscall_read(arg0, arg1, arg2);
+        if (retval != recorded.retval)
+            throw std::runtime_error("replay diverged at entry " + std::to_string(replay_->entry_count()) + ": read result");
+        return true;
+    }
 
-    case SYS_av_delay:
-        retval = sdl_.syscall_delay(arg0);
-        break;
+    retval = recorded.retval;
+    syscall_output outputs[2];
+    const size_t count = syscall_outputs(syscall_no, arg0, arg1, retval, outputs);
+    for (size_t i = 0; i < count; ++i) {
+        if (!memory_.check_range(outputs[i].address, outputs[i].len, RV_MEMORY_W))
+            throw std::runtime_error("replay diverged at entry " + std::to_string(replay_->entry_count()) + ": bad buffer");
+        replay_->get_data(memory_.ram_ptr(outputs[i].address), outputs[i].len);
+    }
+    return true;
+}
 
-    case SYS_av_update:
-        retval = sdl_.syscall_update();
-        break;
+// newlib syscalls and the av range, see newlib_syscalls.h and rv_av.h
+void rv_cpu::register_syscalls(rv_syscall_table& table)
+{
+    table.add(SYS_fstat, "fstat", 2, [](rv_cpu& cpu, const rv_uint* args) {
+        return cpu.syscall_fstat(args[0], args[1]);
+    });
+    table.add(SYS_stat, "stat", 2, [](rv_cpu& cpu, const rv_uint* args) {
+        return cpu.syscall_stat(args[0], args[1]);
+    });
+    table.add(SYS_brk, "brk", 1, [](rv_cpu& cpu, const rv_uint* args) {
+        return cpu.syscall_brk(args[0]);
+    });
+    table.add(SYS_open, "open", 3, [](rv_cpu& cpu, const rv_uint* args) {
+        return cpu.syscall_open(args[0], args[1], args[2]);
+    });
+    table.add(SYS_read, "read", 3, [](rv_cpu& cpu, const rv_uint* args) {
+        return cpu.syscall_read(args[0], args[1], args[2]);
+    });
+    table.add(SYS_write, "write", 3, [](rv_cpu& cpu, const rv_uint* args) {
+        return cpu.syscall_write(args[0], args[1], args[2]);
+    });
+    table.add(SYS_lseek, "lseek", 3, [](rv_cpu& cpu, const rv_uint* args) {
+        return cpu.syscall_lseek(args[0], args[1], args[2]);
+    });
+    table.add(SYS_close, "close", 1, [](rv_cpu& cpu, const rv_uint* args) {
+        return cpu.syscall_close(args[0]);
+    });
+    table.add(SYS_exit, "exit", 1, [](rv_cpu& cpu, const rv_uint* args) {
+        return cpu.syscall_exit(args[0]);
+    });
+    table.add(SYS_openat, "openat", 4, [](rv_cpu& cpu, const rv_uint* args) {
+        return cpu.syscall_openat(args[0], args[1], args[2], args[3]);
+    });
+    table.add(SYS_gettimeofday, "gettimeofday", 2, [](rv_cpu& cpu, const rv_uint* args) {
+        return cpu.syscall_gettimeofday(args[0], args[1]);
+    });
+    table.add(SYS_mmap, "mmap", 6, [](rv_cpu& cpu, const rv_uint* args) {
+        return cpu.syscall_mmap(args[0], args[1], args[2], args[3], args[4], args[5]);
+    });
+    table.add(SYS_munmap, "munmap", 2, [](rv_cpu& cpu, const rv_uint* args) {
+        return cpu.vmas_.unmap(args[0], args[1]);
+    });
+    table.add(SYS_mremap, "mremap", 4, [](rv_cpu& cpu, const rv_uint* args) {
+        return cpu.vmas_.remap(args[0], args[1], args[2], args[3]);
+    });
+
+    table.add(SYS_av_init, "av_init", 2, [](rv_cpu& cpu, const rv_uint* args) {
+        return cpu.av_.syscall_init(args[0], args[1]);
+    });
+    table.add(SYS_av_set_framebuffer, "av_set_framebuffer", 1, [](rv_cpu& cpu, const rv_uint* args) {
+        return cpu.av_.syscall_set_framebuffer(args[0]);
+    });
+    table.add(SYS_av_delay, "av_delay", 1, [](rv_cpu& cpu, const rv_uint* args) {
+        return cpu.av_.syscall_delay(args[0]);
+    });
+    table.add(SYS_av_update, "av_update", 0, [](rv_cpu& cpu, const rv_uint*) {
+        cpu.av_.advance_audio(cpu.cycle_);
+        return cpu.av_.syscall_update();
+    });
+    table.add(SYS_av_set_palette, "av_set_palette", 2, [](rv_cpu& cpu, const rv_uint* args) {
+        return cpu.av_.syscall_set_palette(args[0], args[1]);
+    });
+    table.add(SYS_av_get_ticks, "av_get_ticks", 0, [](rv_cpu& cpu, const rv_uint*) {
+        return cpu.av_.syscall_get_ticks(cpu.cycle_);
+    });
+    table.add(SYS_av_poll_event, "av_poll_event", 1, [](rv_cpu& cpu, const rv_uint* args) {
+        return cpu.av_.syscall_poll_event(args[0]);
+    });
+    table.add(SYS_av_get_mouse_state, "av_get_mouse_state", 2, [](rv_cpu& cpu, const rv_uint* args) {
+        return cpu.av_.syscall_get_mouse_state(args[0], args[1]);
+    });
+    table.add(SYS_av_warp_mouse, "av_warp_mouse", 2, [](rv_cpu& cpu, const rv_uint* args) {
+        return cpu.av_.syscall_warp_mouse(args[0], args[1]);
+    });
+    table.add(SYS_av_shutdown, "av_shutdown", 0, [](rv_cpu& cpu, const rv_uint*) {
+        return cpu.av_.syscall_shutdown();
+    });
+    table.add(SYS_av_snapshot, "av_snapshot", 0, [](rv_cpu& cpu, const rv_uint*) {
+        cpu.snapshot_requested_ = true;
+        return (rv_uint)0;
+    });
+    // the headless mixer catches up first, a sound starts or stops at the right guest time
+    table.add(SYS_av_audio_init, "av_audio_init", 0, [](rv_cpu& cpu, const rv_uint*) {
+        return cpu.av_.syscall_audio_init();
+    });
+    table.add(SYS_av_sound_register, "av_sound_register", 3, [](rv_cpu& cpu, const rv_uint* args) {
+        return cpu.av_.syscall_sound_register(args[0], args[1], args[2]);
+    });
+    table.add(SYS_av_sound_start, "av_sound_start", 4, [](rv_cpu& cpu, const rv_uint* args) {
+        cpu.av_.advance_audio(cpu.cycle_);
+        return cpu.av_.syscall_sound_start(args[0], args[1], args[2], args[3]);
+    });
+    table.add(SYS_av_sound_stop, "av_sound_stop", 1, [](rv_cpu& cpu, const rv_uint* args) {
+        cpu.av_.advance_audio(cpu.cycle_);
+        return cpu.av_.syscall_sound_stop(args[0]);
+    });
+    table.add(SYS_av_sound_update, "av_sound_update", 3, [](rv_cpu& cpu, const rv_uint* args) {
+        cpu.av_.advance_audio(cpu.cycle_);
+        return cpu.av_.syscall_sound_update(args[0], args[1], args[2]);
+    });
+    table.add(SYS_av_sound_playing, "av_sound_playing", 1, [](rv_cpu& cpu, const rv_uint* args) {
+        cpu.av_.advance_audio(cpu.cycle_);
+        return cpu.av_.syscall_sound_playing(args[0]);
+    });
+    table.add(SYS_av_music_init, "av_music_init", 2, [](rv_cpu& cpu, const rv_uint* args) {
+        return cpu.av_.syscall_music_init(args[0], args[1]);
+    });
+    table.add(SYS_av_music_register, "av_music_register", 2, [](rv_cpu& cpu, const rv_uint* args) {
+        return cpu.av_.syscall_music_register(args[0], args[1]);
+    });
+    table.add(SYS_av_music_unregister, "av_music_unregister", 1, [](rv_cpu& cpu, const rv_uint* args) {
+        cpu.av_.advance_audio(cpu.cycle_);
+        return cpu.av_.syscall_music_unregister(args[0]);
+    });
+    table.add(SYS_av_music_play, "av_music_play", 2, [](rv_cpu& cpu, const rv_uint* args) {
+        cpu.av_.advance_audio(cpu.cycle_);
+        return cpu.av_.syscall_music_play(args[0], args[1]);
+    });
+    table.add(SYS_av_music_stop, "av_music_stop", 0, [](rv_cpu& cpu, const rv_uint*) {
+        cpu.av_.advance_audio(cpu.cycle_);
+        return cpu.av_.syscall_music_stop();
+    });
+    table.add(SYS_av_music_pause, "av_music_pause", 0, [](rv_cpu& cpu, const rv_uint*) {
+        cpu.av_.advance_audio(cpu.cycle_);
+        return cpu.av_.syscall_music_pause();
+    });
+    table.add(SYS_av_music_resume, "av_music_resume", 0, [](rv_cpu& cpu, const rv_uint*) {
+        cpu.av_.advance_audio(cpu.cycle_);
+        return cpu.av_.syscall_music_resume();
+    });
+    table.add(SYS_av_music_volume, "av_music_volume", 1, [](rv_cpu& cpu, const rv_uint* args) {
+        cpu.av_.advance_audio(cpu.cycle_);
+        return cpu.av_.syscall_music_volume(args[0]);
+    });
+    table.add(SYS_av_music_playing, "av_music_playing", 1, [](rv_cpu& cpu, const rv_uint* args) {
+        cpu.av_.advance_audio(cpu.cycle_);
+        return cpu.av_.syscall_music_playing(args[0]);
+    });
+    table.add(SYS_av_draw_columns, "av_draw_columns", 3, [](rv_cpu& cpu, const rv_uint* args) {
+        return cpu.av_.syscall_draw_columns(args[0], args[1], args[2]);
+    });
+    table.add(SYS_av_draw_spans, "av_draw_spans", 2, [](rv_cpu& cpu, const rv_uint* args) {
+        return cpu.av_.syscall_draw_spans(args[0], args[1]);
+    });
+}
 
-    case SYS_av_set_palette:
-        retval = sdl_.syscall_set_palette(arg0, arg1);
-        break;
+const rv_syscall_table& rv_cpu::syscalls()
+{
+    static const std::unique_ptr<rv_syscall_table> table = [] {
+        auto table = std::make_unique<rv_syscall_table>();
+        register_syscalls(*table);
+        return table;
+    }();
+    return *table;
+}
 
-    case SYS_av_get_ticks:
-        retval = sdl_.syscall_get_ticks();
-        break;
+void rv_cpu::dispatch_syscall(rv_uint syscall_no,
+    rv_uint arg0,
+    rv_uint arg1,
+    rv_uint arg2,
+    rv_uint arg3,
+    rv_uint arg4,
+    rv_uint arg5
+)
+{
+    const rv_syscall* syscall = syscalls().find(syscall_no);
+    const rv_uint args[6] = {arg0, arg1, arg2, arg3, arg4, arg5};
 
-    case SYS_av_poll_event:
-        retval = sdl_.syscall_poll_event(arg0);
-        break;
+#ifdef DEBUG_SYSCALLS
+    if (syscall != nullptr)
+        fprintf(stderr, "[d] syscall %u: %s\n", syscall_no, syscall->format_call(args).c_str());
+#endif
 
-    case SYS_av_get_mouse_state:
-        retval = sdl_.syscall_get_mouse_state(arg0, arg1);
-        break;
+    rv_uint retval = 0;
 
-    case SYS_av_warp_mouse:
-        retval = sdl_.syscall_warp_mouse(arg0, arg1);
-        break;
+    // nondeterministic results come from the log when replaying
+    if (unlikely(replay_ != nullptr) && replay_->replaying() && replay_syscall(syscall_no, arg0, arg1, arg2, retval)) {
+        regs_[a0] = retval;
+        return;
+    }
 
-    case SYS_av_shutdown:
-        retval = sdl_.syscall_shutdown();
-        break;
+    if (likely(syscall != nullptr)) {
+        const auto start = std::chrono::steady_clock::now();
+        retval = syscall->handler(*this, args);
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+        syscall->stats.add((uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    }
+    else {
+        syscalls().unknown(syscall_no, args);
+        retval = (rv_uint)-ENOSYS;
     }
+    if (unlikely(replay_ != nullptr))
+        record_syscall(syscall_no, arg0, arg1, arg2, retval);
     regs_[a0] = retval;
 }
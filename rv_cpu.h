@@ -2,21 +2,79 @@
 
 #include <limits>
 #include <array>
+#include <string>
 #include "rv_global.h"
 #include "rv_memory.h"
-#include "rv_sdl.h"
+#include "rv_icache.h"
+#include "rv_jit.h"
+#include "rv_av_backend.h"
+#include "rv_fd_table.h"
+#include "rv_vma.h"
+#include "rv_profiler.h"
+#include "rv_syscalls.h"
+#include "rv_hle.h"
+#ifdef RISC_666_TRACE
+#include "rv_trace.h"
+#endif
+
+class rv_snapshot_writer;
+class rv_snapshot_reader;
+class rv_replay;
 
 class rv_cpu
 {
 public:
     rv_cpu() = delete;
-    explicit rv_cpu(rv_memory& memory);
+    // memory, av and the cpu make up one guest, nothing is shared with other instances
+    rv_cpu(rv_memory& memory, rv_av_backend& av);
+    ~rv_cpu();
 
     void reset(rv_uint pc = 0);
     void run(size_t nCycles);
 
+    // compile hot blocks to host code, false if the host is not supported
+    bool enable_jit();
+
     uint64_t cycle_count() const { return cycle_; }
 
+    // handlers, counts and host time of every syscall, shared by all the guests
+    static const rv_syscall_table& syscalls();
+
+    // hand the guest state to profiler every profiler->interval() instructions, nullptr to stop
+    void attach_profiler(rv_profiler* profiler);
+
+    // the guest asked for a snapshot with av_snapshot, taken by the caller once run() returns
+    bool snapshot_requested() const { return snapshot_requested_; }
+    void clear_snapshot_request() { snapshot_requested_ = false; }
+
+    // log the nondeterministic syscall results to replay, or take them from it, nullptr to stop
+    void attach_replay(rv_replay* replay);
+
+    // let hle run the functions it knows in place of the guest code, nullptr to stop
+    // verifying needs the interpreter, the guest result is checked when the call returns
+    void attach_hle(rv_hle* hle);
+
+#ifdef RISC_666_TRACE
+    // push every executed instruction to trace, nullptr to stop
+    // interpreter only, and fusion is off while tracing: one record per guest instruction
+    // blocks translated while tracing carry pseudo ops writing the trace, the others
+    // don't pay for it
+    void attach_trace(rv_trace* trace);
+#endif
+
+    // stop run() before executing the block at pc, which must be the start of a block
+    // (a branch or call target): with the JIT a block is entered mid-chain otherwise
+    void set_breakpoint(rv_uint pc) { break_pc_ = pc; breakpoint_hit_ = false; }
+    void clear_breakpoint() { break_pc_ = kNoBreakpoint; breakpoint_hit_ = false; }
+    bool breakpoint_hit() const { return breakpoint_hit_; }
+
+    // give the guest files opened so far their own offsets, after fork() they are shared with the parent
+    void reopen_files();
+
+    // registers, csrs, counters, open files and the AV state, see rv_snapshot.h
+    void save_state(rv_snapshot_writer& snapshot);
+    void restore_state(rv_snapshot_reader& snapshot);
+
     bool emulation_exit() const { return emulation_exit_; }
     int emulation_exit_status() const { return emulation_exit_status_; }
 
@@ -32,35 +90,59 @@ private:
     // extract a single bit from a 32bit value
     uint32_t bit(uint32_t val, uint32_t bit) const { return (val >> bit) & 1; }
 
-    void next_insn(rv_uint cnt = 4) { pc_ += cnt; }
-    void jump_insn(rv_uint newpc) { pc_ = newpc; }
-
     void raise_exception(rv_exception code);
 
     void raise_illegal_instruction() { raise_exception(rv_exception::illegal_instruction); }
     void raise_memory_exception() { raise_exception(memory_.last_exception()); }
     void raise_breakpoint_exception() { raise_exception(rv_exception::breakpoint); }
 
-    inline void execute_lui(uint32_t insn);
-    inline void execute_auipc(uint32_t insn);
-    inline void execute_jal(uint32_t insn);
-    inline void execute_jalr(uint32_t insn);
-    inline void execute_branch(uint32_t insn);
-    inline void execute_load(uint32_t insn);
-    inline void execute_store(uint32_t insn);
-    inline void execute_amo(uint32_t insn);
-    inline void execute_imm(uint32_t insn);
-    inline void execute_op(uint32_t insn);
-    inline void execute_misc_mem(uint32_t insn);
-    inline void execute_system(uint32_t insn);
+    // expand a 16bit instruction to its 32bit equivalent, 0 if illegal
+    uint32_t expand_compressed(uint32_t insn) const;
+
+    // decode a 32bit instruction at pc into its cached form, returns true if it ends a block
+    bool decode(uint32_t insn, rv_uint pc, rv_insn& out) const;
+    void decode_op_fp(uint32_t insn, rv_insn& out) const;
+
+    // fuse two consecutive instructions into a single op, false if they don't match any pattern
+    bool fuse_pair(const rv_insn& first, const rv_insn& second, rv_insn& out) const;
+    void fuse(std::vector<rv_insn>& insns) const;
+
+    // translate straight-line code starting at pc, nullptr on fetch fault
+    std::unique_ptr<rv_block> translate(rv_uint pc);
+
+    // lookup the block starting at pc, translating it if needed
+    // returns nullptr and raises an exception if pc cannot be executed
+    rv_block* find_block(rv_uint pc);
+
+    // drop every translated block and the host code generated for them
+    void flush_translations();
+
+    // the dispatch loop behind run(), returns the instructions it charged
+    uint64_t interpret(size_t nCycles);
+    // the end of every run() slice: counters, profiler and pending exception
+    void finish_run(uint64_t executed);
+
+    // read-modify-write for amo*.w, false on memory fault
+    template<typename F> bool execute_amo(const rv_insn& insn, F op);
 
     bool csr_read(uint32_t csr, rv_uint& csr_value, bool write_back = false);
+    // time or timeh, logged for replay
+    rv_uint read_time(uint32_t csr);
     bool csr_write(uint32_t csr, rv_uint csr_value);
 
     bool csr_rw(uint32_t csr, uint32_t rd, rv_uint new_value, uint32_t csrop);
 
     void dump_regs();
 
+#ifdef RISC_666_TRACE
+    // describe block to the trace, once per translation
+    void trace_define(rv_block& block);
+    // the x registers, for the reader to start from
+    void trace_state();
+    // publish the block run cut short by an exception, if any
+    void trace_close();
+#endif
+
     void stop_emulation(int exit_code);
     void handle_user_exception();
     void handle_illegal_instruction();
@@ -75,6 +157,9 @@ private:
         rv_uint arg5
         );
 
+    // fills syscalls() once
+    static void register_syscalls(rv_syscall_table& table);
+
     // syscalls emulation
     rv_uint syscall_fstat(rv_uint arg0, rv_uint arg1);
     rv_uint syscall_stat(rv_uint arg0, rv_uint arg1);
@@ -87,22 +172,77 @@ private:
     rv_uint syscall_exit(rv_uint arg0);
     rv_uint syscall_openat(rv_uint arg0, rv_uint arg1, rv_uint arg2, rv_uint arg3);
     rv_uint syscall_gettimeofday(rv_uint arg0, rv_uint arg1);
+    rv_uint syscall_mmap(rv_uint arg0, rv_uint arg1, rv_uint arg2, rv_uint arg3, rv_uint arg4, rv_uint arg5);
+
+    // guest buffers filled by a nondeterministic syscall, see rv_replay.h
+    struct syscall_output
+    {
+        rv_uint address;
+        rv_uint len;
+    };
+    size_t syscall_outputs(rv_uint syscall_no, rv_uint arg0, rv_uint arg1, rv_uint retval,
+        syscall_output outputs[2]) const;
+    void record_syscall(rv_uint syscall_no, rv_uint arg0, rv_uint arg1, rv_uint arg2, rv_uint retval);
+    bool replay_syscall(rv_uint syscall_no, rv_uint arg0, rv_uint arg1, rv_uint arg2, rv_uint& retval);
 
 private:
     rv_uint pc_;
-    std::array<rv_uint, 32> regs_;
+
+    // x0..x31, plus a sink register that receives all writes to x0
+    std::array<rv_uint, 33> regs_;
     rv_uint amo_res_;
+
+    // f0..f31, single precision values are NaN-boxed
+    std::array<uint64_t, 32> fregs_;
+    uint32_t fflags_;
+    uint32_t frm_;
     rv_memory& memory_;
-    rv_sdl sdl_;
+    rv_icache icache_;
+    const void* const* dispatch_table_ = nullptr;
+    std::unique_ptr<rv_jit> jit_;
+    rv_jit_context jit_ctx_;
+
+    // last instruction that touched guest memory, nullptr while in compiled code
+    const rv_insn* fault_insn_ = nullptr;
+    rv_av_backend& av_;
+
+    rv_fd_table files_;
+    rv_vma vmas_;
+
+    // odd, never matches a block
+    static constexpr rv_uint kNoBreakpoint = 0xFFFFFFFF;
+    rv_uint break_pc_ = kNoBreakpoint;
+    bool breakpoint_hit_ = false;
+    bool snapshot_requested_ = false;
+
+    rv_replay* replay_ = nullptr;
+    rv_hle* hle_ = nullptr;
+
+#ifdef RISC_666_TRACE
+    rv_trace* trace_ = nullptr;
+    uint32_t trace_blocks_ = 0;
+    // the block run being written: the next word, its count until it is published
+    // and its block
+    uint32_t* trace_out_ = nullptr;
+    uint32_t* trace_count_ = nullptr;
+    const rv_block* trace_block_ = nullptr;
+#endif
+
+    rv_profiler* profiler_ = nullptr;
+    uint64_t profile_countdown_ = 0;
 
     bool exception_raised_;
     rv_exception exception_code_;
+    // of the ecall or ebreak that raised it, execution resumes past it
+    uint8_t exception_len_ = 4;
 
     bool emulation_exit_;
     int emulation_exit_status_;
 
     // Counter/Timers
-    uint64_t time_;
     uint64_t cycle_;
     uint64_t instret_;
+
+    // cycle/instret as seen by the csr instruction being executed, set by run()
+    uint64_t csr_retired_ = 0;
 };
\ No newline at end of file
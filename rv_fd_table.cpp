@@ -0,0 +1,138 @@
+#include <stdexcept>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "rv_fd_table.h"
+#include "rv_snapshot.h"
+
+// per guest, like a default RLIMIT_NOFILE
+constexpr int kMaxFiles = 1024;
+
+// stdin, stdout and stderr
+constexpr int kNumStdio = 3;
+
+// open path again at offset (-1 for unseekable files), -1 on failure
+static int reopen(const std::string& path, int flags, int mode, int64_t offset)
+{
+    const int fd = open(path.c_str(), flags, mode);
+    if (fd != -1 && offset != -1)
+        lseek(fd, (off_t)offset, SEEK_SET);
+    return fd;
+}
+
+rv_fd_table::rv_fd_table()
+    : files_(kNumStdio)
+{
+    for (int fd = 0; fd < kNumStdio; ++fd)
+        files_[fd].host_fd = fd;
+}
+
+rv_fd_table::~rv_fd_table()
+{
+    close_all();
+}
+
+int rv_fd_table::host_fd(int fd) const
+{
+    if (fd < 0 || (size_t)fd >= files_.size())
+        return -1;
+    return files_[fd].host_fd;
+}
+
+int rv_fd_table::install(int host_fd, const std::string& path, int flags, int mode)
+{
+    size_t fd = kNumStdio;
+    while (fd < files_.size() && files_[fd].host_fd != -1)
+        ++fd;
+    if (fd >= (size_t)kMaxFiles) {
+        ::close(host_fd);
+        return -EMFILE;
+    }
+    if (fd == files_.size())
+        files_.emplace_back();
+
+    // reopening must not create or truncate the file again
+    files_[fd] = open_file{host_fd, path, flags & ~(O_CREAT | O_EXCL | O_TRUNC), mode};
+    return (int)fd;
+}
+
+int rv_fd_table::close(int fd)
+{
+    const int host = host_fd(fd);
+    if (host == -1)
+        return -EBADF;
+
+    // we don't want to close our own stdin, stderrr and stdout :)
+    if (fd < kNumStdio)
+        return 0;
+
+    files_[fd] = open_file{};
+    return ::close(host) != -1 ? 0 : -errno;
+}
+
+void rv_fd_table::close_all()
+{
+    for (size_t fd = kNumStdio; fd < files_.size(); ++fd) {
+        if (files_[fd].host_fd != -1)
+            ::close(files_[fd].host_fd);
+    }
+    files_.resize(kNumStdio);
+}
+
+void rv_fd_table::reopen_files()
+{
+    for (size_t fd = kNumStdio; fd < files_.size(); ++fd) {
+        auto& file = files_[fd];
+        if (file.host_fd == -1 || file.path.empty())
+            continue;
+        const auto offset = (int64_t)lseek(file.host_fd, 0, SEEK_CUR);
+        const int host = reopen(file.path, file.flags, file.mode, offset);
+        if (host == -1)
+            throw std::runtime_error("unable to reopen " + file.path);
+        ::close(file.host_fd);
+        file.host_fd = host;
+    }
+}
+
+void rv_fd_table::save_state(rv_snapshot_writer& snapshot) const
+{
+    uint32_t count = 0;
+    for (size_t fd = kNumStdio; fd < files_.size(); ++fd)
+        count += files_[fd].host_fd != -1 && !files_[fd].path.empty();
+
+    snapshot.put(count);
+    for (size_t fd = kNumStdio; fd < files_.size(); ++fd) {
+        const auto& file = files_[fd];
+        if (file.host_fd == -1 || file.path.empty())
+            continue;
+        snapshot.put<int32_t>((int32_t)fd);
+        snapshot.put_string(file.path);
+        snapshot.put<int32_t>(file.flags);
+        snapshot.put<int32_t>(file.mode);
+        snapshot.put<int64_t>((int64_t)lseek(file.host_fd, 0, SEEK_CUR));
+    }
+}
+
+void rv_fd_table::restore_state(rv_snapshot_reader& snapshot)
+{
+    // files go back to the same guest descriptor and offset
+    close_all();
+    const auto num_files = snapshot.get<uint32_t>();
+    for (uint32_t i = 0; i < num_files; ++i) {
+        const int fd = snapshot.get<int32_t>();
+        open_file file;
+        file.path = snapshot.get_string();
+        file.flags = snapshot.get<int32_t>();
+        file.mode = snapshot.get<int32_t>();
+        const auto offset = snapshot.get<int64_t>();
+
+        if (fd < kNumStdio || fd >= kMaxFiles)
+            throw std::runtime_error("invalid descriptor " + std::to_string(fd) + " in snapshot");
+        file.host_fd = reopen(file.path, file.flags, file.mode, offset);
+        if (file.host_fd == -1)
+            throw std::runtime_error("unable to reopen " + file.path);
+        if ((size_t)fd >= files_.size())
+            files_.resize(fd + 1);
+        files_[fd] = std::move(file);
+    }
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include <string>
+#include <vector>
+
+class rv_snapshot_writer;
+class rv_snapshot_reader;
+
+// guest file descriptors: each guest numbers its files on its own, the host descriptors
+// behind them are private to it
+// 0, 1 and 2 are the emulator's stdio, shared by every guest and never closed
+class rv_fd_table
+{
+public:
+    rv_fd_table();
+    ~rv_fd_table();
+
+    rv_fd_table(const rv_fd_table&) = delete;
+    rv_fd_table& operator=(const rv_fd_table&) = delete;
+
+    // the host descriptor behind fd, -1 if the guest has no such file
+    int host_fd(int fd) const;
+
+    // give host_fd the lowest free guest descriptor, -EMFILE (and host_fd closed) if none is left
+    // path, flags and mode open the file again after fork or on snapshot restore, an empty
+    // path marks a file that can't be
+    int install(int host_fd, const std::string& path, int flags, int mode);
+
+    // 0 or -errno
+    int close(int fd);
+
+    // give every file its own offset, after fork() they are shared with the parent
+    void reopen_files();
+
+    // path, flags, mode and offset of each file that can be opened again
+    void save_state(rv_snapshot_writer& snapshot) const;
+    void restore_state(rv_snapshot_reader& snapshot);
+
+private:
+    struct open_file
+    {
+        int host_fd = -1;
+        std::string path;
+        int flags = 0;
+        int mode = 0;
+    };
+
+    void close_all();
+
+private:
+    std::vector<open_file> files_;
+};
@@ -0,0 +1,108 @@
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <algorithm>
+#include <cstdio>
+#include <thread>
+#include <stdexcept>
+#include "rv_fleet.h"
+
+namespace {
+
+// guests waiting for their next time slice on one worker
+struct run_queue
+{
+    std::mutex lock;
+    std::deque<size_t> guests;
+
+    bool pop_front(size_t& guest)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (guests.empty())
+            return false;
+        guest = guests.front();
+        guests.pop_front();
+        return true;
+    }
+
+    // thieves take from the other end, away from the owner
+    bool pop_back(size_t& guest)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (guests.empty())
+            return false;
+        guest = guests.back();
+        guests.pop_back();
+        return true;
+    }
+
+    void push_back(size_t guest)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        guests.push_back(guest);
+    }
+};
+
+}
+
+rv_fleet::rv_fleet(size_t num_workers)
+    : num_workers_{num_workers != 0 ? num_workers : 1}
+{
+}
+
+void rv_fleet::add(std::unique_ptr<rv_guest> guest)
+{
+    guests_.push_back(std::move(guest));
+}
+
+void rv_fleet::run(size_t slice)
+{
+    const size_t num_workers = std::min(num_workers_, guests_.size());
+    if (num_workers == 0)
+        return;
+
+    std::vector<run_queue> queues(num_workers);
+    for (size_t i = 0; i < guests_.size(); ++i)
+        queues[i % num_workers].guests.push_back(i);
+
+    std::atomic<size_t> running{guests_.size()};
+
+    auto worker = [&](size_t self) {
+        while (running.load(std::memory_order_acquire) != 0) {
+            size_t index;
+            bool found = queues[self].pop_front(index);
+            for (size_t i = 1; !found && i < num_workers; ++i)
+                found = queues[(self + i) % num_workers].pop_back(index);
+            if (!found) {
+                // the remaining guests are all being run by other workers
+                std::this_thread::yield();
+                continue;
+            }
+
+            auto& cpu = guests_[index]->cpu;
+            try {
+                cpu.run(slice);
+            }
+            catch (const std::runtime_error& ex) {
+                fprintf(stderr, "[e] error: guest %zu: %s\n", index, ex.what());
+                running.fetch_sub(1, std::memory_order_release);
+                continue;
+            }
+
+            if (self == 0)
+                rv_syscall_poll_stats(rv_cpu::syscalls());
+
+            if (cpu.emulation_exit())
+                running.fetch_sub(1, std::memory_order_release);
+            else
+                queues[self].push_back(index);
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < num_workers; ++i)
+        workers.emplace_back(worker, i);
+    worker(0);
+    for (auto& thread : workers)
+        thread.join();
+}
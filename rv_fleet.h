@@ -0,0 +1,38 @@
+#pragma once
+#include <memory>
+#include <vector>
+#include "rv_memory.h"
+#include "rv_av_headless.h"
+#include "rv_cpu.h"
+
+// one independent headless guest: its own memory, file descriptors and AV state
+struct rv_guest
+{
+    rv_guest(rv_uint memory_size, uint64_t insns_per_ms)
+        : memory{memory_size}, av{memory, insns_per_ms}, cpu{memory, av} {}
+
+    rv_memory memory;
+    rv_av_headless av;
+    rv_cpu cpu;
+    std::unique_ptr<rv_hle> hle;
+};
+
+// runs many guests at once on a pool of worker threads
+// guests are scheduled in time slices of rv_cpu::run: each worker takes the next slice from
+// its own queue and steals from the others once it runs dry, a guest is never on two
+// workers at the same time
+class rv_fleet
+{
+public:
+    explicit rv_fleet(size_t num_workers);
+
+    void add(std::unique_ptr<rv_guest> guest);
+    const std::vector<std::unique_ptr<rv_guest>>& guests() const { return guests_; }
+
+    // until every guest has exited, slice is the number of instructions per time slice
+    void run(size_t slice);
+
+private:
+    size_t num_workers_;
+    std::vector<std::unique_ptr<rv_guest>> guests_;
+};
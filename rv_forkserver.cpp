@@ -0,0 +1,89 @@
+#include <cstdio>
+#include <cerrno>
+#include <stdexcept>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "rv_forkserver.h"
+
+static bool read_word(int fd, uint32_t& value)
+{
+    auto* p = reinterpret_cast<uint8_t*>(&value);
+    size_t done = 0;
+    while (done < sizeof(value)) {
+        const ssize_t res = read(fd, p + done, sizeof(value) - done);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res <= 0)
+            return false;
+        done += (size_t)res;
+    }
+    return true;
+}
+
+static bool write_words(int fd, const uint32_t* values, size_t count)
+{
+    const auto* p = reinterpret_cast<const uint8_t*>(values);
+    const size_t len = count*sizeof(uint32_t);
+    size_t done = 0;
+    while (done < len) {
+        const ssize_t res = write(fd, p + done, len - done);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res <= 0)
+            return false;
+        done += (size_t)res;
+    }
+    return true;
+}
+
+bool rv_run_fork_server(rv_cpu& cpu)
+{
+    const uint32_t hello = 0;
+    if (!write_words(RV_FORKSRV_STATUS_FD, &hello, 1))
+        throw std::runtime_error("fork-server: no client on the status descriptor");
+
+    fprintf(stderr, "[i] fork-server ready after %llu instructions\n", (unsigned long long)cpu.cycle_count());
+    fflush(stderr);
+
+    uint32_t command;
+    while (read_word(RV_FORKSRV_CONTROL_FD, command)) {
+        if (command == RV_FORKSRV_SPAWN) {
+            const pid_t pid = fork();
+            if (pid < 0)
+                throw std::runtime_error("fork-server: fork() failed");
+
+            if (pid == 0) {
+                close(RV_FORKSRV_CONTROL_FD);
+                close(RV_FORKSRV_STATUS_FD);
+                cpu.reopen_files();
+                return true;
+            }
+
+            const uint32_t reply = (uint32_t)pid;
+            if (!write_words(RV_FORKSRV_STATUS_FD, &reply, 1))
+                break;
+        }
+        else if (command == RV_FORKSRV_WAIT) {
+            int status = 0;
+            pid_t pid;
+            do {
+                pid = waitpid(-1, &status, 0);
+            } while (pid < 0 && errno == EINTR);
+
+            // no children, reported as pid 0
+            const uint32_t reply[2] = { pid > 0 ? (uint32_t)pid : 0, (uint32_t)status };
+            if (!write_words(RV_FORKSRV_STATUS_FD, reply, 2))
+                break;
+        }
+        else {
+            fprintf(stderr, "[e] error: fork-server: unknown command %u\n", command);
+            break;
+        }
+    }
+
+    // don't leave zombies behind
+    while (waitpid(-1, nullptr, 0) > 0 || errno == EINTR)
+        ;
+    return false;
+}
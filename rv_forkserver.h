@@ -0,0 +1,22 @@
+#pragma once
+#include <cstdint>
+#include "rv_cpu.h"
+
+// once the guest is warmed up, the emulator parks as a fork-server: every child resumes the
+// guest from that point and shares its memory copy-on-write, paying only for the pages it dirties
+//
+// protocol, on the descriptors AFL uses (they must be open when the emulator starts):
+//   - the server writes a 4 byte hello on RV_FORKSRV_STATUS_FD once it is ready
+//   - the client writes 4 byte commands on RV_FORKSRV_CONTROL_FD
+//       RV_FORKSRV_SPAWN: fork a child that resumes the guest, the reply is its pid
+//       RV_FORKSRV_WAIT: wait for any child, the reply is its pid and its waitpid() status
+//   - children run in parallel until waited for, the server exits when the control pipe is closed
+constexpr int RV_FORKSRV_CONTROL_FD = 198;
+constexpr int RV_FORKSRV_STATUS_FD = 199;
+
+constexpr uint32_t RV_FORKSRV_SPAWN = 0;
+constexpr uint32_t RV_FORKSRV_WAIT = 1;
+
+// serve requests, returns true in each child (which carries on with the emulation)
+// and false in the server once the client is gone
+bool rv_run_fork_server(rv_cpu& cpu);
@@ -0,0 +1,344 @@
+#include <cfenv>
+#include <limits>
+#include <type_traits>
+#include "rv_fpu.h"
+
+// this file is built with -frounding-math, operands and results go through volatiles
+// so that nothing is evaluated outside of the requested rounding mode
+
+static int host_rounding(uint32_t rm)
+{
+    switch (rm) {
+    case RV_RM_RTZ: return FE_TOWARDZERO;
+    case RV_RM_RDN: return FE_DOWNWARD;
+    case RV_RM_RUP: return FE_UPWARD;
+    default: return FE_TONEAREST;
+    }
+}
+
+template<typename T>
+static T fop(rv_fop op, T a, T b, T c)
+{
+    volatile T va = a;
+    volatile T vb = b;
+    volatile T vc = c;
+    volatile T result;
+
+    switch (op) {
+    case rv_fop::add: result = va + vb; break;
+    case rv_fop::sub: result = va - vb; break;
+    case rv_fop::mul: result = va * vb; break;
+    case rv_fop::div: result = va / vb; break;
+    case rv_fop::sqrt: result = std::sqrt((T)va); break;
+    case rv_fop::madd: result = std::fma((T)va, (T)vb, (T)vc); break;
+    case rv_fop::msub: result = std::fma((T)va, (T)vb, -(T)vc); break;
+    case rv_fop::nmsub: result = std::fma(-(T)va, (T)vb, (T)vc); break;
+    case rv_fop::nmadd: result = std::fma(-(T)va, (T)vb, -(T)vc); break;
+    }
+    return result;
+}
+
+// the last bit of a finite value
+template<typename W>
+static bool last_bit(W value)
+{
+    int exponent;
+    const W mantissa = std::frexp(value, &exponent);
+    return std::fmod(std::ldexp(mantissa, std::numeric_limits<W>::digits), (W)2) != 0;
+}
+
+// value rounded to T, ties away from zero, with the host in round to nearest even
+// only an exact tie can come out differently, it is redone rounding away from zero
+template<typename T, typename W>
+static T round_rmm(W value)
+{
+    volatile W v = value;
+    volatile T result = (T)v;
+    const T nearest = result;
+    const W diff = v - (W)nearest;
+    if (!std::isfinite(nearest) || diff == 0 || (diff > 0) != (v > 0))
+        return nearest;
+
+    const T away = std::nextafter(nearest, v > 0 ? std::numeric_limits<T>::infinity() : -std::numeric_limits<T>::infinity());
+    if (diff != ((W)away - (W)nearest) / 2)
+        return nearest;
+    feclearexcept(FE_ALL_EXCEPT);
+    fesetround(v > 0 ? FE_UPWARD : FE_DOWNWARD);
+    result = (T)v;
+    fesetround(FE_TONEAREST);
+    return result;
+}
+
+// RMM has no host mode: op runs in W rounding towards zero, an inexact result gets its
+// last bit set (round to odd, with two more bits than T every tie stays one and nothing
+// else becomes one), then round_rmm() narrows it
+// invalid and divide by zero come from op, the other flags from the narrowing
+template<typename T, typename W, typename F>
+static T rmm(F op)
+{
+    fexcept_t saved;
+    fegetexceptflag(&saved, FE_ALL_EXCEPT);
+    feclearexcept(FE_ALL_EXCEPT);
+
+    fesetround(FE_TOWARDZERO);
+    W wide = op();
+    fesetround(FE_TONEAREST);
+    const int raised = fetestexcept(FE_INVALID | FE_DIVBYZERO);
+    if (fetestexcept(FE_INEXACT) && std::isfinite(wide) && wide != 0 && !last_bit(wide))
+        wide = std::nextafter(wide, wide > 0 ? std::numeric_limits<W>::infinity() : -std::numeric_limits<W>::infinity());
+
+    feclearexcept(FE_ALL_EXCEPT);
+    const T result = round_rmm<T>(wide);
+    const int rounding = fetestexcept(FE_ALL_EXCEPT);
+
+    fesetexceptflag(&saved, FE_ALL_EXCEPT);
+    feraiseexcept(raised | rounding);
+    return result;
+}
+
+// wide enough for RMM on T
+template<typename T> struct rmm_wide;
+template<> struct rmm_wide<float> { using type = double; };
+template<> struct rmm_wide<double> { using type = std::conditional_t<RV_FPU_RMM_D, long double, double>; };
+
+template<typename T>
+static T fop_rounded(rv_fop op, T a, T b, T c, uint32_t rm)
+{
+    using W = typename rmm_wide<T>::type;
+    if (rm == RV_RM_RMM)
+        return rmm<T, W>([&] { return fop<W>(op, a, b, c); });
+
+    fesetround(host_rounding(rm));
+    volatile T result = fop<T>(op, a, b, c);
+    fesetround(FE_TONEAREST);
+    return result;
+}
+
+float rv_fop_rounded(rv_fop op, float a, float b, float c, uint32_t rm)
+{
+    return fop_rounded(op, a, b, c, rm);
+}
+
+double rv_fop_rounded(rv_fop op, double a, double b, double c, uint32_t rm)
+{
+    return fop_rounded(op, a, b, c, rm);
+}
+
+// doubles and 32bit integers are exact as doubles, RMM only needs the narrowing
+
+float rv_fcvt_s_d(double value, uint32_t rm)
+{
+    if (rm == RV_RM_RMM)
+        return rmm<float, double>([&] { return value; });
+    volatile double v = value;
+    volatile float result;
+    fesetround(host_rounding(rm));
+    result = (float)v;
+    fesetround(FE_TONEAREST);
+    return result;
+}
+
+float rv_fcvt_s_w(int32_t value, uint32_t rm)
+{
+    if (rm == RV_RM_RMM)
+        return rmm<float, double>([&] { return (double)value; });
+    volatile int32_t v = value;
+    volatile float result;
+    fesetround(host_rounding(rm));
+    result = (float)v;
+    fesetround(FE_TONEAREST);
+    return result;
+}
+
+float rv_fcvt_s_wu(uint32_t value, uint32_t rm)
+{
+    if (rm == RV_RM_RMM)
+        return rmm<float, double>([&] { return (double)value; });
+    volatile uint32_t v = value;
+    volatile float result;
+    fesetround(host_rounding(rm));
+    result = (float)v;
+    fesetround(FE_TONEAREST);
+    return result;
+}
+
+// round to an integral value, the host is always in round to nearest even here
+// libm may raise inexact on the way, the caller computes the flags itself
+static double round_integral(double value, uint32_t rm)
+{
+    fexcept_t saved;
+    fegetexceptflag(&saved, FE_ALL_EXCEPT);
+
+    double result;
+    switch (rm) {
+    case RV_RM_RTZ: result = std::trunc(value); break;
+    case RV_RM_RDN: result = std::floor(value); break;
+    case RV_RM_RUP: result = std::ceil(value); break;
+    case RV_RM_RMM: result = std::round(value); break;
+    default: result = std::nearbyint(value); break;
+    }
+
+    fesetexceptflag(&saved, FE_ALL_EXCEPT);
+    return result;
+}
+
+template<typename T>
+rv_uint rv_fcvt_w(T value, uint32_t rm, uint32_t& fflags)
+{
+    if (std::isnan(value)) {
+        fflags |= RV_FFLAG_NV;
+        return (rv_uint)std::numeric_limits<int32_t>::max();
+    }
+    const double result = round_integral((double)value, rm);
+    if (result < -2147483648.0) {
+        fflags |= RV_FFLAG_NV;
+        return (rv_uint)std::numeric_limits<int32_t>::min();
+    }
+    if (result > 2147483647.0) {
+        fflags |= RV_FFLAG_NV;
+        return (rv_uint)std::numeric_limits<int32_t>::max();
+    }
+    if (result != (double)value)
+        fflags |= RV_FFLAG_NX;
+    return (rv_uint)(int32_t)result;
+}
+
+template<typename T>
+rv_uint rv_fcvt_wu(T value, uint32_t rm, uint32_t& fflags)
+{
+    if (std::isnan(value)) {
+        fflags |= RV_FFLAG_NV;
+        return std::numeric_limits<uint32_t>::max();
+    }
+    const double result = round_integral((double)value, rm);
+    if (result <= -1.0) {
+        fflags |= RV_FFLAG_NV;
+        return 0;
+    }
+    if (result > 4294967295.0) {
+        fflags |= RV_FFLAG_NV;
+        return std::numeric_limits<uint32_t>::max();
+    }
+    if (result != (double)value)
+        fflags |= RV_FFLAG_NX;
+    return (rv_uint)result;
+}
+
+template<typename T>
+static T canonical_nan()
+{
+    return std::numeric_limits<T>::quiet_NaN();
+}
+
+template<typename T>
+T rv_fmin(T a, T b, uint32_t& fflags)
+{
+    if (rv_is_snan(a) || rv_is_snan(b))
+        fflags |= RV_FFLAG_NV;
+    if (std::isnan(a) && std::isnan(b))
+        return canonical_nan<T>();
+    if (std::isnan(a))
+        return b;
+    if (std::isnan(b))
+        return a;
+    if (a == b)
+        return std::signbit(a) ? a : b;
+    return a < b ? a : b;
+}
+
+template<typename T>
+T rv_fmax(T a, T b, uint32_t& fflags)
+{
+    if (rv_is_snan(a) || rv_is_snan(b))
+        fflags |= RV_FFLAG_NV;
+    if (std::isnan(a) && std::isnan(b))
+        return canonical_nan<T>();
+    if (std::isnan(a))
+        return b;
+    if (std::isnan(b))
+        return a;
+    if (a == b)
+        return std::signbit(a) ? b : a;
+    return a > b ? a : b;
+}
+
+template<typename T>
+rv_uint rv_feq(T a, T b, uint32_t& fflags)
+{
+    if (std::isnan(a) || std::isnan(b)) {
+        if (rv_is_snan(a) || rv_is_snan(b))
+            fflags |= RV_FFLAG_NV;
+        return 0;
+    }
+    return a == b;
+}
+
+template<typename T>
+rv_uint rv_flt(T a, T b, uint32_t& fflags)
+{
+    if (std::isnan(a) || std::isnan(b)) {
+        fflags |= RV_FFLAG_NV;
+        return 0;
+    }
+    return a < b;
+}
+
+template<typename T>
+rv_uint rv_fle(T a, T b, uint32_t& fflags)
+{
+    if (std::isnan(a) || std::isnan(b)) {
+        fflags |= RV_FFLAG_NV;
+        return 0;
+    }
+    return a <= b;
+}
+
+template<typename T>
+rv_uint rv_fclass(T value)
+{
+    const bool negative = std::signbit(value);
+    switch (std::fpclassify(value)) {
+    case FP_INFINITE: return negative ? 1 << 0 : 1 << 7;
+    case FP_NORMAL: return negative ? 1 << 1 : 1 << 6;
+    case FP_SUBNORMAL: return negative ? 1 << 2 : 1 << 5;
+    case FP_ZERO: return negative ? 1 << 3 : 1 << 4;
+    default: return rv_is_snan(value) ? 1 << 8 : 1 << 9;
+    }
+}
+
+#define RV_FPU_INSTANTIATE(T) \
+    template rv_uint rv_fcvt_w<T>(T, uint32_t, uint32_t&); \
+    template rv_uint rv_fcvt_wu<T>(T, uint32_t, uint32_t&); \
+    template T rv_fmin<T>(T, T, uint32_t&); \
+    template T rv_fmax<T>(T, T, uint32_t&); \
+    template rv_uint rv_feq<T>(T, T, uint32_t&); \
+    template rv_uint rv_flt<T>(T, T, uint32_t&); \
+    template rv_uint rv_fle<T>(T, T, uint32_t&); \
+    template rv_uint rv_fclass<T>(T);
+
+RV_FPU_INSTANTIATE(float)
+RV_FPU_INSTANTIATE(double)
+
+uint32_t rv_host_fflags_take()
+{
+    const int raised = fetestexcept(FE_ALL_EXCEPT);
+    feclearexcept(FE_ALL_EXCEPT);
+
+    uint32_t result = 0;
+    if (raised & FE_INEXACT)
+        result |= RV_FFLAG_NX;
+    if (raised & FE_UNDERFLOW)
+        result |= RV_FFLAG_UF;
+    if (raised & FE_OVERFLOW)
+        result |= RV_FFLAG_OF;
+    if (raised & FE_DIVBYZERO)
+        result |= RV_FFLAG_DZ;
+    if (raised & FE_INVALID)
+        result |= RV_FFLAG_NV;
+    return result;
+}
+
+void rv_host_fflags_clear()
+{
+    feclearexcept(FE_ALL_EXCEPT);
+}
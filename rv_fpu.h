@@ -0,0 +1,129 @@
+#pragma once
+#include <cfloat>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include "rv_global.h"
+
+// rm field / frm csr
+constexpr uint32_t RV_RM_RNE = 0;
+constexpr uint32_t RV_RM_RTZ = 1;
+constexpr uint32_t RV_RM_RDN = 2;
+constexpr uint32_t RV_RM_RUP = 3;
+constexpr uint32_t RV_RM_RMM = 4;
+constexpr uint32_t RV_RM_DYN = 7;
+
+// fflags csr
+constexpr uint32_t RV_FFLAG_NX = 1 << 0;
+constexpr uint32_t RV_FFLAG_UF = 1 << 1;
+constexpr uint32_t RV_FFLAG_OF = 1 << 2;
+constexpr uint32_t RV_FFLAG_DZ = 1 << 3;
+constexpr uint32_t RV_FFLAG_NV = 1 << 4;
+
+constexpr uint32_t RV_CANONICAL_NAN_S = 0x7FC00000;
+constexpr uint64_t RV_CANONICAL_NAN_D = 0x7FF8000000000000ULL;
+
+// f registers are 64bit, single precision values live in the low half
+// with the upper half set to all ones (NaN-boxing)
+inline uint64_t rv_box_bits_s(uint32_t bits) { return 0xFFFFFFFF00000000ULL | bits; }
+
+inline uint32_t rv_unbox_bits_s(uint64_t reg)
+{
+    // anything not properly boxed reads as the canonical NaN
+    return (reg >> 32) == 0xFFFFFFFF ? (uint32_t)reg : RV_CANONICAL_NAN_S;
+}
+
+inline float rv_unbox_s(uint64_t reg)
+{
+    const uint32_t bits = rv_unbox_bits_s(reg);
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+// box an arithmetic result, NaNs are always canonical
+inline uint64_t rv_box_s(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    if (unlikely(value != value))
+        bits = RV_CANONICAL_NAN_S;
+    return rv_box_bits_s(bits);
+}
+
+inline double rv_as_d(uint64_t reg)
+{
+    double value;
+    memcpy(&value, &reg, sizeof(value));
+    return value;
+}
+
+inline uint64_t rv_from_d(double value)
+{
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    if (unlikely(value != value))
+        bits = RV_CANONICAL_NAN_D;
+    return bits;
+}
+
+inline bool rv_is_snan(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return (bits & 0x7F800000) == 0x7F800000 && (bits & 0x007FFFFF) != 0 && (bits & 0x00400000) == 0;
+}
+
+inline bool rv_is_snan(double value)
+{
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return (bits & 0x7FF0000000000000ULL) == 0x7FF0000000000000ULL &&
+           (bits & 0x000FFFFFFFFFFFFFULL) != 0 && (bits & 0x0008000000000000ULL) == 0;
+}
+
+// operations that depend on the rounding mode
+enum class rv_fop
+{
+    add,
+    sub,
+    mul,
+    div,
+    sqrt,
+    madd,
+    msub,
+    nmsub,
+    nmadd
+};
+
+// RMM on doubles is done in long double, which has to have the room for it
+constexpr bool RV_FPU_RMM_D = LDBL_MANT_DIG >= DBL_MANT_DIG + 2;
+
+// arithmetic with the host in the default mode (round to nearest even) is done inline,
+// these switch the host rounding mode for the others
+// there is no host equivalent of RMM, it is done in a wider type and rounded by hand
+float rv_fop_rounded(rv_fop op, float a, float b, float c, uint32_t rm);
+double rv_fop_rounded(rv_fop op, double a, double b, double c, uint32_t rm);
+float rv_fcvt_s_d(double value, uint32_t rm);
+float rv_fcvt_s_w(int32_t value, uint32_t rm);
+float rv_fcvt_s_wu(uint32_t value, uint32_t rm);
+
+// float to integer conversions, saturating as the spec requires, flags are accrued in fflags
+template<typename T> rv_uint rv_fcvt_w(T value, uint32_t rm, uint32_t& fflags);
+template<typename T> rv_uint rv_fcvt_wu(T value, uint32_t rm, uint32_t& fflags);
+
+// RISC-V min/max: a single NaN operand is ignored, -0 < +0
+template<typename T> T rv_fmin(T a, T b, uint32_t& fflags);
+template<typename T> T rv_fmax(T a, T b, uint32_t& fflags);
+
+// comparisons, NaN operands set NV (feq only for signaling ones)
+template<typename T> rv_uint rv_feq(T a, T b, uint32_t& fflags);
+template<typename T> rv_uint rv_flt(T a, T b, uint32_t& fflags);
+template<typename T> rv_uint rv_fle(T a, T b, uint32_t& fflags);
+
+template<typename T> rv_uint rv_fclass(T value);
+
+// exceptions raised by the host since the last call, as fflags bits
+// guest arithmetic accrues them in the host fpu, they're collected when fflags is read
+uint32_t rv_host_fflags_take();
+void rv_host_fflags_clear();
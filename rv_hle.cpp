@@ -0,0 +1,216 @@
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include "rv_hle.h"
+
+static const char* const kFunctionNames[rv_hle::num_functions] = {
+    "memcpy", "memset", "memmove", "strlen", "strcmp", "strncasecmp"
+};
+
+static uint64_t page_end(uint64_t address)
+{
+    return (address | 0xFFF) + 1;
+}
+
+static uint8_t ascii_tolower(uint8_t c)
+{
+    return c >= 'A' && c <= 'Z' ? (uint8_t)(c + ('a' - 'A')) : c;
+}
+
+static int sign(rv_uint value)
+{
+    return (rv_int)value < 0 ? -1 : value != 0 ? 1 : 0;
+}
+
+rv_hle::rv_hle(rv_memory& memory, const elf_loader& loader, const std::vector<std::string>& skip, bool verify)
+    : memory_{memory}, verify_{verify}
+{
+    for (const auto& name : skip) {
+        if (std::find_if(std::begin(kFunctionNames), std::end(kFunctionNames),
+                [&name](const char* function) { return name == function; }) == std::end(kFunctionNames))
+            throw std::runtime_error("no high-level emulation for " + name);
+    }
+
+    for (int i = 0; i < num_functions; ++i) {
+        if (std::find(skip.begin(), skip.end(), kFunctionNames[i]) != skip.end())
+            continue;
+        Elf32_Addr address;
+        if (loader.find_function(kFunctionNames[i], address)) {
+            entries_[i].address = address;
+            entries_[i].enabled = true;
+        }
+    }
+}
+
+size_t rv_hle::function_count() const
+{
+    return (size_t)std::count_if(entries_.begin(), entries_.end(), [](const entry& e) { return e.enabled; });
+}
+
+int rv_hle::lookup(rv_uint pc) const
+{
+    for (int i = 0; i < num_functions; ++i) {
+        if (entries_[i].enabled && entries_[i].address == pc)
+            return i;
+    }
+    return -1;
+}
+
+bool rv_hle::strlen(rv_uint s, rv_uint& result) const
+{
+    // a page at a time, the terminator can be right before an inaccessible one
+    for (uint64_t address = s;; address = page_end(address)) {
+        const size_t len = (size_t)(page_end(address) - address);
+        if (!memory_.check_range((rv_uint)address, len, RV_MEMORY_R))
+            return false;
+        const auto* p = memory_.ram_ptr((rv_uint)address);
+        const auto* found = static_cast<const uint8_t*>(memchr(p, 0, len));
+        if (found != nullptr) {
+            result = (rv_uint)(address - s + (uint64_t)(found - p));
+            return true;
+        }
+    }
+}
+
+bool rv_hle::strncmp(rv_uint s1, rv_uint s2, uint64_t n, bool ignore_case, rv_uint& result) const
+{
+    uint64_t i = 0;
+    while (i < n) {
+        const uint64_t a = (uint64_t)s1 + i;
+        const uint64_t b = (uint64_t)s2 + i;
+        const size_t len = (size_t)std::min({page_end(a) - a, page_end(b) - b, n - i});
+        if (!memory_.check_range((rv_uint)a, len, RV_MEMORY_R) || !memory_.check_range((rv_uint)b, len, RV_MEMORY_R))
+            return false;
+
+        const auto* p = memory_.ram_ptr((rv_uint)a);
+        const auto* q = memory_.ram_ptr((rv_uint)b);
+        for (size_t k = 0; k < len; ++k) {
+            const uint8_t c1 = ignore_case ? ascii_tolower(p[k]) : p[k];
+            const uint8_t c2 = ignore_case ? ascii_tolower(q[k]) : q[k];
+            if (c1 != c2 || c1 == 0) {
+                result = (rv_uint)((int)c1 - (int)c2);
+                return true;
+            }
+        }
+        i += len;
+    }
+    result = 0;
+    return true;
+}
+
+bool rv_hle::run(int function, const rv_uint* args, rv_uint& result)
+{
+    switch (function) {
+    case hle_memcpy:
+    case hle_memmove:
+        if (!memory_.check_range(args[1], args[2], RV_MEMORY_R) || !memory_.check_range(args[0], args[2], RV_MEMORY_W))
+            return false;
+        // memcpy on overlapping buffers is undefined, do what most implementations end up doing
+        memmove(memory_.ram_ptr(args[0]), memory_.ram_ptr(args[1]), args[2]);
+        memory_.host_written(args[0], args[2]);
+        result = args[0];
+        return true;
+
+    case hle_memset:
+        if (!memory_.check_range(args[0], args[2], RV_MEMORY_W))
+            return false;
+        memset(memory_.ram_ptr(args[0]), (uint8_t)args[1], args[2]);
+        memory_.host_written(args[0], args[2]);
+        result = args[0];
+        return true;
+
+    case hle_strlen:
+        return strlen(args[0], result);
+
+    case hle_strcmp:
+        return strncmp(args[0], args[1], UINT64_MAX, false, result);
+
+    case hle_strncasecmp:
+        return strncmp(args[0], args[1], args[2], true, result);
+
+    default:
+        return false;
+    }
+}
+
+bool rv_hle::expect(int function, const rv_uint* args)
+{
+    pending_.function = function;
+    pending_.dest = args[0];
+    pending_.bytes.clear();
+
+    switch (function) {
+    case hle_memcpy:
+    case hle_memmove:
+        if (!memory_.check_range(args[1], args[2], RV_MEMORY_R) || !memory_.check_range(args[0], args[2], RV_MEMORY_W))
+            return false;
+        pending_.bytes.assign(memory_.ram_ptr(args[1]), memory_.ram_ptr(args[1]) + args[2]);
+        pending_.result = args[0];
+        return true;
+
+    case hle_memset:
+        if (!memory_.check_range(args[0], args[2], RV_MEMORY_W))
+            return false;
+        pending_.bytes.assign(args[2], (uint8_t)args[1]);
+        pending_.result = args[0];
+        return true;
+
+    default:
+        // the string functions don't write
+        return run(function, args, pending_.result);
+    }
+}
+
+bool rv_hle::call(int function, rv_uint ra, const rv_uint* args, rv_uint& result)
+{
+    auto& e = entries_[function];
+    e.calls += 1;
+
+    if (verify_) {
+        // called from inside the one being verified (memmove going through memcpy), the outer call covers it
+        if (pending_.ra != 0)
+            return false;
+        if (expect(function, args))
+            pending_.ra = ra & ~1u;
+        else
+            e.fallbacks += 1;
+        return false;
+    }
+
+    if (run(function, args, result))
+        return true;
+    e.fallbacks += 1;
+    return false;
+}
+
+void rv_hle::check(rv_uint result)
+{
+    auto& e = entries_[pending_.function];
+    bool ok;
+    if (pending_.function == hle_strcmp || pending_.function == hle_strncasecmp)
+        ok = sign(result) == sign(pending_.result);
+    else
+        ok = result == pending_.result;
+    if (!pending_.bytes.empty())
+        ok = ok && memcmp(memory_.ram_ptr(pending_.dest), pending_.bytes.data(), pending_.bytes.size()) == 0;
+
+    // the first one of every function is reported, the rest only counted
+    if (!ok && e.mismatches++ == 0) {
+        fprintf(stderr, "[e] error: hle: %s returned 0x%08x, expected 0x%08x (called from 0x%08x)\n",
+            kFunctionNames[pending_.function], result, pending_.result, pending_.ra);
+    }
+    pending_ = pending_call{};
+}
+
+void rv_hle::print_stats(FILE* out) const
+{
+    fprintf(out, "[i] high-level emulation%s\n", verify_ ? ", verified against the guest code" : "");
+    fprintf(out, "[i]   %-12s %10s %10s %10s\n", "function", "calls", "fallbacks", "mismatches");
+    for (int i = 0; i < num_functions; ++i) {
+        const auto& e = entries_[i];
+        if (e.enabled) {
+            fprintf(out, "[i]   %-12s %10llu %10llu %10llu\n", kFunctionNames[i], (unsigned long long)e.calls,
+                (unsigned long long)e.fallbacks, (unsigned long long)e.mismatches);
+        }
+    }
+}
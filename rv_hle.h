@@ -0,0 +1,87 @@
+#pragma once
+#include <array>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "rv_global.h"
+#include "rv_memory.h"
+#include "elfloader.h"
+
+// high-level emulation of hot libc functions: when the guest calls one of them the host
+// does the work against guest memory and returns straight to ra
+// every access is checked against the guest permissions first, if anything is off the
+// guest code runs instead and faults where it would have anyway
+// a call is charged as the instructions of the function's first block
+class rv_hle
+{
+public:
+    enum function
+    {
+        hle_memcpy,
+        hle_memset,
+        hle_memmove,
+        hle_strlen,
+        hle_strcmp,
+        hle_strncasecmp,
+        num_functions
+    };
+
+    rv_hle() = delete;
+    // entry points come from the symbol table, functions named in skip are left to the guest
+    // with verify every call runs the guest code and its result is compared with the host one
+    rv_hle(rv_memory& memory, const elf_loader& loader, const std::vector<std::string>& skip, bool verify);
+
+    rv_hle(const rv_hle&) = delete;
+    rv_hle& operator=(const rv_hle&) = delete;
+
+    // functions found in the executable
+    size_t function_count() const;
+    bool verifying() const { return verify_; }
+
+    // the function entered at pc, -1 if none
+    int lookup(rv_uint pc) const;
+
+    // run function with args (a0..a2), false to run the guest code instead
+    // when verifying, false is returned once the expected result has been computed and
+    // the caller has to stop at ra and hand the guest result to check()
+    bool call(int function, rv_uint ra, const rv_uint* args, rv_uint& result);
+    void check(rv_uint result);
+
+    // the address check() wants to be called at, 0 if none
+    rv_uint pending_return() const { return pending_.ra; }
+
+    // calls, fallbacks and mismatches per function
+    void print_stats(FILE* out) const;
+
+private:
+    bool run(int function, const rv_uint* args, rv_uint& result);
+    bool expect(int function, const rv_uint* args);
+
+    bool strlen(rv_uint s, rv_uint& result) const;
+    bool strncmp(rv_uint s1, rv_uint s2, uint64_t n, bool ignore_case, rv_uint& result) const;
+
+private:
+    struct entry
+    {
+        rv_uint address = 0;
+        bool enabled = false;
+        uint64_t calls = 0;
+        uint64_t fallbacks = 0;
+        uint64_t mismatches = 0;
+    };
+
+    // a call being verified, ra is 0 when there's none
+    struct pending_call
+    {
+        int function = -1;
+        rv_uint ra = 0;
+        rv_uint result = 0;
+        rv_uint dest = 0;
+        std::vector<uint8_t> bytes;
+    };
+
+    rv_memory& memory_;
+    bool verify_;
+    std::array<entry, num_functions> entries_;
+    pending_call pending_;
+};
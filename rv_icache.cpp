@@ -0,0 +1,49 @@
+#include "rv_icache.h"
+
+rv_icache::rv_icache(rv_uint address_space_size)
+{
+    pages_.resize(address_space_size >> page_shift);
+}
+
+rv_block* rv_icache::insert(std::unique_ptr<rv_block> block)
+{
+    const auto pageindex = block->pc >> page_shift;
+    if (pageindex >= pages_.size())
+        return nullptr;
+
+    if (pages_[pageindex] == nullptr) {
+        pages_[pageindex] = std::make_unique<page>();
+        pages_[pageindex]->fill(nullptr);
+    }
+
+    auto* result = block.get();
+    (*pages_[pageindex])[(block->pc & page_mask) >> 1] = result;
+    blocks_.push_back(std::move(block));
+    return result;
+}
+
+void rv_icache::invalidate(rv_uint address, size_t len)
+{
+    if (len == 0)
+        return;
+
+    // the page before may end with an instruction straddling into this one
+    size_t first = address >> page_shift;
+    if (first > 0)
+        first -= 1;
+    const size_t last = ((size_t)address + len - 1) >> page_shift;
+    for (size_t i = first; i <= last && i < pages_.size(); ++i) {
+        if (pages_[i] != nullptr) {
+            flush_pending_ = true;
+            return;
+        }
+    }
+}
+
+void rv_icache::flush()
+{
+    for (auto& page : pages_)
+        page.reset();
+    blocks_.clear();
+    flush_pending_ = false;
+}
@@ -0,0 +1,144 @@
+#pragma once
+#include <array>
+#include <memory>
+#include <vector>
+#include "rv_global.h"
+
+// every operation the translator can emit, each one has a matching
+// "op_<name>" label inside rv_cpu::run
+#define RV_OP_LIST(X) \
+    X(illegal) X(fallthrough) X(nop) \
+    X(ecall) X(ebreak) X(fence_i) \
+    X(csrrw) X(csrrs) X(csrrc) X(csrrwi) X(csrrsi) X(csrrci) \
+    X(lui) X(jal) X(jalr) \
+    X(beq) X(bne) X(blt) X(bge) X(bltu) X(bgeu) \
+    X(lb) X(lh) X(lw) X(lbu) X(lhu) X(sb) X(sh) X(sw) \
+    X(addi) X(slti) X(sltiu) X(xori) X(ori) X(andi) X(slli) X(srli) X(srai) \
+    X(add) X(sub) X(sll) X(slt) X(sltu) X(xor) X(srl) X(sra) X(or) X(and) \
+    X(mul) X(mulh) X(mulhsu) X(mulhu) X(div) X(divu) X(rem) X(remu) \
+    X(lr) X(sc) X(amoswap) X(amoadd) X(amoxor) X(amoand) X(amoor) \
+    X(amomin) X(amomax) X(amominu) X(amomaxu) \
+    X(flw) X(fsw) X(fld) X(fsd) \
+    X(fmadd_s) X(fmsub_s) X(fnmsub_s) X(fnmadd_s) \
+    X(fadd_s) X(fsub_s) X(fmul_s) X(fdiv_s) X(fsqrt_s) \
+    X(fsgnj_s) X(fsgnjn_s) X(fsgnjx_s) X(fmin_s) X(fmax_s) \
+    X(fcvt_w_s) X(fcvt_wu_s) X(fmv_x_w) X(feq_s) X(flt_s) X(fle_s) X(fclass_s) \
+    X(fcvt_s_w) X(fcvt_s_wu) X(fmv_w_x) \
+    X(fmadd_d) X(fmsub_d) X(fnmsub_d) X(fnmadd_d) \
+    X(fadd_d) X(fsub_d) X(fmul_d) X(fdiv_d) X(fsqrt_d) \
+    X(fsgnj_d) X(fsgnjn_d) X(fsgnjx_d) X(fmin_d) X(fmax_d) \
+    X(fcvt_s_d) X(fcvt_d_s) X(feq_d) X(flt_d) X(fle_d) X(fclass_d) \
+    X(fcvt_w_d) X(fcvt_wu_d) X(fcvt_d_w) X(fcvt_d_wu) \
+    X(slli_add) X(lw_addi) \
+    X(hle) \
+    RV_TRACE_OP_LIST(X)
+
+// pseudo ops recording the trace, only in blocks translated while tracing
+#ifdef RISC_666_TRACE
+#define RV_TRACE_OP_LIST(X) \
+    X(trace_start) X(trace_x) X(trace_f) X(trace_end) \
+    X(trace_lb) X(trace_lh) X(trace_lw) X(trace_lbu) X(trace_lhu)
+#else
+#define RV_TRACE_OP_LIST(X)
+#endif
+
+#define RV_OP_ENUM(name) op_##name,
+
+enum class rv_op: uint8_t
+{
+    RV_OP_LIST(RV_OP_ENUM)
+    op_count
+};
+
+// a pre-decoded instruction: register indexes and sign-extended immediates
+// are extracted once, label is the address of the op handler inside rv_cpu::run
+// pc-relative immediates (auipc, jal, branches) are stored as absolute addresses
+// floating point ops keep the rounding mode in imm[2:0] and rs3 in imm[7:3]
+// some common instruction pairs are fused into a single op, see rv_cpu::fuse
+struct rv_insn
+{
+    const void* label;
+    rv_uint pc;
+    rv_int imm;
+    rv_op op;
+    uint8_t rd;
+    uint8_t rs1;
+    uint8_t rs2;
+    uint8_t len;    // 2 for compressed instructions, 4 otherwise, the sum of both for fused pairs
+    uint8_t count;  // guest instructions executed by this op
+#ifdef RISC_666_TRACE
+    // for the trace, filled by rv_cpu::translate
+    uint32_t raw;           // the encoding as fetched
+    uint8_t trace_dest;     // see rv_trace_record::dest
+    uint8_t trace_access;   // 0 no memory access, 1 at rs1 + imm, 2 at rs1 (atomics)
+    uint8_t trace_index;    // position in its block, from 1
+    uint8_t trace_value;    // see rv_trace_format::value_recorded
+#endif
+};
+
+// straight-line guest code up to the next control transfer, the last
+// instruction always leaves the block
+struct rv_block
+{
+    static constexpr size_t max_insns = 64;
+
+    rv_uint pc;
+    uint32_t insn_count;
+
+    // chained successors: [0] jump/branch target, [1] fall-through
+    // a link is only followed if the successor starts at the current pc
+    std::array<rv_block*, 2> links;
+    std::vector<rv_insn> insns;
+
+    // host code generated by rv_jit, once the block gets hot
+    void* native = nullptr;
+    uint32_t exec_count = 0;
+
+#ifdef RISC_666_TRACE
+    // its description in the trace, 0 if it was translated without tracing
+    uint32_t trace_id = 0;
+#endif
+};
+
+// translated block cache, blocks never cross a guest page boundary (except for a
+// trailing 32bit instruction straddling it), any modification to a page holding translated code flushes the whole cache
+// at the next block boundary (RISC-V requires a fence.i for self-modifying code anyway)
+class rv_icache
+{
+public:
+    static constexpr rv_uint page_shift = 12;
+    static constexpr rv_uint page_mask = (1 << page_shift) - 1;
+    static constexpr rv_uint slots_per_page = (1 << page_shift) >> 1;
+
+    rv_icache() = delete;
+    explicit rv_icache(rv_uint address_space_size);
+
+    rv_block* lookup(rv_uint pc) const
+    {
+        const auto pageindex = pc >> page_shift;
+        if (likely(pageindex < pages_.size())) {
+            auto* page = pages_[pageindex].get();
+            if (likely(page != nullptr))
+                return (*page)[(pc & page_mask) >> 1];
+        }
+        return nullptr;
+    }
+
+    // take ownership of a freshly translated block, nullptr if pc is out of range
+    rv_block* insert(std::unique_ptr<rv_block> block);
+
+    // request a flush if [address, address+len) contains translated code
+    void invalidate(rv_uint address, size_t len);
+
+    bool flush_pending() const { return flush_pending_; }
+
+    // drop every translated block, must not be called while a block is executing
+    void flush();
+
+private:
+    using page = std::array<rv_block*, slots_per_page>;
+
+    std::vector<std::unique_ptr<page>> pages_;
+    std::vector<std::unique_ptr<rv_block>> blocks_;
+    bool flush_pending_ = false;
+};
@@ -0,0 +1,589 @@
+#include <cstring>
+#include <cstddef>
+#include <stdexcept>
+#include <sys/mman.h>
+#include "rv_jit.h"
+#include "rv_memory.h"
+
+#if defined(__x86_64__) && defined(RISC_666_LINUX)
+#define RV_JIT_X64 1
+#endif
+
+// host registers
+constexpr uint8_t X64_EAX = 0;
+constexpr uint8_t X64_ECX = 1;
+constexpr uint8_t X64_EDX = 2;
+
+// condition codes, as used by jcc/setcc
+constexpr uint8_t X64_CC_B = 0x2;
+constexpr uint8_t X64_CC_AE = 0x3;
+constexpr uint8_t X64_CC_E = 0x4;
+constexpr uint8_t X64_CC_NE = 0x5;
+constexpr uint8_t X64_CC_A = 0x7;
+constexpr uint8_t X64_CC_L = 0xC;
+constexpr uint8_t X64_CC_GE = 0xD;
+constexpr uint8_t X64_CC_LE = 0xE;
+
+// /ext field of the 0x81 group
+constexpr uint8_t X64_ALU_ADD = 0;
+constexpr uint8_t X64_ALU_OR = 1;
+constexpr uint8_t X64_ALU_AND = 4;
+constexpr uint8_t X64_ALU_XOR = 6;
+constexpr uint8_t X64_ALU_CMP = 7;
+
+// worst case size of a compiled block, including exit stubs and link slots
+constexpr size_t kMaxBlockCode = 16 * 1024;
+
+constexpr uint8_t kCtxPc = offsetof(rv_jit_context, pc);
+constexpr uint8_t kCtxLinkSlot = offsetof(rv_jit_context, link_slot);
+
+bool rv_jit::supported()
+{
+#ifdef RV_JIT_X64
+    return true;
+#else
+    return false;
+#endif
+}
+
+rv_jit::rv_jit(size_t code_size)
+    : size_{code_size}
+{
+#ifdef RV_JIT_X64
+    void* mem = mmap(nullptr, size_, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        throw std::runtime_error("mmap() failed for the JIT code buffer");
+    }
+    code_ = reinterpret_cast<uint8_t*>(mem);
+
+    // uint32_t enter(rv_jit_context* ctx, const void* block)
+    // rbx = guest registers, r12 = guest ram, r13 = mpu, r14 = cycle budget, r15 = ctx
+    static const uint8_t prologue[] = {
+        0x53,                               // push rbx
+        0x55,                               // push rbp
+        0x41, 0x54,                         // push r12
+        0x41, 0x55,                         // push r13
+        0x41, 0x56,                         // push r14
+        0x41, 0x57,                         // push r15
+        0x48, 0x83, 0xEC, 0x08,             // sub rsp, 8
+        0x49, 0x89, 0xFF,                   // mov r15, rdi
+        0x49, 0x8B, 0x5F, offsetof(rv_jit_context, regs),     // mov rbx, [r15+regs]
+        0x4D, 0x8B, 0x67, offsetof(rv_jit_context, ram),      // mov r12, [r15+ram]
+        0x4D, 0x8B, 0x6F, offsetof(rv_jit_context, mpu),      // mov r13, [r15+mpu]
+        0x4D, 0x8B, 0x77, offsetof(rv_jit_context, budget),   // mov r14, [r15+budget]
+        0xFF, 0xD6,                         // call rsi
+        0x4D, 0x89, 0x77, offsetof(rv_jit_context, budget),   // mov [r15+budget], r14
+        0x48, 0x83, 0xC4, 0x08,             // add rsp, 8
+        0x41, 0x5F,                         // pop r15
+        0x41, 0x5E,                         // pop r14
+        0x41, 0x5D,                         // pop r13
+        0x41, 0x5C,                         // pop r12
+        0x5D,                               // pop rbp
+        0x5B,                               // pop rbx
+        0xC3                                // ret
+    };
+    memcpy(code_, prologue, sizeof(prologue));
+    entry_end_ = pos_ = sizeof(prologue);
+#endif
+}
+
+rv_jit::~rv_jit()
+{
+    if (code_ != nullptr)
+        munmap(code_, size_);
+}
+
+void rv_jit::reset()
+{
+    pos_ = entry_end_;
+}
+
+rv_jit::exit_status rv_jit::execute(const rv_block& block, rv_jit_context& ctx)
+{
+    using entry_fn = uint32_t (*)(rv_jit_context*, const void*);
+    auto enter = reinterpret_cast<entry_fn>(code_);
+    return static_cast<exit_status>(enter(&ctx, block.native));
+}
+
+void rv_jit::emit32(uint32_t v)
+{
+    memcpy(code_ + pos_, &v, sizeof(v));
+    pos_ += sizeof(v);
+}
+
+void rv_jit::emit64(uint64_t v)
+{
+    memcpy(code_ + pos_, &v, sizeof(v));
+    pos_ += sizeof(v);
+}
+
+void rv_jit::emit_reg_mem(uint8_t opcode, uint8_t hostreg, uint8_t guestreg)
+{
+    // opcode hostreg, [rbx + guestreg*4]
+    const uint32_t disp = guestreg * sizeof(rv_uint);
+    emit8(opcode);
+    if (disp < 0x80) {
+        emit8(0x40 | (hostreg << 3) | 3);
+        emit8((uint8_t)disp);
+    }
+    else {
+        emit8(0x80 | (hostreg << 3) | 3);
+        emit32(disp);
+    }
+}
+
+void rv_jit::emit_alu_imm(uint8_t ext, uint8_t hostreg, rv_int imm)
+{
+    emit8(0x81);
+    emit8(0xC0 | (ext << 3) | hostreg);
+    emit32((uint32_t)imm);
+}
+
+void rv_jit::emit_setcc_store(uint8_t cc, uint8_t rd)
+{
+    emit8(0x0F); emit8(0x90 | cc); emit8(0xC0);     // setcc al
+    emit8(0x0F); emit8(0xB6); emit8(0xC0);          // movzx eax, al
+    emit_store_guest(rd, X64_EAX);
+}
+
+size_t rv_jit::emit_jcc32(uint8_t cc)
+{
+    emit8(0x0F);
+    emit8(0x80 | cc);
+    emit32(0);
+    return pos_ - 4;
+}
+
+size_t rv_jit::emit_jcc8(uint8_t cc)
+{
+    emit8(0x70 | cc);
+    emit8(0);
+    return pos_ - 1;
+}
+
+void rv_jit::patch32(size_t at, size_t target)
+{
+    const int32_t rel = (int32_t)((int64_t)target - (int64_t)(at + 4));
+    memcpy(code_ + at, &rel, sizeof(rel));
+}
+
+void rv_jit::patch8(size_t at)
+{
+    code_[at] = (uint8_t)(int8_t)(pos_ - (at + 1));
+}
+
+void rv_jit::emit_address(const rv_insn& insn, uint32_t size, uint8_t mask, uint8_t want, rv_uint ram_end)
+{
+    // eax = regs[rs1] + imm
+    emit_load_guest(X64_EAX, insn.rs1);
+    if (insn.imm != 0)
+        emit_alu_imm(X64_ALU_ADD, X64_EAX, insn.imm);
+
+#ifdef RISC_666_HOST_MMU
+    // the host enforces the permissions, just leave the pc for the fault handler
+    (void)size; (void)mask; (void)want; (void)ram_end;
+    emit8(0x41); emit8(0xC7); emit8(0x47); emit8(kCtxPc); emit32(insn.pc);    // mov dword [r15+pc], pc
+#else
+    // same checks as rv_memory::read/write, a failed check goes back to the interpreter
+
+    emit8(0x3D); emit32(ram_end - size);                             // cmp eax, ram_end - size
+    interp_exits_[num_interp_exits_++] = {emit_jcc32(X64_CC_A), insn.pc, 0};
+
+    emit8(0x89); emit8(0xC1);                                       // mov ecx, eax
+    emit8(0xC1); emit8(0xE9); emit8(0x0C);                          // shr ecx, 12
+    emit8(0x41); emit8(0x0F); emit8(0xB6); emit8(0x4C); emit8(0x0D); emit8(0x00);   // movzx ecx, byte [r13+rcx]
+    emit8(0x83); emit8(0xE1); emit8(mask);                          // and ecx, mask
+    emit8(0x83); emit8(0xF9); emit8(want);                          // cmp ecx, want
+    interp_exits_[num_interp_exits_++] = {emit_jcc32(X64_CC_NE), insn.pc, 0};
+#endif
+}
+
+void rv_jit::emit_direct_exit(rv_uint target)
+{
+    // leave when the budget is exhausted, otherwise jump through the link slot
+    // slots initially point to their exit stub, emitted after the block
+    emit8(0x4D); emit8(0x85); emit8(0xF6);                          // test r14, r14
+    const size_t jle_at = emit_jcc32(X64_CC_LE);
+    emit8(0xFF); emit8(0x25); emit32(0);                            // jmp [rip+slot]
+    direct_exits_[num_direct_exits_++] = {jle_at, pos_ - 4, target};
+}
+
+void rv_jit::emit_indirect_exit()
+{
+    // eax holds the next pc
+    emit8(0x41); emit8(0x89); emit8(0x47); emit8(kCtxPc);           // mov [r15+pc], eax
+    emit8(0x49); emit8(0xC7); emit8(0x47); emit8(kCtxLinkSlot); emit32(0);  // mov qword [r15+link_slot], 0
+    emit8(0x31); emit8(0xC0);                                       // xor eax, eax
+    emit8(0xC3);                                                    // ret
+}
+
+bool rv_jit::emit_insn(const rv_insn& insn, rv_uint ram_end)
+{
+    switch (insn.op) {
+    case rv_op::op_nop:
+        break;
+
+    case rv_op::op_fallthrough:
+        emit_direct_exit(insn.pc);
+        break;
+
+    case rv_op::op_lui:
+        emit_reg_mem(0xC7, 0, insn.rd);                             // mov dword [rd], imm
+        emit32((uint32_t)insn.imm);
+        break;
+
+    case rv_op::op_jal:
+        emit_reg_mem(0xC7, 0, insn.rd);
+        emit32(insn.pc + insn.len);
+        emit_direct_exit((rv_uint)insn.imm);
+        break;
+
+    case rv_op::op_jalr:
+        // rd can be the same as rs1
+        emit_load_guest(X64_EAX, insn.rs1);
+        if (insn.imm != 0)
+            emit_alu_imm(X64_ALU_ADD, X64_EAX, insn.imm);
+        emit8(0x83); emit8(0xE0); emit8(0xFE);                      // and eax, ~1
+        emit_reg_mem(0xC7, 0, insn.rd);
+        emit32(insn.pc + insn.len);
+        emit_indirect_exit();
+        break;
+
+    case rv_op::op_beq:
+    case rv_op::op_bne:
+    case rv_op::op_blt:
+    case rv_op::op_bge:
+    case rv_op::op_bltu:
+    case rv_op::op_bgeu:
+    {
+        static const uint8_t conds[] = { X64_CC_E, X64_CC_NE, X64_CC_L, X64_CC_GE, X64_CC_B, X64_CC_AE };
+        const auto cc = conds[(size_t)insn.op - (size_t)rv_op::op_beq];
+        emit_load_guest(X64_EAX, insn.rs1);
+        emit_reg_mem(0x3B, X64_EAX, insn.rs2);                      // cmp eax, [rs2]
+        const size_t taken = emit_jcc32(cc);
+        emit_direct_exit(insn.pc + insn.len);
+        patch32(taken);
+        emit_direct_exit((rv_uint)insn.imm);
+    }
+        break;
+
+    case rv_op::op_lb:
+    case rv_op::op_lbu:
+        emit_address(insn, 1, RV_MEMORY_R, RV_MEMORY_R, ram_end);
+        emit8(0x41); emit8(0x0F); emit8(insn.op == rv_op::op_lb ? 0xBE : 0xB6); emit8(0x14); emit8(0x04);
+        emit_store_guest(insn.rd, X64_EDX);
+        break;
+
+    case rv_op::op_lh:
+    case rv_op::op_lhu:
+        emit_address(insn, 2, RV_MEMORY_R, RV_MEMORY_R, ram_end);
+        emit8(0x41); emit8(0x0F); emit8(insn.op == rv_op::op_lh ? 0xBF : 0xB7); emit8(0x14); emit8(0x04);
+        emit_store_guest(insn.rd, X64_EDX);
+        break;
+
+    case rv_op::op_lw:
+        emit_address(insn, 4, RV_MEMORY_R, RV_MEMORY_R, ram_end);
+        emit8(0x41); emit8(0x8B); emit8(0x14); emit8(0x04);         // mov edx, [r12+rax]
+        emit_store_guest(insn.rd, X64_EDX);
+        break;
+
+    // without the host MMU, stores to executable pages go through the interpreter to invalidate translated code
+    case rv_op::op_sb:
+        emit_address(insn, 1, RV_MEMORY_W | RV_MEMORY_X, RV_MEMORY_W, ram_end);
+        emit_load_guest(X64_EDX, insn.rs2);
+        emit8(0x41); emit8(0x88); emit8(0x14); emit8(0x04);         // mov [r12+rax], dl
+        break;
+
+    case rv_op::op_sh:
+        emit_address(insn, 2, RV_MEMORY_W | RV_MEMORY_X, RV_MEMORY_W, ram_end);
+        emit_load_guest(X64_EDX, insn.rs2);
+        emit8(0x66); emit8(0x41); emit8(0x89); emit8(0x14); emit8(0x04);    // mov [r12+rax], dx
+        break;
+
+    case rv_op::op_sw:
+        emit_address(insn, 4, RV_MEMORY_W | RV_MEMORY_X, RV_MEMORY_W, ram_end);
+        emit_load_guest(X64_EDX, insn.rs2);
+        emit8(0x41); emit8(0x89); emit8(0x14); emit8(0x04);         // mov [r12+rax], edx
+        break;
+
+    case rv_op::op_lw_addi:
+    {
+        rv_insn load = insn;
+        load.imm = (rv_int)((rv_uint)insn.imm << 20) >> 20;
+        emit_address(load, 4, RV_MEMORY_R, RV_MEMORY_R, ram_end);
+        emit8(0x41); emit8(0x8B); emit8(0x14); emit8(0x04);         // mov edx, [r12+rax]
+        emit8(0x81); emit8(0xC2); emit32((uint32_t)(insn.imm >> 12));   // add edx, imm
+        emit_store_guest(insn.rd, X64_EDX);
+    }
+        break;
+
+    case rv_op::op_slli_add:
+        emit_load_guest(X64_EAX, insn.rs1);
+        emit8(0xC1); emit8(0xE0); emit8((uint8_t)(insn.imm & 0x1F));  // shl eax, shamt
+        emit_store_guest((uint8_t)(insn.imm >> 8), X64_EAX);
+        emit_reg_mem(0x03, X64_EAX, insn.rs2);                      // add eax, [rs2]
+        emit_store_guest(insn.rd, X64_EAX);
+        break;
+
+    case rv_op::op_addi:
+    case rv_op::op_xori:
+    case rv_op::op_ori:
+    case rv_op::op_andi:
+    {
+        uint8_t ext = X64_ALU_ADD;
+        if (insn.op == rv_op::op_xori)
+            ext = X64_ALU_XOR;
+        else if (insn.op == rv_op::op_ori)
+            ext = X64_ALU_OR;
+        else if (insn.op == rv_op::op_andi)
+            ext = X64_ALU_AND;
+        emit_load_guest(X64_EAX, insn.rs1);
+        emit_alu_imm(ext, X64_EAX, insn.imm);
+        emit_store_guest(insn.rd, X64_EAX);
+    }
+        break;
+
+    case rv_op::op_slti:
+    case rv_op::op_sltiu:
+        emit_load_guest(X64_EAX, insn.rs1);
+        emit_alu_imm(X64_ALU_CMP, X64_EAX, insn.imm);
+        emit_setcc_store(insn.op == rv_op::op_slti ? X64_CC_L : X64_CC_B, insn.rd);
+        break;
+
+    case rv_op::op_slli:
+    case rv_op::op_srli:
+    case rv_op::op_srai:
+    {
+        // shl /4, shr /5, sar /7
+        const uint8_t ext = insn.op == rv_op::op_slli ? 4 : insn.op == rv_op::op_srli ? 5 : 7;
+        emit_load_guest(X64_EAX, insn.rs1);
+        emit8(0xC1); emit8(0xC0 | (ext << 3)); emit8((uint8_t)insn.imm);
+        emit_store_guest(insn.rd, X64_EAX);
+    }
+        break;
+
+    case rv_op::op_add:
+    case rv_op::op_sub:
+    case rv_op::op_xor:
+    case rv_op::op_or:
+    case rv_op::op_and:
+    {
+        uint8_t opcode = 0x03;
+        if (insn.op == rv_op::op_sub)
+            opcode = 0x2B;
+        else if (insn.op == rv_op::op_xor)
+            opcode = 0x33;
+        else if (insn.op == rv_op::op_or)
+            opcode = 0x0B;
+        else if (insn.op == rv_op::op_and)
+            opcode = 0x23;
+        emit_load_guest(X64_EAX, insn.rs1);
+        emit_reg_mem(opcode, X64_EAX, insn.rs2);
+        emit_store_guest(insn.rd, X64_EAX);
+    }
+        break;
+
+    case rv_op::op_sll:
+    case rv_op::op_srl:
+    case rv_op::op_sra:
+    {
+        // x86 masks the shift amount to 5 bits, same as RISC-V
+        const uint8_t ext = insn.op == rv_op::op_sll ? 4 : insn.op == rv_op::op_srl ? 5 : 7;
+        emit_load_guest(X64_ECX, insn.rs2);
+        emit_load_guest(X64_EAX, insn.rs1);
+        emit8(0xD3); emit8(0xC0 | (ext << 3));
+        emit_store_guest(insn.rd, X64_EAX);
+    }
+        break;
+
+    case rv_op::op_slt:
+    case rv_op::op_sltu:
+        emit_load_guest(X64_EAX, insn.rs1);
+        emit_reg_mem(0x3B, X64_EAX, insn.rs2);
+        emit_setcc_store(insn.op == rv_op::op_slt ? X64_CC_L : X64_CC_B, insn.rd);
+        break;
+
+    case rv_op::op_mul:
+        emit_load_guest(X64_EAX, insn.rs1);
+        emit8(0x0F); emit_reg_mem(0xAF, X64_EAX, insn.rs2);        // imul eax, [rs2]
+        emit_store_guest(insn.rd, X64_EAX);
+        break;
+
+    case rv_op::op_mulh:
+    case rv_op::op_mulhsu:
+    case rv_op::op_mulhu:
+        // 64bit product, sign or zero extending each operand
+        if (insn.op == rv_op::op_mulhu) {
+            emit_load_guest(X64_EAX, insn.rs1);
+        }
+        else {
+            emit8(0x48); emit_reg_mem(0x63, X64_EAX, insn.rs1);    // movsxd rax, [rs1]
+        }
+        if (insn.op == rv_op::op_mulh) {
+            emit8(0x48); emit_reg_mem(0x63, X64_ECX, insn.rs2);    // movsxd rcx, [rs2]
+        }
+        else {
+            emit_load_guest(X64_ECX, insn.rs2);
+        }
+        emit8(0x48); emit8(0x0F); emit8(0xAF); emit8(0xC1);         // imul rax, rcx
+        emit8(0x48); emit8(0xC1); emit8(0xE8); emit8(0x20);         // shr rax, 32
+        emit_store_guest(insn.rd, X64_EAX);
+        break;
+
+    case rv_op::op_div:
+    case rv_op::op_rem:
+    {
+        const bool rem = insn.op == rv_op::op_rem;
+        emit_load_guest(X64_EAX, insn.rs1);
+        emit_load_guest(X64_ECX, insn.rs2);
+        emit8(0x85); emit8(0xC9);                                   // test ecx, ecx
+        const size_t by_zero = emit_jcc8(X64_CC_E);
+        emit8(0x83); emit8(0xF9); emit8(0xFF);                      // cmp ecx, -1
+        const size_t not_minus_one = emit_jcc8(X64_CC_NE);
+        // x / -1 = -x (0x80000000 stays as it is), x % -1 = 0, no overflow trap
+        if (rem) {
+            emit8(0x31); emit8(0xD2);                               // xor edx, edx
+        }
+        else {
+            emit8(0xF7); emit8(0xD8);                               // neg eax
+        }
+        emit8(0xEB); emit8(0);                                      // jmp done
+        const size_t minus_one_done = pos_ - 1;
+        patch8(not_minus_one);
+        emit8(0x99);                                                // cdq
+        emit8(0xF7); emit8(0xF9);                                   // idiv ecx
+        emit8(0xEB); emit8(0);                                      // jmp done
+        const size_t div_done = pos_ - 1;
+        patch8(by_zero);
+        if (rem) {
+            emit8(0x89); emit8(0xC2);                               // mov edx, eax
+        }
+        else {
+            emit8(0xB8); emit32(0xFFFFFFFF);                        // mov eax, -1
+        }
+        patch8(minus_one_done);
+        patch8(div_done);
+        emit_store_guest(insn.rd, rem ? X64_EDX : X64_EAX);
+    }
+        break;
+
+    case rv_op::op_divu:
+    case rv_op::op_remu:
+    {
+        const bool rem = insn.op == rv_op::op_remu;
+        emit_load_guest(X64_EAX, insn.rs1);
+        emit_load_guest(X64_ECX, insn.rs2);
+        emit8(0x85); emit8(0xC9);                                   // test ecx, ecx
+        const size_t by_zero = emit_jcc8(X64_CC_E);
+        emit8(0x31); emit8(0xD2);                                   // xor edx, edx
+        emit8(0xF7); emit8(0xF1);                                   // div ecx
+        emit8(0xEB); emit8(0);                                      // jmp done
+        const size_t div_done = pos_ - 1;
+        patch8(by_zero);
+        if (rem) {
+            emit8(0x89); emit8(0xC2);                               // mov edx, eax
+        }
+        else {
+            emit8(0xB8); emit32(0xFFFFFFFF);                        // mov eax, -1
+        }
+        patch8(div_done);
+        emit_store_guest(insn.rd, rem ? X64_EDX : X64_EAX);
+    }
+        break;
+
+    default:
+        // traps, syscalls, csr and atomics are left to the interpreter
+        return false;
+    }
+    return true;
+}
+
+bool rv_jit::compile(rv_block& block, rv_uint ram_end)
+{
+    if (!supported())
+        return true;
+    if (size_ - pos_ < kMaxBlockCode)
+        return false;
+
+    const size_t start = pos_;
+    num_interp_exits_ = 0;
+    num_direct_exits_ = 0;
+
+    // sub r14, <compiled instructions>, patched at the end
+    emit8(0x49); emit8(0x81); emit8(0xEE); emit32(0);
+    const size_t budget_at = pos_ - 4;
+
+    // guest instructions compiled, and the first op left to the interpreter
+    uint32_t count = 0;
+    size_t next = 0;
+    bool block_end = false;
+    for (; next < block.insns.size(); ++next) {
+        const auto& insn = block.insns[next];
+        const size_t insn_start = pos_;
+        const size_t saved_exits = num_interp_exits_;
+        if (!emit_insn(insn, ram_end)) {
+            pos_ = insn_start;
+            num_interp_exits_ = saved_exits;
+            break;
+        }
+        for (size_t i = saved_exits; i < num_interp_exits_; ++i)
+            interp_exits_[i].before = count;
+        count += insn.count;
+        if (num_direct_exits_ != 0 || insn.op == rv_op::op_jalr) {
+            block_end = true;
+            break;
+        }
+    }
+
+    if (count == 0) {
+        // nothing worth compiling, leave it to the interpreter
+        pos_ = start;
+        return true;
+    }
+    memcpy(code_ + budget_at, &count, sizeof(count));
+
+    // stopped on something we can't compile, continue in the interpreter
+    if (!block_end) {
+        emit8(0x41); emit8(0xC7); emit8(0x47); emit8(kCtxPc);
+        emit32(block.insns[next].pc);                               // mov dword [r15+pc], pc
+        emit8(0xB8); emit32((uint32_t)exit_status::interpret);      // mov eax, interpret
+        emit8(0xC3);                                                // ret
+    }
+
+    // the interpreter charges the instructions from pc onwards again, give them back
+    for (size_t i = 0; i < num_interp_exits_; ++i) {
+        patch32(interp_exits_[i].at);
+        emit8(0x49); emit8(0x81); emit8(0xC6);
+        emit32(count - interp_exits_[i].before);                    // add r14, <not executed>
+        emit8(0x41); emit8(0xC7); emit8(0x47); emit8(kCtxPc);
+        emit32(interp_exits_[i].pc);                                // mov dword [r15+pc], pc
+        emit8(0xB8); emit32((uint32_t)exit_status::interpret);      // mov eax, interpret
+        emit8(0xC3);                                                // ret
+    }
+
+    size_t stubs[2];
+    size_t leas[2];
+    for (size_t i = 0; i < num_direct_exits_; ++i) {
+        stubs[i] = pos_;
+        patch32(direct_exits_[i].jle_at);
+        emit8(0x41); emit8(0xC7); emit8(0x47); emit8(kCtxPc);
+        emit32(direct_exits_[i].target);                            // mov dword [r15+pc], target
+        emit8(0x48); emit8(0x8D); emit8(0x05); emit32(0);           // lea rax, [rip+slot]
+        leas[i] = pos_ - 4;
+        emit8(0x49); emit8(0x89); emit8(0x47); emit8(kCtxLinkSlot); // mov [r15+link_slot], rax
+        emit8(0x31); emit8(0xC0);                                   // xor eax, eax
+        emit8(0xC3);                                                // ret
+    }
+
+    // link slots, 8 bytes aligned
+    while ((pos_ & 7) != 0)
+        emit8(0xCC);
+    for (size_t i = 0; i < num_direct_exits_; ++i) {
+        patch32(direct_exits_[i].jmp_at, pos_);
+        patch32(leas[i], pos_);
+        emit64((uint64_t)(uintptr_t)(code_ + stubs[i]));
+    }
+
+    block.native = code_ + start;
+    return true;
+}
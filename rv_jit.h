@@ -0,0 +1,101 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include "rv_global.h"
+#include "rv_icache.h"
+
+// state shared between rv_cpu and the generated code
+struct rv_jit_context
+{
+    rv_uint* regs;
+    uint8_t* ram;
+    const uint8_t* mpu;
+    int64_t budget;
+
+    // exit slot to patch once the next block is compiled, nullptr for indirect jumps
+    void** link_slot;
+    rv_uint pc;
+    rv_uint ram_end;
+};
+
+// x86-64 code generator for hot translated blocks
+// guest registers stay in rv_cpu::regs_ (rbx points to them), memory accesses
+// are emitted inline against rv_memory's ram and mpu, anything the generated code
+// does not handle (traps, syscalls, csr, atomics, writes to code) goes back to the interpreter
+class rv_jit
+{
+public:
+    // a block is compiled after being entered this many times
+    static constexpr uint32_t hot_threshold = 32;
+
+    enum class exit_status: uint32_t
+    {
+        next_block = 0,     // pc is the next block to execute
+        interpret = 1       // pc must be executed by the interpreter
+    };
+
+    static bool supported();
+
+    explicit rv_jit(size_t code_size = 32_MiB);
+    ~rv_jit();
+
+    rv_jit(const rv_jit&) = delete;
+    rv_jit& operator=(const rv_jit&) = delete;
+
+    // compile block, false if the code buffer is full (the caller must flush every block)
+    bool compile(rv_block& block, rv_uint ram_end);
+
+    exit_status execute(const rv_block& block, rv_jit_context& ctx);
+
+    // make an exit slot jump straight into a compiled block
+    void link(void** slot, const rv_block& target) { *slot = target.native; }
+
+    // drop all generated code, all the blocks referencing it must be gone
+    void reset();
+
+private:
+    struct label_patch
+    {
+        size_t at;
+        rv_uint pc;
+        uint32_t before;    // guest instructions compiled ahead of it
+    };
+
+    void emit8(uint8_t v) { code_[pos_++] = v; }
+    void emit32(uint32_t v);
+    void emit64(uint64_t v);
+    void emit_reg_mem(uint8_t opcode, uint8_t hostreg, uint8_t guestreg);
+    void emit_load_guest(uint8_t hostreg, uint8_t guestreg) { emit_reg_mem(0x8B, hostreg, guestreg); }
+    void emit_store_guest(uint8_t guestreg, uint8_t hostreg) { emit_reg_mem(0x89, hostreg, guestreg); }
+    void emit_alu_imm(uint8_t ext, uint8_t hostreg, rv_int imm);
+    void emit_setcc_store(uint8_t cc, uint8_t rd);
+    void emit_address(const rv_insn& insn, uint32_t size, uint8_t mask, uint8_t want, rv_uint ram_end);
+    size_t emit_jcc32(uint8_t cc);
+    size_t emit_jcc8(uint8_t cc);
+    void patch32(size_t at) { patch32(at, pos_); }
+    void patch32(size_t at, size_t target);
+    void patch8(size_t at);
+    void emit_direct_exit(rv_uint target);
+    void emit_indirect_exit();
+    bool emit_insn(const rv_insn& insn, rv_uint ram_end);
+
+private:
+    uint8_t* code_ = nullptr;
+    size_t size_ = 0;
+    size_t pos_ = 0;
+    size_t entry_end_ = 0;
+
+    // out of line "back to the interpreter" stubs of the block being compiled
+    label_patch interp_exits_[rv_block::max_insns * 2];
+    size_t num_interp_exits_ = 0;
+
+    // direct exits waiting for their link slot
+    struct direct_exit
+    {
+        size_t jle_at;
+        size_t jmp_at;
+        rv_uint target;
+    };
+    direct_exit direct_exits_[2];
+    size_t num_direct_exits_ = 0;
+};
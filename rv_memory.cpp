@@ -1,16 +1,102 @@
 #include <cstring>
+#include <algorithm>
 #include <cassert>
 #include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#ifdef RISC_666_HOST_MMU
+#include <mutex>
+#include <signal.h>
+#include <ucontext.h>
+#endif
 #include "rv_exceptions.h"
 #include "rv_memory.h"
+#include "rv_icache.h"
+#include "rv_snapshot.h"
 
 constexpr rv_uint RV_STACK_SIZE = 4*1024*1024;
 
+#ifdef RISC_666_HOST_MMU
+// the whole 32bit guest address space, plus one page for accesses straddling the end of it
+constexpr size_t RV_HOST_RESERVE = (1ULL << 32) + 0x1000;
+
+// the memory instance running on this thread and where to go on a guest fault
+static thread_local rv_memory* g_fault_memory = nullptr;
+static thread_local sigjmp_buf* g_fault_recovery = nullptr;
+
+static void host_fault_handler(int sig, siginfo_t* info, void* context)
+{
+    bool is_write = false;
+#if defined(__x86_64__)
+    // page fault error code, bit 1 is set for writes
+    is_write = (reinterpret_cast<ucontext_t*>(context)->uc_mcontext.gregs[REG_ERR] & 2) != 0;
+#else
+    (void)context;
+#endif
+
+    auto result = rv_memory::host_fault::not_guest;
+    if (g_fault_memory != nullptr)
+        result = g_fault_memory->handle_host_fault(info->si_addr, is_write);
+
+    if (result == rv_memory::host_fault::retry)
+        return;
+    if (result == rv_memory::host_fault::guest_exception && g_fault_recovery != nullptr)
+        siglongjmp(*g_fault_recovery, 1);
+
+    // a genuine crash, let it happen
+    signal(sig, SIG_DFL);
+}
+
+static int host_protection(uint8_t prot)
+{
+    // executable pages must be readable on the host, the translator fetches through ram_
+    int result = PROT_NONE;
+    if ((prot & RV_MEMORY_RX) != 0)
+        result |= PROT_READ;
+    if ((prot & RV_MEMORY_W) != 0)
+        result |= PROT_READ | PROT_WRITE;
+    return result;
+}
+#endif
+
 rv_memory::rv_memory(rv_uint ram_size)
 {
-    ram_ = new uint8_t[ram_size]();
+#ifdef RISC_666_HOST_MMU
+    if (sysconf(_SC_PAGESIZE) != 0x1000)
+        throw std::runtime_error("host MMU backend requires 4KiB host pages");
+
+    // nothing is accessible until protect_region, and nothing is committed until touched
+    void* mem = mmap(nullptr, RV_HOST_RESERVE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED)
+        throw std::runtime_error("unable to reserve guest address space");
+    ram_ = reinterpret_cast<uint8_t*>(mem);
+    mapped_size_ = RV_HOST_RESERVE;
+    write_protected_.resize(ram_size >> 12, false);
+
+    // process-wide, the guest being served is looked up per thread
+    static std::once_flag handler_installed;
+    std::call_once(handler_installed, []() {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = host_fault_handler;
+        // we leave the handler with siglongjmp, keep SIGSEGV unblocked
+        sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGSEGV, &sa, nullptr);
+        sigaction(SIGBUS, &sa, nullptr);
+    });
+#else
+    // zero filled and only committed as the guest touches it
+    void* mem = mmap(nullptr, ram_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED)
+        throw std::runtime_error("unable to allocate guest memory");
+    ram_ = reinterpret_cast<uint8_t*>(mem);
+    mapped_size_ = ram_size;
+#endif
     ram_begin_ = 0;
     ram_end_ = ram_size;
+    brk_limit_ = ram_size;
 
     // reserve ram_size/4096 "entries" in our mpu
     mpu_.resize(ram_size >> 12);
@@ -19,7 +105,68 @@ rv_memory::rv_memory(rv_uint ram_size)
 
 rv_memory::~rv_memory()
 {
-    delete [] ram_;
+#ifdef RISC_666_HOST_MMU
+    if (g_fault_memory == this)
+        disarm_fault_handler();
+#endif
+    munmap(ram_, mapped_size_);
+}
+
+void rv_memory::advise_huge_pages()
+{
+#ifdef MADV_HUGEPAGE
+    // pages with different guest permissions split them again on the host, the heap and the mappings stay whole
+    madvise(ram_, ram_end_, MADV_HUGEPAGE);
+#endif
+}
+
+size_t rv_memory::committed_bytes() const
+{
+    const size_t pages = ram_end_ >> 12;
+    size_t count = 0;
+#ifdef RISC_666_OSX
+    std::vector<char> resident(pages);
+    if (mincore(ram_, ram_end_, resident.data()) != 0)
+        return 0;
+    for (const auto page : resident) {
+        // written copies of file pages count, the page cache doesn't
+        if ((page & MINCORE_INCORE) != 0 && (page & (MINCORE_ANONYMOUS | MINCORE_COPIED)) != 0)
+            count += 1;
+    }
+#else
+    // not mincore(): files mapped by the host (elf segments, mmaps, snapshot ram) would count
+    // as soon as they are in the page cache, pagemap tells private copies from them
+    // only pages this process has to itself count, not the zero page or what a fork server shares
+    const int fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return 0;
+    constexpr uint64_t exclusive = 1ULL << 56;
+    constexpr uint64_t file = 1ULL << 61;
+    constexpr uint64_t swapped = 1ULL << 62;
+    constexpr uint64_t present = 1ULL << 63;
+    std::vector<uint64_t> entries(4096);
+    const off_t first = (off_t)(reinterpret_cast<uintptr_t>(ram_) >> 12) * (off_t)sizeof(uint64_t);
+    for (size_t page = 0; page < pages; page += entries.size()) {
+        const size_t n = std::min(entries.size(), pages - page);
+        const size_t len = n * sizeof(uint64_t);
+        if (pread(fd, entries.data(), len, first + (off_t)(page * sizeof(uint64_t))) != (ssize_t)len) {
+            close(fd);
+            return 0;
+        }
+        for (size_t i = 0; i < n; ++i) {
+            const uint64_t entry = entries[i];
+            if ((entry & file) == 0 && ((entry & (present | exclusive)) == (present | exclusive) || (entry & swapped) != 0))
+                count += 1;
+        }
+    }
+    close(fd);
+#endif
+    return count << 12;
+}
+
+size_t rv_memory::peak_committed_bytes() const
+{
+    return std::max(peak_committed_, committed_bytes());
 }
 
 void rv_memory::set_region(rv_uint address, const uint8_t *data, size_t len)
@@ -27,8 +174,22 @@ void rv_memory::set_region(rv_uint address, const uint8_t *data, size_t len)
     assert(address <= (ram_end_-len));
     assert(data != nullptr);
 
+#ifdef RISC_666_HOST_MMU
+    // this is the loader writing, not the guest: lift the protection for the copy
+    if (len != 0) {
+        const size_t begin = address & ~0xFFFULL;
+        const size_t end = ((size_t)address + len + 0xFFF) & ~0xFFFULL;
+        mprotect(ram_ + begin, end - begin, PROT_READ | PROT_WRITE);
+    }
+#endif
+
     // fill region with provided data
     memcpy(ram_+address, data, len);
+
+#ifdef RISC_666_HOST_MMU
+    apply_host_protection(address, len);
+#endif
+    code_modified(address, len);
 }
 
 void rv_memory::protect_region(rv_uint address, size_t len, uint8_t prot)
@@ -42,12 +203,239 @@ void rv_memory::protect_region(rv_uint address, size_t len, uint8_t prot)
 
     auto npages = len >> 12;
     auto pageindex = address >> 12;
-    std::fill(mpu_.begin()+pageindex, mpu_.begin()+pageindex+npages+1, prot);
+    auto lastpage = std::min<size_t>(pageindex+npages+1, mpu_.size());
+    std::fill(mpu_.begin()+pageindex, mpu_.begin()+lastpage, prot);
+#ifdef RISC_666_HOST_MMU
+    apply_host_protection(pageindex << 12, (lastpage - pageindex) << 12);
+#endif
+    code_modified(address, len);
+}
+
+bool rv_memory::map_region(rv_uint address, size_t len, uint8_t prot, int host_fd, off_t offset, bool shared)
+{
+    assert((address & 0xFFF) == 0 && (len & 0xFFF) == 0 && address <= ram_end_ - len);
+
+#ifdef RISC_666_HOST_MMU
+    // replaces whatever was there, a fresh anonymous mapping is zero filled
+    int flags = MAP_FIXED;
+    if (host_fd == -1)
+        flags |= MAP_PRIVATE | MAP_ANONYMOUS;
+    else
+        flags |= shared ? MAP_SHARED : MAP_PRIVATE;
+    host_writing(address, len);
+    if (mmap(ram_ + address, len, host_protection(prot), flags, host_fd, host_fd == -1 ? 0 : offset) == MAP_FAILED)
+        return false;
+#else
+    (void)shared;
+    memset(ram_ + address, 0, len);
+    if (host_fd != -1) {
+        size_t done = 0;
+        while (done < len) {
+            const ssize_t res = pread(host_fd, ram_ + address + done, len - done, offset + (off_t)done);
+            if (res < 0)
+                return false;
+            // past the end of the file reads as zero
+            if (res == 0)
+                break;
+            done += (size_t)res;
+        }
+    }
+#endif
+    std::fill(mpu_.begin() + (address >> 12), mpu_.begin() + ((address + len) >> 12), prot);
+    code_modified(address, len);
+    return true;
+}
+
+void rv_memory::release_region(rv_uint address, size_t len)
+{
+    assert((address & 0xFFF) == 0 && (len & 0xFFF) == 0 && address <= ram_end_ - len);
+
+    // the only place guest memory is given back, the peak is right before it
+    peak_committed_ = peak_committed_bytes();
+
+#ifdef RISC_666_HOST_MMU
+    // not madvise(MADV_DONTNEED): on file mappings (including ram restored from a snapshot)
+    // it brings back the file contents instead of zeros, a new anonymous mapping drops the
+    // host pages either way
+    void* mem = mmap(ram_ + address, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE,
+        -1, 0);
+    if (mem == MAP_FAILED)
+        throw std::runtime_error("unable to release guest memory");
+    std::fill(write_protected_.begin() + (address >> 12), write_protected_.begin() + ((address + len) >> 12), false);
+#else
+    // plain anonymous memory, snapshots are read into it
+    madvise(ram_ + address, len, MADV_DONTNEED);
+#endif
+    std::fill(mpu_.begin() + (address >> 12), mpu_.begin() + ((address + len) >> 12), RV_MEMORY_RW);
+    code_modified(address, len);
+}
+
+void rv_memory::code_modified(rv_uint address, size_t len)
+{
+    if (icache_ != nullptr)
+        icache_->invalidate(address, len);
+}
+
+void rv_memory::code_translated(rv_uint address)
+{
+#ifdef RISC_666_HOST_MMU
+    // guest writes are not checked anymore, let the host tell us about them
+    const auto pageindex = address >> 12;
+    if (pageindex < mpu_.size() && (mpu_[pageindex] & RV_MEMORY_W) != 0 && !write_protected_[pageindex]) {
+        mprotect(ram_ + ((size_t)pageindex << 12), 0x1000, PROT_READ);
+        write_protected_[pageindex] = true;
+    }
+#else
+    (void)address;
+#endif
+}
+
+#ifdef RISC_666_HOST_MMU
+void rv_memory::apply_host_protection(rv_uint address, size_t len)
+{
+    if (len == 0)
+        return;
+
+    // one mprotect per run of pages with the same permissions
+    size_t page = address >> 12;
+    const size_t last = std::min<size_t>(((size_t)address + len - 1) >> 12, mpu_.size() - 1);
+    while (page <= last) {
+        size_t run_end = page + 1;
+        while (run_end <= last && mpu_[run_end] == mpu_[page])
+            run_end += 1;
+        mprotect(ram_ + (page << 12), (run_end - page) << 12, host_protection(mpu_[page]));
+        std::fill(write_protected_.begin()+page, write_protected_.begin()+run_end, false);
+        page = run_end;
+    }
+}
+
+void rv_memory::unprotect_code(rv_uint address, size_t len)
+{
+    if (len == 0)
+        return;
+
+    const size_t last = std::min<size_t>(((size_t)address + len - 1) >> 12, mpu_.size() - 1);
+    for (size_t page = address >> 12; page <= last; ++page) {
+        if (write_protected_[page]) {
+            write_protected_[page] = false;
+            mprotect(ram_ + (page << 12), 0x1000, host_protection(mpu_[page]));
+            code_modified((rv_uint)(page << 12), 0x1000);
+        }
+    }
+}
+
+void rv_memory::arm_fault_handler(sigjmp_buf* recovery)
+{
+    g_fault_memory = this;
+    g_fault_recovery = recovery;
+}
+
+void rv_memory::disarm_fault_handler()
+{
+    g_fault_memory = nullptr;
+    g_fault_recovery = nullptr;
+}
+
+rv_memory::host_fault rv_memory::handle_host_fault(const void* host_address, bool is_write)
+{
+    const auto* ptr = reinterpret_cast<const uint8_t*>(host_address);
+    if (ptr < ram_ || ptr >= ram_ + mapped_size_)
+        return host_fault::not_guest;
+
+    const size_t offset = (size_t)(ptr - ram_);
+    const size_t pageindex = offset >> 12;
+
+    // first write to a page with translated code: drop the translations and let the write through
+    if (pageindex < mpu_.size() && write_protected_[pageindex]) {
+        write_protected_[pageindex] = false;
+        mprotect(ram_ + (pageindex << 12), 0x1000, host_protection(mpu_[pageindex]));
+        code_modified((rv_uint)(pageindex << 12), 0x1000);
+        return host_fault::retry;
+    }
+
+    fault_address_ = (rv_uint)offset;
+    last_exception_ = is_write ? rv_exception::store_access_fault : rv_exception::load_access_fault;
+    return host_fault::guest_exception;
+}
+#endif
+
+void rv_memory::save_state(rv_snapshot_writer& snapshot) const
+{
+    snapshot.put(ram_begin_);
+    snapshot.put(ram_end_);
+    snapshot.put(stack_begin_);
+    snapshot.put(stack_end_);
+    snapshot.put(stack_pointer_);
+    snapshot.put(brk_);
+    snapshot.put_vector(mpu_);
+}
+
+void rv_memory::restore_state(rv_snapshot_reader& snapshot)
+{
+    ram_begin_ = snapshot.get<rv_uint>();
+    if (snapshot.get<rv_uint>() != ram_end_)
+        throw std::runtime_error("snapshot ram size mismatch");
+    stack_begin_ = snapshot.get<rv_uint>();
+    stack_end_ = snapshot.get<rv_uint>();
+    stack_pointer_ = snapshot.get<rv_uint>();
+    brk_ = snapshot.get<rv_uint>();
+    snapshot.get_vector(mpu_);
+    if (mpu_.size() != (ram_end_ >> 12))
+        throw std::runtime_error("corrupted snapshot");
+}
+
+void rv_memory::save_ram(rv_snapshot_writer& snapshot) const
+{
+    static const uint8_t zero_page[0x1000] = {};
+
+    // inaccessible pages are never written by the guest, unreadable on the host with RISC_666_HOST_MMU
+    snapshot.begin_ram();
+    for (size_t page = 0; page < mpu_.size(); ++page) {
+        const uint8_t *data = ram_ + (page << 12);
+        if (mpu_[page] == 0 || memcmp(data, zero_page, sizeof(zero_page)) == 0)
+            snapshot.skip(0x1000);
+        else
+            snapshot.write(data, 0x1000);
+    }
+}
+
+void rv_memory::restore_ram(const rv_snapshot_reader& snapshot)
+{
+    const off_t offset = (off_t)snapshot.header().ram_offset;
+#ifdef RISC_666_HOST_MMU
+    // private file mapping: pages are read on first touch and copied on first write
+    void* mem = mmap(ram_, ram_end_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, snapshot.fd(), offset);
+    if (mem == MAP_FAILED)
+        throw std::runtime_error("unable to map snapshot ram");
+    apply_host_protection(0, ram_end_);
+#else
+    // ram is still untouched, reading the holes in the file would commit all of it
+    size_t done = 0;
+    while (done < ram_end_) {
+        size_t end = ram_end_;
+#ifdef SEEK_DATA
+        const off_t data = lseek(snapshot.fd(), offset + (off_t)done, SEEK_DATA);
+        if (data == -1)
+            break;
+        const off_t hole = lseek(snapshot.fd(), data, SEEK_HOLE);
+        done = std::min<size_t>((size_t)(data - offset), ram_end_);
+        if (hole != -1)
+            end = std::min<size_t>((size_t)(hole - offset), ram_end_);
+#endif
+        while (done < end) {
+            const ssize_t res = pread(snapshot.fd(), ram_ + done, end - done, offset + (off_t)done);
+            if (res <= 0)
+                throw std::runtime_error("truncated snapshot");
+            done += (size_t)res;
+        }
+    }
+#endif
+    code_modified(0, ram_end_);
 }
 
 bool rv_memory::set_brk(rv_uint offset)
 {
-    if (offset > ram_end_ || offset < stack_begin_)
+    if (offset > brk_limit_ || offset < stack_begin_)
         return false;
     brk_ = offset;
     return true;
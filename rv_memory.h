@@ -1,6 +1,13 @@
 #pragma once
+#include <algorithm>
+#include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <vector>
+#include <sys/types.h>
+#ifdef RISC_666_HOST_MMU
+#include <setjmp.h>
+#endif
 #include "rv_global.h"
 #include "rv_bits.h"
 #include "rv_exceptions.h"
@@ -13,6 +20,15 @@ constexpr auto RV_MEMORY_RW = RV_MEMORY_R | RV_MEMORY_W;
 constexpr auto RV_MEMORY_RX = RV_MEMORY_R | RV_MEMORY_X;
 constexpr auto RV_MEMORY_RWX = RV_MEMORY_R | RV_MEMORY_W | RV_MEMORY_X;
 
+class rv_icache;
+class rv_snapshot_writer;
+class rv_snapshot_reader;
+
+// with RISC_666_HOST_MMU the whole 4GiB guest address space is reserved on the host and
+// RV_MEMORY_* permissions are applied with mprotect, loads and stores are plain host accesses
+// and a violation raises SIGSEGV, turned into a guest exception by the fault handler
+// pages holding translated code are kept read-only on the host, the first write to them
+// invalidates the translation cache and lifts the protection
 class rv_memory
 {
 public:
@@ -38,8 +54,30 @@ public:
         return false;
     }
 
+    // fetch a 16 or 32bit instruction, the upper half can be on the next page
+    bool fetch_insn(rv_uint address, uint32_t& insn) const
+    {
+        uint16_t lo;
+        if (!fetch(address, lo))
+            return false;
+        insn = lo;
+        if ((lo & 3) != 3)
+            return true;
+
+        uint16_t hi;
+        if (!fetch(address + 2, hi))
+            return false;
+        insn |= (uint32_t)hi << 16;
+        return true;
+    }
+
     template<typename T> bool read(rv_uint address, T& value) const
     {
+#ifdef RISC_666_HOST_MMU
+        // a fault never returns here
+        value = *(T *)(ram_ + address);
+        return true;
+#else
         if (address <= (ram_end_ - sizeof(T)) && ((mpu_[address >> 12] & RV_MEMORY_R) == RV_MEMORY_R)) {
             value = *(T *)(ram_ + address);
             return true;
@@ -47,22 +85,114 @@ public:
         fault_address_ = address;
         last_exception_ = rv_exception::load_access_fault;
         return false;
+#endif
     }
 
     template<typename T> bool write(rv_uint address, T value)
     {
-        if (address <= (ram_end_ - sizeof(T)) && ((mpu_[address >> 12] & RV_MEMORY_W) == RV_MEMORY_W)) {
-            *(T *)(ram_ + address) = value;
-            return true;
+#ifdef RISC_666_HOST_MMU
+        *(T *)(ram_ + address) = value;
+        return true;
+#else
+        if (address <= (ram_end_ - sizeof(T))) {
+            const uint8_t prot = mpu_[address >> 12];
+            if ((prot & RV_MEMORY_W) == RV_MEMORY_W) {
+                *(T *)(ram_ + address) = value;
+
+                // writing to an executable page, drop any decoded instruction there
+                if (unlikely((prot & RV_MEMORY_X) == RV_MEMORY_X))
+                    code_modified(address, sizeof(T));
+                return true;
+            }
         }
         fault_address_ = address;
         last_exception_ = rv_exception::store_access_fault;
         return false;
+#endif
+    }
+
+    // [address, address+len) is inside ram and every page in it has prot
+    bool check_range(rv_uint address, size_t len, uint8_t prot) const
+    {
+        if ((uint64_t)address + len > ram_end_)
+            return false;
+        if (len == 0)
+            return true;
+        for (size_t page = address >> 12; page <= ((uint64_t)address + len - 1) >> 12; ++page) {
+            if ((mpu_[page] & prot) != prot)
+                return false;
+        }
+        return true;
+    }
+
+    // a NUL terminated string at address is inside ram and readable
+    bool check_string(rv_uint address) const
+    {
+        for (uint64_t start = address; start < ram_end_; start = (start | 0xFFF) + 1) {
+            if ((mpu_[start >> 12] & RV_MEMORY_R) != RV_MEMORY_R)
+                return false;
+            const uint64_t end = std::min<uint64_t>((start | 0xFFF) + 1, ram_end_);
+            if (memchr(ram_ + start, 0, end - start) != nullptr)
+                return true;
+        }
+        return false;
+    }
+
+    // the kernel is about to write to [address, address+len) through ram_ptr, on behalf of
+    // the guest: its writes never fault, pages with translated code get their protection
+    // back (and lose the translations) ahead of them
+    void host_writing(rv_uint address, size_t len)
+    {
+#ifdef RISC_666_HOST_MMU
+        unprotect_code(address, len);
+#else
+        (void)address;
+        (void)len;
+#endif
+    }
+
+    // the host wrote to [address, address+len) through ram_ptr, on behalf of the guest
+    void host_written(rv_uint address, size_t len)
+    {
+#ifdef RISC_666_HOST_MMU
+        // pages with translated code are write-protected on the host, the write was noticed
+        // already, or host_writing() made way for it
+        (void)address;
+        (void)len;
+#else
+        // like write(), only executable pages can hold decoded instructions
+        for (size_t page = address >> 12; len != 0 && page <= ((uint64_t)address + len - 1) >> 12; ++page) {
+            if ((mpu_[page] & RV_MEMORY_X) == RV_MEMORY_X) {
+                code_modified(address, len);
+                return;
+            }
+        }
+#endif
     }
 
     bool set_brk(rv_uint offset);
     rv_uint brk() const { return brk_; }
 
+    // the program break can't grow past the lowest mapping made by rv_vma
+    rv_uint brk_limit() const { return brk_limit_; }
+    void set_brk_limit(rv_uint limit) { brk_limit_ = limit; }
+
+    // page aligned [address, address+len) becomes a fresh mapping with prot: zero filled if
+    // host_fd is -1, the file contents from offset otherwise (mapped by the host with
+    // RISC_666_HOST_MMU, copied in without), false if the host refuses
+    bool map_region(rv_uint address, size_t len, uint8_t prot, int host_fd, off_t offset, bool shared);
+
+    // back to free ram: read/write, zero filled and no longer committed on the host
+    void release_region(rv_uint address, size_t len);
+
+    // ask the host for transparent huge pages, fewer TLB misses for a larger footprint
+    void advise_huge_pages();
+
+    // guest ram the host holds for this guest alone, and the most it has ever been:
+    // pages of host-mapped files only count once the guest writes to them
+    size_t committed_bytes() const;
+    size_t peak_committed_bytes() const;
+
     constexpr rv_uint stack_size() const { return (rv_uint)4_MiB; }
 
     rv_uint stack_begin() const { return stack_begin_; }
@@ -73,9 +203,48 @@ public:
     rv_uint ram_begin() const { return ram_begin_; }
     rv_uint ram_end() const { return ram_end_; }
     uint8_t* ram_ptr(rv_uint offset) { return ram_+offset; }
+    const uint8_t* mpu_ptr() const { return mpu_.data(); }
     rv_uint target_ptr(uint8_t *_ram_ptr) const { return (rv_uint)(_ram_ptr - ram_); }
 
     void prepare_environment(int argc, char *argv[], int optind);
+
+    // layout, permissions and program break, see rv_snapshot.h
+    void save_state(rv_snapshot_writer& snapshot) const;
+    void restore_state(rv_snapshot_reader& snapshot);
+
+    // the ram contents, at the end of the snapshot: restore maps them copy-on-write
+    void save_ram(rv_snapshot_writer& snapshot) const;
+    void restore_ram(const rv_snapshot_reader& snapshot);
+
+    // the decoded instruction cache to invalidate on code modification
+    void attach_icache(rv_icache* icache) { icache_ = icache; }
+
+    // code at address has been translated, writes to its page must be noticed
+    void code_translated(rv_uint address);
+
+#ifdef RISC_666_HOST_MMU
+    // host faults on guest memory from this thread jump to recovery (guest exception already set)
+    void arm_fault_handler(sigjmp_buf* recovery);
+    void disarm_fault_handler();
+
+    enum class host_fault
+    {
+        not_guest,
+        retry,
+        guest_exception
+    };
+    host_fault handle_host_fault(const void* host_address, bool is_write);
+#endif
+
+private:
+    void code_modified(rv_uint address, size_t len);
+#ifdef RISC_666_HOST_MMU
+    // apply mpu_ permissions to the host pages in [address, address+len)
+    void apply_host_protection(rv_uint address, size_t len);
+    // drops the write protection code_translated() put on pages in [address, address+len)
+    void unprotect_code(rv_uint address, size_t len);
+#endif
+
 private:
     uint8_t *ram_;
     rv_uint ram_begin_;
@@ -84,7 +253,18 @@ private:
     rv_uint stack_end_;
     rv_uint stack_pointer_;
     rv_uint brk_;
+    rv_uint brk_limit_;
     std::vector<uint8_t> mpu_;
+    rv_icache* icache_ = nullptr;
+
+    // host mapping behind ram_, the whole guest address space with RISC_666_HOST_MMU
+    size_t mapped_size_ = 0;
+    size_t peak_committed_ = 0;
+#ifdef RISC_666_HOST_MMU
+
+    // RW guest pages currently read-only on the host because they hold translated code
+    std::vector<bool> write_protected_;
+#endif
 
     mutable rv_uint fault_address_ = 0;
     mutable rv_exception last_exception_;
@@ -0,0 +1,184 @@
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <errno.h>
+#include "rv_mixer.h"
+#include "rv_snapshot.h"
+
+// frames mixed at a time, the accumulator lives on the stack
+constexpr size_t kChunkFrames = 256;
+
+rv_uint rv_mixer::add_sound(rv_uint address, rv_uint len, rv_uint rate)
+{
+    if (len == 0 || rate == 0 || rate > 0xFFFF)
+        return (rv_uint)-EINVAL;
+    if (!memory_.check_range(address, len, RV_MEMORY_R))
+        return (rv_uint)-EFAULT;
+
+    std::lock_guard<std::mutex> lock(lock_);
+    if (sounds_.size() >= max_sounds)
+        return (rv_uint)-ENOMEM;
+    sounds_.push_back(sound{address, len, rate});
+    return (rv_uint)(sounds_.size() - 1);
+}
+
+size_t rv_mixer::find(rv_uint handle) const
+{
+    for (size_t i = 0; i < channels_.size(); ++i) {
+        if (handle != 0 && channels_[i].handle == handle)
+            return i;
+    }
+    return channels_.size();
+}
+
+void rv_mixer::set_volume(channel& ch, rv_uint volume, rv_uint separation)
+{
+    // the stereo law of the original DooM mixer, the farther side fades with separation squared
+    const int32_t vol = (int32_t)volume;
+    int32_t sep = (int32_t)separation + 1;
+    const int32_t left = vol - ((vol*sep*sep) >> 16);
+    sep -= 257;
+    const int32_t right = vol - ((vol*sep*sep) >> 16);
+
+    // a full scale sample at full volume is a full scale 16bit one
+    ch.left = left * 256 / 127;
+    ch.right = right * 256 / 127;
+}
+
+rv_uint rv_mixer::start(rv_uint sound, rv_uint volume, rv_uint separation, rv_uint pitch)
+{
+    if (volume > 127 || separation > 255 || pitch > 255)
+        return (rv_uint)-EINVAL;
+
+    std::lock_guard<std::mutex> lock(lock_);
+    if (sound >= sounds_.size())
+        return (rv_uint)-EINVAL;
+
+    // a free channel, or the one that started first
+    channel* target = &channels_[0];
+    for (auto& ch : channels_) {
+        if (ch.handle == 0) {
+            target = &ch;
+            break;
+        }
+        if (ch.handle < target->handle)
+            target = &ch;
+    }
+
+    const double speed = std::pow(2.0, ((double)pitch - normal_pitch) / 64.0);
+    target->handle = next_handle_;
+    target->sound = sound;
+    target->position = 0;
+    target->step = std::max<uint32_t>(1, (uint32_t)((double)sounds_[sound].rate * 65536.0 * speed / output_rate));
+    set_volume(*target, volume, separation);
+
+    // handles stay positive for the guest
+    next_handle_ = next_handle_ < 0x7FFFFFFF ? next_handle_ + 1 : 1;
+    return target->handle;
+}
+
+rv_uint rv_mixer::stop(rv_uint handle)
+{
+    std::lock_guard<std::mutex> lock(lock_);
+    const size_t i = find(handle);
+    if (i < channels_.size())
+        channels_[i].handle = 0;
+    return 0;
+}
+
+rv_uint rv_mixer::update(rv_uint handle, rv_uint volume, rv_uint separation)
+{
+    if (volume > 127 || separation > 255)
+        return (rv_uint)-EINVAL;
+
+    std::lock_guard<std::mutex> lock(lock_);
+    const size_t i = find(handle);
+    if (i < channels_.size())
+        set_volume(channels_[i], volume, separation);
+    return 0;
+}
+
+rv_uint rv_mixer::playing(rv_uint handle) const
+{
+    std::lock_guard<std::mutex> lock(lock_);
+    return find(handle) < channels_.size() ? 1 : 0;
+}
+
+void rv_mixer::mix(int16_t* out, size_t frames)
+{
+    int32_t acc[kChunkFrames*2];
+
+    std::lock_guard<std::mutex> lock(lock_);
+    while (frames != 0) {
+        const size_t n = std::min(frames, kChunkFrames);
+        if (out != nullptr)
+            std::fill(acc, acc + n*2, 0);
+
+        for (auto& ch : channels_) {
+            if (ch.handle == 0)
+                continue;
+
+            // frames until the end of the sound, the inner loop needs no bounds check
+            const auto& s = sounds_[ch.sound];
+            const uint64_t end = (uint64_t)s.len << 16;
+            const uint64_t remaining = (end - ch.position + ch.step - 1) / ch.step;
+            const size_t count = (size_t)std::min<uint64_t>(n, remaining);
+
+            if (out != nullptr) {
+                const uint8_t* samples = memory_.ram_ptr(s.address);
+                const int32_t left = ch.left;
+                const int32_t right = ch.right;
+                uint64_t position = ch.position;
+                for (size_t i = 0; i < count; ++i) {
+                    const int32_t value = (int32_t)samples[position >> 16] - 128;
+                    acc[2*i] += value*left;
+                    acc[2*i + 1] += value*right;
+                    position += ch.step;
+                }
+            }
+            ch.position += (uint64_t)count*ch.step;
+            if (ch.position >= end)
+                ch.handle = 0;
+        }
+        if (music_ != nullptr)
+            music_->render(out != nullptr ? acc : nullptr, n);
+
+        if (out != nullptr) {
+            for (size_t i = 0; i < n*2; ++i)
+                out[i] = (int16_t)std::min(std::max(acc[i], -32768), 32767);
+            out += n*2;
+        }
+        frames -= n;
+    }
+}
+
+void rv_mixer::save_state(rv_snapshot_writer& snapshot) const
+{
+    std::lock_guard<std::mutex> lock(lock_);
+    snapshot.put<uint64_t>(sounds_.size());
+    for (const auto& s : sounds_) {
+        snapshot.put(s.address);
+        snapshot.put(s.len);
+        snapshot.put(s.rate);
+    }
+}
+
+void rv_mixer::restore_state(rv_snapshot_reader& snapshot)
+{
+    std::lock_guard<std::mutex> lock(lock_);
+    const auto count = snapshot.get<uint64_t>();
+    if (count > max_sounds)
+        throw std::runtime_error("corrupted snapshot");
+
+    sounds_.clear();
+    for (uint64_t i = 0; i < count; ++i) {
+        sound s;
+        s.address = snapshot.get<rv_uint>();
+        s.len = snapshot.get<rv_uint>();
+        s.rate = snapshot.get<rv_uint>();
+        if (s.len == 0 || s.rate == 0 || (uint64_t)s.address + s.len > memory_.ram_end())
+            throw std::runtime_error("corrupted snapshot");
+        sounds_.push_back(s);
+    }
+    channels_.fill(channel{});
+}
@@ -0,0 +1,84 @@
+#pragma once
+#include <array>
+#include <mutex>
+#include <vector>
+#include "rv_global.h"
+#include "rv_memory.h"
+#include "rv_music.h"
+
+class rv_snapshot_writer;
+class rv_snapshot_reader;
+
+// sound effects mixed on the host for the av_sound_* syscalls
+// a sound is registered once and stays where the guest has it: 8bit unsigned mono samples
+// read straight from guest ram while mixing, so it must not be freed or changed afterwards
+// mix() runs wherever the backend wants the samples (the SDL audio thread, or the guest
+// clock when headless), everything else is called on behalf of the guest
+// the music, when attached, is added on top of the sound effects
+class rv_mixer
+{
+public:
+    static constexpr int output_rate = 44100;
+    static constexpr size_t num_channels = 16;
+    static constexpr size_t max_sounds = 4096;
+
+    // pitch at which a sound plays at its own rate, one octave every 64 steps
+    static constexpr rv_uint normal_pitch = 128;
+
+    rv_mixer() = delete;
+    explicit rv_mixer(rv_memory& memory) : memory_{memory} {}
+
+    rv_mixer(const rv_mixer&) = delete;
+    rv_mixer& operator=(const rv_mixer&) = delete;
+
+    // all of these return like the syscalls, the result or -errno
+    // volume is 0..127, separation 0 (left) .. 255 (right) with 128 centered
+    rv_uint add_sound(rv_uint address, rv_uint len, rv_uint rate);
+    // a handle for the playing sound, once all channels are busy the oldest one is dropped
+    rv_uint start(rv_uint sound, rv_uint volume, rv_uint separation, rv_uint pitch);
+    rv_uint stop(rv_uint handle);
+    rv_uint update(rv_uint handle, rv_uint volume, rv_uint separation);
+    // 1 while playing, 0 once done or stopped
+    rv_uint playing(rv_uint handle) const;
+
+    void attach_music(rv_music* music) { music_ = music; }
+
+    // frames of interleaved 16bit stereo at output_rate, a nullptr out only advances the channels
+    void mix(int16_t* out, size_t frames);
+
+    // the registered sounds, what was playing is cut short by a restore
+    void save_state(rv_snapshot_writer& snapshot) const;
+    void restore_state(rv_snapshot_reader& snapshot);
+
+private:
+    struct sound
+    {
+        rv_uint address;
+        rv_uint len;
+        rv_uint rate;
+    };
+
+    struct channel
+    {
+        rv_uint handle;     // 0 when free
+        rv_uint sound;
+        uint64_t position;  // in samples, 16.16 fixed point
+        uint32_t step;
+        int32_t left;
+        int32_t right;
+    };
+
+    // the channel playing handle, num_channels if none
+    size_t find(rv_uint handle) const;
+    static void set_volume(channel& ch, rv_uint volume, rv_uint separation);
+
+private:
+    rv_memory& memory_;
+    rv_music* music_ = nullptr;
+
+    // taken by mix() for a whole chunk, and by every guest call
+    mutable std::mutex lock_;
+    std::vector<sound> sounds_;
+    std::array<channel, num_channels> channels_{};
+    rv_uint next_handle_ = 1;
+};
@@ -0,0 +1,586 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <errno.h>
+#include "rv_music.h"
+#include "rv_snapshot.h"
+
+// MUS time runs at 140 ticks per second
+constexpr int kTickRate = 140;
+
+constexpr char kGenmidiMagic[8] = {'#', 'O', 'P', 'L', '_', 'I', 'I', '#'};
+constexpr size_t kGenmidiInstruments = 175;
+constexpr size_t kGenmidiInstrumentSize = 36;
+
+// instruments 128.. are the percussion, played by note on MUS channel 15
+constexpr uint8_t kPercussionChannel = 15;
+constexpr uint8_t kFirstPercussion = 35;
+constexpr uint8_t kLastPercussion = 81;
+
+constexpr uint16_t kFixedPitch = 0x0001;
+
+// frames rendered at a time on the stack, and ahead of the audio callback by the thread
+constexpr size_t kChunkFrames = 256;
+constexpr size_t kThreadBlock = 512;
+constexpr size_t kRingFrames = 2048;
+
+// a channel at full level is a quarter of the 16bit range, a few of them together fill it
+constexpr float kOutputScale = 8192.0f;
+
+// events processed in one tick at most, a looping score without delays must not hang the mixer
+constexpr int kMaxEventsPerTick = 1024;
+
+static uint16_t get16(const uint8_t* p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+// the operator registers of an OPL channel, the carrier is 3 after the modulator
+static uint8_t modulator_offset(size_t v)
+{
+    return (uint8_t)((v / 3) * 8 + v % 3);
+}
+
+rv_music::rv_music(int sample_rate)
+    : opl_{sample_rate}, samples_per_tick_{sample_rate / kTickRate}
+{
+    opl_.write(0x01, 0x20);
+}
+
+rv_music::~rv_music()
+{
+    stop_thread();
+}
+
+bool rv_music::parse_instruments(const uint8_t* data, size_t len, std::vector<instrument>& instruments)
+{
+    if (len < sizeof(kGenmidiMagic) + kGenmidiInstruments*kGenmidiInstrumentSize ||
+        memcmp(data, kGenmidiMagic, sizeof(kGenmidiMagic)) != 0)
+        return false;
+
+    instruments.resize(kGenmidiInstruments);
+    const uint8_t* p = data + sizeof(kGenmidiMagic);
+    for (auto& instr : instruments) {
+        instr.flags = get16(p);
+        instr.fine_tune = p[2];
+        instr.fixed_note = p[3];
+        for (size_t i = 0; i < 2; ++i) {
+            const uint8_t* v = p + 4 + i*16;
+            auto& voice = instr.voice[i];
+            memcpy(voice.modulator, v, 6);
+            voice.feedback = v[6];
+            memcpy(voice.carrier, v + 7, 6);
+            voice.unused = v[13];
+            voice.note_offset = (int16_t)get16(v + 14);
+        }
+        p += kGenmidiInstrumentSize;
+    }
+    return true;
+}
+
+bool rv_music::parse_song(song& s)
+{
+    // "MUS" 0x1a, score length, score start, then channel and instrument counts
+    if (s.data.size() < 16 || memcmp(s.data.data(), "MUS\x1a", 4) != 0)
+        return false;
+    const uint32_t length = get16(&s.data[4]);
+    const uint32_t start = get16(&s.data[6]);
+    if (start >= s.data.size())
+        return false;
+    s.score_start = start;
+    s.score_end = (uint32_t)std::min<size_t>(s.data.size(), (size_t)start + length);
+    return true;
+}
+
+rv_uint rv_music::set_instruments(const uint8_t* data, size_t len)
+{
+    std::vector<instrument> instruments;
+    if (!parse_instruments(data, len, instruments))
+        return (rv_uint)-EINVAL;
+
+    std::lock_guard<std::mutex> lock(lock_);
+    all_notes_off();
+    instruments_ = std::move(instruments);
+    genmidi_.assign(data, data + len);
+    return 0;
+}
+
+rv_uint rv_music::add_song(const uint8_t* data, size_t len)
+{
+    song s;
+    s.data.assign(data, data + len);
+    if (!parse_song(s))
+        return (rv_uint)-EINVAL;
+
+    std::lock_guard<std::mutex> lock(lock_);
+    auto free = std::find_if(songs_.begin(), songs_.end(), [](const song& other) { return other.data.empty(); });
+    if (free == songs_.end()) {
+        if (songs_.size() >= max_songs)
+            return (rv_uint)-ENOMEM;
+        free = songs_.insert(songs_.end(), song{});
+    }
+    *free = std::move(s);
+    return (rv_uint)(free - songs_.begin() + 1);
+}
+
+rv_uint rv_music::remove_song(rv_uint handle)
+{
+    std::lock_guard<std::mutex> lock(lock_);
+    if (handle == 0 || handle > songs_.size() || songs_[handle - 1].data.empty())
+        return (rv_uint)-EINVAL;
+    if (handle == current_) {
+        all_notes_off();
+        current_ = 0;
+    }
+    songs_[handle - 1] = song{};
+    return 0;
+}
+
+rv_uint rv_music::play(rv_uint handle, rv_uint looping)
+{
+    std::lock_guard<std::mutex> lock(lock_);
+    if (instruments_.empty() || handle == 0 || handle > songs_.size() || songs_[handle - 1].data.empty())
+        return (rv_uint)-EINVAL;
+
+    all_notes_off();
+    reset_channels();
+    current_ = handle;
+    looping_ = looping != 0;
+    paused_ = false;
+    finished_ = false;
+    position_ = songs_[handle - 1].score_start;
+    delay_ticks_ = 0;
+    tick_samples_left_ = 0;
+    flush_ = true;
+    return 0;
+}
+
+rv_uint rv_music::stop()
+{
+    std::lock_guard<std::mutex> lock(lock_);
+    all_notes_off();
+    current_ = 0;
+    flush_ = true;
+    return 0;
+}
+
+rv_uint rv_music::pause()
+{
+    std::lock_guard<std::mutex> lock(lock_);
+    if (current_ != 0 && !paused_) {
+        all_notes_off();
+        paused_ = true;
+        flush_ = true;
+    }
+    return 0;
+}
+
+rv_uint rv_music::resume()
+{
+    // the notes cut by the pause stay silent until played again, as with DMX
+    std::lock_guard<std::mutex> lock(lock_);
+    paused_ = false;
+    return 0;
+}
+
+rv_uint rv_music::set_volume(rv_uint volume)
+{
+    if (volume > 127)
+        return (rv_uint)-EINVAL;
+
+    std::lock_guard<std::mutex> lock(lock_);
+    volume_ = volume;
+    gain_ = (float)volume / 127.0f;
+    return 0;
+}
+
+rv_uint rv_music::playing(rv_uint handle) const
+{
+    std::lock_guard<std::mutex> lock(lock_);
+    return handle != 0 && handle == current_ && !finished_ ? 1 : 0;
+}
+
+void rv_music::reset_channels()
+{
+    channels_.fill(mus_channel{});
+}
+
+void rv_music::key_off(size_t v)
+{
+    voices_[v].active = false;
+    opl_.write((uint8_t)(0xB0 + v), 0);
+}
+
+void rv_music::all_notes_off()
+{
+    for (size_t v = 0; v < voices_.size(); ++v) {
+        if (voices_[v].active)
+            key_off(v);
+    }
+}
+
+void rv_music::set_frequency(size_t v, bool key_on)
+{
+    // equal temperament from A4, the bend moves up to two semitones either way
+    const auto& vc = voices_[v];
+    const double semitones = vc.key - 69 + ((double)channels_[vc.channel].bend - 128.0) / 64.0;
+    const double frequency = 440.0 * std::pow(2.0, semitones / 12.0);
+
+    // the lowest block that fits has the finest steps
+    int block = 0;
+    int fnum = 0;
+    for (; block < 8; ++block) {
+        fnum = (int)std::lround(frequency * (double)(1 << (20 - block)) / 49716.0);
+        if (fnum < 1024)
+            break;
+    }
+    if (block == 8) {
+        block = 7;
+        fnum = 1023;
+    }
+
+    opl_.write((uint8_t)(0xA0 + v), (uint8_t)(fnum & 0xFF));
+    opl_.write((uint8_t)(0xB0 + v), (uint8_t)((key_on ? 0x20 : 0) | (block << 2) | (fnum >> 8)));
+}
+
+void rv_music::set_level(size_t v)
+{
+    // velocity and channel volume on the carrier, attenuation in 0.75dB steps of the TL register
+    const auto& vc = voices_[v];
+    const auto& ov = vc.instr->voice[0];
+    const int volume = vc.velocity * channels_[vc.channel].volume / 127;
+    const int attenuation = volume == 0 ? 63 : (int)std::lround(-20.0 * std::log10(volume / 127.0) / 0.75);
+
+    auto level = [attenuation](const uint8_t* op) {
+        return (uint8_t)((op[4] & 0xC0) | std::min(63, (op[5] & 0x3F) + attenuation));
+    };
+    const uint8_t modulator = modulator_offset(v);
+    opl_.write((uint8_t)(0x40 + modulator + 3), level(ov.carrier));
+    // both operators are heard when they are added
+    if ((ov.feedback & 1) != 0)
+        opl_.write((uint8_t)(0x40 + modulator), level(ov.modulator));
+    else
+        opl_.write((uint8_t)(0x40 + modulator), (uint8_t)((ov.modulator[4] & 0xC0) | (ov.modulator[5] & 0x3F)));
+}
+
+void rv_music::note_on(uint8_t channel, uint8_t note, uint8_t velocity)
+{
+    const instrument* instr;
+    if (channel == kPercussionChannel) {
+        if (note < kFirstPercussion || note > kLastPercussion)
+            return;
+        instr = &instruments_[128 + note - kFirstPercussion];
+    }
+    else {
+        instr = &instruments_[channels_[channel].instrument & 127];
+    }
+
+    // a free voice, or the one that started first
+    size_t v = 0;
+    for (size_t i = 0; i < voices_.size(); ++i) {
+        if (!voices_[i].active) {
+            v = i;
+            break;
+        }
+        if (voices_[i].age < voices_[v].age)
+            v = i;
+    }
+    if (voices_[v].active)
+        key_off(v);
+
+    auto& vc = voices_[v];
+    vc.active = true;
+    vc.channel = channel;
+    vc.note = note;
+    vc.velocity = velocity;
+    vc.instr = instr;
+    vc.age = ++voice_age_;
+    vc.key = ((instr->flags & kFixedPitch) != 0 ? instr->fixed_note : note) + instr->voice[0].note_offset;
+    while (vc.key < 0)
+        vc.key += 12;
+    while (vc.key > 127)
+        vc.key -= 12;
+
+    const auto& ov = instr->voice[0];
+    const uint8_t modulator = modulator_offset(v);
+    const uint8_t carrier = (uint8_t)(modulator + 3);
+    opl_.write((uint8_t)(0x20 + modulator), ov.modulator[0]);
+    opl_.write((uint8_t)(0x60 + modulator), ov.modulator[1]);
+    opl_.write((uint8_t)(0x80 + modulator), ov.modulator[2]);
+    opl_.write((uint8_t)(0xE0 + modulator), ov.modulator[3]);
+    opl_.write((uint8_t)(0x20 + carrier), ov.carrier[0]);
+    opl_.write((uint8_t)(0x60 + carrier), ov.carrier[1]);
+    opl_.write((uint8_t)(0x80 + carrier), ov.carrier[2]);
+    opl_.write((uint8_t)(0xE0 + carrier), ov.carrier[3]);
+    opl_.write((uint8_t)(0xC0 + v), ov.feedback);
+    set_level(v);
+    set_frequency(v, true);
+}
+
+void rv_music::note_off(uint8_t channel, uint8_t note)
+{
+    for (size_t v = 0; v < voices_.size(); ++v) {
+        if (voices_[v].active && voices_[v].channel == channel && voices_[v].note == note)
+            key_off(v);
+    }
+}
+
+uint8_t rv_music::next_byte()
+{
+    // reading past the score ends it
+    const auto& s = songs_[current_ - 1];
+    return position_ < s.score_end ? s.data[position_++] : 0x60;
+}
+
+void rv_music::end_of_score()
+{
+    all_notes_off();
+    if (looping_) {
+        position_ = songs_[current_ - 1].score_start;
+        delay_ticks_ = 0;
+    }
+    else {
+        finished_ = true;
+    }
+}
+
+void rv_music::process_event()
+{
+    // events up to the one with the last bit set, then the delay to the next group
+    for (;;) {
+        const uint8_t event = next_byte();
+        const uint8_t channel = event & 15;
+        auto& ch = channels_[channel];
+        switch ((event >> 4) & 7) {
+        case 0:
+            note_off(channel, next_byte() & 127);
+            break;
+        case 1: {
+            const uint8_t note = next_byte();
+            if ((note & 0x80) != 0)
+                ch.last_velocity = next_byte() & 127;
+            note_on(channel, note & 127, ch.last_velocity);
+        }
+            break;
+        case 2:
+            ch.bend = next_byte();
+            for (size_t v = 0; v < voices_.size(); ++v) {
+                if (voices_[v].active && voices_[v].channel == channel)
+                    set_frequency(v, true);
+            }
+            break;
+        case 3: {
+            // all sounds off, all notes off, reset all controllers
+            const uint8_t controller = next_byte();
+            if (controller == 10 || controller == 11) {
+                for (size_t v = 0; v < voices_.size(); ++v) {
+                    if (voices_[v].active && voices_[v].channel == channel)
+                        key_off(v);
+                }
+            }
+            else if (controller == 14) {
+                ch = mus_channel{};
+            }
+        }
+            break;
+        case 4: {
+            // instrument and volume, the rest has no equivalent on an OPL2
+            const uint8_t controller = next_byte();
+            const uint8_t value = next_byte() & 127;
+            if (controller == 0) {
+                ch.instrument = value;
+            }
+            else if (controller == 3) {
+                ch.volume = value;
+                for (size_t v = 0; v < voices_.size(); ++v) {
+                    if (voices_[v].active && voices_[v].channel == channel)
+                        set_level(v);
+                }
+            }
+        }
+            break;
+        case 5:
+            break;
+        default:
+            end_of_score();
+            return;
+        }
+        if ((event & 0x80) != 0)
+            break;
+    }
+
+    uint32_t delay = 0;
+    uint8_t b;
+    do {
+        b = next_byte();
+        delay = (delay << 7) | (b & 127);
+    } while ((b & 0x80) != 0);
+    delay_ticks_ = delay;
+}
+
+void rv_music::tick()
+{
+    if (current_ == 0 || paused_ || finished_)
+        return;
+    if (delay_ticks_ > 0 && --delay_ticks_ > 0)
+        return;
+    for (int i = 0; i < kMaxEventsPerTick && delay_ticks_ == 0 && !finished_; ++i)
+        process_event();
+}
+
+void rv_music::synthesize(float* out, size_t frames)
+{
+    while (frames != 0) {
+        if (tick_samples_left_ == 0) {
+            tick();
+            tick_samples_left_ = samples_per_tick_;
+        }
+        const size_t n = std::min(frames, (size_t)tick_samples_left_);
+        if (out != nullptr) {
+            std::fill(out, out + n, 0.0f);
+            opl_.render(out, n);
+            out += n;
+        }
+        tick_samples_left_ -= (int)n;
+        frames -= n;
+    }
+}
+
+void rv_music::render(int32_t* acc, size_t frames)
+{
+    float samples[kChunkFrames];
+    const float gain = gain_ * kOutputScale;
+
+    while (frames != 0) {
+        const size_t n = std::min(frames, kChunkFrames);
+        if (thread_.joinable()) {
+            if (flush_.exchange(false))
+                ring_read_ = ring_write_.load(std::memory_order_acquire);
+
+            // whatever the thread didn't make in time is silence
+            const size_t read = ring_read_.load(std::memory_order_relaxed);
+            const size_t available = std::min(n, ring_write_.load(std::memory_order_acquire) - read);
+            for (size_t i = 0; i < available; ++i)
+                samples[i] = ring_[(read + i) & (kRingFrames - 1)];
+            std::fill(samples + available, samples + n, 0.0f);
+            ring_read_.store(read + available, std::memory_order_release);
+            wake_.notify_one();
+        }
+        else {
+            std::lock_guard<std::mutex> lock(lock_);
+            synthesize(acc != nullptr ? samples : nullptr, n);
+        }
+
+        if (acc != nullptr) {
+            for (size_t i = 0; i < n; ++i) {
+                const auto value = (int32_t)(samples[i] * gain);
+                acc[2*i] += value;
+                acc[2*i + 1] += value;
+            }
+            acc += n*2;
+        }
+        frames -= n;
+    }
+}
+
+void rv_music::thread_main()
+{
+    float block[kThreadBlock];
+    while (!quit_) {
+        const size_t write = ring_write_.load(std::memory_order_relaxed);
+        if (kRingFrames - (write - ring_read_.load(std::memory_order_acquire)) < kThreadBlock) {
+            std::unique_lock<std::mutex> wait(wake_lock_);
+            wake_.wait_for(wait, std::chrono::milliseconds(10));
+            continue;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(lock_);
+            synthesize(block, kThreadBlock);
+        }
+        for (size_t i = 0; i < kThreadBlock; ++i)
+            ring_[(write + i) & (kRingFrames - 1)] = block[i];
+        ring_write_.store(write + kThreadBlock, std::memory_order_release);
+    }
+}
+
+void rv_music::start_thread()
+{
+    if (thread_.joinable())
+        return;
+    ring_.assign(kRingFrames, 0.0f);
+    ring_read_ = 0;
+    ring_write_ = 0;
+    quit_ = false;
+    thread_ = std::thread(&rv_music::thread_main, this);
+}
+
+void rv_music::stop_thread()
+{
+    if (!thread_.joinable())
+        return;
+    quit_ = true;
+    wake_.notify_one();
+    thread_.join();
+}
+
+void rv_music::save_state(rv_snapshot_writer& snapshot) const
+{
+    std::lock_guard<std::mutex> lock(lock_);
+    snapshot.put_vector(genmidi_);
+    snapshot.put<uint64_t>(songs_.size());
+    for (const auto& s : songs_)
+        snapshot.put_vector(s.data);
+
+    snapshot.put(current_);
+    snapshot.put<uint8_t>(looping_);
+    snapshot.put<uint8_t>(paused_);
+    snapshot.put<uint8_t>(finished_);
+    snapshot.put(position_);
+    snapshot.put(delay_ticks_);
+    snapshot.put(tick_samples_left_);
+    snapshot.put(channels_);
+    snapshot.put(volume_);
+}
+
+void rv_music::restore_state(rv_snapshot_reader& snapshot)
+{
+    std::vector<uint8_t> genmidi;
+    snapshot.get_vector(genmidi);
+    std::vector<instrument> instruments;
+    if (!genmidi.empty() && !parse_instruments(genmidi.data(), genmidi.size(), instruments))
+        throw std::runtime_error("corrupted snapshot");
+
+    const auto count = snapshot.get<uint64_t>();
+    if (count > max_songs)
+        throw std::runtime_error("corrupted snapshot");
+    std::vector<song> songs(count);
+    for (auto& s : songs) {
+        snapshot.get_vector(s.data);
+        if (!s.data.empty() && !parse_song(s))
+            throw std::runtime_error("corrupted snapshot");
+    }
+
+    std::lock_guard<std::mutex> lock(lock_);
+    all_notes_off();
+    genmidi_ = std::move(genmidi);
+    instruments_ = std::move(instruments);
+    songs_ = std::move(songs);
+
+    current_ = snapshot.get<rv_uint>();
+    looping_ = snapshot.get<uint8_t>() != 0;
+    paused_ = snapshot.get<uint8_t>() != 0;
+    finished_ = snapshot.get<uint8_t>() != 0;
+    position_ = snapshot.get<uint32_t>();
+    delay_ticks_ = snapshot.get<uint32_t>();
+    tick_samples_left_ = snapshot.get<int>();
+    channels_ = snapshot.get<std::array<mus_channel, 16>>();
+    volume_ = snapshot.get<rv_uint>();
+    if (current_ > songs_.size() || (current_ != 0 && (songs_[current_ - 1].data.empty() || instruments_.empty())) ||
+        tick_samples_left_ < 0 || tick_samples_left_ > samples_per_tick_ || volume_ > 127)
+        throw std::runtime_error("corrupted snapshot");
+    gain_ = (float)volume_ / 127.0f;
+    flush_ = true;
+}
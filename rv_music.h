@@ -0,0 +1,158 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "rv_global.h"
+#include "rv_opl.h"
+
+class rv_snapshot_writer;
+class rv_snapshot_reader;
+
+// DooM music for the av_music_* syscalls: MUS songs played on an OPL2 with the GENMIDI
+// instruments, like the DMX driver did on an AdLib
+// songs and instruments are copied when registered, the guest may free them afterwards
+// by default the sequencer and the synthesizer run inside render(), on the mixer clock;
+// start_thread() moves them to a thread of their own that keeps a short buffer ahead,
+// so the audio callback only copies samples
+class rv_music
+{
+public:
+    static constexpr size_t max_songs = 64;
+
+    explicit rv_music(int sample_rate);
+    ~rv_music();
+
+    rv_music(const rv_music&) = delete;
+    rv_music& operator=(const rv_music&) = delete;
+
+    // all of these return like the syscalls, the result or -errno
+    // the GENMIDI lump, needed before the first play
+    rv_uint set_instruments(const uint8_t* data, size_t len);
+    // a MUS lump, returns a handle
+    rv_uint add_song(const uint8_t* data, size_t len);
+    rv_uint remove_song(rv_uint handle);
+    rv_uint play(rv_uint handle, rv_uint looping);
+    rv_uint stop();
+    rv_uint pause();
+    rv_uint resume();
+    // 0..127
+    rv_uint set_volume(rv_uint volume);
+    // 1 while handle is the song playing, paused included, 0 once a single play is over
+    rv_uint playing(rv_uint handle) const;
+
+    void start_thread();
+    void stop_thread();
+
+    // adds frames of interleaved stereo to acc, in 16bit units
+    // a nullptr acc only advances the sequencer, never used with the thread running
+    void render(int32_t* acc, size_t frames);
+
+    // instruments, songs and the sequencer position, the notes being played are cut short
+    void save_state(rv_snapshot_writer& snapshot) const;
+    void restore_state(rv_snapshot_reader& snapshot);
+
+private:
+    // one of the two voices of a GENMIDI instrument, as in the lump
+    struct opl_voice
+    {
+        uint8_t modulator[6];   // characteristic, attack/decay, sustain/release, waveform, ksl, level
+        uint8_t feedback;
+        uint8_t carrier[6];
+        uint8_t unused;
+        int16_t note_offset;
+    };
+
+    struct instrument
+    {
+        uint16_t flags;
+        uint8_t fine_tune;
+        uint8_t fixed_note;
+        opl_voice voice[2];
+    };
+
+    struct song
+    {
+        std::vector<uint8_t> data; // empty when the handle is free
+        uint32_t score_start;
+        uint32_t score_end;
+    };
+
+    struct mus_channel
+    {
+        uint8_t instrument = 0;
+        uint8_t volume = 127;
+        uint8_t bend = 128;
+        uint8_t last_velocity = 127;
+    };
+
+    struct voice
+    {
+        bool active = false;
+        uint8_t channel = 0;
+        uint8_t note = 0;           // as played, to find the voice again on release
+        uint8_t velocity = 0;
+        int key = 0;                // note of the OPL, after the instrument offsets
+        const instrument* instr = nullptr;
+        uint64_t age = 0;
+    };
+
+    static bool parse_instruments(const uint8_t* data, size_t len, std::vector<instrument>& instruments);
+    // score_start and score_end from the header of data
+    static bool parse_song(song& s);
+
+    // sequencer, all with lock_ held
+    void synthesize(float* out, size_t frames);
+    void tick();
+    void process_event();
+    void end_of_score();
+    void reset_channels();
+    void all_notes_off();
+    void note_on(uint8_t channel, uint8_t note, uint8_t velocity);
+    void note_off(uint8_t channel, uint8_t note);
+    void key_off(size_t v);
+    void set_frequency(size_t v, bool key_on);
+    void set_level(size_t v);
+    uint8_t next_byte();
+
+    void thread_main();
+
+private:
+    rv_opl opl_;
+    int samples_per_tick_;
+
+    // taken for every guest call and while synthesizing
+    mutable std::mutex lock_;
+    std::vector<instrument> instruments_;
+    std::vector<uint8_t> genmidi_;      // kept for snapshots
+    std::vector<song> songs_;
+
+    // the song playing, 0 if none
+    rv_uint current_ = 0;
+    bool looping_ = false;
+    bool paused_ = false;
+    bool finished_ = false;
+    uint32_t position_ = 0;
+    uint32_t delay_ticks_ = 0;
+    int tick_samples_left_ = 0;
+    std::array<mus_channel, 16> channels_{};
+    std::array<voice, rv_opl::num_channels> voices_{};
+    uint64_t voice_age_ = 0;
+
+    // set from the guest thread, applied to the output
+    rv_uint volume_ = 127;
+    std::atomic<float> gain_{1.0f};
+
+    // single producer single consumer ring of mono samples, filled by the thread
+    std::thread thread_;
+    std::atomic<bool> quit_{false};
+    std::mutex wake_lock_;
+    std::condition_variable wake_;
+    std::vector<float> ring_;
+    std::atomic<size_t> ring_read_{0};
+    std::atomic<size_t> ring_write_{0};
+    // what is buffered is stale after a play, stop or pause
+    std::atomic<bool> flush_{false};
+};
@@ -0,0 +1,265 @@
+#include <algorithm>
+#include <cmath>
+#include "rv_opl.h"
+
+constexpr double kChipRate = 49716.0;
+constexpr double kPi = 3.14159265358979323846;
+
+// dB below which an operator is silent, and the attenuation of one 6dB step in exp2
+constexpr float kSilence = 96.0f;
+constexpr float kDbPerOctave = 6.0206f;
+
+constexpr size_t kWaveSize = 1024;
+
+static const float kMultiples[16] = {0.5f, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 10, 12, 12, 15, 15};
+
+// key scale level at block 7 by the top four bits of fnum, in 0.75dB steps
+static const int kKeyScaleLevels[16] = {0, 32, 40, 45, 48, 51, 53, 55, 56, 58, 59, 60, 61, 62, 63, 64};
+
+// sine, half sine, absolute sine and quarter sine pulses
+static const std::array<std::array<float, kWaveSize>, 4>& waveforms()
+{
+    static const auto tables = [] {
+        std::array<std::array<float, kWaveSize>, 4> t{};
+        for (size_t i = 0; i < kWaveSize; ++i) {
+            const float s = (float)std::sin(2.0 * kPi * (double)i / kWaveSize);
+            t[0][i] = s;
+            t[1][i] = i < kWaveSize/2 ? s : 0.0f;
+            t[2][i] = std::fabs(s);
+            t[3][i] = (i & (kWaveSize/4)) == 0 ? std::fabs(s) : 0.0f;
+        }
+        return t;
+    }();
+    return tables;
+}
+
+rv_opl::rv_opl(int sample_rate)
+    : sample_rate_{sample_rate}
+{
+    reset();
+}
+
+void rv_opl::reset()
+{
+    channels_.fill(channel_state{});
+    waveform_select_ = false;
+    note_select_ = false;
+    deep_tremolo_ = false;
+    deep_vibrato_ = false;
+    lfo_time_ = 0.0;
+    for (auto& ch : channels_)
+        update_channel(ch);
+}
+
+void rv_opl::update_operator(channel_state& ch, operator_state& op)
+{
+    // rates are scaled by the key code, fully with KSR and by a quarter without
+    const int key_code = ch.block*2 + ((ch.fnum >> (note_select_ ? 8 : 9)) & 1);
+    const int rate_offset = op.key_scale_rate ? key_code : key_code >> 2;
+    auto effective = [rate_offset](int rate) { return rate == 0 ? 0 : std::min(63, rate*4 + rate_offset); };
+
+    // a full attack takes 2826ms at rate 4 and halves every 4 rates, 60 and up are instant
+    const int attack = effective(op.attack_rate);
+    if (attack == 0) {
+        op.attack_factor = 1.0f;
+    }
+    else if (attack >= 60) {
+        op.attack_factor = 0.0f;
+    }
+    else {
+        const double samples = std::max(1.0, 2.826 / std::pow(2.0, (attack - 4) / 4.0) * sample_rate_);
+        op.attack_factor = (float)std::pow(0.1 / kSilence, 1.0 / samples);
+    }
+
+    // decaying by 96dB takes 39280ms at rate 4, same halving
+    auto step = [this](int rate) {
+        if (rate == 0)
+            return 0.0f;
+        const double seconds = 39.28 / std::pow(2.0, (std::min(rate, 60) - 4) / 4.0);
+        return (float)(kSilence / (seconds * sample_rate_));
+    };
+    op.decay_step = step(effective(op.decay_rate));
+    op.release_step = step(effective(op.release_rate));
+
+    // key scaling in 0.1875dB units: 3, 1.5 or 6dB per octave
+    static const int kShifts[4] = {31, 1, 2, 0};
+    const int level = std::max(0, (kKeyScaleLevels[ch.fnum >> 6] << 2) - ((8 - ch.block) << 5));
+    op.fixed_attenuation = op.total_level*0.75f + (float)(level >> kShifts[op.key_scale_level])*0.1875f;
+}
+
+void rv_opl::update_channel(channel_state& ch)
+{
+    ch.phase_step = ch.fnum * kChipRate / (double)(1 << (20 - ch.block)) / sample_rate_;
+    update_operator(ch, ch.op[0]);
+    update_operator(ch, ch.op[1]);
+}
+
+void rv_opl::write(uint8_t reg, uint8_t value)
+{
+    switch (reg) {
+    case 0x01:
+        waveform_select_ = (value & 0x20) != 0;
+        return;
+    case 0x08:
+        note_select_ = (value & 0x40) != 0;
+        for (auto& ch : channels_)
+            update_channel(ch);
+        return;
+    case 0xBD:
+        deep_tremolo_ = (value & 0x80) != 0;
+        deep_vibrato_ = (value & 0x40) != 0;
+        return;
+    }
+
+    const uint8_t group = reg & 0xE0;
+    if (group == 0x20 || group == 0x40 || group == 0x60 || group == 0x80 || group == 0xE0) {
+        // operators sit at 0-5, 8-13 and 16-21: three modulators then their three carriers
+        const uint8_t offset = reg & 0x1F;
+        if (offset > 0x15 || (offset & 7) >= 6)
+            return;
+        auto& ch = channels_[(offset >> 3)*3 + (offset & 7) % 3];
+        auto& op = ch.op[(offset & 7) / 3];
+        switch (group) {
+        case 0x20:
+            op.tremolo = (value & 0x80) != 0;
+            op.vibrato = (value & 0x40) != 0;
+            op.sustained = (value & 0x20) != 0;
+            op.key_scale_rate = (value & 0x10) != 0;
+            op.multiple = kMultiples[value & 15];
+            break;
+        case 0x40:
+            op.key_scale_level = value >> 6;
+            op.total_level = value & 63;
+            break;
+        case 0x60:
+            op.attack_rate = value >> 4;
+            op.decay_rate = value & 15;
+            break;
+        case 0x80:
+            op.sustain_level = value >> 4;
+            op.release_rate = value & 15;
+            break;
+        case 0xE0:
+            op.waveform = value & 3;
+            break;
+        }
+        update_operator(ch, op);
+        return;
+    }
+
+    const uint8_t index = reg & 0x0F;
+    if (index >= num_channels)
+        return;
+    auto& ch = channels_[index];
+    switch (reg & 0xF0) {
+    case 0xA0:
+        ch.fnum = (uint16_t)((ch.fnum & 0x300) | value);
+        update_channel(ch);
+        break;
+    case 0xB0: {
+        ch.fnum = (uint16_t)((ch.fnum & 0xFF) | ((value & 3) << 8));
+        ch.block = (value >> 2) & 7;
+        const bool key_on = (value & 0x20) != 0;
+        if (key_on && !ch.key_on) {
+            for (auto& op : ch.op) {
+                op.state = stage::attack;
+                op.phase = 0.0;
+            }
+        }
+        else if (!key_on && ch.key_on) {
+            for (auto& op : ch.op) {
+                if (op.state != stage::off)
+                    op.state = stage::release;
+            }
+        }
+        ch.key_on = key_on;
+        update_channel(ch);
+    }
+        break;
+    case 0xC0:
+        ch.feedback = (value >> 1) & 7;
+        ch.additive = (value & 1) != 0;
+        break;
+    }
+}
+
+float rv_opl::operator_output(operator_state& op, double phase_step, float modulation, float vibrato, float tremolo)
+{
+    switch (op.state) {
+    case stage::attack:
+        op.env *= op.attack_factor;
+        if (op.env < 0.1f) {
+            op.env = 0.0f;
+            op.state = stage::decay;
+        }
+        break;
+    case stage::decay: {
+        const float sustain = op.sustain_level == 15 ? kSilence : op.sustain_level*3.0f;
+        op.env += op.decay_step;
+        if (op.env >= sustain) {
+            op.env = sustain;
+            // without EGT the sound keeps fading at the release rate
+            op.state = op.sustained ? stage::sustain : stage::release;
+        }
+    }
+        break;
+    case stage::sustain:
+        break;
+    case stage::release:
+        op.env += op.release_step;
+        if (op.env >= kSilence) {
+            op.env = kSilence;
+            op.state = stage::off;
+        }
+        break;
+    case stage::off:
+        return 0.0f;
+    }
+
+    const double phase = op.phase + modulation;
+    op.phase += phase_step*op.multiple*(op.vibrato ? vibrato : 1.0f);
+    op.phase -= std::floor(op.phase);
+
+    const float attenuation = op.env + op.fixed_attenuation + (op.tremolo ? tremolo : 0.0f);
+    if (attenuation >= kSilence)
+        return 0.0f;
+    const auto index = (size_t)((int64_t)std::floor(phase*kWaveSize) & (int64_t)(kWaveSize - 1));
+    const float sample = waveforms()[waveform_select_ ? op.waveform : 0][index];
+    return sample*std::exp2(-attenuation/kDbPerOctave);
+}
+
+void rv_opl::render(float* out, size_t frames)
+{
+    const double dt = 1.0/sample_rate_;
+    for (size_t i = 0; i < frames; ++i) {
+        // tremolo at 3.7Hz by 1 or 4.8dB, vibrato at 6.1Hz by 7 or 14 cents
+        const float tremolo = (deep_tremolo_ ? 4.8f : 1.0f)*(float)(0.5 - 0.5*std::cos(2.0*kPi*3.7*lfo_time_));
+        const float vibrato = (float)std::exp2((deep_vibrato_ ? 14.0 : 7.0)*std::sin(2.0*kPi*6.1*lfo_time_)/1200.0);
+        lfo_time_ += dt;
+
+        float sample = 0.0f;
+        for (auto& ch : channels_) {
+            auto& modulator = ch.op[0];
+            auto& carrier = ch.op[1];
+            if (modulator.state == stage::off && carrier.state == stage::off)
+                continue;
+
+            // a full scale modulator shifts the carrier by four cycles, feedback by up to two
+            const float feedback = ch.feedback != 0 ?
+                (modulator.out[0] + modulator.out[1])*std::ldexp(1.0f, ch.feedback - 7) : 0.0f;
+            const float m = operator_output(modulator, ch.phase_step, feedback, vibrato, tremolo);
+            modulator.out[1] = modulator.out[0];
+            modulator.out[0] = m;
+
+            if (ch.additive)
+                sample += m + operator_output(carrier, ch.phase_step, 0.0f, vibrato, tremolo);
+            else
+                sample += operator_output(carrier, ch.phase_step, m*4.0f, vibrato, tremolo);
+        }
+        out[i] += sample;
+    }
+
+    // keep the lfo phase precise over long runs
+    if (lfo_time_ > 1000.0)
+        lfo_time_ = std::fmod(lfo_time_, 1.0/0.1);
+}
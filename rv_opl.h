@@ -0,0 +1,86 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+// a YM3812 (OPL2) FM synthesizer driven through its registers, computed in floating point
+// at the output rate rather than the chip's 49716 Hz: 9 two-operator channels, the four
+// waveforms, envelopes with key scaling, tremolo, vibrato and feedback
+// rhythm mode, CSM and the timers are left out, the DooM music driver uses none of them
+class rv_opl
+{
+public:
+    static constexpr size_t num_channels = 9;
+
+    explicit rv_opl(int sample_rate);
+
+    void reset();
+    void write(uint8_t reg, uint8_t value);
+
+    // mono output of all the channels added to out, a channel at full level peaks at 1.0
+    void render(float* out, size_t frames);
+
+private:
+    enum class stage : uint8_t
+    {
+        attack,
+        decay,
+        sustain,
+        release,
+        off
+    };
+
+    struct operator_state
+    {
+        // from the registers
+        bool tremolo = false;
+        bool vibrato = false;
+        bool sustained = false;     // EGT, holds at the sustain level while the key is on
+        bool key_scale_rate = false;
+        float multiple = 0.5f;
+        uint8_t key_scale_level = 0;
+        uint8_t total_level = 63;
+        uint8_t attack_rate = 0;
+        uint8_t decay_rate = 0;
+        uint8_t sustain_level = 0;
+        uint8_t release_rate = 0;
+        uint8_t waveform = 0;
+
+        // derived whenever the operator or its channel frequency changes
+        float attack_factor = 1.0f;     // env is multiplied by it each sample during attack
+        float decay_step = 0.0f;        // dB per sample
+        float release_step = 0.0f;
+        float fixed_attenuation = 0.0f; // total level plus key scaling, dB
+
+        // running
+        stage state = stage::off;
+        float env = 96.0f;              // attenuation, dB
+        double phase = 0.0;             // in cycles
+        float out[2] = {0.0f, 0.0f};    // last two outputs, for feedback
+    };
+
+    struct channel_state
+    {
+        uint16_t fnum = 0;
+        uint8_t block = 0;
+        bool key_on = false;
+        uint8_t feedback = 0;
+        bool additive = false;
+        double phase_step = 0.0;        // cycles per sample at multiple 1
+        operator_state op[2];           // modulator, carrier
+    };
+
+    void update_operator(channel_state& ch, operator_state& op);
+    void update_channel(channel_state& ch);
+    float operator_output(operator_state& op, double phase_step, float modulation, float vibrato, float tremolo);
+
+private:
+    int sample_rate_;
+    std::array<channel_state, num_channels> channels_;
+
+    bool waveform_select_ = false;
+    bool note_select_ = false;
+    bool deep_tremolo_ = false;
+    bool deep_vibrato_ = false;
+    double lfo_time_ = 0.0;             // seconds, drives tremolo and vibrato
+};
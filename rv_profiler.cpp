@@ -0,0 +1,121 @@
+#include <algorithm>
+#include <cstring>
+#include "rv_profiler.h"
+
+rv_profiler::rv_profiler(rv_memory& memory, const std::vector<elf_function>& functions, uint64_t interval)
+    : memory_{memory}, functions_{functions}, interval_{interval != 0 ? interval : 1}
+{
+    self_.resize(functions_.size() + 1, 0);
+    frames_.reserve(max_frames);
+}
+
+int rv_profiler::find_function(rv_uint address) const
+{
+    auto it = std::upper_bound(functions_.begin(), functions_.end(), address,
+        [](rv_uint addr, const elf_function& f) { return addr < f.address; });
+    if (it == functions_.begin())
+        return -1;
+    --it;
+
+    // symbols without a size extend up to the next function
+    if (it->size != 0 && address - it->address >= it->size)
+        return -1;
+    return (int)(it - functions_.begin());
+}
+
+bool rv_profiler::is_return_address(rv_uint address) const
+{
+    if ((address & 1) != 0 || address < 4)
+        return false;
+
+    uint32_t insn;
+    if (memory_.fetch(address - 4, insn)) {
+        const uint32_t opcode = insn & 0x7F;
+        const uint32_t rd = (insn >> 7) & 0x1F;
+        // jal ra / jalr ra
+        if ((opcode == 0x6F || opcode == 0x67) && rd == 1)
+            return true;
+    }
+
+    uint16_t cinsn;
+    if (memory_.fetch(address - 2, cinsn)) {
+        // c.jal
+        if ((cinsn & 0xE003) == 0x2001)
+            return true;
+        // c.jalr
+        if ((cinsn & 0xF07F) == 0x9002 && ((cinsn >> 7) & 0x1F) != 0)
+            return true;
+    }
+    return false;
+}
+
+void rv_profiler::sample(rv_uint pc, rv_uint ra, rv_uint sp)
+{
+    ++samples_;
+
+    // innermost first
+    frames_.clear();
+    const int current = find_function(pc);
+    frames_.push_back(current);
+    self_[current + 1] += 1;
+
+    // in a leaf function the caller is only in ra, once saved it's also on the stack
+    // a call in the current function leaves ra pointing back into it, that's not a caller
+    rv_uint last_return = 0;
+    if (is_return_address(ra) && find_function(ra - 2) != current) {
+        frames_.push_back(find_function(ra - 2));
+        last_return = ra;
+    }
+
+    if (sp >= memory_.stack_end() && sp < memory_.stack_begin()) {
+        const rv_uint scan_end = std::min<rv_uint>(memory_.stack_begin(), sp + max_stack_scan);
+        for (rv_uint addr = sp & ~3u; addr + 4 <= scan_end && frames_.size() < max_frames; addr += 4) {
+            rv_uint value;
+            memcpy(&value, memory_.ram_ptr(addr), sizeof(value));
+            if (value == last_return || !is_return_address(value))
+                continue;
+            const int caller = find_function(value - 2);
+            if (caller < 0)
+                continue;
+            frames_.push_back(caller);
+            last_return = value;
+        }
+    }
+
+    key_.clear();
+    for (auto it = frames_.rbegin(); it != frames_.rend(); ++it) {
+        if (!key_.empty())
+            key_ += ';';
+        key_ += function_name(*it);
+    }
+    stacks_[key_] += 1;
+}
+
+void rv_profiler::print_flat_profile(FILE* out, size_t max_entries) const
+{
+    std::vector<size_t> order;
+    for (size_t i = 0; i < self_.size(); ++i) {
+        if (self_[i] != 0)
+            order.push_back(i);
+    }
+    std::sort(order.begin(), order.end(), [this](size_t a, size_t b) { return self_[a] > self_[b]; });
+
+    fprintf(out, "[i] flat profile, %llu samples every %llu instructions\n",
+        (unsigned long long)samples_, (unsigned long long)interval_);
+    fprintf(out, "[i]   self%%    samples  function\n");
+    for (size_t i = 0; i < order.size() && i < max_entries; ++i) {
+        const uint64_t count = self_[order[i]];
+        fprintf(out, "[i] %6.2f%% %10llu  %s\n", 100.0*double(count)/double(samples_), (unsigned long long)count,
+            function_name((int)order[i] - 1));
+    }
+}
+
+bool rv_profiler::write_collapsed_stacks(const std::string& path) const
+{
+    FILE* out = fopen(path.c_str(), "w");
+    if (out == nullptr)
+        return false;
+    for (const auto& stack : stacks_)
+        fprintf(out, "%s %llu\n", stack.first.c_str(), (unsigned long long)stack.second);
+    return fclose(out) == 0;
+}
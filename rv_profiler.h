@@ -0,0 +1,56 @@
+#pragma once
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "rv_global.h"
+#include "rv_memory.h"
+#include "elfloader.h"
+
+// statistical profiler for the target, rv_cpu hands it the guest state every interval()
+// executed instructions and samples are resolved to functions through the ELF symbol table
+// targets are built without frame pointers, callers are found by scanning the guest stack
+// for words that point right after a call instruction: stale ones can show up as extra frames
+class rv_profiler
+{
+public:
+    rv_profiler() = delete;
+    rv_profiler(rv_memory& memory, const std::vector<elf_function>& functions, uint64_t interval);
+
+    uint64_t interval() const { return interval_; }
+    uint64_t sample_count() const { return samples_; }
+
+    void sample(rv_uint pc, rv_uint ra, rv_uint sp);
+
+    // self samples per function, most sampled first
+    void print_flat_profile(FILE* out, size_t max_entries) const;
+
+    // one "outer;...;inner count" line per distinct stack, the input format of flamegraph.pl
+    bool write_collapsed_stacks(const std::string& path) const;
+
+private:
+    // index into functions_ of the function containing address, -1 if none
+    int find_function(rv_uint address) const;
+
+    // address follows a jal/jalr writing ra
+    bool is_return_address(rv_uint address) const;
+
+    const char* function_name(int index) const { return index >= 0 ? functions_[index].name.c_str() : "[unknown]"; }
+
+private:
+    static constexpr size_t max_frames = 64;
+    static constexpr rv_uint max_stack_scan = 64 * 1024;
+
+    rv_memory& memory_;
+    std::vector<elf_function> functions_;
+    uint64_t interval_;
+    uint64_t samples_ = 0;
+
+    // self samples, indexed by function + 1 (0 is [unknown])
+    std::vector<uint64_t> self_;
+    std::unordered_map<std::string, uint64_t> stacks_;
+
+    // scratch space for sample()
+    std::vector<int> frames_;
+    std::string key_;
+};
@@ -0,0 +1,149 @@
+#include <algorithm>
+#include <errno.h>
+#include "rv_raster.h"
+
+// the inner loops of r_draw.c, one instance per flag combination keeps them branch free
+template<bool wrap, bool translate, bool wide>
+static void draw_column(uint8_t* dest, const uint8_t* source, const uint8_t* colormap, const uint8_t* translation,
+    uint32_t frac, uint32_t step, size_t count, size_t pitch)
+{
+    for (size_t i = 0; i < count; ++i) {
+        const int32_t index = wrap ? (int32_t)((frac >> 16) & 127) : (int32_t)frac >> 16;
+        const uint8_t texel = translate ? translation[source[index]] : source[index];
+        dest[0] = colormap[texel];
+        if (wide)
+            dest[1] = dest[0];
+        dest += pitch;
+        frac += step;
+    }
+}
+
+template<bool wide>
+static void draw_span(uint8_t* dest, const uint8_t* source, const uint8_t* colormap,
+    uint32_t xfrac, uint32_t yfrac, uint32_t xstep, uint32_t ystep, size_t count)
+{
+    for (size_t i = 0; i < count; ++i) {
+        const uint32_t spot = ((yfrac >> 10) & (63*64)) + ((xfrac >> 16) & 63);
+        const uint8_t pixel = colormap[source[spot]];
+        *dest++ = pixel;
+        if (wide)
+            *dest++ = pixel;
+        xfrac += xstep;
+        yfrac += ystep;
+    }
+}
+
+bool rv_raster::check_column(const av_column& column, rv_uint pitch) const
+{
+    if (column.count == 0)
+        return true;
+
+    // the texels reached, wrapped columns stay within 128 of source
+    int64_t first = 0;
+    int64_t last = 127;
+    if ((column.flags & AV_DRAW_WRAP) == 0) {
+        const int64_t end = (int64_t)column.frac + (int64_t)(column.count - 1)*column.step;
+        if (end < INT32_MIN || end > INT32_MAX)
+            return false;
+        first = std::min<int64_t>(column.frac >> 16, end >> 16);
+        last = std::max<int64_t>(column.frac >> 16, end >> 16);
+    }
+    if ((int64_t)column.source + first < 0 ||
+        !memory_.check_range((rv_uint)(column.source + first), (size_t)(last - first + 1), RV_MEMORY_R))
+        return false;
+
+    const size_t width = (column.flags & AV_DRAW_DOUBLE) != 0 ? 2 : 1;
+    return memory_.check_range(column.colormap, 256, RV_MEMORY_R) &&
+        (column.translation == 0 || memory_.check_range(column.translation, 256, RV_MEMORY_R)) &&
+        memory_.check_range(column.dest, (size_t)(column.count - 1)*pitch + width, RV_MEMORY_R | RV_MEMORY_W);
+}
+
+bool rv_raster::check_span(const av_span& span) const
+{
+    const size_t width = (span.flags & AV_DRAW_DOUBLE) != 0 ? 2 : 1;
+    return memory_.check_range(span.source, 64*64, RV_MEMORY_R) &&
+        memory_.check_range(span.colormap, 256, RV_MEMORY_R) &&
+        memory_.check_range(span.dest, (size_t)span.count*width, RV_MEMORY_R | RV_MEMORY_W);
+}
+
+rv_uint rv_raster::draw_columns(rv_uint address, rv_uint count, rv_uint pitch)
+{
+    if (count > max_batch || pitch == 0)
+        return (rv_uint)-EINVAL;
+    if (!memory_.check_range(address, (size_t)count*sizeof(av_column), RV_MEMORY_R))
+        return (rv_uint)-EFAULT;
+
+    // copied first, the batch could be drawn over
+    const auto* columns = reinterpret_cast<const av_column*>(memory_.ram_ptr(address));
+    columns_.assign(columns, columns + count);
+    for (const auto& c : columns_) {
+        if (!check_column(c, pitch))
+            return (rv_uint)-EFAULT;
+    }
+
+    uint64_t low = UINT64_MAX;
+    uint64_t high = 0;
+    for (const auto& c : columns_) {
+        if (c.count == 0)
+            continue;
+
+        uint8_t* dest = memory_.ram_ptr(c.dest);
+        const uint8_t* source = memory_.ram_ptr(c.source);
+        const uint8_t* colormap = memory_.ram_ptr(c.colormap);
+        const uint8_t* translation = c.translation != 0 ? memory_.ram_ptr(c.translation) : nullptr;
+        const bool wrap = (c.flags & AV_DRAW_WRAP) != 0;
+        const bool wide = (c.flags & AV_DRAW_DOUBLE) != 0;
+        const auto frac = (uint32_t)c.frac;
+        const auto step = (uint32_t)c.step;
+        if (translation != nullptr) {
+            if (wrap)
+                (wide ? draw_column<true, true, true> : draw_column<true, true, false>)(dest, source, colormap, translation, frac, step, c.count, pitch);
+            else
+                (wide ? draw_column<false, true, true> : draw_column<false, true, false>)(dest, source, colormap, translation, frac, step, c.count, pitch);
+        }
+        else {
+            if (wrap)
+                (wide ? draw_column<true, false, true> : draw_column<true, false, false>)(dest, source, colormap, translation, frac, step, c.count, pitch);
+            else
+                (wide ? draw_column<false, false, true> : draw_column<false, false, false>)(dest, source, colormap, translation, frac, step, c.count, pitch);
+        }
+
+        low = std::min<uint64_t>(low, c.dest);
+        high = std::max<uint64_t>(high, (uint64_t)c.dest + (uint64_t)(c.count - 1)*pitch + (wide ? 2 : 1));
+    }
+    if (low < high)
+        memory_.host_written((rv_uint)low, (size_t)(high - low));
+    return 0;
+}
+
+rv_uint rv_raster::draw_spans(rv_uint address, rv_uint count)
+{
+    if (count > max_batch)
+        return (rv_uint)-EINVAL;
+    if (!memory_.check_range(address, (size_t)count*sizeof(av_span), RV_MEMORY_R))
+        return (rv_uint)-EFAULT;
+
+    const auto* spans = reinterpret_cast<const av_span*>(memory_.ram_ptr(address));
+    spans_.assign(spans, spans + count);
+    for (const auto& s : spans_) {
+        if (!check_span(s))
+            return (rv_uint)-EFAULT;
+    }
+
+    uint64_t low = UINT64_MAX;
+    uint64_t high = 0;
+    for (const auto& s : spans_) {
+        if (s.count == 0)
+            continue;
+
+        const bool wide = (s.flags & AV_DRAW_DOUBLE) != 0;
+        (wide ? draw_span<true> : draw_span<false>)(memory_.ram_ptr(s.dest), memory_.ram_ptr(s.source),
+            memory_.ram_ptr(s.colormap), (uint32_t)s.xfrac, (uint32_t)s.yfrac, (uint32_t)s.xstep, (uint32_t)s.ystep, s.count);
+
+        low = std::min<uint64_t>(low, s.dest);
+        high = std::max<uint64_t>(high, (uint64_t)s.dest + (uint64_t)s.count*(wide ? 2 : 1));
+    }
+    if (low < high)
+        memory_.host_written((rv_uint)low, (size_t)(high - low));
+    return 0;
+}
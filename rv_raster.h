@@ -0,0 +1,36 @@
+#pragma once
+#include <vector>
+#include "rv_av.h"
+#include "rv_global.h"
+#include "rv_memory.h"
+
+// the av_draw_* syscalls: batches of DooM renderer columns and spans drawn on the host,
+// straight into the guest framebuffer and in the order they were queued
+// a batch is checked whole before the first pixel, on an error nothing is drawn and the
+// guest is expected to draw it by itself
+class rv_raster
+{
+public:
+    static constexpr rv_uint max_batch = 65536;
+
+    rv_raster() = delete;
+    explicit rv_raster(rv_memory& memory) : memory_{memory} {}
+
+    rv_raster(const rv_raster&) = delete;
+    rv_raster& operator=(const rv_raster&) = delete;
+
+    // 0 or -errno, like the syscalls
+    rv_uint draw_columns(rv_uint address, rv_uint count, rv_uint pitch);
+    rv_uint draw_spans(rv_uint address, rv_uint count);
+
+private:
+    bool check_column(const av_column& column, rv_uint pitch) const;
+    bool check_span(const av_span& span) const;
+
+private:
+    rv_memory& memory_;
+
+    // the batch being drawn, kept to reuse the allocation
+    std::vector<av_column> columns_;
+    std::vector<av_span> spans_;
+};
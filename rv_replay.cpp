@@ -0,0 +1,72 @@
+#include <stdexcept>
+#include "rv_replay.h"
+
+rv_replay::rv_replay(const std::string& path, mode m)
+    : mode_{m}
+{
+    file_ = fopen(path.c_str(), m == mode::record ? "wb" : "rb");
+    if (file_ == nullptr)
+        throw std::runtime_error("unable to open replay log " + path);
+}
+
+rv_replay::~rv_replay()
+{
+    if (file_ != nullptr)
+        fclose(file_);
+}
+
+void rv_replay::put_varint(uint64_t value)
+{
+    while (value >= 0x80) {
+        fputc((int)(value & 0x7F) | 0x80, file_);
+        value >>= 7;
+    }
+    fputc((int)value, file_);
+}
+
+uint64_t rv_replay::get_varint()
+{
+    uint64_t value = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+        const int c = fgetc(file_);
+        if (c == EOF)
+            throw std::runtime_error("replay log ended after " + std::to_string(entries_) + " entries");
+        value |= (uint64_t)(c & 0x7F) << shift;
+        if ((c & 0x80) == 0)
+            return value;
+    }
+    throw std::runtime_error("corrupted replay log");
+}
+
+void rv_replay::put_entry(rv_uint syscall_no, rv_uint retval, bool has_data)
+{
+    put_varint(((uint64_t)syscall_no << 1) | (has_data ? 1 : 0));
+    put_varint(retval);
+    entries_ += 1;
+}
+
+void rv_replay::put_data(const void* data, size_t len)
+{
+    put_varint(len);
+    if (len != 0 && fwrite(data, 1, len, file_) != len)
+        throw std::runtime_error("replay log write failed");
+}
+
+rv_replay::entry rv_replay::next_entry()
+{
+    const uint64_t header = get_varint();
+    entry result;
+    result.syscall_no = (rv_uint)(header >> 1);
+    result.has_data = (header & 1) != 0;
+    result.retval = (rv_uint)get_varint();
+    entries_ += 1;
+    return result;
+}
+
+void rv_replay::get_data(void* data, size_t len)
+{
+    if (get_varint() != len)
+        throw std::runtime_error("replay diverged at entry " + std::to_string(entries_) + ": buffer size mismatch");
+    if (len != 0 && fread(data, 1, len, file_) != len)
+        throw std::runtime_error("replay log ended after " + std::to_string(entries_) + " entries");
+}
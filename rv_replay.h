@@ -0,0 +1,60 @@
+#pragma once
+#include <cstdio>
+#include <cstdint>
+#include <string>
+#include "rv_global.h"
+
+// log of the nondeterministic results the host hands to the guest (clock, input, reads from
+// anything that isn't a regular file), in the order the guest asked for them
+//
+// stream format, one entry per syscall, numbers are LEB128 varints:
+//   (syscall_no << 1) | has_data, retval, then if has_data one (length, bytes) chunk
+//   per guest buffer the syscall filled
+// entries without data are syscalls the host performs again on replay (reads from regular
+// files), only their result is checked
+// reads of the time/timeh csrs are entries too, numbered RV_REPLAY_CSR + csr with the value
+// read as retval
+constexpr rv_uint RV_REPLAY_CSR = 0x10000;
+
+class rv_replay
+{
+public:
+    enum class mode
+    {
+        record,
+        replay
+    };
+
+    struct entry
+    {
+        rv_uint syscall_no;
+        rv_uint retval;
+        bool has_data;
+    };
+
+    rv_replay(const std::string& path, mode m);
+    ~rv_replay();
+
+    rv_replay(const rv_replay&) = delete;
+    rv_replay& operator=(const rv_replay&) = delete;
+
+    bool replaying() const { return mode_ == mode::replay; }
+    uint64_t entry_count() const { return entries_; }
+
+    // record
+    void put_entry(rv_uint syscall_no, rv_uint retval, bool has_data);
+    void put_data(const void* data, size_t len);
+
+    // replay, both throw once the log and the guest disagree
+    entry next_entry();
+    void get_data(void* data, size_t len);
+
+private:
+    void put_varint(uint64_t value);
+    uint64_t get_varint();
+
+private:
+    FILE* file_ = nullptr;
+    mode mode_;
+    uint64_t entries_ = 0;
+};
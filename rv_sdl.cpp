@@ -1,11 +1,95 @@
 #include "rv_sdl.h"
+#include <algorithm>
 #include <errno.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+static void expand_row_scalar(const uint8_t* src, uint32_t* dst, const uint32_t* palette, int width)
+{
+    for (int x = 0; x < width; ++x)
+        dst[x] = palette[src[x]];
+}
+
+#if defined(__x86_64__)
+// 8 pixels at a time, the palette lookup is a single gather
+__attribute__((target("avx2")))
+static void expand_row_avx2(const uint8_t* src, uint32_t* dst, const uint32_t* palette, int width)
+{
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        const __m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + x)));
+        const __m256i argb = _mm256_i32gather_epi32(reinterpret_cast<const int*>(palette), index, 4);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + x), argb);
+    }
+    expand_row_scalar(src + x, dst + x, palette, width - x);
+}
+#endif
+
+static void (*select_expand_row())(const uint8_t*, uint32_t*, const uint32_t*, int)
+{
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2"))
+        return expand_row_avx2;
+#endif
+    return expand_row_scalar;
+}
 
 void rv_sdl::log_sdl_error(const char *syscall_name, const char *sdl_func)
 {
     fprintf(stderr, "[e] error: syscall_%s - SDL_%s() failed with: %s\n", syscall_name, sdl_func, SDL_GetError());
 }
 
+rv_sdl::~rv_sdl()
+{
+    // the callback must not outlive the mixer
+    close_audio();
+}
+
+void rv_sdl::audio_callback(void* userdata, Uint8* stream, int len)
+{
+    static_cast<rv_sdl*>(userdata)->mixer_.mix(reinterpret_cast<int16_t*>(stream), (size_t)len / 4);
+}
+
+bool rv_sdl::open_audio()
+{
+    if (SDL_InitSubSystem(SDL_INIT_AUDIO) < 0) {
+        log_sdl_error("audio_init", "InitSubSystem");
+        return false;
+    }
+
+    // whatever the device wants instead, SDL converts to it
+    SDL_AudioSpec wanted{};
+    wanted.freq = rv_mixer::output_rate;
+    wanted.format = AUDIO_S16SYS;
+    wanted.channels = 2;
+    wanted.samples = 512;
+    wanted.callback = audio_callback;
+    wanted.userdata = this;
+    audio_device_ = SDL_OpenAudioDevice(nullptr, 0, &wanted, nullptr, 0);
+    if (audio_device_ == 0) {
+        log_sdl_error("audio_init", "OpenAudioDevice");
+        SDL_QuitSubSystem(SDL_INIT_AUDIO);
+        return false;
+    }
+    // the music is synthesized ahead on its own thread, the callback only picks it up
+    music_.start_thread();
+    SDL_PauseAudioDevice(audio_device_, 0);
+    return true;
+}
+
+void rv_sdl::close_audio()
+{
+    if (audio_device_ != 0) {
+        SDL_CloseAudioDevice(audio_device_);
+        SDL_QuitSubSystem(SDL_INIT_AUDIO);
+        music_.stop_thread();
+        audio_device_ = 0;
+        audio_open_ = false;
+    }
+}
+
 rv_uint rv_sdl::syscall_init(rv_uint arg0, rv_uint arg1)
 {
     if (SDL_Init(SDL_INIT_VIDEO) < 0) {
@@ -26,59 +110,76 @@ rv_uint rv_sdl::syscall_init(rv_uint arg0, rv_uint arg1)
     SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "nearest");
     SDL_RenderSetLogicalSize(main_renderer_, width_, height_);
 
-    main_surface_ = SDL_CreateRGBSurface(0, width_, height_, 32, 0, 0, 0, 0);
-    if (main_surface_ == nullptr) {
-        log_sdl_error("init", "CreateRGBSurface");
-        return (rv_uint)-1;
-    }
-
     main_texture_ = SDL_CreateTexture(main_renderer_, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, width_, height_);
     if (main_texture_ == nullptr) {
         log_sdl_error("init", "CreateTexture");
         return (rv_uint)-1;
     }
+
+    presented_.assign((size_t)width_*height_, 0);
+    full_redraw_ = true;
+    expand_row_ = select_expand_row();
     return 0;
 }
 
 rv_uint rv_sdl::syscall_set_palette(rv_uint arg0, rv_uint arg1)
 {
-    if (arg0 == 0 || arg1 == 0)
-        return (rv_uint)-EINVAL;
+    const rv_uint res = rv_av_backend::syscall_set_palette(arg0, arg1);
 
-    SDL_Color *colors = reinterpret_cast<SDL_Color*>(memory_.ram_ptr(arg0));
-    int cnt = (int)arg1;
-
-    if (SDL_SetPaletteColors(screen_surface_->format->palette, colors, 0, cnt) < 0) {
-        log_sdl_error("set_palette", "SetPaletteColors");
-        return (rv_uint)-1;
-    }
-    return 0;
+    // every pixel may have changed
+    if (res == 0)
+        full_redraw_ = true;
+    return res;
 }
 
 rv_uint rv_sdl::syscall_set_framebuffer(rv_uint arg0)
 {
-    if (arg0 == 0)
-        return (rv_uint)-EINVAL;
-
-    void *pixels = reinterpret_cast<void*>(memory_.ram_ptr(arg0));
-    screen_surface_ = SDL_CreateRGBSurfaceFrom(pixels, width_, height_, 8, width_, 0, 0, 0, 0);
-    if (screen_surface_ == nullptr) {
-        log_sdl_error("set_framebuffer", "CreateRGBSurfaceFrom");
-        return (rv_uint)-1;
-    }
-    return 0;
+    const rv_uint res = rv_av_backend::syscall_set_framebuffer(arg0);
+    if (res == 0)
+        full_redraw_ = true;
+    return res;
 }
 
 rv_uint rv_sdl::syscall_update()
 {
-    if (SDL_BlitSurface(screen_surface_, nullptr, main_surface_, nullptr) < 0) {
-        log_sdl_error("update", "BlitSurface");
-        return (rv_uint)-1;
+    if (framebuffer_ == 0)
+        return (rv_uint)-EINVAL;
+    if (!memory_.check_range(framebuffer_, (size_t)width_*height_, RV_MEMORY_R))
+        return (rv_uint)-EFAULT;
+
+    // only the rows that changed since the last frame are converted, straight into the texture
+    const uint8_t *pixels = memory_.ram_ptr(framebuffer_);
+    int first_row = height_;
+    int last_row = -1;
+    for (int y = 0; y < height_; ++y) {
+        const uint8_t *row = pixels + (size_t)y*width_;
+        uint8_t *presented_row = presented_.data() + (size_t)y*width_;
+        if (full_redraw_ || memcmp(row, presented_row, width_) != 0) {
+            memcpy(presented_row, row, width_);
+            if (first_row > y)
+                first_row = y;
+            last_row = y;
+        }
     }
-    if (SDL_UpdateTexture(main_texture_, nullptr, main_surface_->pixels, main_surface_->pitch) < 0) {
-        log_sdl_error("update", "UpdateTexture");
-        return (rv_uint)-1;
+    full_redraw_ = false;
+
+    if (last_row >= 0) {
+        // the locked rows don't keep their old content, clean rows in between are converted too
+        SDL_Rect rect{0, first_row, width_, last_row - first_row + 1};
+        void *texture_pixels = nullptr;
+        int pitch = 0;
+        if (SDL_LockTexture(main_texture_, &rect, &texture_pixels, &pitch) < 0) {
+            log_sdl_error("update", "LockTexture");
+            full_redraw_ = true;
+            return (rv_uint)-1;
+        }
+        for (int y = first_row; y <= last_row; ++y) {
+            auto *dst = reinterpret_cast<uint32_t*>(static_cast<uint8_t*>(texture_pixels) + (size_t)(y - first_row)*pitch);
+            expand_row_(presented_.data() + (size_t)y*width_, dst, palette_.data(), width_);
+        }
+        SDL_UnlockTexture(main_texture_);
     }
+
     if (SDL_RenderClear(main_renderer_) < 0) {
         log_sdl_error("update", "RenderClear");
         return (rv_uint)-1;
@@ -88,6 +189,7 @@ rv_uint rv_sdl::syscall_update()
         return (rv_uint)-1;
     }
     SDL_RenderPresent(main_renderer_);
+    ++frame_count_;
 
     return 0;
 }
@@ -96,6 +198,11 @@ rv_uint rv_sdl::syscall_poll_event(rv_uint arg0)
 {
     if (arg0 == 0)
         return (rv_uint)-EINVAL;
+    // room for the largest event
+    const size_t event_size = std::max(sizeof(av_event_keyboard),
+        std::max(sizeof(av_event_mouse_button), sizeof(av_event_mouse_move)));
+    if (!memory_.check_range(arg0, event_size, RV_MEMORY_W))
+        return (rv_uint)-EFAULT;
 
     SDL_Event event;
     if(SDL_PollEvent(&event)) {
@@ -157,13 +264,16 @@ rv_uint rv_sdl::syscall_delay(rv_uint arg0)
     return 0;
 }
 
-rv_uint rv_sdl::syscall_get_ticks()
+rv_uint rv_sdl::syscall_get_ticks(uint64_t) const
 {
-    return (rv_uint)SDL_GetTicks();
+    return (rv_uint)SDL_GetTicks() + ticks_offset_;
 }
 
 rv_uint rv_sdl::syscall_get_mouse_state(rv_uint arg0, rv_uint arg1)
 {
+    if ((arg0 != 0 && !memory_.check_range(arg0, sizeof(int32_t), RV_MEMORY_W)) ||
+        (arg1 != 0 && !memory_.check_range(arg1, sizeof(int32_t), RV_MEMORY_W)))
+        return (rv_uint)-EFAULT;
     int *x = arg0 != 0 ? (int *)memory_.ram_ptr(arg0) : nullptr;
     int *y = arg1 != 0 ? (int *)memory_.ram_ptr(arg1) : nullptr;
 
@@ -181,10 +291,8 @@ rv_uint rv_sdl::syscall_warp_mouse(rv_uint arg0, rv_uint arg1)
 
 rv_uint rv_sdl::syscall_shutdown()
 {
-    if (main_surface_ != nullptr)
-        SDL_FreeSurface(main_surface_);
-    if (screen_surface_ != nullptr)
-        SDL_FreeSurface(screen_surface_);
+    close_audio();
+
     if (main_texture_ != nullptr)
         SDL_DestroyTexture(main_texture_);
 
@@ -195,4 +303,16 @@ rv_uint rv_sdl::syscall_shutdown()
 
     SDL_Quit();
     return 0;
-}
\ No newline at end of file
+}
+
+uint64_t rv_sdl::time_us(uint64_t) const
+{
+    const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - epoch_);
+    return (uint64_t)elapsed.count() + (uint64_t)((int64_t)(int32_t)ticks_offset_ * 1000);
+}
+
+void rv_sdl::restore_ticks(rv_uint ticks)
+{
+    full_redraw_ = true;
+    ticks_offset_ = ticks - (rv_uint)SDL_GetTicks();
+}
@@ -1,37 +1,60 @@
 #pragma once
+#include <chrono>
+#include <vector>
 #include <SDL2/SDL.h>
 
-#include "rv_av.h"
-#include "rv_global.h"
-#include "rv_memory.h"
+#include "rv_av_backend.h"
 
-class rv_sdl
+// SDL_Init/SDL_Quit are process-global: one window per process, the other guests of
+// a process must be headless
+class rv_sdl : public rv_av_backend
 {
 public:
-    rv_sdl() = delete;
-    explicit rv_sdl(rv_memory& memory) : memory_{memory} {}
-
-    rv_uint syscall_init(rv_uint arg0, rv_uint arg1);
-    rv_uint syscall_set_framebuffer(rv_uint arg0);
-    rv_uint syscall_delay(rv_uint arg0);
-    rv_uint syscall_update();
-    rv_uint syscall_set_palette(rv_uint arg0, rv_uint arg1);
-    rv_uint syscall_poll_event(rv_uint arg0);
-    rv_uint syscall_get_ticks();
-    rv_uint syscall_get_mouse_state(rv_uint arg0, rv_uint arg1);
-    rv_uint syscall_warp_mouse(rv_uint arg0, rv_uint arg1);
-    rv_uint syscall_shutdown();
+    explicit rv_sdl(rv_memory& memory) : rv_av_backend{memory} {}
+    ~rv_sdl() override;
+
+    rv_uint syscall_init(rv_uint arg0, rv_uint arg1) override;
+    rv_uint syscall_set_framebuffer(rv_uint arg0) override;
+    rv_uint syscall_delay(rv_uint arg0) override;
+    rv_uint syscall_update() override;
+    rv_uint syscall_set_palette(rv_uint arg0, rv_uint arg1) override;
+    rv_uint syscall_poll_event(rv_uint arg0) override;
+    rv_uint syscall_get_ticks(uint64_t insn_count) const override;
+    rv_uint syscall_get_mouse_state(rv_uint arg0, rv_uint arg1) override;
+    rv_uint syscall_warp_mouse(rv_uint arg0, rv_uint arg1) override;
+    rv_uint syscall_shutdown() override;
+
+    uint64_t time_us(uint64_t insn_count) const override;
+
+protected:
+    void restore_ticks(rv_uint ticks) override;
+
+    // the mixer runs on the SDL audio thread, the music synthesizer on one of its own
+    bool open_audio() override;
 
 private:
     void log_sdl_error(const char* syscall_name, const char* sdl_func);
+    void close_audio();
+    static void audio_callback(void* userdata, Uint8* stream, int len);
+
+    // 8bit indexed scanline to ARGB8888
+    using expand_row_fn = void (*)(const uint8_t* src, uint32_t* dst, const uint32_t* palette, int width);
 
 private:
-    rv_memory& memory_;
     SDL_Window *main_window_ = nullptr;
     SDL_Renderer *main_renderer_ = nullptr;
-    SDL_Surface *main_surface_ = nullptr;
-    SDL_Surface *screen_surface_ = nullptr;
     SDL_Texture *main_texture_ = nullptr;
-    int width_ = -1;
-    int height_ = -1;
-};
\ No newline at end of file
+
+    // the framebuffer as last presented, rows that still match are not converted again
+    std::vector<uint8_t> presented_;
+    bool full_redraw_ = true;
+    expand_row_fn expand_row_ = nullptr;
+
+    SDL_AudioDeviceID audio_device_ = 0;
+
+    // added to the host clock, av_get_ticks carries on from where a snapshot was taken
+    uint32_t ticks_offset_ = 0;
+
+    // rdtime counts from here, SDL_GetTicks only has ms
+    std::chrono::steady_clock::time_point epoch_ = std::chrono::steady_clock::now();
+};
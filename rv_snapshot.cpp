@@ -0,0 +1,107 @@
+#include <cstring>
+#include <stdexcept>
+#include <unistd.h>
+#include <fcntl.h>
+#include "rv_snapshot.h"
+#include "rv_memory.h"
+#include "rv_cpu.h"
+
+rv_snapshot_writer::rv_snapshot_writer(const std::string& path, rv_uint ram_size)
+{
+    fd_ = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd_ == -1)
+        throw std::runtime_error("unable to create snapshot " + path);
+
+    memcpy(header_.magic, RV_SNAPSHOT_MAGIC, sizeof(header_.magic));
+    header_.version = RV_SNAPSHOT_VERSION;
+    header_.ram_size = ram_size;
+    offset_ = sizeof(header_);
+}
+
+rv_snapshot_writer::~rv_snapshot_writer()
+{
+    if (fd_ != -1)
+        close(fd_);
+}
+
+void rv_snapshot_writer::write(const void* data, size_t len)
+{
+    auto* p = static_cast<const uint8_t*>(data);
+    while (len != 0) {
+        const ssize_t res = pwrite(fd_, p, len, (off_t)offset_);
+        if (res <= 0)
+            throw std::runtime_error("snapshot write failed");
+        p += res;
+        len -= (size_t)res;
+        offset_ += (uint64_t)res;
+    }
+}
+
+void rv_snapshot_writer::put_string(const std::string& value)
+{
+    put<uint32_t>((uint32_t)value.size());
+    write(value.data(), value.size());
+}
+
+void rv_snapshot_writer::begin_ram()
+{
+    offset_ = (offset_ + 0xFFF) & ~0xFFFULL;
+    header_.ram_offset = offset_;
+}
+
+void rv_snapshot_writer::finish()
+{
+    // trailing holes
+    if (ftruncate(fd_, (off_t)offset_) == -1)
+        throw std::runtime_error("snapshot write failed");
+    offset_ = 0;
+    write(&header_, sizeof(header_));
+}
+
+rv_snapshot_reader::rv_snapshot_reader(const std::string& path)
+{
+    fd_ = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd_ == -1)
+        throw std::runtime_error("unable to open snapshot " + path);
+
+    read(&header_, sizeof(header_));
+    if (memcmp(header_.magic, RV_SNAPSHOT_MAGIC, sizeof(header_.magic)) != 0)
+        throw std::runtime_error("invalid snapshot file");
+    if (header_.version != RV_SNAPSHOT_VERSION)
+        throw std::runtime_error("unsupported snapshot version");
+}
+
+rv_snapshot_reader::~rv_snapshot_reader()
+{
+    if (fd_ != -1)
+        close(fd_);
+}
+
+void rv_snapshot_reader::read(void* data, size_t len)
+{
+    auto* p = static_cast<uint8_t*>(data);
+    while (len != 0) {
+        const ssize_t res = pread(fd_, p, len, (off_t)offset_);
+        if (res <= 0)
+            throw std::runtime_error("truncated snapshot");
+        p += res;
+        len -= (size_t)res;
+        offset_ += (uint64_t)res;
+    }
+}
+
+std::string rv_snapshot_reader::get_string()
+{
+    std::string value(get<uint32_t>(), '\0');
+    read(&value[0], value.size());
+    return value;
+}
+
+void rv_save_snapshot(const std::string& path, const rv_memory& memory, rv_cpu& cpu)
+{
+    rv_snapshot_writer snapshot(path, memory.ram_end());
+    memory.save_state(snapshot);
+    cpu.save_state(snapshot);
+    memory.save_ram(snapshot);
+    snapshot.finish();
+}
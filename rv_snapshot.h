@@ -0,0 +1,87 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "rv_global.h"
+
+// snapshot file layout: a header, the state of rv_memory and rv_cpu (in this order)
+// and finally the guest ram at ram_offset, page aligned so that it can be mapped
+// copy-on-write on restore. all zero ram pages are left as holes in the file
+struct rv_snapshot_header
+{
+    char magic[8];
+    uint32_t version;
+    rv_uint ram_size;
+    uint64_t ram_offset;
+};
+
+constexpr char RV_SNAPSHOT_MAGIC[8] = {'R', 'I', 'S', 'C', '6', '6', '6', 'S'};
+constexpr uint32_t RV_SNAPSHOT_VERSION = 4;
+
+class rv_memory;
+class rv_cpu;
+
+class rv_snapshot_writer
+{
+public:
+    explicit rv_snapshot_writer(const std::string& path, rv_uint ram_size);
+    ~rv_snapshot_writer();
+
+    rv_snapshot_writer(const rv_snapshot_writer&) = delete;
+    rv_snapshot_writer& operator=(const rv_snapshot_writer&) = delete;
+
+    void write(const void* data, size_t len);
+    template<typename T> void put(const T& value) { write(&value, sizeof(T)); }
+    void put_string(const std::string& value);
+    template<typename T> void put_vector(const std::vector<T>& value)
+    {
+        put<uint64_t>(value.size());
+        write(value.data(), value.size()*sizeof(T));
+    }
+
+    // ram comes last, from here on skip() leaves holes
+    void begin_ram();
+    void skip(size_t len) { offset_ += len; }
+
+    // write the header and set the final size of the file
+    void finish();
+
+private:
+    int fd_ = -1;
+    uint64_t offset_ = 0;
+    rv_snapshot_header header_{};
+};
+
+class rv_snapshot_reader
+{
+public:
+    explicit rv_snapshot_reader(const std::string& path);
+    ~rv_snapshot_reader();
+
+    rv_snapshot_reader(const rv_snapshot_reader&) = delete;
+    rv_snapshot_reader& operator=(const rv_snapshot_reader&) = delete;
+
+    const rv_snapshot_header& header() const { return header_; }
+    int fd() const { return fd_; }
+
+    void read(void* data, size_t len);
+    template<typename T> T get()
+    {
+        T value;
+        read(&value, sizeof(T));
+        return value;
+    }
+    std::string get_string();
+    template<typename T> void get_vector(std::vector<T>& value)
+    {
+        value.resize(get<uint64_t>());
+        read(value.data(), value.size()*sizeof(T));
+    }
+
+private:
+    int fd_ = -1;
+    uint64_t offset_ = 0;
+    rv_snapshot_header header_{};
+};
+
+void rv_save_snapshot(const std::string& path, const rv_memory& memory, rv_cpu& cpu);
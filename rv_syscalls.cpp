@@ -0,0 +1,126 @@
+#include <algorithm>
+#include <csignal>
+#include <stdexcept>
+#include <string>
+#include "rv_syscalls.h"
+
+static volatile sig_atomic_t stats_requested = 0;
+
+static void stats_signal_handler(int)
+{
+    stats_requested = 1;
+}
+
+void rv_syscall_stats::add(uint64_t ns)
+{
+    size_t bucket = 0;
+    if (ns != 0)
+        bucket = std::min<size_t>(63 - __builtin_clzll(ns), num_buckets - 1);
+    calls.fetch_add(1, std::memory_order_relaxed);
+    total_ns.fetch_add(ns, std::memory_order_relaxed);
+    histogram[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+rv_syscall_table::rv_syscall_table()
+    : index_{new const rv_syscall*[max_syscall]()}
+{
+}
+
+void rv_syscall_table::add(rv_uint number, const char* name, uint8_t num_args, rv_syscall_handler handler)
+{
+    if (number >= max_syscall || index_[number] != nullptr)
+        throw std::runtime_error("invalid syscall registration: " + std::string(name));
+    auto syscall = std::make_unique<rv_syscall>();
+    syscall->number = number;
+    syscall->name = name;
+    syscall->num_args = num_args;
+    syscall->handler = handler;
+    index_[number] = syscall.get();
+    syscalls_.push_back(std::move(syscall));
+}
+
+std::string rv_syscall::format_call(const rv_uint* args) const
+{
+    std::string call = std::string(name) + "(";
+    char arg[16];
+    for (uint8_t i = 0; i < num_args; ++i) {
+        snprintf(arg, sizeof(arg), "0x%08x", args[i]);
+        call += i == 0 ? arg : std::string(", ") + arg;
+    }
+    return call + ")";
+}
+
+void rv_syscall_table::unknown(rv_uint number, const rv_uint* args) const
+{
+    unknown_stats_.add(0);
+    std::lock_guard<std::mutex> lock(unknown_lock_);
+    if (unknown_seen_.insert(number).second)
+        fprintf(stderr, "[e] error: unimplemented syscall %u (0x%08x, 0x%08x, 0x%08x, 0x%08x, 0x%08x, 0x%08x), returning -ENOSYS\n",
+            number, args[0], args[1], args[2], args[3], args[4], args[5]);
+}
+
+// lower bound of a histogram bucket, in the largest unit that keeps it whole
+static std::string bucket_label(size_t bucket)
+{
+    const uint64_t ns = 1ull << bucket;
+    if (ns >= 1000000000ull)
+        return std::to_string(ns / 1000000000ull) + "s";
+    if (ns >= 1000000ull)
+        return std::to_string(ns / 1000000ull) + "ms";
+    if (ns >= 1000ull)
+        return std::to_string(ns / 1000ull) + "us";
+    return std::to_string(ns) + "ns";
+}
+
+static void print_histogram(FILE* out, const rv_syscall_stats& stats)
+{
+    std::string line;
+    for (size_t i = 0; i < rv_syscall_stats::num_buckets; ++i) {
+        const uint64_t count = stats.histogram[i].load(std::memory_order_relaxed);
+        if (count != 0)
+            line += " >=" + bucket_label(i) + ":" + std::to_string(count);
+    }
+    fprintf(out, "[i]       %s\n", line.c_str());
+}
+
+void rv_syscall_table::print_stats(FILE* out) const
+{
+    std::vector<const rv_syscall*> order;
+    for (const auto& syscall : syscalls_) {
+        if (syscall->stats.calls.load(std::memory_order_relaxed) != 0)
+            order.push_back(syscall.get());
+    }
+    std::sort(order.begin(), order.end(), [](const rv_syscall* a, const rv_syscall* b) {
+        return a->stats.total_ns.load(std::memory_order_relaxed) > b->stats.total_ns.load(std::memory_order_relaxed);
+    });
+
+    fprintf(out, "[i] syscalls, host time\n");
+    fprintf(out, "[i]   %-24s %4s %10s %12s %10s\n", "syscall", "args", "calls", "total ms", "avg us");
+    for (const auto* syscall : order) {
+        const uint64_t calls = syscall->stats.calls.load(std::memory_order_relaxed);
+        const uint64_t ns = syscall->stats.total_ns.load(std::memory_order_relaxed);
+        fprintf(out, "[i]   %-24s %4u %10llu %12.3f %10.3f\n", syscall->name, syscall->num_args, (unsigned long long)calls,
+            double(ns)/1e6, double(ns)/1e3/double(calls));
+        print_histogram(out, syscall->stats);
+    }
+    const uint64_t unknown = unknown_stats_.calls.load(std::memory_order_relaxed);
+    if (unknown != 0)
+        fprintf(out, "[i]   %-24s %4s %10llu\n", "unimplemented", "", (unsigned long long)unknown);
+}
+
+void rv_syscall_install_stats_signal()
+{
+    struct sigaction sa{};
+    sa.sa_handler = stats_signal_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &sa, nullptr);
+}
+
+void rv_syscall_poll_stats(const rv_syscall_table& table)
+{
+    if (likely(stats_requested == 0))
+        return;
+    stats_requested = 0;
+    table.print_stats(stderr);
+}
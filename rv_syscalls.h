@@ -0,0 +1,76 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+#include "rv_global.h"
+
+class rv_cpu;
+
+// args holds a0..a5, the result goes back to a0
+using rv_syscall_handler = rv_uint (*)(rv_cpu& cpu, const rv_uint* args);
+
+// calls and host time spent in one syscall, shared by every guest in the process
+struct rv_syscall_stats
+{
+    // bucket i counts calls that took [2^i, 2^(i+1)) ns
+    static constexpr size_t num_buckets = 40;
+
+    void add(uint64_t ns);
+
+    std::atomic<uint64_t> calls{0};
+    std::atomic<uint64_t> total_ns{0};
+    std::array<std::atomic<uint64_t>, num_buckets> histogram{};
+};
+
+struct rv_syscall
+{
+    rv_uint number;
+    const char* name;
+    uint8_t num_args;
+    rv_syscall_handler handler;
+    mutable rv_syscall_stats stats;
+
+    // "name(0x..., ...)" with its num_args arguments
+    std::string format_call(const rv_uint* args) const;
+};
+
+// handlers by syscall number, newlib numbers and the av range share it
+class rv_syscall_table
+{
+public:
+    static constexpr rv_uint max_syscall = 4096;
+
+    rv_syscall_table();
+
+    // throws if number is out of range or taken already
+    void add(rv_uint number, const char* name, uint8_t num_args, rv_syscall_handler handler);
+
+    // nullptr if nothing is registered under number
+    const rv_syscall* find(rv_uint number) const
+    {
+        return number < max_syscall ? index_[number] : nullptr;
+    }
+
+    // counted together, each number is reported once, with a0..a5 of its first call
+    void unknown(rv_uint number, const rv_uint* args) const;
+
+    // every syscall called so far, most host time first
+    void print_stats(FILE* out) const;
+
+private:
+    std::vector<std::unique_ptr<rv_syscall>> syscalls_;
+    std::unique_ptr<const rv_syscall*[]> index_;
+
+    mutable rv_syscall_stats unknown_stats_;
+    mutable std::mutex unknown_lock_;
+    mutable std::set<rv_uint> unknown_seen_;
+};
+
+// SIGUSR1 asks for the syscall stats, printed by the next rv_syscall_poll_stats() call
+void rv_syscall_install_stats_signal();
+void rv_syscall_poll_stats(const rv_syscall_table& table);
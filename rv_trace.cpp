@@ -0,0 +1,414 @@
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+#include "rv_trace.h"
+
+constexpr char RV_TRACE_MAGIC[8] = {'R', 'V', '6', 'T', 'R', 'A', 'C', 'E'};
+constexpr uint32_t RV_TRACE_VERSION = 3;
+
+// bytes written out at once
+constexpr size_t kWriteBuffer = 256 * 1024;
+
+constexpr uint8_t RV_TRACE_BLOCK = 1;
+constexpr uint8_t RV_TRACE_COUNT = 2;
+
+static uint8_t* put_varint(uint64_t value, uint8_t* out)
+{
+    while (value >= 0x80) {
+        *out++ = (uint8_t)((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    *out++ = (uint8_t)value;
+    return out;
+}
+
+static uint64_t zigzag(int64_t value)
+{
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static int64_t unzigzag(uint64_t value)
+{
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+// 2 for compressed instructions
+static rv_uint insn_length(uint32_t insn)
+{
+    return (insn & 3) != 3 ? 2 : 4;
+}
+
+void rv_trace_format::block::add(rv_uint pc, uint32_t insn, uint8_t dest, uint8_t access, uint8_t value,
+    uint8_t src1, uint8_t src2, rv_int imm)
+{
+    if (words_before.empty())
+        words_before.push_back(0);
+    pcs.push_back(pc);
+    insns.push_back(insn);
+    dests.push_back(dest);
+    accesses.push_back(access);
+    values.push_back(value);
+    rs1.push_back(src1 & 31);
+    rs2.push_back(src2 & 31);
+    imms.push_back(imm);
+    size_t words = last.size();
+    if (dest != rv_trace_record::no_dest && value == rv_trace_format::value_recorded)
+        words += dest >= 32 ? 2 : 1;
+    last.resize(words);
+    stride.resize(words);
+    words_before.push_back((uint32_t)words);
+}
+
+rv_uint rv_trace_format::compute(uint8_t value, rv_uint a, rv_uint b)
+{
+    switch (value & ~value_imm_operand) {
+    case value_add: return a + b;
+    case value_sub: return a - b;
+    case value_sll: return a << (b & 0x1F);
+    case value_slt: return (rv_int)a < (rv_int)b ? 1 : 0;
+    case value_sltu: return a < b ? 1 : 0;
+    case value_xor: return a ^ b;
+    case value_srl: return a >> (b & 0x1F);
+    case value_sra: return (rv_uint)((rv_int)a >> (b & 0x1F));
+    case value_or: return a | b;
+    case value_and: return a & b;
+    case value_mul: return (rv_uint)((rv_long)(rv_int)a * (rv_long)(rv_int)b);
+    case value_mulh: return (rv_uint)(((rv_long)(rv_int)a * (rv_long)(rv_int)b) >> 32);
+    case value_mulhsu: return (rv_uint)(((rv_long)(rv_int)a * (rv_long)b) >> 32);
+    case value_mulhu: return (rv_uint)(((rv_ulong)a * (rv_ulong)b) >> 32);
+    case value_div:
+        if (b == 0)
+            return (rv_uint)-1;
+        if (a == 0x80000000 && b == (rv_uint)-1)
+            return a;
+        return (rv_uint)((rv_int)a / (rv_int)b);
+    case value_divu: return b == 0 ? (rv_uint)-1 : a / b;
+    case value_rem:
+        if (b == 0)
+            return a;
+        if (a == 0x80000000 && b == (rv_uint)-1)
+            return 0;
+        return (rv_uint)((rv_int)a % (rv_int)b);
+    case value_remu: return b == 0 ? a : a % b;
+    default:
+        throw std::runtime_error("corrupted trace");
+    }
+}
+
+void rv_trace_encoder::header(std::string& out)
+{
+    out.append(RV_TRACE_MAGIC, sizeof(RV_TRACE_MAGIC));
+    out.append(reinterpret_cast<const char*>(&RV_TRACE_VERSION), sizeof(RV_TRACE_VERSION));
+}
+
+const uint32_t* rv_trace_encoder::encode(const uint32_t* in, uint8_t*& out)
+{
+    uint8_t* p = out;
+    if (in[0] == rv_trace_format::trace_define) {
+        const uint32_t n = in[1];
+        rv_uint pc = in[2];
+        in += 3;
+        rv_trace_format::block block;
+        *p++ = rv_trace_format::trace_file_define;
+        p = put_varint(n, p);
+        p = put_varint(pc, p);
+        for (uint32_t i = 0; i < n; ++i, in += 4) {
+            const uint8_t dest = (uint8_t)in[1];
+            const uint8_t access = (uint8_t)(in[1] >> 8);
+            const uint8_t value = (uint8_t)(in[1] >> 16);
+            const uint8_t rs1 = (uint8_t)(in[1] >> 24);
+            block.add(pc, in[0], dest, access, value, rs1, (uint8_t)in[2], (rv_int)in[3]);
+            pc += insn_length(in[0]);
+            p = put_varint(in[0], p);
+            *p++ = dest;
+            *p++ = access;
+            *p++ = value;
+            *p++ = rs1;
+            *p++ = (uint8_t)in[2];
+            p = put_varint(zigzag((int32_t)in[3]), p);
+        }
+        blocks_.push_back(std::move(block));
+        out = p;
+        return in;
+    }
+
+    if (in[0] == rv_trace_format::trace_state) {
+        *p++ = rv_trace_format::trace_file_state;
+        for (int i = 1; i < 32; ++i)
+            p = put_varint(in[i], p);
+        out = p;
+        return in + 32;
+    }
+
+    const uint32_t id = in[0];
+    const uint32_t count = in[1];
+    in += 2;
+    auto& block = blocks_[id];
+    auto& previous = blocks_[previous_];
+
+    uint8_t flags = 0;
+    if (id != previous.successor)
+        flags |= RV_TRACE_BLOCK;
+    if (count != block.pcs.size())
+        flags |= RV_TRACE_COUNT;
+    previous.successor = id;
+    previous_ = id;
+
+    *p++ = flags;
+    if (flags & RV_TRACE_BLOCK)
+        p = put_varint(id, p);
+    if (flags & RV_TRACE_COUNT)
+        p = put_varint(count, p);
+
+    // the prediction bits first, the differences after them
+    const uint32_t words = block.words_before[count];
+    uint32_t* last = block.last.data();
+    uint32_t* stride = block.stride.data();
+    uint32_t delta[rv_trace::max_item_words];
+    for (uint32_t i = 0; i < words; ++i) {
+        delta[i] = in[i] - last[i] - stride[i];
+        stride[i] = in[i] - last[i];
+        last[i] = in[i];
+    }
+    in += words;
+
+    uint8_t* bits = p;
+    p += (words + 7) / 8;
+    for (uint32_t i = 0; i < words; i += 8) {
+        uint8_t mispredicted = 0;
+        for (uint32_t j = i; j < i + 8 && j < words; ++j) {
+            if (delta[j] != 0) {
+                mispredicted |= (uint8_t)(1 << (j - i));
+                p = put_varint(zigzag((int32_t)delta[j]), p);
+            }
+        }
+        *bits++ = mispredicted;
+    }
+    out = p;
+    return in;
+}
+
+rv_trace_decoder::rv_trace_decoder(FILE* file)
+    : file_{file}
+{
+    char magic[sizeof(RV_TRACE_MAGIC)];
+    uint32_t version = 0;
+    if (fread(magic, 1, sizeof(magic), file_) != sizeof(magic) || memcmp(magic, RV_TRACE_MAGIC, sizeof(magic)) != 0)
+        throw std::runtime_error("invalid trace file");
+    if (fread(&version, 1, sizeof(version), file_) != sizeof(version) || version != RV_TRACE_VERSION)
+        throw std::runtime_error("unsupported trace version");
+}
+
+int rv_trace_decoder::get_byte()
+{
+    const int c = fgetc(file_);
+    if (c == EOF)
+        throw std::runtime_error("truncated trace");
+    return c;
+}
+
+uint64_t rv_trace_decoder::get_varint()
+{
+    uint64_t value = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+        const int c = get_byte();
+        value |= (uint64_t)(c & 0x7F) << shift;
+        if ((c & 0x80) == 0)
+            return value;
+    }
+    throw std::runtime_error("corrupted trace");
+}
+
+void rv_trace_decoder::read_define()
+{
+    const uint64_t n = get_varint();
+    if (n == 0 || n > 64)
+        throw std::runtime_error("corrupted trace");
+    rv_trace_format::block block;
+    rv_uint pc = (rv_uint)get_varint();
+    for (uint64_t i = 0; i < n; ++i) {
+        const uint32_t insn = (uint32_t)get_varint();
+        const uint8_t dest = (uint8_t)get_byte();
+        const uint8_t access = (uint8_t)get_byte();
+        const uint8_t value = (uint8_t)get_byte();
+        const uint8_t rs1 = (uint8_t)get_byte();
+        const uint8_t rs2 = (uint8_t)get_byte();
+        const rv_int imm = (rv_int)unzigzag(get_varint());
+        if (dest != rv_trace_record::no_dest &&
+            (dest == 0 || dest >= 64 || (dest >= 32 && value != rv_trace_format::value_recorded)))
+            throw std::runtime_error("corrupted trace");
+        block.add(pc, insn, dest, access, value, rs1, rs2, imm);
+        pc += insn_length(insn);
+    }
+    blocks_.push_back(std::move(block));
+}
+
+void rv_trace_decoder::read_state()
+{
+    for (int i = 1; i < 32; ++i)
+        x_[i] = (rv_uint)get_varint();
+}
+
+void rv_trace_decoder::read_run(int flags)
+{
+    const uint32_t id = (flags & RV_TRACE_BLOCK) ? (uint32_t)get_varint() : blocks_[previous_].successor;
+    if (id == 0 || id >= blocks_.size())
+        throw std::runtime_error("corrupted trace");
+    auto& block = blocks_[id];
+    const uint64_t count = (flags & RV_TRACE_COUNT) ? get_varint() : block.pcs.size();
+    if (count == 0 || count > block.pcs.size())
+        throw std::runtime_error("corrupted trace");
+    blocks_[previous_].successor = id;
+    previous_ = id;
+
+    mispredicted_.resize((block.words_before[count] + 7) / 8);
+    for (auto& bits : mispredicted_)
+        bits = (uint8_t)get_byte();
+    count_ = (uint32_t)count;
+    index_ = 0;
+    word_ = 0;
+}
+
+uint32_t rv_trace_decoder::get_word(rv_trace_format::block& block)
+{
+    const uint32_t i = word_++;
+    uint32_t value = block.last[i] + block.stride[i];
+    if (mispredicted_[i >> 3] & (1 << (i & 7)))
+        value += (uint32_t)unzigzag(get_varint());
+    block.stride[i] = value - block.last[i];
+    block.last[i] = value;
+    return value;
+}
+
+bool rv_trace_decoder::next(rv_trace_record& record)
+{
+    while (index_ == count_) {
+        const int flags = fgetc(file_);
+        if (flags == EOF)
+            return false;
+        if (flags == rv_trace_format::trace_file_define)
+            read_define();
+        else if (flags == rv_trace_format::trace_file_state)
+            read_state();
+        else
+            read_run(flags);
+    }
+
+    auto& block = blocks_[previous_];
+    const uint32_t i = index_++;
+    record.pc = block.pcs[i];
+    record.insn = block.insns[i];
+    record.dest = block.dests[i];
+    record.has_address = block.accesses[i] != 0;
+    record.address = record.has_address ? x_[block.rs1[i]] + block.imms[i] : 0;
+    const uint8_t value = block.values[i];
+    if (record.dest == rv_trace_record::no_dest) {
+        record.value = 0;
+    }
+    else if (value == rv_trace_format::value_recorded) {
+        record.value = get_word(block);
+        if (record.dest >= 32)
+            record.value |= (uint64_t)get_word(block) << 32;
+    }
+    else if (value == rv_trace_format::value_link) {
+        record.value = record.pc + insn_length(record.insn);
+    }
+    else if (value == rv_trace_format::value_imm) {
+        record.value = (rv_uint)block.imms[i];
+    }
+    else {
+        const rv_uint b = (value & rv_trace_format::value_imm_operand) ? (rv_uint)block.imms[i] : x_[block.rs2[i]];
+        record.value = rv_trace_format::compute(value, x_[block.rs1[i]], b);
+    }
+    if (record.dest < 32)
+        x_[record.dest] = (rv_uint)record.value;
+    return true;
+}
+
+rv_trace::rv_trace(const std::string& path)
+    : ring_{new uint32_t[kRingWords]}
+{
+    file_ = fopen(path.c_str(), "wb");
+    if (file_ == nullptr)
+        throw std::runtime_error("unable to create trace " + path);
+    writer_ = std::thread(&rv_trace::writer, this);
+}
+
+rv_trace::~rv_trace()
+{
+    done_.store(true, std::memory_order_release);
+    wakeup_.notify_one();
+    writer_.join();
+    fclose(file_);
+}
+
+uint32_t* rv_trace::wrap(uint64_t head)
+{
+    // the marker itself needs a word
+    if (head + 1 - tail_cache_ > kRingWords)
+        wait_for_space(head + 1);
+    ring_[head & (kRingWords - 1)] = rv_trace_format::trace_wrap;
+    head = (head | (kRingWords - 1)) + 1;
+    head_.store(head, std::memory_order_release);
+    if (head + max_item_words - tail_cache_ > kRingWords)
+        wait_for_space(head + max_item_words);
+    return &ring_[0];
+}
+
+void rv_trace::wait_for_space(uint64_t end)
+{
+    for (;;) {
+        tail_cache_ = tail_.load(std::memory_order_acquire);
+        if (end - tail_cache_ <= kRingWords)
+            return;
+        wakeup_.notify_one();
+        std::this_thread::yield();
+    }
+}
+
+void rv_trace::writer()
+{
+    rv_trace_encoder encoder;
+    std::unique_ptr<uint8_t[]> out{new uint8_t[kWriteBuffer + rv_trace_encoder::max_item_size]};
+    uint64_t tail = 0;
+    bool failed = false;
+
+    // even an empty trace is a valid one
+    std::string header;
+    rv_trace_encoder::header(header);
+    if (fwrite(header.data(), 1, header.size(), file_) != header.size()) {
+        fprintf(stderr, "[e] error: trace write failed, the rest of the trace is dropped\n");
+        failed = true;
+    }
+
+    for (;;) {
+        // done_ first: once it is set, head_ holds every item
+        const bool done = done_.load(std::memory_order_acquire);
+        const uint64_t head = head_.load(std::memory_order_acquire);
+        if (head == tail) {
+            if (done)
+                break;
+            std::unique_lock<std::mutex> lock(wakeup_lock_);
+            wakeup_.wait_for(lock, std::chrono::milliseconds(1));
+            continue;
+        }
+
+        // hand the space back a buffer at a time, the emulation thread may be waiting for it
+        uint8_t* p = out.get();
+        while (tail != head && (size_t)(p - out.get()) < kWriteBuffer) {
+            const uint32_t* item = &ring_[tail & (kRingWords - 1)];
+            if (*item == rv_trace_format::trace_wrap)
+                tail = (tail | (kRingWords - 1)) + 1;
+            else
+                tail += (uint64_t)(encoder.encode(item, p) - item);
+        }
+        tail_.store(tail, std::memory_order_release);
+
+        const size_t len = (size_t)(p - out.get());
+        if (!failed && fwrite(out.get(), 1, len, file_) != len) {
+            fprintf(stderr, "[e] error: trace write failed, the rest of the trace is dropped\n");
+            failed = true;
+        }
+    }
+}
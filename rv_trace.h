@@ -0,0 +1,214 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "rv_global.h"
+
+// one executed guest instruction
+struct rv_trace_record
+{
+    static constexpr uint8_t no_dest = 0xFF;
+
+    rv_uint pc;
+    uint32_t insn;      // as fetched, the low 16 bits only for compressed instructions
+    rv_uint address;    // loads, stores and atomics only
+    uint8_t has_address;
+    uint8_t dest;       // x1..x31, 32 + f0..f31 or no_dest
+    uint64_t value;     // dest after the instruction, f registers as stored (NaN-boxed singles)
+};
+
+// the emulation thread traces whole blocks: every translated block is described once
+// (pc, encodings, which register each instruction writes, how it gets its value and
+// whether it accesses memory), then each run of it only adds the values the reader
+// can't work out itself: it keeps the x registers, computes addresses and integer
+// results from them and only reads loads, csrs, atomics and fp results from the trace
+//
+// ring words, a block description:
+//   trace_define, n, pc of the first instruction, then n times the encoding,
+//   dest | access << 8 | value << 16 | rs1 << 24, rs2 and imm, numbered from 1
+//   access is 0 (none), 1 (at rs1 + imm) or 2 (atomics, at rs1, imm is 0)
+// a run of a block:
+//   id, instructions executed, then for each of them with a value_recorded dest,
+//   its value (two words, low first, for f registers)
+// the registers, ahead of the first run and whenever they may have changed behind
+// the trace's back (syscalls): trace_state, then x1..x31
+// trace_wrap: the rest of the ring is unused, carry on at its start
+//
+// trace file: "RV6TRACE", a 32bit version, then one item per description, state or run
+// numbers are LEB128 varints, deltas are zigzag encoded
+//   description: trace_file_define, n, pc of the first instruction, then for each
+//     instruction its encoding, dest, access, value, rs1 and rs2 (one byte each), then imm
+//     descriptions are numbered from 1 in the order they appear
+//   state: trace_file_state, then x1..x31
+//   run: flags, bit0 the block id follows, otherwise it's the block that followed the
+//     previous one last time, bit1 the count follows, otherwise the whole block ran
+//     then one bit per recorded word (in order, lsb first), set when the word is not
+//     the previous word of the same instruction plus the same stride as last time,
+//     and the difference from that prediction for each set bit
+class rv_trace_format
+{
+public:
+    static constexpr uint32_t trace_wrap = 0xFFFFFFFF;
+    static constexpr uint32_t trace_define = 0xFFFFFFFE;
+    static constexpr uint32_t trace_state = 0xFFFFFFFD;
+    static constexpr uint8_t trace_file_define = 0x80;
+    static constexpr uint8_t trace_file_state = 0x81;
+
+    // how an instruction's dest gets its value
+    enum : uint8_t
+    {
+        value_recorded,     // in the trace
+        value_link,         // the address of the next instruction
+        value_imm,          // lui, auipc (imm is absolute)
+        // rs1 op rs2, or rs1 op imm with value_imm_operand
+        value_add, value_sub, value_sll, value_slt, value_sltu, value_xor,
+        value_srl, value_sra, value_or, value_and,
+        value_mul, value_mulh, value_mulhsu, value_mulhu,
+        value_div, value_divu, value_rem, value_remu,
+    };
+    static constexpr uint8_t value_imm_operand = 0x80;
+
+    // value_add.. on the x registers, like the interpreter does
+    static rv_uint compute(uint8_t value, rv_uint a, rv_uint b);
+
+    // a described block, with the state of its predictors: one per recorded word
+    struct block
+    {
+        std::vector<rv_uint> pcs;
+        std::vector<uint32_t> insns;
+        std::vector<uint8_t> dests;
+        std::vector<uint8_t> accesses;
+        std::vector<uint8_t> values;
+        std::vector<uint8_t> rs1;
+        std::vector<uint8_t> rs2;
+        std::vector<rv_int> imms;
+        // words ahead of each instruction, one more entry for the total
+        std::vector<uint32_t> words_before;
+        std::vector<uint32_t> last;
+        std::vector<uint32_t> stride;
+        uint32_t successor = 0;
+
+        void add(rv_uint pc, uint32_t insn, uint8_t dest, uint8_t access, uint8_t value,
+            uint8_t src1, uint8_t src2, rv_int imm);
+    };
+};
+
+class rv_trace_encoder
+{
+public:
+    static void header(std::string& out);
+
+    // worst case for one item
+    static constexpr size_t max_item_size = 4096;
+
+    // encodes the item at in (not a trace_wrap) to out, returns the word after it
+    const uint32_t* encode(const uint32_t* in, uint8_t*& out);
+
+private:
+    std::vector<rv_trace_format::block> blocks_{1};
+    uint32_t previous_ = 0;
+};
+
+class rv_trace_decoder
+{
+public:
+    // throws on a bad header
+    explicit rv_trace_decoder(FILE* file);
+
+    // false at the end of the trace, throws if it's truncated
+    bool next(rv_trace_record& record);
+
+private:
+    int get_byte();
+    uint64_t get_varint();
+    void read_define();
+    void read_state();
+    void read_run(int flags);
+    uint32_t get_word(rv_trace_format::block& block);
+
+private:
+    FILE* file_;
+    std::vector<rv_trace_format::block> blocks_{1};
+    uint32_t previous_ = 0;
+
+    // the run being read back
+    rv_trace_format::block* block_ = nullptr;
+    uint32_t count_ = 0;
+    uint32_t index_ = 0;
+    uint32_t word_ = 0;
+    std::vector<uint8_t> mispredicted_;
+
+    // x0..x31 as of the record returned last
+    rv_uint x_[32] = {};
+};
+
+// lock-free single producer, single consumer ring of words between the emulation thread
+// and a writer thread that encodes them and writes them out
+// the emulation thread only waits when the writer falls a whole ring behind
+class rv_trace
+{
+public:
+    // the most words a block run or description takes
+    static constexpr size_t max_item_words = 4*64 + 4;  // 64 = rv_block::max_insns, and a spare word
+
+    // starts the writer thread
+    explicit rv_trace(const std::string& path);
+    // drains the ring and closes the file
+    ~rv_trace();
+
+    rv_trace(const rv_trace&) = delete;
+    rv_trace& operator=(const rv_trace&) = delete;
+
+    // emulation thread only: room for at least max_item_words contiguous words at the head,
+    // written up to end with commit()
+    uint32_t* reserve()
+    {
+        const uint64_t head = head_.load(std::memory_order_relaxed);
+        const size_t pos = head & (kRingWords - 1);
+        if (unlikely(pos + max_item_words > kRingWords))
+            return wrap(head);
+        if (unlikely(head + max_item_words - tail_cache_ > kRingWords))
+            wait_for_space(head + max_item_words);
+        return &ring_[pos];
+    }
+    // publishes everything up to end, records are the instructions it holds
+    void commit(const uint32_t* end, uint64_t records)
+    {
+        const uint64_t head = head_.load(std::memory_order_relaxed);
+        head_.store(head + (uint64_t)(end - &ring_[head & (kRingWords - 1)]), std::memory_order_release);
+        records_ += records;
+    }
+
+    // instructions traced so far
+    uint64_t record_count() const { return records_; }
+
+private:
+    uint32_t* wrap(uint64_t head);
+    // until the head can move up to end
+    void wait_for_space(uint64_t end);
+    void writer();
+
+private:
+    static constexpr size_t kRingWords = 1 << 20;
+
+    FILE* file_ = nullptr;
+    std::unique_ptr<uint32_t[]> ring_;
+    uint64_t records_ = 0;
+
+    // producer side, the consumer's position as last seen
+    alignas(64) std::atomic<uint64_t> head_{0};
+    uint64_t tail_cache_ = 0;
+
+    alignas(64) std::atomic<uint64_t> tail_{0};
+    std::atomic<bool> done_{false};
+
+    // the writer naps on it while the ring is empty, a full ring wakes it up early
+    std::mutex wakeup_lock_;
+    std::condition_variable wakeup_;
+    std::thread writer_;
+};
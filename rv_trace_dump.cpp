@@ -0,0 +1,85 @@
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <unordered_set>
+#include <unistd.h>
+#include "rv_trace.h"
+
+// reader for the traces written by risc_666 --trace, see rv_trace.h
+
+static void usage(const char *path)
+{
+    fprintf(stderr, "Usage: %s [-s] <trace_file>\n", path);
+    fprintf(stderr, "  -s   only print a summary\n");
+}
+
+static void print_record(const rv_trace_record& record)
+{
+    if ((record.insn & 3) != 3)
+        printf("%08x:     %04x", record.pc, record.insn);
+    else
+        printf("%08x: %08x", record.pc, record.insn);
+
+    if (record.dest < 32)
+        printf("  x%-2u = %08x", record.dest, (rv_uint)record.value);
+    else if (record.dest != rv_trace_record::no_dest)
+        printf("  f%-2u = %016llx", record.dest - 32, (unsigned long long)record.value);
+    if (record.has_address)
+        printf("  [%08x]", record.address);
+    printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+    bool summary = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "s")) != -1) {
+        switch (opt) {
+        case 's':
+            summary = true;
+            break;
+        default:
+            usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    FILE* file = fopen(argv[optind], "rb");
+    if (file == nullptr) {
+        fprintf(stderr, "[e] error: cannot open %s\n", argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+
+    int ret_val = EXIT_SUCCESS;
+    uint64_t records = 0;
+    std::unordered_set<rv_uint> pcs;
+    try {
+        rv_trace_decoder decoder(file);
+        rv_trace_record record;
+        while (decoder.next(record)) {
+            ++records;
+            if (summary)
+                pcs.insert(record.pc);
+            else
+                print_record(record);
+        }
+    }
+    catch (const std::runtime_error& ex) {
+        fprintf(stderr, "[e] error: %s after %llu records\n", ex.what(), (unsigned long long)records);
+        ret_val = EXIT_FAILURE;
+    }
+
+    if (summary) {
+        const long size = ftell(file);
+        printf("records: %llu\n", (unsigned long long)records);
+        printf("distinct pcs: %zu\n", pcs.size());
+        printf("file size: %ld bytes, %.2f bytes per record\n", size,
+            records != 0 ? double(size)/double(records) : 0.0);
+    }
+    fclose(file);
+    return ret_val;
+}
@@ -0,0 +1,210 @@
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
+#include <errno.h>
+#include "rv_vma.h"
+#include "rv_snapshot.h"
+
+constexpr uint64_t kPageSize = 0x1000;
+
+static uint64_t page_round_up(uint64_t value)
+{
+    return (value + kPageSize - 1) & ~(kPageSize - 1);
+}
+
+static uint8_t memory_protection(rv_uint prot)
+{
+    uint8_t result = 0;
+    if (prot & RV_PROT_READ)
+        result |= RV_MEMORY_R;
+    if (prot & RV_PROT_WRITE)
+        result |= RV_MEMORY_W;
+    if (prot & RV_PROT_EXEC)
+        result |= RV_MEMORY_X;
+    return result;
+}
+
+rv_uint rv_vma::floor() const
+{
+    return (rv_uint)page_round_up(memory_.brk());
+}
+
+rv_uint rv_vma::find_free(rv_uint len) const
+{
+    const uint64_t low = floor();
+    uint64_t high = memory_.ram_end();
+    for (auto it = areas_.rbegin(); it != areas_.rend(); ++it) {
+        const uint64_t gap_begin = std::max<uint64_t>(it->second.end, low);
+        if (high >= gap_begin + len)
+            return (rv_uint)(high - len);
+        high = it->first;
+    }
+    if (high >= low + len)
+        return (rv_uint)(high - len);
+    return 0;
+}
+
+void rv_vma::remove(rv_uint address, rv_uint end)
+{
+    auto it = areas_.upper_bound(address);
+    if (it != areas_.begin())
+        it = std::prev(it);
+
+    while (it != areas_.end() && it->first < end) {
+        const rv_uint begin = it->first;
+        const area current = it->second;
+        if (current.end <= address) {
+            ++it;
+            continue;
+        }
+
+        // what is left on either side stays mapped
+        it = areas_.erase(it);
+        if (begin < address)
+            areas_[begin] = area{address, current.prot, current.file, current.shared};
+        if (current.end > end)
+            areas_[end] = area{current.end, current.prot, current.file, current.shared};
+
+        const rv_uint release_begin = std::max(begin, address);
+        const rv_uint release_end = std::min(current.end, end);
+        memory_.release_region(release_begin, release_end - release_begin);
+    }
+}
+
+void rv_vma::update_brk_limit()
+{
+    memory_.set_brk_limit(areas_.empty() ? memory_.ram_end() : areas_.begin()->first);
+}
+
+rv_uint rv_vma::map(rv_uint address, rv_uint len, rv_uint prot, rv_uint flags, int host_fd, off_t offset)
+{
+    const bool anonymous = (flags & RV_MAP_ANONYMOUS) != 0;
+    const bool shared = (flags & RV_MAP_SHARED) != 0;
+    if (len == 0 || (offset & (kPageSize - 1)) != 0 || (flags & (RV_MAP_SHARED | RV_MAP_PRIVATE)) == 0)
+        return (rv_uint)-EINVAL;
+    if (!anonymous && host_fd == -1)
+        return (rv_uint)-EBADF;
+
+    const uint64_t size = page_round_up(len);
+    if (size > memory_.ram_end())
+        return (rv_uint)-ENOMEM;
+
+    rv_uint start;
+    if (flags & RV_MAP_FIXED) {
+        // only over the mapping area, never over the executable, the stack or the heap
+        if ((address & (kPageSize - 1)) != 0)
+            return (rv_uint)-EINVAL;
+        if (address < floor() || (uint64_t)address + size > memory_.ram_end())
+            return (rv_uint)-ENOMEM;
+        start = address;
+        remove(start, (rv_uint)(start + size));
+    }
+    else {
+        // the hint is ignored, mappings are packed from the top of ram down
+        start = find_free((rv_uint)size);
+        if (start == 0)
+            return (rv_uint)-ENOMEM;
+    }
+
+    if (!memory_.map_region(start, size, memory_protection(prot), anonymous ? -1 : host_fd, offset, shared)) {
+        const int error = errno;
+        memory_.release_region(start, size);
+        update_brk_limit();
+        return (rv_uint)-error;
+    }
+    areas_[start] = area{(rv_uint)(start + size), memory_protection(prot), !anonymous, shared};
+    update_brk_limit();
+    return start;
+}
+
+rv_uint rv_vma::unmap(rv_uint address, rv_uint len)
+{
+    const uint64_t end = (uint64_t)address + page_round_up(len);
+    if ((address & (kPageSize - 1)) != 0 || len == 0 || end > memory_.ram_end())
+        return (rv_uint)-EINVAL;
+
+    remove(address, (rv_uint)end);
+    update_brk_limit();
+    return 0;
+}
+
+rv_uint rv_vma::remap(rv_uint address, rv_uint old_len, rv_uint new_len, rv_uint flags)
+{
+    // MREMAP_FIXED is not supported
+    if ((address & (kPageSize - 1)) != 0 || old_len == 0 || new_len == 0 || (flags & ~RV_MREMAP_MAYMOVE) != 0)
+        return (rv_uint)-EINVAL;
+
+    const uint64_t old_size = page_round_up(old_len);
+    const uint64_t new_size = page_round_up(new_len);
+
+    // the old range must lie within one area
+    auto it = areas_.upper_bound(address);
+    if (it == areas_.begin())
+        return (rv_uint)-EFAULT;
+    it = std::prev(it);
+    if ((uint64_t)address + old_size > it->second.end)
+        return (rv_uint)-EFAULT;
+
+    if (new_size <= old_size) {
+        remove((rv_uint)(address + new_size), (rv_uint)(address + old_size));
+        update_brk_limit();
+        return address;
+    }
+
+    const area current = it->second;
+    if (current.file)
+        return (rv_uint)-EINVAL;
+
+    // in place, when the range ends the area and the pages after it are free
+    const uint64_t new_end = (uint64_t)address + new_size;
+    if (address + old_size == current.end) {
+        const auto next = std::next(it);
+        const uint64_t limit = next == areas_.end() ? memory_.ram_end() : next->first;
+        if (new_end <= limit) {
+            if (!memory_.map_region(current.end, (size_t)(new_end - current.end), current.prot, -1, 0, false))
+                return (rv_uint)-ENOMEM;
+            it->second.end = (rv_uint)new_end;
+            return address;
+        }
+    }
+
+    if ((flags & RV_MREMAP_MAYMOVE) == 0)
+        return (rv_uint)-ENOMEM;
+
+    const rv_uint start = find_free((rv_uint)new_size);
+    if (start == 0 || !memory_.map_region(start, new_size, current.prot, -1, 0, false))
+        return (rv_uint)-ENOMEM;
+
+    // inaccessible areas are still all zero
+    if (current.prot != 0)
+        memory_.set_region(start, memory_.ram_ptr(address), old_size);
+    remove(address, (rv_uint)(address + old_size));
+    areas_[start] = area{(rv_uint)(start + new_size), current.prot, false, false};
+    update_brk_limit();
+    return start;
+}
+
+void rv_vma::save_state(rv_snapshot_writer& snapshot) const
+{
+    snapshot.put<uint64_t>(areas_.size());
+    for (const auto& entry : areas_) {
+        snapshot.put(entry.first);
+        snapshot.put(entry.second.end);
+        snapshot.put(entry.second.prot);
+    }
+}
+
+void rv_vma::restore_state(rv_snapshot_reader& snapshot)
+{
+    areas_.clear();
+    const auto count = snapshot.get<uint64_t>();
+    for (uint64_t i = 0; i < count; ++i) {
+        const auto begin = snapshot.get<rv_uint>();
+        const auto end = snapshot.get<rv_uint>();
+        const auto prot = snapshot.get<uint8_t>();
+        if (end <= begin || end > memory_.ram_end())
+            throw std::runtime_error("corrupted snapshot");
+        areas_[begin] = area{end, prot, false, false};
+    }
+    update_brk_limit();
+}
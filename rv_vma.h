@@ -0,0 +1,76 @@
+#pragma once
+#include <map>
+#include <sys/types.h>
+#include "rv_global.h"
+#include "rv_memory.h"
+
+class rv_snapshot_writer;
+class rv_snapshot_reader;
+
+// mmap, munmap and mremap flags as the guest passes them (the Linux generic values)
+constexpr rv_uint RV_PROT_READ = 0x1;
+constexpr rv_uint RV_PROT_WRITE = 0x2;
+constexpr rv_uint RV_PROT_EXEC = 0x4;
+
+constexpr rv_uint RV_MAP_SHARED = 0x01;
+constexpr rv_uint RV_MAP_PRIVATE = 0x02;
+constexpr rv_uint RV_MAP_FIXED = 0x10;
+constexpr rv_uint RV_MAP_ANONYMOUS = 0x20;
+
+constexpr rv_uint RV_MREMAP_MAYMOVE = 0x1;
+constexpr rv_uint RV_MREMAP_FIXED = 0x2;
+
+// guest virtual memory areas, carved from the top of ram down towards the program break
+// every area is page aligned, anonymous ones start zero filled and file ones are mapped by
+// the host straight into guest ram (with RISC_666_HOST_MMU), freed pages go back to the host
+// the lowest area caps the program break, the heap and the mappings never overlap
+class rv_vma
+{
+public:
+    rv_vma() = delete;
+    explicit rv_vma(rv_memory& memory) : memory_{memory} {}
+
+    rv_vma(const rv_vma&) = delete;
+    rv_vma& operator=(const rv_vma&) = delete;
+
+    // all of these return the guest address or -errno, like the syscalls
+    // host_fd is ignored for anonymous mappings, offset is in bytes
+    rv_uint map(rv_uint address, rv_uint len, rv_uint prot, rv_uint flags, int host_fd, off_t offset);
+    rv_uint unmap(rv_uint address, rv_uint len);
+
+    // only anonymous areas grow, in place if the pages after them are free or elsewhere with MREMAP_MAYMOVE
+    rv_uint remap(rv_uint address, rv_uint old_len, rv_uint new_len, rv_uint flags);
+
+    size_t area_count() const { return areas_.size(); }
+
+    // the list of areas, their contents are part of the snapshot ram
+    // file areas come back as private copies
+    void save_state(rv_snapshot_writer& snapshot) const;
+    void restore_state(rv_snapshot_reader& snapshot);
+
+private:
+    struct area
+    {
+        rv_uint end;
+        uint8_t prot;       // RV_MEMORY_*
+        bool file;
+        bool shared;
+    };
+
+    // highest free range of len bytes between the program break and the end of ram, 0 if none
+    rv_uint find_free(rv_uint len) const;
+
+    // first page that can be mapped, right above the program break
+    rv_uint floor() const;
+
+    // drop [address, end) from the areas, splitting them as needed, and release the pages
+    void remove(rv_uint address, rv_uint end);
+
+    void update_brk_limit();
+
+private:
+    rv_memory& memory_;
+
+    // by start address
+    std::map<rv_uint, area> areas_;
+};
@@ -87,6 +87,7 @@ static int access(char *file, int mode)
 
 
 #include "d_main.h"
+#include "rv_av_api.h"
 
 //
 // D-DoomLoop()
@@ -1108,6 +1109,9 @@ printf("added\n");
 
     printf ("ST_Init: Init status bar.\n");
     ST_Init ();
+
+    // everything is loaded, a good point to resume from
+    av_snapshot ();
     // check for a driver that wants intermission stats
     p = M_CheckParm ("-statcopy");
     if (p && p<myargc-1)
@@ -41,274 +41,70 @@ rcsid[] = "$Id: i_unix.c,v 1.5 1997/02/03 22:45:10 b1 Exp $";
 #include "w_wad.h"
 
 #include "doomdef.h"
+#include "rv_av_api.h"
 
 
-// The number of internal mixing channels,
-//  the samples calculated for each mixing step,
-//  the size of the 16bit, 2 hardware channel (stereo)
-//  mixing buffer, and the samplerate of the raw data.
+// Sound effects are mixed by the emulator, on the host.
+// The lumps are registered once, the host reads the samples
+//  straight from the (static) lump cache.
 
+// The raw data of DMX sound lumps: an 8 byte header,
+//  then 8bit unsigned samples.
+#define DMX_HEADER		8
 
-// Needed for calling the actual sound output.
-static int SAMPLECOUNT=		512;
-#define NUM_CHANNELS		8
+// Host sound of every SFX, -1 if it can't be played.
+static int		sfxsounds[NUMSFX];
 
-#define SAMPLERATE		11025	// Hz
-
-// The actual lengths of all sound effects.
-int 		lengths[NUMSFX];
-
-// The actual output device.
-int	audio_fd;
-
-
-// The channel step amount...
-unsigned int	channelstep[NUM_CHANNELS];
-// ... and a 0.16 bit remainder of last step.
-unsigned int	channelstepremainder[NUM_CHANNELS];
-
-
-// The channel data pointers, start and end.
-unsigned char*	channels[NUM_CHANNELS];
-unsigned char*	channelsend[NUM_CHANNELS];
-
-
-// Time/gametic that the channel started playing,
-//  used to determine oldest, which automatically
-//  has lowest priority.
-// In case number of active sounds exceeds
-//  available channels.
-int		channelstart[NUM_CHANNELS];
-
-// The sound in channel handles,
-//  determined on registration,
-//  might be used to unregister/stop/modify,
-//  currently unused.
-int 		channelhandles[NUM_CHANNELS];
-
-// SFX id of the playing sound effect.
+// Handle of the last start of every SFX, 0 if none.
 // Used to catch duplicates (like chainsaw).
-int		channelids[NUM_CHANNELS];			
-
-// Pitch to stepping lookup, unused.
-int		steptable[256];
-
-// Volume lookups.
-int		vol_lookup[128*256];
+static int		sfxhandles[NUMSFX];
 
-// Hardware left and right channel volume lookup.
-int*		channelleftvol_lookup[NUM_CHANNELS];
-int*		channelrightvol_lookup[NUM_CHANNELS];
+// No audio on the host, all the sound calls do nothing.
+static int		sound_ok = 0;
 
+// Same for the music, which needs the GENMIDI lump too.
+static int		music_ok = 0;
 
 
 //
-// This function loads the sound data from the WAD lump,
-//  for single sound.
+// This function registers the sound data of the WAD lump
+//  with the host, for a single sound.
 //
-void*
-getsfx
-( char*         sfxname,
-  int*          len )
+static int
+registersfx
+( char*         sfxname )
 {
     unsigned char*      sfx;
-    unsigned char*      paddedsfx;
-    int                 i;
     int                 size;
-    int                 paddedsize;
+    int                 len;
+    int                 rate;
     char                name[20];
     int                 sfxlump;
 
-    
-    // Get the sound data from the WAD, allocate lump
-    //  in zone memory.
+    // Same fallback as before: DOOM II sounds are
+    //  requested with DOOM shareware too.
     sprintf(name, "ds%s", sfxname);
-
-    // Now, there is a severe problem with the
-    //  sound handling, in it is not (yet/anymore)
-    //  gamemode aware. That means, sounds from
-    //  DOOM II will be requested even with DOOM
-    //  shareware.
-    // The sound list is wired into sounds.c,
-    //  which sets the external variable.
-    // I do not do runtime patches to that
-    //  variable. Instead, we will use a
-    //  default sound for replacement.
     if ( W_CheckNumForName(name) == -1 )
       sfxlump = W_GetNumForName("dspistol");
     else
       sfxlump = W_GetNumForName(name);
-    
+
     size = W_LumpLength( sfxlump );
+    if (size <= DMX_HEADER)
+	return -1;
 
-    // Debug.
-    // fprintf( stderr, "." );
-    //fprintf( stderr, " -loading  %s (lump %d, %d bytes)\n",
-    //	     sfxname, sfxlump, size );
-    //fflush( stderr );
-    
+    // Stays cached for good, the host reads it while mixing.
     sfx = (unsigned char*)W_CacheLumpNum( sfxlump, PU_STATIC );
 
-    // Pads the sound effect out to the mixing buffer size.
-    // The original realloc would interfere with zone memory.
-    paddedsize = ((size-8 + (SAMPLECOUNT-1)) / SAMPLECOUNT) * SAMPLECOUNT;
-
-    // Allocate from zone memory.
-    paddedsfx = (unsigned char*)Z_Malloc( paddedsize+8, PU_STATIC, 0 );
-    // ddt: (unsigned char *) realloc(sfx, paddedsize+8);
-    // This should interfere with zone memory handling,
-    //  which does not kick in in the soundserver.
-
-    // Now copy and pad.
-    memcpy(  paddedsfx, sfx, size );
-    for (i=size ; i<paddedsize+8 ; i++)
-        paddedsfx[i] = 128;
-
-    // Remove the cached lump.
-    Z_Free( sfx );
-    
-    // Preserve padded length.
-    *len = paddedsize;
-
-    // Return allocated padded data.
-    return (void *) (paddedsfx + 8);
-}
-
-
-
-
+    rate = sfx[2] | (sfx[3] << 8);
+    len = sfx[4] | (sfx[5] << 8) | (sfx[6] << 16) | (sfx[7] << 24);
+    if (len <= 0 || len > size - DMX_HEADER)
+	len = size - DMX_HEADER;
 
-//
-// This function adds a sound to the
-//  list of currently active sounds,
-//  which is maintained as a given number
-//  (eight, usually) of internal channels.
-// Returns a handle.
-//
-int
-addsfx
-( int		sfxid,
-  int		volume,
-  int		step,
-  int		seperation )
-{
-    static unsigned short	handlenums = 0;
- 
-    int		i;
-    int		rc = -1;
-    
-    int		oldest = gametic;
-    int		oldestnum = 0;
-    int		slot;
-
-    int		rightvol;
-    int		leftvol;
-
-    // Chainsaw troubles.
-    // Play these sound effects only one at a time.
-    if ( sfxid == sfx_sawup
-	 || sfxid == sfx_sawidl
-	 || sfxid == sfx_sawful
-	 || sfxid == sfx_sawhit
-	 || sfxid == sfx_stnmov
-	 || sfxid == sfx_pistol	 )
-    {
-	// Loop all channels, check.
-	for (i=0 ; i<NUM_CHANNELS ; i++)
-	{
-	    // Active, and using the same SFX?
-	    if ( (channels[i])
-		 && (channelids[i] == sfxid) )
-	    {
-		// Reset.
-		channels[i] = 0;
-		// We are sure that iff,
-		//  there will only be one.
-		break;
-	    }
-	}
-    }
-
-    // Loop all channels to find oldest SFX.
-    for (i=0; (i<NUM_CHANNELS) && (channels[i]); i++)
-    {
-	if (channelstart[i] < oldest)
-	{
-	    oldestnum = i;
-	    oldest = channelstart[i];
-	}
-    }
-
-    // Tales from the cryptic.
-    // If we found a channel, fine.
-    // If not, we simply overwrite the first one, 0.
-    // Probably only happens at startup.
-    if (i == NUM_CHANNELS)
-	slot = oldestnum;
-    else
-	slot = i;
-
-    // Okay, in the less recent channel,
-    //  we will handle the new SFX.
-    // Set pointer to raw data.
-    channels[slot] = (unsigned char *) S_sfx[sfxid].data;
-    // Set pointer to end of raw data.
-    channelsend[slot] = channels[slot] + lengths[sfxid];
-
-    // Reset current handle number, limited to 0..100.
-    if (!handlenums)
-	handlenums = 100;
-
-    // Assign current handle number.
-    // Preserved so sounds could be stopped (unused).
-    channelhandles[slot] = rc = handlenums++;
-
-    // Set stepping???
-    // Kinda getting the impression this is never used.
-    channelstep[slot] = step;
-    // ???
-    channelstepremainder[slot] = 0;
-    // Should be gametic, I presume.
-    channelstart[slot] = gametic;
-
-    // Separation, that is, orientation/stereo.
-    //  range is: 1 - 256
-    seperation += 1;
-
-    // Per left/right channel.
-    //  x^2 seperation,
-    //  adjust volume properly.
-    volume *= 8;
-    leftvol =
-	volume - ((volume*seperation*seperation) >> 16); ///(256*256);
-    seperation = seperation - 257;
-    rightvol =
-	volume - ((volume*seperation*seperation) >> 16);	
-
-    // Sanity check, clamp volume.
-    if (rightvol < 0 || rightvol > 127)
-	I_Error("rightvol out of bounds");
-    
-    if (leftvol < 0 || leftvol > 127)
-	I_Error("leftvol out of bounds");
-    
-    // Get the proper lookup table piece
-    //  for this volume level???
-    channelleftvol_lookup[slot] = &vol_lookup[leftvol*256];
-    channelrightvol_lookup[slot] = &vol_lookup[rightvol*256];
-
-    // Preserve sound SFX id,
-    //  e.g. for avoiding duplicates of chainsaw.
-    channelids[slot] = sfxid;
-
-    // You tell me.
-    return rc;
+    return av_sound_register(sfx + DMX_HEADER, len, rate);
 }
 
 
-
-
-
 //
 // SFX API
 // Note: this was called by S_Init.
@@ -320,34 +116,6 @@ addsfx
 //
 void I_SetChannels()
 {
-//   // Init internal lookups (raw data, mixing buffer, channels).
-//   // This function sets up internal lookups used during
-//   //  the mixing process. 
-//   int		i;
-//   int		j;
-    
-//   int*	steptablemid = steptable + 128;
-  
-//   // Okay, reset internal mixing channels to zero.
-//   /*for (i=0; i<NUM_CHANNELS; i++)
-//   {
-//     channels[i] = 0;
-//   }*/
-
-//   // This table provides step widths for pitch parameters.
-//   // I fail to see that this is currently used.
-//   for (i=-128 ; i<128 ; i++)
-//     steptablemid[i] = (int)(pow(2.0, (i/64.0))*65536.0);
-  
-  
-//   // Generates volume lookup tables
-//   //  which also turn the unsigned samples
-//   //  into signed samples.
-//   for (i=0 ; i<128 ; i++)
-//     for (j=0 ; j<256 ; j++) {
-//       vol_lookup[i*256+j] = (i*(j-128)*256)/127;
-// //fprintf(stderr, "vol_lookup[%d*256+%d] = %d\n", i, j, vol_lookup[i*256+j]);
-//     }
 }	
 
  
@@ -361,13 +129,15 @@ void I_SetSfxVolume(int volume)
   snd_SfxVolume = volume;
 }
 
-// MUSIC API - dummy. Some code from DOS version.
+// MUSIC API. Some code from DOS version.
 void I_SetMusicVolume(int volume)
 {
   // Internal state variable.
   snd_MusicVolume = volume;
-  // Now set volume on output device.
-  // Whatever( snd_MusciVolume );
+  // Now set volume on output device,
+  //  the menu goes 0..15, the host 0..127.
+  if (music_ok)
+    av_music_volume(volume*8 > 127 ? 127 : volume*8);
 }
 
 
@@ -383,16 +153,11 @@ int I_GetSfxLumpNum(sfxinfo_t* sfx)
 }
 
 //
-// Starting a sound means adding it
-//  to the current list of active sounds
-//  in the internal channels.
-// As the SFX info struct contains
-//  e.g. a pointer to the raw data,
-//  it is ignored.
+// Starting a sound hands it to the host mixer,
+//  which picks a channel and returns a handle.
 // As our sound handling does not handle
 //  priority, it is ignored.
-// Pitching (that is, increased speed of playback)
-//  is set, but currently not used by mixing.
+// Volume is 0..15, the host wants 0..127.
 //
 int
 I_StartSound
@@ -402,148 +167,51 @@ I_StartSound
   int		pitch,
   int		priority )
 {
+    int		handle;
+
+    // UNUSED
+    priority = 0;
+
+    if (!sound_ok || sfxsounds[id] < 0)
+	return -1;
 
-  // UNUSED
-  priority = 0;
-  
-    // Debug.
-    //fprintf( stderr, "starting sound %d", id );
-    
-    // Returns a handle (not used).
-//    SDL_LockAudio();
-    id = addsfx( id, vol, steptable[pitch], sep );
-//    SDL_UnlockAudio();
-
-    // fprintf( stderr, "/handle is %d\n", id );
-    
-    return id;
+    // Chainsaw troubles.
+    // Play these sound effects only one at a time.
+    // Handles are never reused, stopping one that
+    //  finished already does nothing.
+    if ( (id == sfx_sawup
+	  || id == sfx_sawidl
+	  || id == sfx_sawful
+	  || id == sfx_sawhit
+	  || id == sfx_stnmov
+	  || id == sfx_pistol)
+	 && sfxhandles[id] > 0 )
+	av_sound_stop(sfxhandles[id]);
+
+    handle = av_sound_start(sfxsounds[id], vol*8, sep, pitch);
+    if (handle < 0)
+	return -1;
+    sfxhandles[id] = handle;
+    return handle;
 }
 
 
 
 void I_StopSound (int handle)
 {
-  // You need the handle returned by StartSound.
-  // Would be looping all channels,
-  //  tracking down the handle,
-  //  an setting the channel to zero.
-  
-  // UNUSED.
-  handle = 0;
+    if (sound_ok && handle > 0)
+	av_sound_stop(handle);
 }
 
 
 int I_SoundIsPlaying(int handle)
 {
-    // Ouch.
-    return gametic < handle;
+    if (!sound_ok || handle <= 0)
+	return 0;
+    return av_sound_playing(handle) > 0;
 }
 
 
-//
-// This function loops all active (internal) sound
-//  channels, retrieves a given number of samples
-//  from the raw sound data, modifies it according
-//  to the current (internal) channel parameters,
-//  mixes the per channel samples into the given
-//  mixing buffer, and clamping it to the allowed
-//  range.
-//
-// This function currently supports only 16bit.
-//
-void I_UpdateSound(void *unused, uint8_t *stream, int len)
-{
-  // Mix current sound data.
-  // Data, from raw sound, for right and left.
-  register unsigned int	sample;
-  register int		dl;
-  register int		dr;
-  
-  // Pointers in audio stream, left, right, end.
-  signed short*		leftout;
-  signed short*		rightout;
-  signed short*		leftend;
-  // Step in stream, left and right, thus two.
-  int				step;
-
-  // Mixing channel index.
-  int				chan;
-    
-    // Left and right channel
-    //  are in audio stream, alternating.
-    leftout = (signed short *)stream;
-    rightout = ((signed short *)stream)+1;
-    step = 2;
-
-    // Determine end, for left channel only
-    //  (right channel is implicit).
-    leftend = leftout + SAMPLECOUNT*step;
-
-    // Mix sounds into the mixing buffer.
-    // Loop over step*SAMPLECOUNT,
-    //  that is 512 values for two channels.
-    while (leftout != leftend)
-    {
-	// Reset left/right value. 
-	dl = 0;
-	dr = 0;
-
-	// Love thy L2 chache - made this a loop.
-	// Now more channels could be set at compile time
-	//  as well. Thus loop those  channels.
-	for ( chan = 0; chan < NUM_CHANNELS; chan++ )
-	{
-	    // Check channel, if active.
-	    if (channels[ chan ])
-	    {
-		// Get the raw data from the channel. 
-		sample = *channels[ chan ];
-		// Add left and right part
-		//  for this channel (sound)
-		//  to the current data.
-		// Adjust volume accordingly.
-		dl += channelleftvol_lookup[ chan ][sample];
-		dr += channelrightvol_lookup[ chan ][sample];
-		// Increment index ???
-		channelstepremainder[ chan ] += channelstep[ chan ];
-		// MSB is next sample???
-		channels[ chan ] += channelstepremainder[ chan ] >> 16;
-		// Limit to LSB???
-		channelstepremainder[ chan ] &= 65536-1;
-
-		// Check whether we are done.
-		if (channels[ chan ] >= channelsend[ chan ])
-		    channels[ chan ] = 0;
-	    }
-	}
-	
-	// Clamp to range. Left hardware channel.
-	// Has been char instead of short.
-	// if (dl > 127) *leftout = 127;
-	// else if (dl < -128) *leftout = -128;
-	// else *leftout = dl;
-
-	if (dl > 0x7fff)
-	    *leftout = 0x7fff;
-	else if (dl < -0x8000)
-	    *leftout = -0x8000;
-	else
-	    *leftout = dl;
-
-	// Same for right hardware channel.
-	if (dr > 0x7fff)
-	    *rightout = 0x7fff;
-	else if (dr < -0x8000)
-	    *rightout = -0x8000;
-	else
-	    *rightout = dr;
-
-	// Increment current pointers in stream
-	leftout += step;
-	rightout += step;
-    }
-}
-
 void
 I_UpdateSoundParams
 ( int	handle,
@@ -551,74 +219,48 @@ I_UpdateSoundParams
   int	sep,
   int	pitch)
 {
-  // I fail too see that this is used.
-  // Would be using the handle to identify
-  //  on which channel the sound might be active,
-  //  and resetting the channel parameters.
+    // Pitch is only set when the sound starts.
+    pitch = 0;
 
-  // UNUSED.
-  handle = vol = sep = pitch = 0;
+    if (sound_ok && handle > 0)
+	av_sound_update(handle, vol*8, sep);
 }
 
 
 void I_ShutdownSound(void)
 {    
-//  SDL_CloseAudio();
+    // The host closes the device with av_shutdown.
+    sound_ok = 0;
 }
 
 
 void
 I_InitSound()
 { 
-    /*
-  SDL_AudioSpec wanted;
   int i;
-  
-  // Secure and configure sound device first.
+
   fprintf( stderr, "I_InitSound: ");
-  
-  // Open the audio device
-  wanted.freq = SAMPLERATE;
-  if ( SDL_BYTEORDER == SDL_BIG_ENDIAN ) {
-    wanted.format = AUDIO_S16MSB;
-  } else {
-    wanted.format = AUDIO_S16LSB;
-  }
-  wanted.channels = 2;
-  wanted.samples = SAMPLECOUNT;
-  wanted.callback = I_UpdateSound;
-  if ( SDL_OpenAudio(&wanted, NULL) < 0 ) {
-    fprintf(stderr, "couldn't open audio with desired format\n");
+  if (av_audio_init() < 0) {
+    fprintf(stderr, "no audio on the host, sound disabled\n");
     return;
   }
-  SAMPLECOUNT = wanted.samples;
-  fprintf(stderr, " configured audio device with %d samples/slice\n", SAMPLECOUNT);
 
-    
-  // Initialize external data (all sounds) at start, keep static.
-  fprintf( stderr, "I_InitSound: ");
-  
+  // Register the data of all sounds at start, keep static.
   for (i=1 ; i<NUMSFX ; i++)
   { 
     // Alias? Example is the chaingun sound linked to pistol.
     if (!S_sfx[i].link)
-    {
-      // Load data from WAD file.
-      S_sfx[i].data = getsfx( S_sfx[i].name, &lengths[i] );
-    }	
+      sfxsounds[i] = registersfx( S_sfx[i].name );
     else
-    {
-      // Previously loaded already?
-      S_sfx[i].data = S_sfx[i].link->data;
-      lengths[i] = lengths[(S_sfx[i].link - S_sfx)/sizeof(sfxinfo_t)];
-    }
+      sfxsounds[i] = sfxsounds[S_sfx[i].link - S_sfx];
+
+    // Only checked for non-null by the sound code.
+    S_sfx[i].data = (void *) &sfxsounds[i];
   }
+  sfxsounds[0] = -1;
+  sound_ok = 1;
 
-  fprintf( stderr, " pre-cached all sound data\n");
-  
-  // Finished initialization.
-  fprintf(stderr, "I_InitSound: sound module ready\n");
-  SDL_PauseAudio(0);*/
+  fprintf(stderr, " sound effects registered with the host\n");
 }
 
 
@@ -626,62 +268,86 @@ I_InitSound()
 
 //
 // MUSIC API.
-// Still no music done.
-// Remains. Dummies.
+// The MUS lumps are played by the emulator, on the host,
+//  with the OPL2 instruments of the GENMIDI lump.
 //
-void I_InitMusic(void)		{ }
-void I_ShutdownMusic(void)	{ }
+void I_InitMusic(void)
+{
+  int lump;
+
+  if (!sound_ok)
+    return;
 
-static int	looping=0;
-static int	musicdies=-1;
+  lump = W_CheckNumForName("GENMIDI");
+  if (lump == -1)
+  {
+    fprintf(stderr, "I_InitMusic: no GENMIDI lump, music disabled\n");
+    return;
+  }
+
+  // The host keeps a copy, the lump can be purged.
+  if (av_music_init(W_CacheLumpNum(lump, PU_CACHE), W_LumpLength(lump)) < 0)
+  {
+    fprintf(stderr, "I_InitMusic: bad GENMIDI lump, music disabled\n");
+    return;
+  }
+  music_ok = 1;
+}
+
+void I_ShutdownMusic(void)
+{
+  if (music_ok)
+    av_music_stop();
+  music_ok = 0;
+}
 
 void I_PlaySong(int handle, int looping)
 {
-  // UNUSED.
-  handle = looping = 0;
-  musicdies = gametic + TICRATE*30;
+  if (music_ok && handle > 0)
+    av_music_play(handle, looping);
 }
 
 void I_PauseSong (int handle)
 {
-  // UNUSED.
-  handle = 0;
+  if (music_ok && handle > 0)
+    av_music_pause();
 }
 
 void I_ResumeSong (int handle)
 {
-  // UNUSED.
-  handle = 0;
+  if (music_ok && handle > 0)
+    av_music_resume();
 }
 
 void I_StopSong(int handle)
 {
-  // UNUSED.
-  handle = 0;
-  
-  looping = 0;
-  musicdies = 0;
+  if (music_ok && handle > 0)
+    av_music_stop();
 }
 
 void I_UnRegisterSong(int handle)
 {
-  // UNUSED.
-  handle = 0;
+  if (music_ok && handle > 0)
+    av_music_unregister(handle);
 }
 
 int I_RegisterSong(void* data)
 {
-  // UNUSED.
-  data = NULL;
-  
-  return 1;
+  unsigned char*	mus = (unsigned char*)data;
+  int			len;
+
+  if (!music_ok)
+    return 0;
+
+  // The header has the score length and start,
+  //  the score is the end of the lump.
+  len = (mus[4] | (mus[5] << 8)) + (mus[6] | (mus[7] << 8));
+  return av_music_register(mus, len);
 }
 
 // Is the song playing?
 int I_QrySongPlaying(int handle)
 {
-  // UNUSED.
-  handle = 0;
-  return looping || musicdies > gametic;
+  return music_ok && handle > 0 && av_music_playing(handle) > 0;
 }
 
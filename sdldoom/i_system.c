@@ -110,6 +110,7 @@ void I_Init (void)
     if (av_init(SCREENWIDTH, SCREENHEIGHT) < 0)
         I_Error("Could not initialize rv_av");
     I_InitSound();
+    I_InitMusic();
     //  I_InitGraphics();
 }
 
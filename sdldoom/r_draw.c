@@ -42,6 +42,9 @@ rcsid[] = "$Id: r_draw.c,v 1.4 1997/02/03 16:47:55 b1 Exp $";
 // State.
 #include "doomstat.h"
 
+// Columns and spans are drawn by the host.
+#include "rv_av_api.h"
+
 
 // ?
 #define MAXWIDTH			1120
@@ -95,6 +98,101 @@ byte*			dc_source;
 // just for profiling 
 int			dccount;
 
+
+//
+// The inner loops run on the host: columns and spans
+//  are queued here and handed over in batches.
+// A queue is flushed when full, before the other kind
+//  is queued (sprites overdraw the flats), before the
+//  framebuffer is read back (fuzz), before the zone
+//  frees anything (a queued source could go with it),
+//  and at the end of the frame.
+//
+#define MAXQUEUED		2048
+
+static struct av_column	columnqueue[MAXQUEUED];
+static int		numcolumns;
+
+static struct av_span	spanqueue[MAXQUEUED];
+static int		numspans;
+
+static void R_FlushSpans (void);
+
+
+//
+// R_DrawColumnBatch
+// The same loops on the guest, for when the host
+//  can't draw a batch.
+//
+static void R_DrawColumnBatch (struct av_column* col, int count)
+{
+    byte*		dest;
+    byte*		source;
+    byte*		colormap;
+    byte*		translation;
+    unsigned		frac;
+    int			n;
+    byte		pixel;
+
+    for ( ; count-- ; col++)
+    {
+	dest = (byte *)(uintptr_t)col->dest;
+	source = (byte *)(uintptr_t)col->source;
+	colormap = (byte *)(uintptr_t)col->colormap;
+	translation = (byte *)(uintptr_t)col->translation;
+	frac = col->frac;
+
+	for (n = col->count ; n-- ; )
+	{
+	    if (col->flags & AV_DRAW_WRAP)
+		pixel = source[(frac>>FRACBITS)&127];
+	    else
+		pixel = source[(fixed_t)frac>>FRACBITS];
+	    if (translation)
+		pixel = translation[pixel];
+	    dest[0] = colormap[pixel];
+	    if (col->flags & AV_DRAW_DOUBLE)
+		dest[1] = dest[0];
+	    dest += SCREENWIDTH;
+	    frac += col->step;
+	}
+    }
+}
+
+
+static void R_FlushColumns (void)
+{
+    if (!numcolumns)
+	return;
+    if (av_draw_columns(columnqueue, numcolumns, SCREENWIDTH) < 0)
+	R_DrawColumnBatch(columnqueue, numcolumns);
+    numcolumns = 0;
+}
+
+
+//
+// R_QueueColumn
+// A column from the dc_* state, flags as in av_column.
+//
+static void R_QueueColumn (byte* dest, byte* translation, int flags)
+{
+    struct av_column*	col;
+
+    R_FlushSpans ();
+    if (numcolumns == MAXQUEUED)
+	R_FlushColumns ();
+
+    col = &columnqueue[numcolumns++];
+    col->dest = (uintptr_t)dest;
+    col->source = (uintptr_t)dc_source;
+    col->colormap = (uintptr_t)dc_colormap;
+    col->translation = (uintptr_t)translation;
+    col->frac = dc_texturemid + (dc_yl-centery)*dc_iscale;
+    col->step = dc_iscale;
+    col->count = dc_yh - dc_yl + 1;
+    col->flags = flags;
+}
+
 //
 // A column is a vertical slice/span from a wall texture that,
 //  given the DOOM style restrictions on the view orientation,
@@ -105,9 +203,6 @@ int			dccount;
 void R_DrawColumn (void) 
 { 
     int			count; 
-    byte*		dest; 
-    fixed_t		frac;
-    fixed_t		fracstep;	 
  
     count = dc_yh - dc_yl; 
 
@@ -125,26 +220,9 @@ void R_DrawColumn (void)
     // Framebuffer destination address.
     // Use ylookup LUT to avoid multiply with ScreenWidth.
     // Use columnofs LUT for subwindows? 
-    dest = ylookup[dc_yl] + columnofs[dc_x];  
-
-    // Determine scaling,
-    //  which is the only mapping to be done.
-    fracstep = dc_iscale; 
-    frac = dc_texturemid + (dc_yl-centery)*fracstep; 
-
-    // Inner loop that does the actual texture mapping,
-    //  e.g. a DDA-lile scaling.
-    // This is as fast as it gets.
-    do 
-    {
-	// Re-map color indices from wall texture column
-	//  using a lighting/special effects LUT.
-	*dest = dc_colormap[dc_source[(frac>>FRACBITS)&127]];
-	
-	dest += SCREENWIDTH; 
-	frac += fracstep;
-	
-    } while (count--); 
+    // The host does the DDA-like scaling of the
+    //  texture column, remapped by the colormap.
+    R_QueueColumn (ylookup[dc_yl] + columnofs[dc_x], NULL, AV_DRAW_WRAP);
 } 
 
 
@@ -211,10 +289,6 @@ void R_DrawColumn (void)
 void R_DrawColumnLow (void) 
 { 
     int			count; 
-    byte*		dest; 
-    byte*		dest2;
-    fixed_t		frac;
-    fixed_t		fracstep;	 
  
     count = dc_yh - dc_yl; 
 
@@ -235,21 +309,9 @@ void R_DrawColumnLow (void)
     // Blocky mode, need to multiply by 2.
     dc_x <<= 1;
     
-    dest = ylookup[dc_yl] + columnofs[dc_x];
-    dest2 = ylookup[dc_yl] + columnofs[dc_x+1];
-    
-    fracstep = dc_iscale; 
-    frac = dc_texturemid + (dc_yl-centery)*fracstep;
-    
-    do 
-    {
-	// Hack. Does not work corretly.
-	*dest2 = *dest = dc_colormap[dc_source[(frac>>FRACBITS)&127]];
-	dest += SCREENWIDTH;
-	dest2 += SCREENWIDTH;
-	frac += fracstep; 
-
-    } while (count--);
+    // Hack. Does not work corretly.
+    // Both pixels of a pair are written by the host.
+    R_QueueColumn (ylookup[dc_yl] + columnofs[dc_x], NULL, AV_DRAW_WRAP|AV_DRAW_DOUBLE);
 }
 
 
@@ -339,6 +401,9 @@ void R_DrawFuzzColumn (void)
     }*/
 
     
+    // Reads back what was drawn so far.
+    R_FlushDraws ();
+
     // Does not work with blocky mode.
     dest = ylookup[dc_yl] + columnofs[dc_x];
 
@@ -385,9 +450,6 @@ byte*	translationtables;
 void R_DrawTranslatedColumn (void) 
 { 
     int			count; 
-    byte*		dest; 
-    fixed_t		frac;
-    fixed_t		fracstep;	 
  
     count = dc_yh - dc_yl; 
     if (count < 0) 
@@ -425,25 +487,12 @@ void R_DrawTranslatedColumn (void)
 
     
     // FIXME. As above.
-    dest = ylookup[dc_yl] + columnofs[dc_x]; 
-
-    // Looks familiar.
-    fracstep = dc_iscale; 
-    frac = dc_texturemid + (dc_yl-centery)*fracstep; 
-
-    // Here we do an additional index re-mapping.
-    do 
-    {
-	// Translation tables are used
-	//  to map certain colorramps to other ones,
-	//  used with PLAY sprites.
-	// Thus the "green" ramp of the player 0 sprite
-	//  is mapped to gray, red, black/indigo. 
-	*dest = dc_colormap[dc_translation[dc_source[frac>>FRACBITS]]];
-	dest += SCREENWIDTH;
-	
-	frac += fracstep; 
-    } while (count--); 
+    // Here we do an additional index re-mapping,
+    //  translation tables are used to map certain
+    //  colorramps to other ones, used with PLAY sprites.
+    // Thus the "green" ramp of the player 0 sprite
+    //  is mapped to gray, red, black/indigo. 
+    R_QueueColumn (ylookup[dc_yl] + columnofs[dc_x], dc_translation, 0);
 } 
 
 
@@ -515,16 +564,91 @@ byte*			ds_source;
 int			dscount;
 
 
+//
+// R_DrawSpanBatch
+// The guest fallback, as for the columns.
+//
+static void R_DrawSpanBatch (struct av_span* span, int count)
+{
+    byte*		dest;
+    byte*		source;
+    byte*		colormap;
+    unsigned		xfrac;
+    unsigned		yfrac;
+    int			spot;
+    int			n;
+
+    for ( ; count-- ; span++)
+    {
+	dest = (byte *)(uintptr_t)span->dest;
+	source = (byte *)(uintptr_t)span->source;
+	colormap = (byte *)(uintptr_t)span->colormap;
+	xfrac = span->xfrac;
+	yfrac = span->yfrac;
+
+	for (n = span->count ; n-- ; )
+	{
+	    spot = ((yfrac>>(16-6))&(63*64)) + ((xfrac>>16)&63);
+	    *dest++ = colormap[source[spot]];
+	    if (span->flags & AV_DRAW_DOUBLE)
+		*dest++ = colormap[source[spot]];
+	    xfrac += span->xstep;
+	    yfrac += span->ystep;
+	}
+    }
+}
+
+
+static void R_FlushSpans (void)
+{
+    if (!numspans)
+	return;
+    if (av_draw_spans(spanqueue, numspans) < 0)
+	R_DrawSpanBatch(spanqueue, numspans);
+    numspans = 0;
+}
+
+
+//
+// R_QueueSpan
+// A span from the ds_* state, count texels.
+//
+static void R_QueueSpan (byte* dest, int count, int flags)
+{
+    struct av_span*	span;
+
+    R_FlushColumns ();
+    if (numspans == MAXQUEUED)
+	R_FlushSpans ();
+
+    span = &spanqueue[numspans++];
+    span->dest = (uintptr_t)dest;
+    span->source = (uintptr_t)ds_source;
+    span->colormap = (uintptr_t)ds_colormap;
+    span->xfrac = ds_xfrac;
+    span->yfrac = ds_yfrac;
+    span->xstep = ds_xstep;
+    span->ystep = ds_ystep;
+    span->count = count;
+    span->flags = flags;
+}
+
+
+//
+// R_FlushDraws
+// Everything queued so far is in the framebuffer.
+//
+void R_FlushDraws (void)
+{
+    R_FlushColumns ();
+    R_FlushSpans ();
+}
+
+
 //
 // Draws the actual span.
 void R_DrawSpan (void) 
 { 
-    fixed_t		xfrac;
-    fixed_t		yfrac; 
-    byte*		dest; 
-    int			count;
-    int			spot; 
-	 
 #ifdef RANGECHECK 
     if (ds_x2 < ds_x1
 	|| ds_x1<0
@@ -537,29 +661,11 @@ void R_DrawSpan (void)
 //	dscount++; 
 #endif 
 
-    
-    xfrac = ds_xfrac; 
-    yfrac = ds_yfrac; 
-	 
-    dest = ylookup[ds_y] + columnofs[ds_x1];
-
+    // Lookup pixel from flat texture tile,
+    //  re-index using light/colormap,
+    //  done by the host.
     // We do not check for zero spans here?
-    count = ds_x2 - ds_x1; 
-
-    do 
-    {
-	// Current texture index in u,v.
-	spot = ((yfrac>>(16-6))&(63*64)) + ((xfrac>>16)&63);
-
-	// Lookup pixel from flat texture tile,
-	//  re-index using light/colormap.
-	*dest++ = ds_colormap[ds_source[spot]];
-
-	// Next step in u,v.
-	xfrac += ds_xstep; 
-	yfrac += ds_ystep;
-	
-    } while (count--); 
+    R_QueueSpan (ylookup[ds_y] + columnofs[ds_x1], ds_x2 - ds_x1 + 1, 0);
 } 
 
 
@@ -642,12 +748,6 @@ void R_DrawSpan (void)
 //
 void R_DrawSpanLow (void) 
 { 
-    fixed_t		xfrac;
-    fixed_t		yfrac; 
-    byte*		dest; 
-    int			count;
-    int			spot; 
-	 
 #ifdef RANGECHECK 
     if (ds_x2 < ds_x1
 	|| ds_x1<0
@@ -660,29 +760,13 @@ void R_DrawSpanLow (void)
 //	dscount++; 
 #endif 
 	 
-    xfrac = ds_xfrac; 
-    yfrac = ds_yfrac; 
-
     // Blocky mode, need to multiply by 2.
     ds_x1 <<= 1;
     ds_x2 <<= 1;
     
-    dest = ylookup[ds_y] + columnofs[ds_x1];
-  
-    
-    count = ds_x2 - ds_x1; 
-    do 
-    { 
-	spot = ((yfrac>>(16-6))&(63*64)) + ((xfrac>>16)&63);
-	// Lowres/blocky mode does it twice,
-	//  while scale is adjusted appropriately.
-	*dest++ = ds_colormap[ds_source[spot]]; 
-	*dest++ = ds_colormap[ds_source[spot]];
-	
-	xfrac += ds_xstep; 
-	yfrac += ds_ystep; 
-
-    } while (count--); 
+    // Lowres/blocky mode does it twice,
+    //  while scale is adjusted appropriately.
+    R_QueueSpan (ylookup[ds_y] + columnofs[ds_x1], ds_x2 - ds_x1 + 1, AV_DRAW_DOUBLE);
 }
 
 //
@@ -86,6 +86,10 @@ void 	R_DrawSpan (void);
 // Low resolution mode, 160x200?
 void 	R_DrawSpanLow (void);
 
+// Columns and spans are queued for the host,
+//  this draws them all.
+void	R_FlushDraws (void);
+
 
 void
 R_InitBuffer
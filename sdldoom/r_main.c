@@ -893,6 +893,9 @@ void R_RenderPlayerView (player_t* player)
     
     R_DrawMasked ();
 
+    // The frame is complete once the queued draws are.
+    R_FlushDraws ();
+
     // Check for new console commands.
     NetUpdate ();				
 }
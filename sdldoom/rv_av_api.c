@@ -1,6 +1,8 @@
+#include <stddef.h>
 #include <stdint.h>
 #include <errno.h>
 #include "rv_av_api.h"
+#include "../newlib_syscalls.h"
 
 static inline long
 __syscall_error(long a0)
@@ -10,7 +12,7 @@ __syscall_error(long a0)
 }
 
 static inline long
-__internal_syscall(long n, long _a0, long _a1, long _a2, long _a3, long _a4, long _a5)
+__internal_syscall_raw(long n, long _a0, long _a1, long _a2, long _a3, long _a4, long _a5)
 {
   register long a0 asm("a0") = _a0;
   register long a1 asm("a1") = _a1;
@@ -28,6 +30,14 @@ __internal_syscall(long n, long _a0, long _a1, long _a2, long _a3, long _a4, lon
   asm volatile ("scall"
 		: "+r"(a0) : "r"(a1), "r"(a2), "r"(a3), "r"(a4), "r"(a5), "r"(syscall_id));
 
+  return a0;
+}
+
+static inline long
+__internal_syscall(long n, long _a0, long _a1, long _a2, long _a3, long _a4, long _a5)
+{
+  long a0 = __internal_syscall_raw(n, _a0, _a1, _a2, _a3, _a4, _a5);
+
   if (a0 < 0)
     return __syscall_error (a0);
   else
@@ -87,3 +97,104 @@ void av_shutdown()
 	syscall_errno(SYS_av_shutdown, 0, 0, 0, 0, 0, 0);
 }
 
+void av_snapshot()
+{
+	syscall_errno(SYS_av_snapshot, 0, 0, 0, 0, 0, 0);
+}
+
+int av_audio_init()
+{
+	return syscall_errno(SYS_av_audio_init, 0, 0, 0, 0, 0, 0);
+}
+
+int av_sound_register(const uint8_t *samples, uint32_t len, uint32_t rate)
+{
+	return syscall_errno(SYS_av_sound_register, samples, len, rate, 0, 0, 0);
+}
+
+int av_sound_start(int sound, int volume, int separation, int pitch)
+{
+	return syscall_errno(SYS_av_sound_start, sound, volume, separation, pitch, 0, 0);
+}
+
+void av_sound_stop(int handle)
+{
+	syscall_errno(SYS_av_sound_stop, handle, 0, 0, 0, 0, 0);
+}
+
+void av_sound_update(int handle, int volume, int separation)
+{
+	syscall_errno(SYS_av_sound_update, handle, volume, separation, 0, 0, 0);
+}
+
+int av_sound_playing(int handle)
+{
+	return syscall_errno(SYS_av_sound_playing, handle, 0, 0, 0, 0, 0);
+}
+
+int av_music_init(const void *genmidi, uint32_t len)
+{
+	return syscall_errno(SYS_av_music_init, genmidi, len, 0, 0, 0, 0);
+}
+
+int av_music_register(const void *mus, uint32_t len)
+{
+	return syscall_errno(SYS_av_music_register, mus, len, 0, 0, 0, 0);
+}
+
+void av_music_unregister(int handle)
+{
+	syscall_errno(SYS_av_music_unregister, handle, 0, 0, 0, 0, 0);
+}
+
+int av_music_play(int handle, int looping)
+{
+	return syscall_errno(SYS_av_music_play, handle, looping, 0, 0, 0, 0);
+}
+
+void av_music_stop()
+{
+	syscall_errno(SYS_av_music_stop, 0, 0, 0, 0, 0, 0);
+}
+
+void av_music_pause()
+{
+	syscall_errno(SYS_av_music_pause, 0, 0, 0, 0, 0, 0);
+}
+
+void av_music_resume()
+{
+	syscall_errno(SYS_av_music_resume, 0, 0, 0, 0, 0, 0);
+}
+
+void av_music_volume(int volume)
+{
+	syscall_errno(SYS_av_music_volume, volume, 0, 0, 0, 0, 0);
+}
+
+int av_music_playing(int handle)
+{
+	return syscall_errno(SYS_av_music_playing, handle, 0, 0, 0, 0, 0);
+}
+
+int av_draw_columns(const struct av_column *columns, int count, int pitch)
+{
+	return syscall_errno(SYS_av_draw_columns, columns, count, pitch, 0, 0, 0);
+}
+
+int av_draw_spans(const struct av_span *spans, int count)
+{
+	return syscall_errno(SYS_av_draw_spans, spans, count, 0, 0, 0, 0);
+}
+
+void *av_map_file(int fd, uint32_t len)
+{
+	// addresses can look negative, errors are -4095..-1
+	long addr = __internal_syscall_raw(SYS_mmap, 0, len, AV_PROT_READ | AV_PROT_WRITE, AV_MAP_PRIVATE, fd, 0);
+
+	if ((unsigned long)addr >= -4095UL) {
+		errno = -addr;
+		return NULL;
+	}
+	return (void *)addr;
+}
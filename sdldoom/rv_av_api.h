@@ -14,4 +14,37 @@ uint32_t av_get_mouse_state(int *x, int *y);
 int av_warp_mouse(int x, int y);
 void av_shutdown();
 
+// with --save-snapshot the emulator saves the whole machine state here
+void av_snapshot();
+
+// the samples stay where they are, they must not be freed or changed once registered
+int av_audio_init();
+int av_sound_register(const uint8_t *samples, uint32_t len, uint32_t rate);
+int av_sound_start(int sound, int volume, int separation, int pitch);
+void av_sound_stop(int handle);
+void av_sound_update(int handle, int volume, int separation);
+int av_sound_playing(int handle);
+
+// the instruments and songs are copied by the host, they can be freed right after
+int av_music_init(const void *genmidi, uint32_t len);
+int av_music_register(const void *mus, uint32_t len);
+void av_music_unregister(int handle);
+int av_music_play(int handle, int looping);
+void av_music_stop();
+void av_music_pause();
+void av_music_resume();
+void av_music_volume(int volume);
+int av_music_playing(int handle);
+
+// drawn in order straight into the framebuffer, nothing is drawn if it fails
+int av_draw_columns(const struct av_column *columns, int count, int pitch);
+int av_draw_spans(const struct av_span *spans, int count);
+
+// the first len bytes of an open file, mapped by the host with the standard mmap syscall:
+// copy on write, the page cache is shared until a page is written, NULL on errors
+#define AV_PROT_READ	0x1
+#define AV_PROT_WRITE	0x2
+#define AV_MAP_PRIVATE	0x02
+void *av_map_file(int fd, uint32_t len);
+
 #endif
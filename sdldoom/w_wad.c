@@ -35,6 +35,8 @@ rcsid[] = "$Id: w_wad.c,v 1.5 1997/02/03 16:47:57 b1 Exp $";
 #include "doomtype.h"
 #include "i_system.h"
 #include "z_zone.h"
+#include "m_argv.h"
+#include "rv_av_api.h"
 
 #ifdef __GNUG__
 #pragma implementation "w_wad.h"
@@ -56,6 +58,19 @@ int			numlumps;
 
 void**			lumpcache;
 
+// Whole wad files mapped by the host,
+//  their lumps are never read or cached.
+#define MAXMAPPED	16
+
+typedef struct
+{
+    byte*	start;
+    byte*	end;
+} mappedfile_t;
+
+static mappedfile_t	mappedfiles[MAXMAPPED];
+static int		nummapped;
+
 
 #if defined(linux) || defined(__BEOS__) || defined(__SVR4)
 void strupr (char* s)
@@ -150,10 +165,12 @@ void W_AddFile (char *filename)
     unsigned		i;
     FILE	       *handle;
     int			length;
+    int			filesize;
     int			startlump;
     filelump_t*		fileinfo;
     filelump_t		singleinfo;
     int			storehandle;
+    byte*		mapped;
     
     // open the file and add to directory
 
@@ -173,6 +190,28 @@ void W_AddFile (char *filename)
 
     printf (" adding %s\n",filename);
     startlump = numlumps;
+
+    // Map the whole file, copy on write,
+    //  unless it can be reloaded.
+    mapped = NULL;
+    filesize = 0;
+    if (!reloadname
+	&& nummapped < MAXMAPPED
+	&& !M_CheckParm ("-nowadmap"))
+    {
+	fseek (handle, 0, SEEK_END);
+	filesize = ftell (handle);
+	fseek (handle, 0, SEEK_SET);
+
+	if (filesize > 0)
+	    mapped = av_map_file (fileno(handle), filesize);
+	if (mapped)
+	{
+	    mappedfiles[nummapped].start = mapped;
+	    mappedfiles[nummapped].end = mapped + filesize;
+	    nummapped++;
+	}
+    }
 	
     if (I_strncasecmp (filename+strlen(filename)-3 , "wad", 3 ) )
     {
@@ -224,6 +263,12 @@ void W_AddFile (char *filename)
 	lump_p->position = LONG(fileinfo->filepos);
 	lump_p->size = LONG(fileinfo->size);
 	strncpy (lump_p->name, fileinfo->name, 8);
+	lump_p->data = NULL;
+	if (mapped
+	    && lump_p->position >= 0
+	    && lump_p->size >= 0
+	    && lump_p->position + lump_p->size <= filesize)
+	    lump_p->data = mapped + lump_p->position;
     }
 	
     if (reloadname)
@@ -446,6 +491,12 @@ W_ReadLump
 	I_Error ("W_ReadLump: %i >= numlumps",lump);
 
     l = lumpinfo+lump;
+
+    if (l->data)
+    {
+	memcpy (dest, l->data, l->size);
+	return;
+    }
 	
     // ??? I_BeginRead ();
 	
@@ -486,6 +537,10 @@ W_CacheLumpNum
 
     if ((unsigned)lump >= numlumps)
 	I_Error ("W_CacheLumpNum: %i >= numlumps",lump);
+
+    // Mapped lumps stay put, whatever the tag.
+    if (lumpinfo[lump].data)
+	return lumpinfo[lump].data;
 		
     if (!lumpcache[lump])
     {
@@ -518,6 +573,25 @@ W_CacheLumpName
 }
 
 
+//
+// W_IsMapped
+// True for lumps in a mapped file, they
+//  are not zone blocks and are never freed.
+//
+boolean W_IsMapped (void* ptr)
+{
+    int		i;
+
+    for (i=0 ; i<nummapped ; i++)
+    {
+	if ((byte *)ptr >= mappedfiles[i].start
+	    && (byte *)ptr < mappedfiles[i].end)
+	    return true;
+    }
+    return false;
+}
+
+
 //
 // W_Profile
 //
@@ -28,6 +28,8 @@
 #pragma interface
 #endif
 
+#include "doomtype.h"
+
 
 //
 // TYPES
@@ -59,6 +61,7 @@ typedef struct
     int		handle;
     int		position;
     int		size;
+    byte*	data;	// in the mapped file, NULL if read
 } lumpinfo_t;
 
 
@@ -78,6 +81,8 @@ void    W_ReadLump (int lump, void *dest);
 void*	W_CacheLumpNum (int lump, int tag);
 void*	W_CacheLumpName (char* name, int tag);
 
+boolean	W_IsMapped (void* ptr);
+
 
 
 
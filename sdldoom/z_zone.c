@@ -27,6 +27,7 @@ rcsid[] = "$Id: z_zone.c,v 1.4 1997/02/03 16:47:58 b1 Exp $";
 #include "z_zone.h"
 #include "i_system.h"
 #include "doomdef.h"
+#include "r_local.h"
 
 
 //
@@ -123,11 +124,19 @@ void Z_Free (void* ptr)
 {
     memblock_t*		block;
     memblock_t*		other;
+
+    // Lumps in a mapped wad stay for good.
+    if (W_IsMapped (ptr))
+	return;
 	
     block = (memblock_t *) ( (byte *)ptr - sizeof(memblock_t));
 
     if (block->id != ZONEID)
 	I_Error ("Z_Free: freed a pointer without ZONEID");
+
+    // Columns and spans queued for the host
+    //  may still read from it.
+    R_FlushDraws ();
 		
     if (block->user > (void **)0x100)
     {
@@ -431,6 +440,9 @@ Z_ChangeTag2
   int		tag )
 {
     memblock_t*	block;
+
+    if (W_IsMapped (ptr))
+	return;
 	
     block = (memblock_t *) ( (byte *)ptr - sizeof(memblock_t));
 
@@ -28,6 +28,7 @@
 #define __Z_ZONE__
 
 #include <stdio.h>
+#include "w_wad.h"
 
 //
 // ZONE MEMORY
@@ -69,11 +70,15 @@ typedef struct memblock_s
 // This is used to get the local FILE:LINE info from CPP
 // prior to really call the function in question.
 //
+// Lumps in a mapped wad are not zone blocks.
 #define Z_ChangeTag(p,t) \
 { \
+      if (!W_IsMapped(p)) \
+      { \
       if (( (memblock_t *)( (byte *)(p) - sizeof(memblock_t)))->id!=0x1d4a11) \
 	  I_Error("Z_CT at "__FILE__":%i",__LINE__); \
 	  Z_ChangeTag2(p,t); \
+      } \
 };
 
 